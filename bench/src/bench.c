@@ -0,0 +1,658 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libcommon/libcommon.h"
+
+#define IPADDR    "127.0.0.1"
+#define PORT      "3490"
+#define MAXEVENTS 256
+
+// every generated message starts with this marker followed by its send time in nanoseconds
+#define BENCH_MARKER "#nxb"
+
+// stop queueing messages on a client whose socket has this much unsent data
+#define BENCH_MAX_BACKLOG (64 * 1024)
+
+typedef struct nexchat_bench_config_t
+{
+    nexchat_inet_id_t host;
+    size_t clients;
+    size_t threads;
+    double rate;     // messages per second, across all clients
+    size_t size;     // bytes per message
+    double churn;    // reconnects per second, across all clients
+    double duration; // seconds
+} nexchat_bench_config_t;
+
+typedef struct nexchat_bench_client_t
+{
+    nexchat_client_state_t state;
+    uint32_t generation; // bumped on every reconnect so the server sees a fresh username
+} nexchat_bench_client_t;
+
+typedef struct nexchat_bench_worker_t
+{
+    const nexchat_bench_config_t* config;
+    size_t index;
+    pthread_t thread;
+    pthread_barrier_t* ready;
+
+    int32_t epollfd;
+    nexchat_bench_client_t* clients;
+    size_t client_count;
+    size_t next_sender;
+
+    nexchat_buffer_t scratch;
+    char* padding;
+    uint64_t seed;
+
+    uint64_t sent;
+    uint64_t throttled;
+    uint64_t received;
+    uint64_t received_bytes;
+    uint64_t reconnects;
+    uint64_t failures;
+    nexchat_histogram_t latency;
+} nexchat_bench_worker_t;
+
+static uint64_t nexchat_bench_random(nexchat_bench_worker_t* worker)
+{
+    // xorshift64, plenty for picking which client to churn
+    uint64_t x = worker->seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    worker->seed = x;
+    return x;
+}
+
+static int32_t nexchat_bench_set_nonblocking(int32_t fd)
+{
+    int32_t flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int32_t nexchat_bench_connect(nexchat_bench_worker_t* worker, nexchat_bench_client_t* client, size_t slot)
+{
+    nexchat_client_state_t* state = &client->state;
+    state->connected = false;
+
+    // same blocking connect and username handshake the interactive client goes through
+    if (nexchat_session_connect(state, &worker->config->host) == -1)
+    {
+        return -1;
+    }
+
+    char username[sizeof(state->username)];
+    snprintf(username, sizeof(username), "bench%zu_%zu_%u", worker->index, slot, client->generation);
+
+    if (nexchat_session_handshake(state, username) == -1 || nexchat_bench_set_nonblocking(state->sockfd) == -1)
+    {
+        nexchat_frame_decoder_free(&state->decoder);
+        close(state->sockfd);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = client;
+
+    if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, state->sockfd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        nexchat_frame_decoder_free(&state->decoder);
+        close(state->sockfd);
+        return -1;
+    }
+
+    nexchat_outqueue_init(&state->outqueue);
+    state->connected = true;
+
+    return 0;
+}
+
+static void nexchat_bench_disconnect(nexchat_bench_worker_t* worker, nexchat_bench_client_t* client)
+{
+    nexchat_client_state_t* state = &client->state;
+
+    if (!state->connected)
+    {
+        return;
+    }
+
+    epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, state->sockfd, NULL);
+    close(state->sockfd);
+    nexchat_frame_decoder_free(&state->decoder);
+    nexchat_outqueue_free(&state->outqueue);
+    state->connected = false;
+}
+
+static void nexchat_bench_record(nexchat_bench_worker_t* worker, const nexchat_frame_t* frame, uint64_t now)
+{
+    worker->received_bytes += NEXCHAT_FRAME_HEADER_SIZE + frame->size;
+
+    // broadcasts arrive as "<username>: <message>", server notices carry no marker
+    const char* marker = strstr(frame->payload, ": " BENCH_MARKER " ");
+    if (marker == NULL)
+    {
+        return;
+    }
+
+    uint64_t sent_at = strtoull(marker + sizeof(": " BENCH_MARKER " ") - 1, NULL, 10);
+
+    worker->received++;
+    nexchat_histogram_record(&worker->latency, now > sent_at ? now - sent_at : 0);
+}
+
+// clients that only listen would otherwise be dropped by the server's heartbeat
+static void nexchat_bench_pong(nexchat_bench_worker_t* worker, nexchat_bench_client_t* client)
+{
+    nexchat_client_state_t* state = &client->state;
+
+    uint8_t header[NEXCHAT_FRAME_HEADER_SIZE];
+    nexchat_frame_write_header(header, FRAME_PONG, 0);
+
+    nexchat_msgbuf_t* pong = nexchat_msgbuf_create(header, sizeof header);
+    if (pong == NULL || nexchat_outqueue_push(&state->outqueue, pong) == -1 || nexchat_outqueue_flush(&state->outqueue, state->sockfd) == -1)
+    {
+        worker->failures++;
+    }
+
+    if (pong != NULL)
+    {
+        nexchat_msgbuf_release(pong);
+    }
+}
+
+static void nexchat_bench_receive(nexchat_bench_worker_t* worker, nexchat_bench_client_t* client)
+{
+    nexchat_client_state_t* state = &client->state;
+
+    while (state->connected)
+    {
+        nexchat_frame_t frame;
+        int32_t status = 0;
+        uint64_t now = nexchat_clock_now_ns();
+
+        while ((status = nexchat_frame_decoder_next(&state->decoder, &frame)) == 1)
+        {
+            if (frame.type == FRAME_TEXT)
+            {
+                nexchat_bench_record(worker, &frame, now);
+            }
+            else if (frame.type == FRAME_PING)
+            {
+                nexchat_bench_pong(worker, client);
+            }
+        }
+
+        size_t space = 0;
+        uint8_t* recvbuf = status == 0 ? nexchat_frame_decoder_prepare(&state->decoder, &space) : NULL;
+        if (recvbuf == NULL)
+        {
+            worker->failures++;
+            nexchat_bench_disconnect(worker, client);
+            break;
+        }
+
+        ssize_t bytesread = recv(state->sockfd, recvbuf, space, 0);
+
+        if (bytesread == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                worker->failures++;
+                nexchat_bench_disconnect(worker, client);
+            }
+
+            break;
+        }
+        else if (bytesread == 0) // kicked or the server went away
+        {
+            worker->failures++;
+            nexchat_bench_disconnect(worker, client);
+            break;
+        }
+
+        nexchat_frame_decoder_commit(&state->decoder, (size_t)bytesread);
+    }
+}
+
+static void nexchat_bench_send(nexchat_bench_worker_t* worker)
+{
+    // round robin over the connected clients, skipping any the server isn't keeping up with
+    for (size_t attempts = 0; attempts < worker->client_count; attempts++)
+    {
+        nexchat_bench_client_t* client = &worker->clients[worker->next_sender];
+        worker->next_sender = (worker->next_sender + 1) % worker->client_count;
+
+        nexchat_client_state_t* state = &client->state;
+        if (!state->connected)
+        {
+            continue;
+        }
+
+        if (state->outqueue.bytes >= BENCH_MAX_BACKLOG)
+        {
+            worker->throttled++;
+            return;
+        }
+
+        nexchat_buffer_clear(&worker->scratch);
+
+        uint64_t now = nexchat_clock_now_ns();
+        if (nexchat_frame_printf(&worker->scratch, BENCH_MARKER " %020llu %s", (unsigned long long)now, worker->padding) == -1)
+        {
+            worker->failures++;
+            return;
+        }
+
+        nexchat_msgbuf_t* msg = nexchat_msgbuf_create(nexchat_buffer_head(&worker->scratch), nexchat_buffer_readable(&worker->scratch));
+        if (msg == NULL || nexchat_outqueue_push(&state->outqueue, msg) == -1)
+        {
+            worker->failures++;
+        }
+        else
+        {
+            worker->sent++;
+        }
+
+        if (msg != NULL)
+        {
+            nexchat_msgbuf_release(msg);
+        }
+
+        if (nexchat_outqueue_flush(&state->outqueue, state->sockfd) == -1)
+        {
+            worker->failures++;
+            nexchat_bench_disconnect(worker, client);
+        }
+
+        return;
+    }
+}
+
+static void nexchat_bench_churn(nexchat_bench_worker_t* worker)
+{
+    size_t slot = (size_t)(nexchat_bench_random(worker) % worker->client_count);
+    nexchat_bench_client_t* client = &worker->clients[slot];
+
+    nexchat_bench_disconnect(worker, client);
+    client->generation++;
+
+    if (nexchat_bench_connect(worker, client, slot) == -1)
+    {
+        worker->failures++;
+        return;
+    }
+
+    worker->reconnects++;
+}
+
+static void* nexchat_bench_run_worker(void* arg)
+{
+    nexchat_bench_worker_t* worker = (nexchat_bench_worker_t*)arg;
+    const nexchat_bench_config_t* config = worker->config;
+
+    for (size_t i = 0; i < worker->client_count; i++)
+    {
+        if (nexchat_bench_connect(worker, &worker->clients[i], i) == -1)
+        {
+            worker->failures++;
+        }
+    }
+
+    // everyone starts sending at once, after every client has joined
+    pthread_barrier_wait(worker->ready);
+
+    double rate = config->rate / (double)config->threads;
+    double churn = config->churn / (double)config->threads;
+    double send_credit = 0.0;
+    double churn_credit = 0.0;
+
+    uint64_t start = nexchat_clock_now_ns();
+    uint64_t end = start + (uint64_t)(config->duration * 1e9);
+    uint64_t last = start;
+
+    struct epoll_event events[MAXEVENTS];
+
+    for (uint64_t now = start; now < end; )
+    {
+        int32_t nevents = epoll_wait(worker->epollfd, events, MAXEVENTS, 1);
+
+        for (int32_t i = 0; i < nevents; i++)
+        {
+            nexchat_bench_client_t* client = (nexchat_bench_client_t*)events[i].data.ptr;
+
+            if (!client->state.connected)
+            {
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && !nexchat_outqueue_empty(&client->state.outqueue))
+            {
+                if (nexchat_outqueue_flush(&client->state.outqueue, client->state.sockfd) == -1)
+                {
+                    worker->failures++;
+                    nexchat_bench_disconnect(worker, client);
+                    continue;
+                }
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+            {
+                nexchat_bench_receive(worker, client);
+            }
+        }
+
+        now = nexchat_clock_now_ns();
+        double elapsed = (double)(now - last) / 1e9;
+        last = now;
+
+        // credit accrues with wall time, capped at a second's worth so a stall doesn't turn into a burst
+        send_credit += rate * elapsed;
+        send_credit = send_credit > rate ? rate : send_credit;
+        churn_credit += churn * elapsed;
+        churn_credit = churn_credit > churn ? churn : churn_credit;
+
+        for (; send_credit >= 1.0; send_credit -= 1.0)
+        {
+            nexchat_bench_send(worker);
+        }
+
+        for (; churn_credit >= 1.0; churn_credit -= 1.0)
+        {
+            nexchat_bench_churn(worker);
+        }
+    }
+
+    for (size_t i = 0; i < worker->client_count; i++)
+    {
+        nexchat_bench_disconnect(worker, &worker->clients[i]);
+    }
+
+    return NULL;
+}
+
+static void nexchat_bench_print_usage(const char* program)
+{
+    printf("usage: %s [options]\n", program);
+    printf("  -a, --address <ip>       server address (default %s)\n", IPADDR);
+    printf("  -p, --port <port>        server port (default %s)\n", PORT);
+    printf("  -n, --clients <n>        simulated users (default 100)\n");
+    printf("  -t, --threads <n>        load generator threads (default 1)\n");
+    printf("  -r, --rate <n>           messages per second across all users (default 1000)\n");
+    printf("  -s, --size <bytes>       message size (default 64)\n");
+    printf("  -c, --churn <n>          disconnect/reconnect cycles per second (default 0)\n");
+    printf("  -d, --duration <secs>    measurement length (default 10)\n");
+    printf("  -h, --help               show this message\n");
+}
+
+static int32_t nexchat_bench_parse_number(const char* name, const char* arg, double min, double* value)
+{
+    char* end = NULL;
+    *value = strtod(arg, &end);
+
+    if (*end != '\0' || *value < min)
+    {
+        fprintf(stderr, "nexchat-bench: invalid --%s '%s'\n", name, arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int32_t nexchat_bench_parse_args(nexchat_bench_config_t* config, int argc, char** argv)
+{
+    static const struct option options[] =
+    {
+        {"address",  required_argument, NULL, 'a'},
+        {"port",     required_argument, NULL, 'p'},
+        {"clients",  required_argument, NULL, 'n'},
+        {"threads",  required_argument, NULL, 't'},
+        {"rate",     required_argument, NULL, 'r'},
+        {"size",     required_argument, NULL, 's'},
+        {"churn",    required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    config->host.ipaddr = IPADDR;
+    config->host.service = PORT;
+    config->clients = 100;
+    config->threads = 1;
+    config->rate = 1000.0;
+    config->size = 64;
+    config->churn = 0.0;
+    config->duration = 10.0;
+
+    int32_t opt = 0;
+    double value = 0.0;
+
+    while ((opt = getopt_long(argc, argv, "a:p:n:t:r:s:c:d:h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': config->host.ipaddr = optarg; break;
+            case 'p': config->host.service = optarg; break;
+            case 'n':
+            {
+                if (nexchat_bench_parse_number("clients", optarg, 2, &value) == -1) return -1;
+                config->clients = (size_t)value;
+            } break;
+            case 't':
+            {
+                if (nexchat_bench_parse_number("threads", optarg, 1, &value) == -1) return -1;
+                config->threads = (size_t)value;
+            } break;
+            case 'r':
+            {
+                if (nexchat_bench_parse_number("rate", optarg, 0, &value) == -1) return -1;
+                config->rate = value;
+            } break;
+            case 's':
+            {
+                if (nexchat_bench_parse_number("size", optarg, 0, &value) == -1) return -1;
+                config->size = (size_t)value;
+            } break;
+            case 'c':
+            {
+                if (nexchat_bench_parse_number("churn", optarg, 0, &value) == -1) return -1;
+                config->churn = value;
+            } break;
+            case 'd':
+            {
+                if (nexchat_bench_parse_number("duration", optarg, 0.001, &value) == -1) return -1;
+                config->duration = value;
+            } break;
+            case 'h':
+            default:
+                nexchat_bench_print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (config->threads > config->clients)
+    {
+        config->threads = config->clients;
+    }
+
+    // the marker and timestamp alone take 26 bytes, the rest of the message is padding
+    size_t overhead = sizeof(BENCH_MARKER " 00000000000000000000 ") - 1;
+    if (config->size + 1 > NEXCHAT_FRAME_MAX_PAYLOAD / 2)
+    {
+        fprintf(stderr, "nexchat-bench: --size must be below %d\n", NEXCHAT_FRAME_MAX_PAYLOAD / 2);
+        return -1;
+    }
+
+    config->size = config->size < overhead ? overhead : config->size;
+
+    return 0;
+}
+
+static void nexchat_bench_raise_fd_limit(size_t clients)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        return;
+    }
+
+    rlim_t wanted = (rlim_t)clients + 64;
+    if (limit.rlim_cur >= wanted)
+    {
+        return;
+    }
+
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > wanted ? wanted : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        perror("setrlimit");
+    }
+}
+
+static void nexchat_bench_report(const nexchat_bench_config_t* config, nexchat_bench_worker_t* workers)
+{
+    nexchat_bench_worker_t total;
+    memset(&total, 0, sizeof total);
+
+    for (size_t i = 0; i < config->threads; i++)
+    {
+        total.sent += workers[i].sent;
+        total.throttled += workers[i].throttled;
+        total.received += workers[i].received;
+        total.received_bytes += workers[i].received_bytes;
+        total.reconnects += workers[i].reconnects;
+        total.failures += workers[i].failures;
+        nexchat_histogram_merge(&total.latency, &workers[i].latency);
+    }
+
+    double secs = config->duration;
+
+    printf("nexchat-bench: %zu clients on %zu thread(s), %.2f s, %.0f msg/s of %zu bytes, %.1f reconnects/s\n",
+           config->clients, config->threads, secs, config->rate, config->size, config->churn);
+    printf("  sent        %12llu msgs  %12.1f msg/s  (%llu throttled)\n",
+           (unsigned long long)total.sent, (double)total.sent / secs, (unsigned long long)total.throttled);
+    printf("  delivered   %12llu msgs  %12.1f msg/s  %8.2f MiB/s\n",
+           (unsigned long long)total.received, (double)total.received / secs, (double)total.received_bytes / secs / (1024.0 * 1024.0));
+    printf("  latency     p50 %.1f us  p99 %.1f us  p999 %.1f us  max %.1f us\n",
+           (double)nexchat_histogram_percentile(&total.latency, 0.50) / 1e3,
+           (double)nexchat_histogram_percentile(&total.latency, 0.99) / 1e3,
+           (double)nexchat_histogram_percentile(&total.latency, 0.999) / 1e3,
+           (double)total.latency.max / 1e3);
+    printf("  churn       %12llu reconnects, %llu connection failures\n",
+           (unsigned long long)total.reconnects, (unsigned long long)total.failures);
+}
+
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    nexchat_bench_config_t config;
+    if (nexchat_bench_parse_args(&config, argc, argv) == -1)
+    {
+        return 1;
+    }
+
+    nexchat_bench_raise_fd_limit(config.clients);
+
+    nexchat_bench_worker_t* workers = (nexchat_bench_worker_t*)calloc(config.threads, sizeof(nexchat_bench_worker_t));
+    nexchat_bench_client_t* clients = (nexchat_bench_client_t*)calloc(config.clients, sizeof(nexchat_bench_client_t));
+    char* padding = (char*)malloc(config.size + 1);
+
+    if (workers == NULL || clients == NULL || padding == NULL)
+    {
+        fprintf(stderr, "nexchat-bench: out of memory\n");
+        return 1;
+    }
+
+    size_t overhead = sizeof(BENCH_MARKER " 00000000000000000000 ") - 1;
+    memset(padding, 'x', config.size - overhead);
+    padding[config.size - overhead] = '\0';
+
+    pthread_barrier_t ready;
+    pthread_barrier_init(&ready, NULL, (unsigned)config.threads);
+
+    // split the users as evenly as possible, every worker owns its slice outright
+    size_t offset = 0;
+    for (size_t i = 0; i < config.threads; i++)
+    {
+        nexchat_bench_worker_t* worker = &workers[i];
+        size_t count = config.clients / config.threads + (i < config.clients % config.threads ? 1 : 0);
+
+        worker->config = &config;
+        worker->index = i;
+        worker->ready = &ready;
+        worker->clients = &clients[offset];
+        worker->client_count = count;
+        worker->padding = padding;
+        worker->seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        worker->epollfd = epoll_create1(0);
+        nexchat_buffer_init(&worker->scratch, config.size + NEXCHAT_FRAME_HEADER_SIZE + 1);
+        offset += count;
+
+        if (worker->epollfd == -1)
+        {
+            perror("epoll_create1");
+            return 1;
+        }
+    }
+
+    printf("nexchat-bench: connecting %zu clients to %s:%s...\n", config.clients, config.host.ipaddr, config.host.service);
+    fflush(stdout);
+
+    for (size_t i = 1; i < config.threads; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, nexchat_bench_run_worker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "nexchat-bench: failed to launch worker %zu\n", i);
+            return 1;
+        }
+    }
+
+    nexchat_bench_run_worker(&workers[0]);
+
+    for (size_t i = 1; i < config.threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    nexchat_bench_report(&config, workers);
+
+    for (size_t i = 0; i < config.threads; i++)
+    {
+        nexchat_buffer_free(&workers[i].scratch);
+        close(workers[i].epollfd);
+    }
+
+    pthread_barrier_destroy(&ready);
+    free(padding);
+    free(clients);
+    free(workers);
+
+    return 0;
+}
@@ -4,7 +4,24 @@ workspace "nexchat"
 
 OutputDir = "%{cfg.system}-%{cfg.architecture}/%{cfg.buildcfg}"
 
+newoption
+{
+    trigger = "libfuzzer",
+    description = "Build the fuzz harnesses against libFuzzer, everything instrumented for it (needs clang)",
+}
+
+filter "options:libfuzzer"
+    toolset "clang"
+    buildoptions { "-fsanitize=fuzzer-no-link,address,undefined" }
+    linkoptions { "-fsanitize=address,undefined" }
+
+filter {}
+
 include "libcommon/build-libcommon.lua"
 
 include "server/build-server.lua"
-include "client/build-client.lua"
\ No newline at end of file
+include "client/build-client.lua"
+include "bench/build-bench.lua"
+include "microbench/build-microbench.lua"
+include "fuzz/build-fuzz.lua"
+include "test/build-test.lua"
\ No newline at end of file
@@ -1,12 +1,16 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "libcommon/libcommon.h"
@@ -14,181 +18,539 @@
 #define IPADDR     "127.0.0.1"
 #define PORT       "3490"
 
-int32_t nexchat_client_connect_to_host(nexchat_client_state_t* state, nexchat_inet_id_t* id);
-int32_t nexchat_client_send_username_to_host(nexchat_client_state_t* state);
-void nexchat_client_launch(nexchat_client_state_t* state);
-void* nexchat_client_handle_incoming_msgs(void* arg);
-void nexchat_client_sendmsg(int32_t sockfd, const char* msg);
+#define INPUT_CHUNK       (64 * 1024)   // bytes read from the input per wakeup
+#define SEND_HIGH_WATER   (1024 * 1024) // stop reading input while this much is waiting for the host
+#define OUTPUT_HIGH_WATER (64 * 1024)   // write stdout early once this much text has piled up
 
-int32_t nexchat_client_connect_to_host(nexchat_client_state_t* state, nexchat_inet_id_t* id)
+typedef struct nexchat_client_config_t
 {
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+    nexchat_inet_id_t host;
+    const char* username; // prompted for when NULL in interactive mode
+    const char* batch;    // file to stream messages from, "-" for stdin, NULL for interactive
+    bool quiet;           // drop everything the host sends
+} nexchat_client_config_t;
+
+// One thread polls the socket and the input. Lines are encoded into `sendbuf` and written when
+// the socket takes them, incoming text is collected in `output` and written to stdout once per
+// wakeup, so a burst of frames costs one write instead of one printf each.
+typedef struct nexchat_client_io_t
+{
+    const nexchat_client_config_t* config;
+
+    int32_t inputfd;
+    bool input_open;
+    bool write_shutdown;   // batch mode, told the host we're done after the last message
+    nexchat_buffer_t line; // partial line carried over between reads
+    nexchat_buffer_t sendbuf;
+    nexchat_buffer_t output;
+
+    size_t messages_sent;
+    uint64_t started_ns;
+} nexchat_client_io_t;
+
+int32_t nexchat_client_connect_to_host(nexchat_client_state_t* state, const nexchat_client_config_t* config);
+int32_t nexchat_client_send_username_to_host(nexchat_client_state_t* state, const char* username);
+int32_t nexchat_client_launch(nexchat_client_state_t* state, const nexchat_client_config_t* config);
+int32_t nexchat_client_read_input(nexchat_client_io_t* io);
+int32_t nexchat_client_queue_line(nexchat_client_io_t* io, const char* line, size_t len);
+int32_t nexchat_client_receive(nexchat_client_state_t* state, nexchat_client_io_t* io);
+int32_t nexchat_client_flush_sendbuf(nexchat_client_state_t* state, nexchat_client_io_t* io);
+void nexchat_client_flush_output(nexchat_client_io_t* io);
+
+static int32_t nexchat_client_set_nonblocking(int32_t fd)
+{
+    int32_t flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int32_t nexchat_client_connect_to_host(nexchat_client_state_t* state, const nexchat_client_config_t* config)
+{
+    if (nexchat_session_connect(state, &config->host) == -1)
+    {
+        fprintf(stderr, "client: failed to connect to host\n");
+        return -1;
+    }
+
+    if (config->batch == NULL)
+    {
+        printf("client: connected to host\n");
+    }
+
+    return nexchat_client_send_username_to_host(state, config->username);
+}
+
+int32_t nexchat_client_send_username_to_host(nexchat_client_state_t* state, const char* username)
+{
+    char prompted[sizeof(state->username)];
+    memset(prompted, 0, sizeof(prompted));
+
+    // send the host our username, asking for one if it wasn't given on the command line
+    if (username == NULL)
+    {
+        bool first_attempt = true;
 
-    struct addrinfo* res = NULL;
-    int32_t status = getaddrinfo(IPADDR, PORT, &hints, &res);
+        do
+        {
+            if (!first_attempt)
+            {
+                printf("Username must not be empty!\n\n");
+            }
+            printf("Enter username: ");
+            fflush(stdout);
+            if (fgets(prompted, sizeof(prompted) - 1, stdin) == NULL)
+            {
+                return -1;
+            }
+            first_attempt = false;
+        } while (strcmp(prompted, "\n") == 0);
+
+        prompted[strcspn(prompted, "\n")] = '\0';
+        username = prompted;
+    }
 
-    if (status != 0)
+    if (nexchat_session_handshake(state, username) == -1)
     {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        fprintf(stderr, "client: failed to send username to host\n");
         return -1;
     }
 
-    struct addrinfo* it = NULL;
+    return 0;
+}
 
-    for (it = res; it != NULL; it = it->ai_next)
+int32_t nexchat_client_launch(nexchat_client_state_t* state, const nexchat_client_config_t* config)
+{
+    nexchat_client_io_t io;
+    memset(&io, 0, sizeof io);
+    io.config = config;
+    io.inputfd = STDIN_FILENO;
+    io.input_open = true;
+    io.started_ns = nexchat_clock_now_ns();
+
+    if (config->batch != NULL && strcmp(config->batch, "-") != 0)
     {
-        state->sockfd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
-        if (state->sockfd == -1)
+        io.inputfd = open(config->batch, O_RDONLY);
+        if (io.inputfd == -1)
         {
-            perror("socket");
-            continue;
+            perror("open");
+            fprintf(stderr, "client: failed to open '%s'\n", config->batch);
+            return -1;
         }
+    }
 
-        if (connect(state->sockfd, it->ai_addr, it->ai_addrlen) == -1)
+    // the handshake was blocking, from here on nothing waits except poll
+    if (nexchat_client_set_nonblocking(state->sockfd) == -1)
+    {
+        perror("fcntl");
+        return -1;
+    }
+
+    nexchat_buffer_init(&io.line, INPUT_CHUNK);
+    nexchat_buffer_init(&io.sendbuf, INPUT_CHUNK);
+    nexchat_buffer_init(&io.output, OUTPUT_HIGH_WATER);
+
+    int32_t status = 0;
+    state->connected = true;
+
+    while (state->connected)
+    {
+        size_t pending = nexchat_buffer_readable(&io.sendbuf);
+
+        // batch mode hangs up once everything is out, the host closes after reading it all
+        if (config->batch != NULL && !io.input_open && pending == 0 && !io.write_shutdown)
         {
-            perror("connect");
-            close(state->sockfd);
-            continue;
+            shutdown(state->sockfd, SHUT_WR);
+            io.write_shutdown = true;
         }
 
-        printf("client: connected to host\n");
+        // an interactive session ends with its input
+        if (config->batch == NULL && !io.input_open && pending == 0)
+        {
+            break;
+        }
 
-        if (nexchat_client_send_username_to_host(state) == -1)
+        struct pollfd fds[2];
+        fds[0].fd = state->sockfd;
+        fds[0].events = POLLIN | (pending > 0 ? POLLOUT : 0);
+        fds[0].revents = 0;
+
+        // leaving the input out of the set is the backpressure, the host drains at its own pace
+        fds[1].fd = io.input_open && pending < SEND_HIGH_WATER ? io.inputfd : -1;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        if (poll(fds, 2, -1) == -1)
         {
-            continue;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("poll");
+            status = -1;
+            break;
         }
 
-        break;
+        if (fds[1].revents != 0 && nexchat_client_read_input(&io) == -1)
+        {
+            status = -1;
+            break;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            int32_t received = nexchat_client_receive(state, &io);
+            if (received != 1)
+            {
+                status = received;
+                state->connected = false;
+            }
+        }
+
+        // try even without POLLOUT, lines typed since poll returned usually fit in the socket buffer
+        if (state->connected && nexchat_buffer_readable(&io.sendbuf) > 0 &&
+            nexchat_client_flush_sendbuf(state, &io) == -1)
+        {
+            status = -1;
+            break;
+        }
+
+        nexchat_client_flush_output(&io);
     }
 
-    if (it == NULL)
+    nexchat_client_flush_output(&io);
+
+    if (config->batch != NULL)
     {
-        fprintf(stderr, "client: failed to connect to host\n");
-        return -1;
+        double elapsed = (double)(nexchat_clock_now_ns() - io.started_ns) / 1e9;
+        size_t unsent = nexchat_buffer_readable(&io.sendbuf);
+
+        fprintf(stderr, "client: sent %zu messages in %.3f s (%.0f msg/s)%s\n", io.messages_sent, elapsed,
+            elapsed > 0.0 ? (double)io.messages_sent / elapsed : 0.0, unsent > 0 ? ", host left before the rest" : "");
+
+        if (unsent > 0 || io.input_open)
+        {
+            status = -1;
+        }
+
+        if (io.inputfd != STDIN_FILENO)
+        {
+            close(io.inputfd);
+        }
     }
 
-    freeaddrinfo(res);
+    nexchat_buffer_free(&io.line);
+    nexchat_buffer_free(&io.sendbuf);
+    nexchat_buffer_free(&io.output);
+    nexchat_frame_decoder_free(&state->decoder);
+    close(state->sockfd);
 
-    return 0;
+    return status;
 }
 
-int32_t nexchat_client_send_username_to_host(nexchat_client_state_t* state)
+int32_t nexchat_client_read_input(nexchat_client_io_t* io)
 {
-    // send the host our username
-    bool first_attempt = true;
+    if (nexchat_buffer_reserve(&io->line, INPUT_CHUNK) == -1)
+    {
+        fprintf(stderr, "client: out of memory\n");
+        return -1;
+    }
 
-    memset(state->username, 0, sizeof(state->username));
+    ssize_t bytesread = read(io->inputfd, nexchat_buffer_tail(&io->line), INPUT_CHUNK);
+    if (bytesread == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return 0;
+        }
 
-    do 
+        perror("read");
+        return -1;
+    }
+
+    nexchat_buffer_commit(&io->line, (size_t)bytesread);
+
+    // every complete line becomes a frame, a trailing partial one waits for the rest
+    char* start = (char*)nexchat_buffer_head(&io->line);
+    char* end = (char*)nexchat_buffer_tail(&io->line);
+    char* newline = NULL;
+
+    while ((newline = memchr(start, '\n', (size_t)(end - start))) != NULL)
     {
-        if (!first_attempt)
+        if (nexchat_client_queue_line(io, start, (size_t)(newline - start)) == -1)
         {
-            printf("Username must not be empty!\n\n");
+            return -1;
         }
-        printf("Enter username: ");
-        fgets(state->username, sizeof(state->username) - 1, stdin);
-        first_attempt = false;
-    } while (strcmp(state->username, "\n") == 0);
 
-    for (size_t i = 0; state->username[i] != '\0'; i++)
+        start = newline + 1;
+    }
+
+    nexchat_buffer_consume(&io->line, (size_t)(start - (char*)nexchat_buffer_head(&io->line)));
+
+    if (bytesread == 0)
     {
-        if (state->username[i] != '\n')
+        // the last line may not end in a newline
+        if (nexchat_buffer_readable(&io->line) > 0 &&
+            nexchat_client_queue_line(io, (const char*)nexchat_buffer_head(&io->line), nexchat_buffer_readable(&io->line)) == -1)
         {
-            continue;
+            return -1;
         }
-    
-        state->username[i] = '\0';
-        break;
+
+        nexchat_buffer_clear(&io->line);
+        io->input_open = false;
+    }
+
+    return 0;
+}
+
+int32_t nexchat_client_queue_line(nexchat_client_io_t* io, const char* line, size_t len)
+{
+    if (len + 1 > NEXCHAT_FRAME_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "client: message is too long\n");
+        return 0;
     }
 
-    int32_t bytessent = send(state->sockfd, state->username, strlen(state->username), 0);
-    if (bytessent == -1)
+    // text payloads carry their terminator, the input doesn't have one to point at
+    if (nexchat_buffer_reserve(&io->sendbuf, NEXCHAT_FRAME_HEADER_SIZE + len + 1) == -1)
     {
-        perror("send");
-        fprintf(stderr, "client: failed to send username to host\n");
+        fprintf(stderr, "client: out of memory\n");
         return -1;
     }
 
+    uint8_t* dst = nexchat_buffer_tail(&io->sendbuf);
+    nexchat_frame_write_header(dst, FRAME_TEXT, (uint32_t)(len + 1));
+    memcpy(dst + NEXCHAT_FRAME_HEADER_SIZE, line, len);
+    dst[NEXCHAT_FRAME_HEADER_SIZE + len] = '\0';
+    nexchat_buffer_commit(&io->sendbuf, NEXCHAT_FRAME_HEADER_SIZE + len + 1);
+
+    io->messages_sent++;
+
     return 0;
 }
 
-void nexchat_client_launch(nexchat_client_state_t* state)
+// 1 while connected, 0 once the host hung up, -1 on error
+int32_t nexchat_client_receive(nexchat_client_state_t* state, nexchat_client_io_t* io)
 {
-    state->connected = true;
+    while (true)
+    {
+        size_t space = 0;
+        uint8_t* recvbuf = nexchat_frame_decoder_prepare(&state->decoder, &space);
+        if (recvbuf == NULL)
+        {
+            fprintf(stderr, "client: out of memory\n");
+            return -1;
+        }
 
-    pthread_create(&state->recv_thread, NULL, nexchat_client_handle_incoming_msgs, state);
-    pthread_detach(state->recv_thread);
+        ssize_t bytesread = recv(state->sockfd, recvbuf, space, 0);
 
-    char sendbuf[1024];
+        if (bytesread == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 1;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
 
-    while (state->connected)
-    {
-        fgets(sendbuf, sizeof(sendbuf) - 1, stdin);
-        for (size_t i = 0; sendbuf[i] != '\0'; i++)
+            perror("recv");
+            return -1;
+        }
+        else if (bytesread == 0) // server disconnected
         {
-            if (sendbuf[i] == '\n')
+            if (io->config->batch == NULL)
             {
-                sendbuf[i] = '\0';
-                break;
+                const char* msg = "client: host disconnected\n";
+                nexchat_buffer_append(&io->output, msg, strlen(msg));
             }
+
+            return 0;
         }
 
-        nexchat_client_sendmsg(state->sockfd, sendbuf);
-    }
-}
+        nexchat_frame_decoder_commit(&state->decoder, (size_t)bytesread);
 
-void* nexchat_client_handle_incoming_msgs(void* arg)
-{
-    nexchat_client_state_t* client = (nexchat_client_state_t*)arg;
+        // print every complete frame, a single recv may carry several or only part of one
+        nexchat_frame_t frame;
+        int32_t status = 0;
 
-    char recvbuf[1024];
+        while ((status = nexchat_frame_decoder_next(&state->decoder, &frame)) == 1)
+        {
+            // answered along with whatever is typed next, the poll loop writes it out. Once batch
+            // mode has shut down its write side there is no way to answer, writing would be EPIPE
+            if (frame.type == FRAME_PING && !io->write_shutdown && nexchat_frame_encode(&io->sendbuf, FRAME_PONG, NULL, 0) == -1)
+            {
+                fprintf(stderr, "client: out of memory\n");
+                return -1;
+            }
 
-    while (client->connected)
-    {
-        int32_t bytesread = recv(client->sockfd, recvbuf, sizeof recvbuf, 0);
+            if ((frame.type != FRAME_TEXT && frame.type != FRAME_PRESENCE) || io->config->quiet)
+            {
+                continue;
+            }
 
-        if (bytesread == -1)
+            // presence events are printed as they came, after /presence on
+            const char* prefix = frame.type == FRAME_PRESENCE ? "presence: " : "";
+            size_t prefixlen = strlen(prefix);
+
+            size_t len = strnlen(frame.payload, frame.size);
+            if (nexchat_buffer_reserve(&io->output, prefixlen + len + 1) == -1)
+            {
+                fprintf(stderr, "client: out of memory\n");
+                return -1;
+            }
+
+            memcpy(nexchat_buffer_tail(&io->output), prefix, prefixlen);
+            nexchat_buffer_commit(&io->output, prefixlen);
+            memcpy(nexchat_buffer_tail(&io->output), frame.payload, len);
+            nexchat_buffer_tail(&io->output)[len] = '\n';
+            nexchat_buffer_commit(&io->output, len + 1);
+        }
+
+        if (status == -1)
         {
-            perror("recv");
-            continue;
+            fprintf(stderr, "client: received a malformed frame from host\n");
+            return -1;
         }
-        else if (bytesread == 0) // server disconnected
+
+        if (nexchat_buffer_readable(&io->output) >= OUTPUT_HIGH_WATER)
         {
-            printf("client: host disconnected\n");
-            break;
+            nexchat_client_flush_output(io);
         }
+    }
+}
 
-        recvbuf[bytesread] = '\0';
+int32_t nexchat_client_flush_sendbuf(nexchat_client_state_t* state, nexchat_client_io_t* io)
+{
+    while (nexchat_buffer_readable(&io->sendbuf) > 0)
+    {
+        ssize_t bytessent = send(state->sockfd, nexchat_buffer_head(&io->sendbuf), nexchat_buffer_readable(&io->sendbuf), 0);
+        if (bytessent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
 
-        printf("%s\n", recvbuf);
+            perror("send");
+            return -1;
+        }
+
+        nexchat_buffer_consume(&io->sendbuf, (size_t)bytessent);
     }
 
-    return NULL;
+    return 0;
 }
 
-void nexchat_client_sendmsg(int32_t sockfd, const char* msg)
+void nexchat_client_flush_output(nexchat_client_io_t* io)
 {
-    int32_t bytessent = send(sockfd, msg, strlen(msg), 0);
-    if (bytessent == -1)
+    while (nexchat_buffer_readable(&io->output) > 0)
     {
-        perror("send");
-        return;
+        ssize_t written = write(STDOUT_FILENO, nexchat_buffer_head(&io->output), nexchat_buffer_readable(&io->output));
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            // nobody is reading anymore, keep chatting without output
+            nexchat_buffer_clear(&io->output);
+            return;
+        }
+
+        nexchat_buffer_consume(&io->output, (size_t)written);
     }
 }
 
+static void nexchat_client_print_usage(const char* program)
+{
+    printf("usage: %s [options]\n", program);
+    printf("  -a, --address <ip>       server address (default %s)\n", IPADDR);
+    printf("  -p, --port <port>        server port (default %s)\n", PORT);
+    printf("  -u, --username <name>    username to join with instead of asking for one\n");
+    printf("  -f, --batch <file>       send every line of <file> (- for stdin) as fast as the host takes them, then leave\n");
+    printf("  -q, --quiet              don't print what the host sends\n");
+    printf("  -h, --help               show this message\n");
+}
+
+static int32_t nexchat_client_parse_args(nexchat_client_config_t* config, int argc, char** argv)
+{
+    static const struct option options[] =
+    {
+        {"address",  required_argument, NULL, 'a'},
+        {"port",     required_argument, NULL, 'p'},
+        {"username", required_argument, NULL, 'u'},
+        {"batch",    required_argument, NULL, 'f'},
+        {"quiet",    no_argument,       NULL, 'q'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    config->host.ipaddr = IPADDR;
+    config->host.service = PORT;
+    config->username = NULL;
+    config->batch = NULL;
+    config->quiet = false;
+
+    int32_t opt = 0;
+    while ((opt = getopt_long(argc, argv, "a:p:u:f:qh", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': config->host.ipaddr = optarg; break;
+            case 'p': config->host.service = optarg; break;
+            case 'u': config->username = optarg; break;
+            case 'f': config->batch = optarg; break;
+            case 'q': config->quiet = true; break;
+            case 'h':
+            default:
+                nexchat_client_print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    // there's nobody to prompt in batch mode, the input is all messages
+    if (config->batch != NULL && config->username == NULL)
+    {
+        config->username = "bot";
+    }
+
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
+    // a host closing mid-send shows up as EPIPE instead of killing the client
+    signal(SIGPIPE, SIG_IGN);
+
+    nexchat_client_config_t config;
+    if (nexchat_client_parse_args(&config, argc, argv) == -1)
+    {
+        return 1;
+    }
+
+    // the prompt reads stdin through stdio, unbuffered so nothing meant for the poll loop is swallowed
+    setvbuf(stdin, NULL, _IONBF, 0);
+
     nexchat_client_state_t client;
-    nexchat_inet_id_t id = {.ipaddr=IPADDR, .service=NULL};
+    memset(&client, 0, sizeof client);
 
-    if (nexchat_client_connect_to_host(&client, &id) == -1)
+    if (nexchat_client_connect_to_host(&client, &config) == -1)
     {
         return 1;
     }
 
-    nexchat_client_launch(&client);
-}
\ No newline at end of file
+    fflush(stdout);
+
+    return nexchat_client_launch(&client, &config) == -1 ? 1 : 0;
+}
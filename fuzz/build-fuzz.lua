@@ -0,0 +1,62 @@
+-- One project per harness, each a harness file plus the standalone driver, or plus libFuzzer
+-- when generated with --libfuzzer (see build.lua)
+local harnesses =
+{
+   frame = {},
+   command = { "../server/src/commands.c" },
+}
+
+for name, sources in pairs(harnesses) do
+   project ("nexchat-fuzz-" .. name)
+      kind "ConsoleApp"
+      language "C"
+      cdialect "gnu99"
+      targetdir "bin/%{cfg.buildcfg}"
+      staticruntime "off"
+
+      files { "src/fuzz.h", "src/driver.c", "src/fuzz_" .. name .. ".c" }
+      files (sources)
+
+      includedirs
+      {
+         "src",
+
+         -- include libcommon
+         "../libcommon/src",
+
+         -- include the server's headers
+         "../server/src",
+      }
+
+      links
+      {
+         "libcommon",
+         "pthread",
+      }
+
+      targetdir ("../bin/" .. OutputDir .. "/%{prj.name}")
+      objdir ("../bin/int/" .. OutputDir .. "/%{prj.name}")
+
+      filter "options:libfuzzer"
+         removefiles { "src/driver.c" }
+         linkoptions { "-fsanitize=fuzzer" }
+
+      filter "configurations:Debug"
+         defines { "DEBUG" }
+         runtime "Debug"
+         symbols "On"
+
+      filter "configurations:Release"
+         defines { "RELEASE" }
+         runtime "Release"
+         optimize "On"
+         symbols "On"
+
+      filter "configurations:Dist"
+         defines { "DIST" }
+         runtime "Release"
+         optimize "On"
+         symbols "Off"
+
+      filter {}
+end
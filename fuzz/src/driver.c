@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <getopt.h>
+#include <dirent.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libcommon/libcommon.h"
+
+#include "fuzz.h"
+
+// Standalone driver for the harnesses, for toolchains without libFuzzer. It runs every corpus
+// input (or the harness's seeds), then --runs random mutations of them. There is no coverage
+// feedback, so it finds shallow bugs and guards against regressions on known inputs; build
+// with --libfuzzer for real fuzzing. An input that crashes is written to --crash before the
+// process dies, the summary is JSON on stdout.
+#define FUZZ_MAX_LEN  4096
+#define FUZZ_RUNS     100000
+
+typedef struct nexchat_fuzz_config_t
+{
+    uint64_t runs;
+    uint64_t seed;
+    size_t max_len;
+    const char* crash; // where a crashing input is saved
+    const char* output;
+} nexchat_fuzz_config_t;
+
+typedef struct nexchat_fuzz_input_t
+{
+    uint8_t* data;
+    size_t size;
+} nexchat_fuzz_input_t;
+
+typedef struct nexchat_fuzz_corpus_t
+{
+    nexchat_fuzz_input_t* inputs;
+    size_t count;
+    size_t capacity;
+} nexchat_fuzz_corpus_t;
+
+// the input being run, for the crash handler
+static const uint8_t* nexchat_fuzz_current;
+static size_t nexchat_fuzz_current_size;
+static const char* nexchat_fuzz_crash_path;
+
+static void nexchat_fuzz_on_crash(int sig)
+{
+    // only async-signal-safe calls from here on
+    int32_t fd = open(nexchat_fuzz_crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1)
+    {
+        ssize_t written = write(fd, nexchat_fuzz_current, nexchat_fuzz_current_size);
+        (void)written;
+        close(fd);
+    }
+
+    static const char note[] = "nexchat-fuzz: crashed, input saved\n";
+    ssize_t noted = write(STDERR_FILENO, note, sizeof note - 1);
+    (void)noted;
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static uint64_t nexchat_fuzz_random(uint64_t* seed)
+{
+    // xorshift64
+    uint64_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *seed = x;
+    return x;
+}
+
+static int32_t nexchat_fuzz_corpus_add(nexchat_fuzz_corpus_t* corpus, const void* data, size_t size)
+{
+    if (corpus->count == corpus->capacity)
+    {
+        size_t capacity = corpus->capacity > 0 ? corpus->capacity * 2 : 16;
+        nexchat_fuzz_input_t* inputs = (nexchat_fuzz_input_t*)realloc(corpus->inputs, capacity * sizeof(nexchat_fuzz_input_t));
+        if (inputs == NULL)
+        {
+            return -1;
+        }
+
+        corpus->inputs = inputs;
+        corpus->capacity = capacity;
+    }
+
+    nexchat_fuzz_input_t* input = &corpus->inputs[corpus->count];
+    input->data = (uint8_t*)malloc(size > 0 ? size : 1);
+    if (input->data == NULL)
+    {
+        return -1;
+    }
+
+    memcpy(input->data, data, size);
+    input->size = size;
+    corpus->count++;
+
+    return 0;
+}
+
+static int32_t nexchat_fuzz_load_file(nexchat_fuzz_corpus_t* corpus, const char* path, size_t max_len)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    uint8_t* data = (uint8_t*)malloc(max_len);
+    size_t size = data != NULL ? fread(data, 1, max_len, file) : 0;
+    int32_t status = data != NULL && !ferror(file) ? nexchat_fuzz_corpus_add(corpus, data, size) : -1;
+
+    free(data);
+    fclose(file);
+
+    return status;
+}
+
+static int32_t nexchat_fuzz_load(nexchat_fuzz_corpus_t* corpus, const char* path, size_t max_len)
+{
+    struct stat info;
+    if (stat(path, &info) == -1)
+    {
+        perror(path);
+        return -1;
+    }
+
+    if (!S_ISDIR(info.st_mode))
+    {
+        return nexchat_fuzz_load_file(corpus, path, max_len);
+    }
+
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    struct dirent* entry = NULL;
+    int32_t status = 0;
+
+    while (status == 0 && (entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        char child[4096];
+        snprintf(child, sizeof child, "%s/%s", path, entry->d_name);
+
+        if (stat(child, &info) == 0 && S_ISREG(info.st_mode))
+        {
+            status = nexchat_fuzz_load_file(corpus, child, max_len);
+        }
+    }
+
+    closedir(dir);
+
+    return status;
+}
+
+static void nexchat_fuzz_corpus_free(nexchat_fuzz_corpus_t* corpus)
+{
+    for (size_t i = 0; i < corpus->count; i++)
+    {
+        free(corpus->inputs[i].data);
+    }
+
+    free(corpus->inputs);
+}
+
+// values that tend to sit on boundaries of the wire format and the command syntax
+static const uint8_t nexchat_fuzz_bytes[] = {0x00, 0x01, 0x7f, 0x80, 0xff, '/', '"', ' ', '\t', '\n', FRAME_TEXT, FRAME_MAXTYPES};
+static const uint32_t nexchat_fuzz_sizes[] = {0, 1, 5, NEXCHAT_FRAME_RECV_CHUNK, NEXCHAT_FRAME_MAX_PAYLOAD, NEXCHAT_FRAME_MAX_PAYLOAD + 1, UINT32_MAX};
+
+// applies a few random edits to `buf`, which holds `size` bytes and has room for `max_len`
+static size_t nexchat_fuzz_mutate(uint8_t* buf, size_t size, size_t max_len, const nexchat_fuzz_corpus_t* corpus, uint64_t* seed)
+{
+    size_t edits = 1 + nexchat_fuzz_random(seed) % 4;
+
+    for (size_t e = 0; e < edits; e++)
+    {
+        uint64_t r = nexchat_fuzz_random(seed);
+        size_t at = size > 0 ? (size_t)(r >> 8) % size : 0;
+
+        switch (r % 7)
+        {
+            case 0: // flip a bit
+            {
+                if (size > 0) buf[at] ^= (uint8_t)(1u << ((r >> 40) % 8));
+            } break;
+            case 1: // an interesting byte
+            {
+                if (size > 0) buf[at] = nexchat_fuzz_bytes[(r >> 40) % sizeof nexchat_fuzz_bytes];
+            } break;
+            case 2: // an interesting big-endian frame size
+            {
+                if (size >= 4)
+                {
+                    uint32_t value = nexchat_fuzz_sizes[(r >> 40) % (sizeof nexchat_fuzz_sizes / sizeof nexchat_fuzz_sizes[0])];
+                    at = at <= size - 4 ? at : size - 4;
+                    buf[at] = (uint8_t)(value >> 24);
+                    buf[at + 1] = (uint8_t)(value >> 16);
+                    buf[at + 2] = (uint8_t)(value >> 8);
+                    buf[at + 3] = (uint8_t)value;
+                }
+            } break;
+            case 3: // insert a random byte
+            {
+                if (size < max_len)
+                {
+                    memmove(buf + at + 1, buf + at, size - at);
+                    buf[at] = (uint8_t)(r >> 40);
+                    size++;
+                }
+            } break;
+            case 4: // erase a range
+            {
+                if (size > 0)
+                {
+                    size_t len = 1 + (size_t)(r >> 40) % (size - at);
+                    memmove(buf + at, buf + at + len, size - at - len);
+                    size -= len;
+                }
+            } break;
+            case 5: // repeat a range, frames back to back
+            {
+                size_t len = size > 0 ? 1 + (size_t)(r >> 40) % (size - at) : 0;
+                if (len > 0 && size + len <= max_len)
+                {
+                    memcpy(buf + size, buf + at, len);
+                    size += len;
+                }
+            } break;
+            case 6: // splice in the head of another input
+            {
+                const nexchat_fuzz_input_t* other = &corpus->inputs[(r >> 40) % corpus->count];
+                size_t len = other->size < max_len - at ? other->size : max_len - at;
+                len = len > 0 ? 1 + (size_t)(r >> 20) % len : 0;
+                memcpy(buf + at, other->data, len);
+                size = at + len > size ? at + len : size;
+            } break;
+        }
+    }
+
+    return size;
+}
+
+static void nexchat_fuzz_run_one(const uint8_t* data, size_t size)
+{
+    nexchat_fuzz_current = data;
+    nexchat_fuzz_current_size = size;
+
+    LLVMFuzzerTestOneInput(data, size);
+}
+
+static void nexchat_fuzz_print_usage(const char* program)
+{
+    printf("usage: %s [options] [file|dir ...]\n", program);
+    printf("  -r, --runs <n>           mutated inputs to run after the corpus (default %d)\n", FUZZ_RUNS);
+    printf("  -s, --seed <n>           random seed (default 1)\n");
+    printf("  -m, --max-len <bytes>    largest input, corpus files are cut to it (default %d)\n", FUZZ_MAX_LEN);
+    printf("  -c, --crash <file>       where a crashing input is saved (default crash-<harness>)\n");
+    printf("  -o, --output <file>      write the JSON summary to <file> instead of stdout\n");
+    printf("  -h, --help               show this message\n");
+}
+
+static int32_t nexchat_fuzz_parse_number(const char* name, const char* arg, uint64_t min, uint64_t* value)
+{
+    char* end = NULL;
+    *value = strtoull(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || *value < min)
+    {
+        fprintf(stderr, "nexchat-fuzz: invalid --%s '%s'\n", name, arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int32_t nexchat_fuzz_parse_args(nexchat_fuzz_config_t* config, int argc, char** argv)
+{
+    static const struct option options[] =
+    {
+        {"runs",    required_argument, NULL, 'r'},
+        {"seed",    required_argument, NULL, 's'},
+        {"max-len", required_argument, NULL, 'm'},
+        {"crash",   required_argument, NULL, 'c'},
+        {"output",  required_argument, NULL, 'o'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    static char crash[64];
+    snprintf(crash, sizeof crash, "crash-%s", nexchat_fuzz_harness);
+
+    config->runs = FUZZ_RUNS;
+    config->seed = 1;
+    config->max_len = FUZZ_MAX_LEN;
+    config->crash = crash;
+    config->output = NULL;
+
+    int32_t opt = 0;
+    uint64_t value = 0;
+
+    while ((opt = getopt_long(argc, argv, "r:s:m:c:o:h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'r':
+            {
+                if (nexchat_fuzz_parse_number("runs", optarg, 0, &value) == -1) return -1;
+                config->runs = value;
+            } break;
+            case 's':
+            {
+                if (nexchat_fuzz_parse_number("seed", optarg, 1, &value) == -1) return -1;
+                config->seed = value;
+            } break;
+            case 'm':
+            {
+                if (nexchat_fuzz_parse_number("max-len", optarg, 1, &value) == -1) return -1;
+                config->max_len = (size_t)value;
+            } break;
+            case 'c': config->crash = optarg; break;
+            case 'o': config->output = optarg; break;
+            case 'h':
+            default:
+                nexchat_fuzz_print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    nexchat_fuzz_config_t config;
+    if (nexchat_fuzz_parse_args(&config, argc, argv) == -1)
+    {
+        return 1;
+    }
+
+    nexchat_fuzz_corpus_t corpus;
+    memset(&corpus, 0, sizeof corpus);
+
+    for (int i = optind; i < argc; i++)
+    {
+        if (nexchat_fuzz_load(&corpus, argv[i], config.max_len) == -1)
+        {
+            nexchat_fuzz_corpus_free(&corpus);
+            return 1;
+        }
+    }
+
+    size_t seeds = corpus.count == 0 ? nexchat_fuzz_seed_count : 0;
+
+    for (size_t i = 0; i < seeds; i++)
+    {
+        const nexchat_fuzz_seed_t* seed = &nexchat_fuzz_seeds[i];
+        if (nexchat_fuzz_corpus_add(&corpus, seed->data, seed->size < config.max_len ? seed->size : config.max_len) == -1)
+        {
+            fprintf(stderr, "nexchat-fuzz: out of memory\n");
+            nexchat_fuzz_corpus_free(&corpus);
+            return 1;
+        }
+    }
+
+    uint8_t* buf = (uint8_t*)malloc(config.max_len);
+    FILE* out = config.output != NULL ? fopen(config.output, "w") : stdout;
+
+    if (buf == NULL || out == NULL)
+    {
+        perror(buf == NULL ? "malloc" : config.output);
+        nexchat_fuzz_corpus_free(&corpus);
+        free(buf);
+        return 1;
+    }
+
+    nexchat_fuzz_crash_path = config.crash;
+    signal(SIGABRT, nexchat_fuzz_on_crash);
+    signal(SIGSEGV, nexchat_fuzz_on_crash);
+    signal(SIGBUS, nexchat_fuzz_on_crash);
+    signal(SIGFPE, nexchat_fuzz_on_crash);
+
+    uint64_t started = nexchat_clock_now_ns();
+    uint64_t bytes = 0;
+
+    for (size_t i = 0; i < corpus.count; i++)
+    {
+        nexchat_fuzz_run_one(corpus.inputs[i].data, corpus.inputs[i].size);
+        bytes += corpus.inputs[i].size;
+    }
+
+    uint64_t seed = config.seed;
+
+    for (uint64_t run = 0; run < config.runs; run++)
+    {
+        const nexchat_fuzz_input_t* base = &corpus.inputs[nexchat_fuzz_random(&seed) % corpus.count];
+
+        memcpy(buf, base->data, base->size);
+        size_t size = nexchat_fuzz_mutate(buf, base->size, config.max_len, &corpus, &seed);
+
+        nexchat_fuzz_run_one(buf, size);
+        bytes += size;
+    }
+
+    double seconds = (double)(nexchat_clock_now_ns() - started) / 1e9;
+    uint64_t total = corpus.count + config.runs;
+
+    fprintf(out, "{\"tool\": \"nexchat-fuzz\", \"harness\": \"%s\", \"engine\": \"standalone\", \"seed\": %llu, "
+                 "\"corpus\": %zu, \"runs\": %llu, \"bytes\": %llu, \"seconds\": %.3f, \"execs_per_sec\": %.1f, \"crashes\": 0}\n",
+            nexchat_fuzz_harness, (unsigned long long)config.seed, corpus.count, (unsigned long long)total,
+            (unsigned long long)bytes, seconds, seconds > 0.0 ? (double)total / seconds : 0.0);
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    free(buf);
+    nexchat_fuzz_corpus_free(&corpus);
+
+    return 0;
+}
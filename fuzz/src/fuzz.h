@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Every harness is one libFuzzer target: it defines LLVMFuzzerTestOneInput, which must accept
+// any input and abort through NEXCHAT_FUZZ_CHECK when an invariant of the code under test
+// breaks. Built with --libfuzzer the entry point is driven by libFuzzer's coverage guided
+// engine; otherwise driver.c replays a corpus and random mutations of it, which needs no
+// special toolchain and is what the default build produces.
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+typedef struct nexchat_fuzz_seed_t
+{
+    const char* data;
+    size_t size;
+} nexchat_fuzz_seed_t;
+
+#define NEXCHAT_FUZZ_SEED(literal) {literal, sizeof(literal) - 1}
+
+// defined by each harness, the driver starts from the seeds when it is given no corpus
+extern const char nexchat_fuzz_harness[];
+extern const nexchat_fuzz_seed_t nexchat_fuzz_seeds[];
+extern const size_t nexchat_fuzz_seed_count;
+
+#define NEXCHAT_FUZZ_CHECK(cond)                                                               \
+    do                                                                                         \
+    {                                                                                          \
+        if (!(cond))                                                                           \
+        {                                                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);           \
+            abort();                                                                           \
+        }                                                                                      \
+    } while (0)
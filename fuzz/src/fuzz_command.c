@@ -0,0 +1,98 @@
+#include "fuzz.h"
+
+#include <string.h>
+
+#include "libcommon/libcommon.h"
+
+#include "commands.h"
+
+// A text payload starting with '/' as nexchat_server_handle_msg takes it: tokenized, looked up
+// and its arguments counted. Words must stay inside the argument storage with the quotes gone,
+// and the perfect hash must agree with a plain search of the command table.
+const char nexchat_fuzz_harness[] = "command";
+
+const nexchat_fuzz_seed_t nexchat_fuzz_seeds[] =
+{
+    NEXCHAT_FUZZ_SEED("/users"),
+    NEXCHAT_FUZZ_SEED("/kick bob"),
+    NEXCHAT_FUZZ_SEED("/join \"red room\""),
+    NEXCHAT_FUZZ_SEED("/set-username \"a b\"c"),
+    NEXCHAT_FUZZ_SEED("/presence\ton"),
+    NEXCHAT_FUZZ_SEED("/admin \"unterminated"),
+    NEXCHAT_FUZZ_SEED("/a b c d e f g h i j"),
+    NEXCHAT_FUZZ_SEED("/\"\""),
+};
+
+const size_t nexchat_fuzz_seed_count = sizeof nexchat_fuzz_seeds / sizeof nexchat_fuzz_seeds[0];
+
+static nexchat_client_command_t nexchat_fuzz_command_search(const char* name)
+{
+    for (size_t i = CMD_NONE + 1; i < CMD_MAXCOMMANDS; i++)
+    {
+        if (strcmp(nexchat_client_command_to_str((nexchat_client_command_t)i), name) == 0)
+        {
+            return (nexchat_client_command_t)i;
+        }
+    }
+
+    return CMD_NONE;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    // payloads arrive NUL terminated and at most a frame long, the server reads up to the first NUL
+    char line[NEXCHAT_FRAME_MAX_PAYLOAD + 1];
+    size = size < NEXCHAT_FRAME_MAX_PAYLOAD ? size : NEXCHAT_FRAME_MAX_PAYLOAD;
+    memcpy(line, data, size);
+    line[size] = '\0';
+
+    if (line[0] != '/')
+    {
+        return 0;
+    }
+
+    nexchat_command_args_t args;
+    memset(&args, 0xa5, sizeof args);
+
+    int32_t status = nexchat_command_tokenize(&line[1], &args);
+    NEXCHAT_FUZZ_CHECK(status == 0 || status == NEXCHAT_COMMAND_MALFORMED || status == NEXCHAT_COMMAND_TOO_LONG || status == NEXCHAT_COMMAND_TOO_MANY);
+
+    // too many words still leaves the first ones for the server to name the command by
+    if (status != 0 && status != NEXCHAT_COMMAND_TOO_MANY)
+    {
+        return 0;
+    }
+
+    NEXCHAT_FUZZ_CHECK(args.argc <= NEXCHAT_COMMAND_MAXARGS);
+    NEXCHAT_FUZZ_CHECK(status == 0 || args.argc == NEXCHAT_COMMAND_MAXARGS);
+
+    const char* storage_end = args.storage + sizeof args.storage;
+
+    for (size_t i = 0; i < args.argc; i++)
+    {
+        const char* word = args.argv[i];
+        NEXCHAT_FUZZ_CHECK(word >= args.storage && word < storage_end);
+
+        size_t len = strnlen(word, (size_t)(storage_end - word));
+        NEXCHAT_FUZZ_CHECK(word + len < storage_end);
+        NEXCHAT_FUZZ_CHECK(memchr(word, '"', len) == NULL);
+
+        // words are laid out in order, each after the previous one's terminator
+        NEXCHAT_FUZZ_CHECK(i == 0 || word > args.argv[i - 1] + strlen(args.argv[i - 1]));
+    }
+
+    if (args.argc == 0)
+    {
+        return 0;
+    }
+
+    nexchat_client_command_t cmd = nexchat_client_command_lookup(args.argv[0], strlen(args.argv[0]));
+    NEXCHAT_FUZZ_CHECK(cmd == nexchat_fuzz_command_search(args.argv[0]));
+
+    // a command the server accepts has room for its arguments after the name
+    const nexchat_command_info_t* info = nexchat_client_command_info(cmd);
+    NEXCHAT_FUZZ_CHECK(info->minargs <= info->maxargs && info->maxargs < NEXCHAT_COMMAND_MAXARGS);
+    NEXCHAT_FUZZ_CHECK(cmd != CMD_NONE || strcmp(info->name, "none") == 0);
+
+    return 0;
+}
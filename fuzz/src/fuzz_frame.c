@@ -0,0 +1,100 @@
+#include "fuzz.h"
+
+#include <string.h>
+
+#include "libcommon/libcommon.h"
+
+// The receive parser, fed the way a socket feeds it. The first byte picks how many bytes each
+// "recv" hands over, the rest is the stream. Every frame decoded must be one the encoder would
+// produce from the same bytes, and a stream the decoder rejects must stay rejected.
+const char nexchat_fuzz_harness[] = "frame";
+
+const nexchat_fuzz_seed_t nexchat_fuzz_seeds[] =
+{
+    NEXCHAT_FUZZ_SEED("\x00\x00\x00\x00\x06\x01hello\x00"),
+    NEXCHAT_FUZZ_SEED("\x03\x00\x00\x00\x07\x01/users\x00\x00\x00\x00\x00\x05\x00\x00\x00\x00\x04"),
+    NEXCHAT_FUZZ_SEED("\x01\x00\x00\x00\x0a\x03+1 alice\x00\x00\x00\x00\x03\x01hi"),
+    NEXCHAT_FUZZ_SEED("\x00\x00\x01\x00\x01\x01"),
+    NEXCHAT_FUZZ_SEED("\x07\x00\x00\x00\x00\x01"),
+};
+
+const size_t nexchat_fuzz_seed_count = sizeof nexchat_fuzz_seeds / sizeof nexchat_fuzz_seeds[0];
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    // 0 hands over everything the decoder has room for, like a recv into a large buffer
+    size_t chunk = data[0] % 64;
+    const uint8_t* stream = data + 1;
+    size_t length = size - 1;
+
+    nexchat_frame_decoder_t decoder;
+    nexchat_frame_decoder_init(&decoder);
+
+    nexchat_buffer_t encoded;
+    nexchat_buffer_init(&encoded, NEXCHAT_FRAME_HEADER_SIZE + 256);
+
+    size_t fed = 0;
+    size_t decoded = 0; // stream bytes accounted for by decoded frames
+    int32_t status = 0;
+
+    while (status != -1)
+    {
+        nexchat_frame_t frame;
+
+        while ((status = nexchat_frame_decoder_next(&decoder, &frame)) == 1)
+        {
+            NEXCHAT_FUZZ_CHECK(frame.type > FRAME_NONE && frame.type < FRAME_MAXTYPES);
+            NEXCHAT_FUZZ_CHECK(frame.size <= NEXCHAT_FRAME_MAX_PAYLOAD);
+            NEXCHAT_FUZZ_CHECK(decoded + NEXCHAT_FRAME_HEADER_SIZE + frame.size <= fed);
+
+            if (frame.type == FRAME_TEXT || frame.type == FRAME_PRESENCE)
+            {
+                // the server uses text payloads in place as C strings
+                NEXCHAT_FUZZ_CHECK(frame.size > 0 && frame.payload[frame.size - 1] == '\0');
+            }
+
+            // re-encoding gives back exactly the bytes that were decoded
+            nexchat_buffer_clear(&encoded);
+            NEXCHAT_FUZZ_CHECK(nexchat_frame_encode(&encoded, frame.type, frame.payload, frame.size) == 0);
+            NEXCHAT_FUZZ_CHECK(nexchat_buffer_readable(&encoded) == NEXCHAT_FRAME_HEADER_SIZE + frame.size);
+            NEXCHAT_FUZZ_CHECK(memcmp(nexchat_buffer_head(&encoded), stream + decoded, NEXCHAT_FRAME_HEADER_SIZE + frame.size) == 0);
+
+            decoded += NEXCHAT_FRAME_HEADER_SIZE + frame.size;
+        }
+
+        if (status == -1)
+        {
+            // the server drops the connection here, and the same bytes must not parse later
+            nexchat_frame_t again;
+            NEXCHAT_FUZZ_CHECK(nexchat_frame_decoder_next(&decoder, &again) == -1);
+            break;
+        }
+
+        if (fed == length)
+        {
+            break;
+        }
+
+        size_t space = 0;
+        uint8_t* dst = nexchat_frame_decoder_prepare(&decoder, &space);
+        NEXCHAT_FUZZ_CHECK(dst != NULL && space > 0);
+
+        size_t n = length - fed;
+        n = n < space ? n : space;
+        n = chunk > 0 && n > chunk ? chunk : n;
+
+        memcpy(dst, stream + fed, n);
+        nexchat_frame_decoder_commit(&decoder, n);
+        fed += n;
+    }
+
+    nexchat_buffer_free(&encoded);
+    nexchat_frame_decoder_free(&decoder);
+
+    return 0;
+}
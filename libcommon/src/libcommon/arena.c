@@ -0,0 +1,99 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pool.h"
+
+void nexchat_arena_free(nexchat_arena_t* arena)
+{
+    nexchat_arena_chunk_t* chunk = arena->head;
+    while (chunk != NULL)
+    {
+        nexchat_arena_chunk_t* next = chunk->next;
+        nexchat_pool_free(chunk);
+        chunk = next;
+    }
+
+    arena->head = NULL;
+}
+
+void nexchat_arena_reset(nexchat_arena_t* arena)
+{
+    if (arena->head == NULL)
+    {
+        return;
+    }
+
+    // the oldest chunk is the smallest, keep it for the next round of scratch
+    while (arena->head->next != NULL)
+    {
+        nexchat_arena_chunk_t* next = arena->head->next;
+        nexchat_pool_free(arena->head);
+        arena->head = next;
+    }
+
+    arena->head->used = 0;
+}
+
+void* nexchat_arena_alloc(nexchat_arena_t* arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+
+    nexchat_arena_chunk_t* chunk = arena->head;
+    if (chunk == NULL || chunk->capacity - chunk->used < size)
+    {
+        size_t capacity = chunk != NULL ? chunk->capacity * 2 : NEXCHAT_ARENA_CHUNK;
+        while (capacity < size)
+        {
+            capacity *= 2;
+        }
+
+        chunk = (nexchat_arena_chunk_t*)nexchat_pool_alloc(sizeof(nexchat_arena_chunk_t) + capacity);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+
+        chunk->next = arena->head;
+        chunk->capacity = capacity;
+        chunk->used = 0;
+        arena->head = chunk;
+    }
+
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return ptr;
+}
+
+char* nexchat_arena_vprintf(nexchat_arena_t* arena, const char* fmt, va_list args)
+{
+    va_list copy;
+    va_copy(copy, args);
+    int32_t len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+
+    if (len < 0)
+    {
+        return NULL;
+    }
+
+    char* str = (char*)nexchat_arena_alloc(arena, (size_t)len + 1);
+    if (str != NULL)
+    {
+        vsnprintf(str, (size_t)len + 1, fmt, args);
+    }
+
+    return str;
+}
+
+char* nexchat_arena_printf(nexchat_arena_t* arena, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    char* str = nexchat_arena_vprintf(arena, fmt, args);
+    va_end(args);
+
+    return str;
+}
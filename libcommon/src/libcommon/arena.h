@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#define NEXCHAT_ARENA_CHUNK 1024 // first chunk, later ones double
+
+typedef struct nexchat_arena_chunk_t
+{
+    struct nexchat_arena_chunk_t* next;
+    size_t capacity;
+    size_t used;
+    uint8_t data[] __attribute__((aligned(16)));
+} nexchat_arena_chunk_t;
+
+// Bump allocator for short lived scratch, chunks come from the pool allocator. Nothing is freed
+// on its own, a reset drops everything at once and keeps the first chunk for next time.
+typedef struct nexchat_arena_t
+{
+    nexchat_arena_chunk_t* head; // newest chunk, allocations are made from it
+} nexchat_arena_t;
+
+static inline void nexchat_arena_init(nexchat_arena_t* arena)
+{
+    arena->head = NULL;
+}
+
+void nexchat_arena_free(nexchat_arena_t* arena);
+void nexchat_arena_reset(nexchat_arena_t* arena);
+
+// 16 byte aligned, NULL when out of memory
+void* nexchat_arena_alloc(nexchat_arena_t* arena, size_t size);
+
+// formats into the arena without a length limit, NULL when out of memory
+char* nexchat_arena_printf(nexchat_arena_t* arena, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+char* nexchat_arena_vprintf(nexchat_arena_t* arena, const char* fmt, va_list args);
@@ -0,0 +1,98 @@
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+void nexchat_buffer_init(nexchat_buffer_t* buf, size_t capacity)
+{
+    buf->data = capacity > 0 ? (uint8_t*)nexchat_pool_alloc(capacity) : NULL;
+    buf->offset = 0;
+    buf->size = 0;
+    buf->capacity = buf->data != NULL ? capacity : 0;
+}
+
+void nexchat_buffer_free(nexchat_buffer_t* buf)
+{
+    nexchat_pool_free(buf->data);
+    buf->data = NULL;
+    buf->offset = 0;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+void nexchat_buffer_clear(nexchat_buffer_t* buf)
+{
+    buf->offset = 0;
+    buf->size = 0;
+}
+
+int32_t nexchat_buffer_reserve(nexchat_buffer_t* buf, size_t bytes)
+{
+    if (nexchat_buffer_writable(buf) >= bytes)
+    {
+        return 0;
+    }
+
+    // slide the unread bytes to the front before growing
+    size_t readable = nexchat_buffer_readable(buf);
+    if (buf->offset > 0)
+    {
+        memmove(buf->data, buf->data + buf->offset, readable);
+        buf->offset = 0;
+        buf->size = readable;
+
+        if (nexchat_buffer_writable(buf) >= bytes)
+        {
+            return 0;
+        }
+    }
+
+    size_t capacity = buf->capacity > 0 ? buf->capacity : 256;
+    while (capacity - readable < bytes)
+    {
+        capacity *= 2;
+    }
+
+    uint8_t* data = (uint8_t*)nexchat_pool_realloc(buf->data, capacity);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    buf->data = data;
+    buf->capacity = capacity;
+
+    return 0;
+}
+
+int32_t nexchat_buffer_append(nexchat_buffer_t* buf, const void* data, size_t size)
+{
+    if (nexchat_buffer_reserve(buf, size) == -1)
+    {
+        return -1;
+    }
+
+    memcpy(nexchat_buffer_tail(buf), data, size);
+    buf->size += size;
+
+    return 0;
+}
+
+void nexchat_buffer_commit(nexchat_buffer_t* buf, size_t bytes)
+{
+    buf->size += bytes;
+}
+
+void nexchat_buffer_consume(nexchat_buffer_t* buf, size_t bytes)
+{
+    buf->offset += bytes;
+
+    // fully drained, rewind for free instead of memmoving later
+    if (buf->offset >= buf->size)
+    {
+        buf->offset = 0;
+        buf->size = 0;
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Growable byte buffer with a read cursor. Bytes are appended at the tail and
+// consumed from the front; consumed space is reclaimed lazily when the tail runs out.
+typedef struct nexchat_buffer_t
+{
+    uint8_t* data;
+    size_t offset;   // first unread byte
+    size_t size;     // one past the last written byte
+    size_t capacity;
+} nexchat_buffer_t;
+
+void nexchat_buffer_init(nexchat_buffer_t* buf, size_t capacity);
+void nexchat_buffer_free(nexchat_buffer_t* buf);
+void nexchat_buffer_clear(nexchat_buffer_t* buf);
+
+// make room for at least `bytes` more bytes at the tail, returns -1 on allocation failure
+int32_t nexchat_buffer_reserve(nexchat_buffer_t* buf, size_t bytes);
+int32_t nexchat_buffer_append(nexchat_buffer_t* buf, const void* data, size_t size);
+void nexchat_buffer_commit(nexchat_buffer_t* buf, size_t bytes);
+void nexchat_buffer_consume(nexchat_buffer_t* buf, size_t bytes);
+
+static inline uint8_t* nexchat_buffer_head(const nexchat_buffer_t* buf) { return buf->data + buf->offset; }
+static inline uint8_t* nexchat_buffer_tail(const nexchat_buffer_t* buf) { return buf->data + buf->size; }
+static inline size_t nexchat_buffer_readable(const nexchat_buffer_t* buf) { return buf->size - buf->offset; }
+static inline size_t nexchat_buffer_writable(const nexchat_buffer_t* buf) { return buf->capacity - buf->size; }
@@ -0,0 +1,106 @@
+#include "epoch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int32_t nexchat_epoch_init(nexchat_epoch_t* epoch, size_t readers)
+{
+    memset(epoch, 0, sizeof(nexchat_epoch_t));
+
+    epoch->slots = (nexchat_epoch_slot_t*)calloc(readers, sizeof(nexchat_epoch_slot_t));
+    if (epoch->slots == NULL)
+    {
+        return -1;
+    }
+
+    // 0 means quiescent, so the count starts above it
+    epoch->global = 1;
+    epoch->slot_count = readers;
+    pthread_mutex_init(&epoch->mutex, NULL);
+
+    return 0;
+}
+
+static void nexchat_epoch_collect(nexchat_epoch_t* epoch, size_t bucket)
+{
+    nexchat_epoch_garbage_t* garbage = epoch->limbo[bucket];
+    epoch->limbo[bucket] = NULL;
+
+    while (garbage != NULL)
+    {
+        nexchat_epoch_garbage_t* next = garbage->next;
+        garbage->free_fn(garbage->ptr);
+        free(garbage);
+        epoch->pending--;
+        garbage = next;
+    }
+}
+
+void nexchat_epoch_free(nexchat_epoch_t* epoch)
+{
+    for (size_t i = 0; i < 3; i++)
+    {
+        nexchat_epoch_collect(epoch, i);
+    }
+
+    free(epoch->slots);
+    pthread_mutex_destroy(&epoch->mutex);
+    memset(epoch, 0, sizeof(nexchat_epoch_t));
+}
+
+static bool nexchat_epoch_try_advance(nexchat_epoch_t* epoch)
+{
+    uint64_t global = __atomic_load_n(&epoch->global, __ATOMIC_SEQ_CST);
+
+    // a reader still in an older epoch may hold anything retired since
+    for (size_t i = 0; i < epoch->slot_count; i++)
+    {
+        uint64_t active = __atomic_load_n(&epoch->slots[i].active, __ATOMIC_SEQ_CST);
+        if (active != 0 && active != global)
+        {
+            return false;
+        }
+    }
+
+    // retired three epochs ago, before any reader that is active now had entered
+    uint64_t next = global + 1;
+    nexchat_epoch_collect(epoch, next % 3);
+    __atomic_store_n(&epoch->global, next, __ATOMIC_SEQ_CST);
+
+    return true;
+}
+
+int32_t nexchat_epoch_retire(nexchat_epoch_t* epoch, void* ptr, nexchat_epoch_free_fn free_fn)
+{
+    nexchat_epoch_garbage_t* garbage = (nexchat_epoch_garbage_t*)malloc(sizeof(nexchat_epoch_garbage_t));
+    if (garbage == NULL)
+    {
+        return -1;
+    }
+
+    garbage->ptr = ptr;
+    garbage->free_fn = free_fn;
+
+    pthread_mutex_lock(&epoch->mutex);
+
+    size_t bucket = __atomic_load_n(&epoch->global, __ATOMIC_RELAXED) % 3;
+    garbage->next = epoch->limbo[bucket];
+    epoch->limbo[bucket] = garbage;
+    epoch->pending++;
+
+    // writers drive reclamation, there is no background thread
+    nexchat_epoch_try_advance(epoch);
+
+    pthread_mutex_unlock(&epoch->mutex);
+
+    return 0;
+}
+
+bool nexchat_epoch_advance(nexchat_epoch_t* epoch)
+{
+    pthread_mutex_lock(&epoch->mutex);
+    bool advanced = nexchat_epoch_try_advance(epoch);
+    pthread_mutex_unlock(&epoch->mutex);
+
+    return advanced;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Epoch based reclamation. Readers announce the global epoch they entered in and never block;
+// writers retire memory they have unpublished, and it is freed once every reader that could
+// still be looking at it has left. The global epoch only advances when all active readers
+// have caught up with it, so anything retired three advances ago is unreachable.
+//
+// Each reader thread owns one slot, readers don't nest.
+
+typedef void (*nexchat_epoch_free_fn)(void* ptr);
+
+typedef struct nexchat_epoch_slot_t
+{
+    uint64_t active; // epoch the reader entered in, 0 when outside a read section
+    uint8_t pad[56]; // one cache line per reader, they're written on every read section
+} nexchat_epoch_slot_t;
+
+typedef struct nexchat_epoch_garbage_t
+{
+    struct nexchat_epoch_garbage_t* next;
+    void* ptr;
+    nexchat_epoch_free_fn free_fn;
+} nexchat_epoch_garbage_t;
+
+typedef struct nexchat_epoch_t
+{
+    uint64_t global; // atomic
+    nexchat_epoch_slot_t* slots;
+    size_t slot_count;
+
+    pthread_mutex_t mutex; // guards the limbo lists and advancing
+    nexchat_epoch_garbage_t* limbo[3]; // retired during epoch e waits in limbo[e % 3]
+    size_t pending;
+} nexchat_epoch_t;
+
+int32_t nexchat_epoch_init(nexchat_epoch_t* epoch, size_t readers);
+
+// frees everything still in limbo, no reader may be active
+void nexchat_epoch_free(nexchat_epoch_t* epoch);
+
+static inline void nexchat_epoch_enter(nexchat_epoch_t* epoch, size_t slot)
+{
+    // the announcement must be visible before any pointer the section loads, hence seq_cst
+    uint64_t global = __atomic_load_n(&epoch->global, __ATOMIC_RELAXED);
+    __atomic_store_n(&epoch->slots[slot].active, global, __ATOMIC_SEQ_CST);
+}
+
+static inline void nexchat_epoch_exit(nexchat_epoch_t* epoch, size_t slot)
+{
+    __atomic_store_n(&epoch->slots[slot].active, 0, __ATOMIC_RELEASE);
+}
+
+// hands `ptr` over to be freed with `free_fn` once no reader can reach it, returns -1 when
+// out of memory, in which case the caller still owns it
+int32_t nexchat_epoch_retire(nexchat_epoch_t* epoch, void* ptr, nexchat_epoch_free_fn free_fn);
+
+// tries to move the global epoch forward and frees what became unreachable, true on success
+bool nexchat_epoch_advance(nexchat_epoch_t* epoch);
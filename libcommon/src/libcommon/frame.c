@@ -0,0 +1,177 @@
+#include "frame.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void nexchat_frame_write_header(uint8_t* dst, nexchat_frame_type_t type, uint32_t size)
+{
+    dst[0] = (uint8_t)(size >> 24);
+    dst[1] = (uint8_t)(size >> 16);
+    dst[2] = (uint8_t)(size >> 8);
+    dst[3] = (uint8_t)size;
+    dst[4] = (uint8_t)type;
+}
+
+int32_t nexchat_frame_encode(nexchat_buffer_t* out, nexchat_frame_type_t type, const void* payload, size_t size)
+{
+    if (size > NEXCHAT_FRAME_MAX_PAYLOAD)
+    {
+        return -1;
+    }
+
+    if (nexchat_buffer_reserve(out, NEXCHAT_FRAME_HEADER_SIZE + size) == -1)
+    {
+        return -1;
+    }
+
+    uint8_t* dst = nexchat_buffer_tail(out);
+    nexchat_frame_write_header(dst, type, (uint32_t)size);
+    if (size > 0)
+    {
+        memcpy(dst + NEXCHAT_FRAME_HEADER_SIZE, payload, size);
+    }
+    nexchat_buffer_commit(out, NEXCHAT_FRAME_HEADER_SIZE + size);
+
+    return 0;
+}
+
+int32_t nexchat_frame_encode_text(nexchat_buffer_t* out, const char* text)
+{
+    return nexchat_frame_encode(out, FRAME_TEXT, text, strlen(text) + 1);
+}
+
+int32_t nexchat_frame_printf(nexchat_buffer_t* out, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int32_t result = nexchat_frame_vprintf(out, fmt, args);
+    va_end(args);
+
+    return result;
+}
+
+int32_t nexchat_frame_vprintf(nexchat_buffer_t* out, const char* fmt, va_list args)
+{
+    // format straight into the buffer behind the header, growing once if it doesn't fit
+    size_t guess = 256;
+
+    for (;;)
+    {
+        if (nexchat_buffer_reserve(out, NEXCHAT_FRAME_HEADER_SIZE + guess) == -1)
+        {
+            return -1;
+        }
+
+        uint8_t* dst = nexchat_buffer_tail(out);
+        size_t space = nexchat_buffer_writable(out) - NEXCHAT_FRAME_HEADER_SIZE;
+
+        va_list copy;
+        va_copy(copy, args);
+        int32_t len = vsnprintf((char*)dst + NEXCHAT_FRAME_HEADER_SIZE, space, fmt, copy);
+        va_end(copy);
+
+        if (len < 0)
+        {
+            return -1;
+        }
+
+        // truncate rather than emit a frame the peer will reject
+        size_t size = (size_t)len + 1;
+        if (size > NEXCHAT_FRAME_MAX_PAYLOAD)
+        {
+            size = NEXCHAT_FRAME_MAX_PAYLOAD;
+        }
+
+        if (size > space)
+        {
+            guess = size;
+            continue;
+        }
+
+        dst[NEXCHAT_FRAME_HEADER_SIZE + size - 1] = '\0';
+        nexchat_frame_write_header(dst, FRAME_TEXT, (uint32_t)size);
+        nexchat_buffer_commit(out, NEXCHAT_FRAME_HEADER_SIZE + size);
+
+        return 0;
+    }
+}
+
+void nexchat_frame_decoder_init(nexchat_frame_decoder_t* dec)
+{
+    nexchat_buffer_init(&dec->buffer, NEXCHAT_FRAME_RECV_CHUNK);
+    dec->needed = NEXCHAT_FRAME_HEADER_SIZE;
+}
+
+void nexchat_frame_decoder_free(nexchat_frame_decoder_t* dec)
+{
+    nexchat_buffer_free(&dec->buffer);
+    dec->needed = NEXCHAT_FRAME_HEADER_SIZE;
+}
+
+uint8_t* nexchat_frame_decoder_prepare(nexchat_frame_decoder_t* dec, size_t* space)
+{
+    // always leave room for a full recv chunk, and for the whole pending frame so it ends up contiguous
+    size_t want = NEXCHAT_FRAME_RECV_CHUNK;
+    size_t readable = nexchat_buffer_readable(&dec->buffer);
+
+    if (dec->needed > readable && dec->needed - readable > want)
+    {
+        want = dec->needed - readable;
+    }
+
+    if (nexchat_buffer_reserve(&dec->buffer, want) == -1)
+    {
+        *space = 0;
+        return NULL;
+    }
+
+    *space = nexchat_buffer_writable(&dec->buffer);
+    return nexchat_buffer_tail(&dec->buffer);
+}
+
+void nexchat_frame_decoder_commit(nexchat_frame_decoder_t* dec, size_t bytes)
+{
+    nexchat_buffer_commit(&dec->buffer, bytes);
+}
+
+int32_t nexchat_frame_decoder_next(nexchat_frame_decoder_t* dec, nexchat_frame_t* frame)
+{
+    size_t readable = nexchat_buffer_readable(&dec->buffer);
+    if (readable < NEXCHAT_FRAME_HEADER_SIZE)
+    {
+        dec->needed = NEXCHAT_FRAME_HEADER_SIZE;
+        return 0;
+    }
+
+    const uint8_t* head = nexchat_buffer_head(&dec->buffer);
+    uint32_t size = ((uint32_t)head[0] << 24) | ((uint32_t)head[1] << 16) | ((uint32_t)head[2] << 8) | (uint32_t)head[3];
+    uint8_t type = head[4];
+
+    if (size > NEXCHAT_FRAME_MAX_PAYLOAD || type == FRAME_NONE || type >= FRAME_MAXTYPES)
+    {
+        return -1;
+    }
+
+    if (readable < NEXCHAT_FRAME_HEADER_SIZE + size)
+    {
+        dec->needed = NEXCHAT_FRAME_HEADER_SIZE + size;
+        return 0;
+    }
+
+    const char* payload = (const char*)head + NEXCHAT_FRAME_HEADER_SIZE;
+
+    if ((type == FRAME_TEXT || type == FRAME_PRESENCE) && (size == 0 || payload[size - 1] != '\0'))
+    {
+        return -1;
+    }
+
+    frame->type = (nexchat_frame_type_t)type;
+    frame->payload = payload;
+    frame->size = size;
+
+    // only the cursor moves, the payload stays where it is until the next prepare
+    nexchat_buffer_consume(&dec->buffer, NEXCHAT_FRAME_HEADER_SIZE + size);
+    dec->needed = NEXCHAT_FRAME_HEADER_SIZE;
+
+    return 1;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#include "buffer.h"
+
+// Wire format: every message is a frame made of a 5 byte header followed by its payload.
+//
+//   [u32 payload size, big-endian][u8 frame type][payload ...]
+//
+// Text payloads carry their NUL terminator so the receiver can use them in place as C strings.
+#define NEXCHAT_FRAME_HEADER_SIZE 5
+#define NEXCHAT_FRAME_MAX_PAYLOAD (64 * 1024)
+#define NEXCHAT_FRAME_RECV_CHUNK  4096
+
+typedef enum nexchat_frame_type_t
+{
+    FRAME_NONE,
+    FRAME_TEXT,
+    FRAME_RELAY, // server to server only, a batch of federation records, see server/src/federation.h
+    FRAME_PRESENCE, // text, a roster change sent to /presence subscribers, see nexchat_server_publish_presence
+    FRAME_PING,     // empty, the server checking a quiet connection is still there, answered with FRAME_PONG
+    FRAME_PONG,     // empty
+    FRAME_MAXTYPES,
+} nexchat_frame_type_t;
+
+typedef struct nexchat_frame_t
+{
+    nexchat_frame_type_t type;
+    const char* payload; // points into the decoder buffer, valid until the next prepare
+    uint32_t size;
+} nexchat_frame_t;
+
+typedef struct nexchat_frame_decoder_t
+{
+    nexchat_buffer_t buffer;
+    size_t needed; // bytes the frame at the head of the buffer still needs
+} nexchat_frame_decoder_t;
+
+void nexchat_frame_write_header(uint8_t* dst, nexchat_frame_type_t type, uint32_t size);
+
+// append one complete frame to `out`
+int32_t nexchat_frame_encode(nexchat_buffer_t* out, nexchat_frame_type_t type, const void* payload, size_t size);
+int32_t nexchat_frame_encode_text(nexchat_buffer_t* out, const char* text);
+int32_t nexchat_frame_printf(nexchat_buffer_t* out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+int32_t nexchat_frame_vprintf(nexchat_buffer_t* out, const char* fmt, va_list args);
+
+void nexchat_frame_decoder_init(nexchat_frame_decoder_t* dec);
+void nexchat_frame_decoder_free(nexchat_frame_decoder_t* dec);
+
+// returns a pointer to free space to recv() into and stores its size in `space`.
+// frames returned by nexchat_frame_decoder_next are invalidated by this call.
+uint8_t* nexchat_frame_decoder_prepare(nexchat_frame_decoder_t* dec, size_t* space);
+void nexchat_frame_decoder_commit(nexchat_frame_decoder_t* dec, size_t bytes);
+
+// 1 when a frame was decoded, 0 when more bytes are needed, -1 on a malformed stream
+int32_t nexchat_frame_decoder_next(nexchat_frame_decoder_t* dec, nexchat_frame_t* frame);
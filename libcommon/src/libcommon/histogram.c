@@ -0,0 +1,58 @@
+#include "histogram.h"
+
+uint64_t nexchat_histogram_bucket_value(size_t index)
+{
+    if (index < 2 * NEXCHAT_HISTOGRAM_SUB)
+    {
+        return (uint64_t)index;
+    }
+
+    size_t shift = index / NEXCHAT_HISTOGRAM_SUB - 1;
+    uint64_t mantissa = (uint64_t)(index - shift * NEXCHAT_HISTOGRAM_SUB);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void nexchat_histogram_merge(nexchat_histogram_t* dst, const nexchat_histogram_t* src)
+{
+    for (size_t i = 0; i < NEXCHAT_HISTOGRAM_BUCKETS; i++)
+    {
+        dst->counts[i] += nexchat_counter_load(&src->counts[i]);
+    }
+
+    // the total is rebuilt from the buckets so it matches them even while `src` is being written
+    dst->total = 0;
+    for (size_t i = 0; i < NEXCHAT_HISTOGRAM_BUCKETS; i++)
+    {
+        dst->total += dst->counts[i];
+    }
+
+    dst->sum += nexchat_counter_load(&src->sum);
+
+    uint64_t max = nexchat_counter_load(&src->max);
+    dst->max = max > dst->max ? max : dst->max;
+}
+
+uint64_t nexchat_histogram_percentile(const nexchat_histogram_t* hist, double quantile)
+{
+    if (hist->total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(quantile * (double)hist->total + 0.5);
+    target = target == 0 ? 1 : target;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NEXCHAT_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+
+        if (seen >= target)
+        {
+            uint64_t value = nexchat_histogram_bucket_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+
+    return hist->max;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// Log-linear latency histogram in the style of HdrHistogram: values below 128 get a bucket each,
+// above that every power of two is split into 64 linear sub-buckets, so any recorded value is
+// reported within 1.6% without configuring a range up front.
+//
+// A histogram has a single writer. Updates are relaxed atomic stores rather than locked
+// read-modify-writes, so recording is a handful of plain instructions and any other thread
+// may read it at the same time.
+#define NEXCHAT_HISTOGRAM_SUB_BITS 6
+#define NEXCHAT_HISTOGRAM_SUB      (1 << NEXCHAT_HISTOGRAM_SUB_BITS)
+#define NEXCHAT_HISTOGRAM_BUCKETS  ((64 - NEXCHAT_HISTOGRAM_SUB_BITS) * NEXCHAT_HISTOGRAM_SUB + NEXCHAT_HISTOGRAM_SUB)
+
+typedef struct nexchat_histogram_t
+{
+    uint64_t counts[NEXCHAT_HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} nexchat_histogram_t;
+
+static inline uint64_t nexchat_clock_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// single writer counter bump, no lock prefix
+static inline void nexchat_counter_add(uint64_t* counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t nexchat_counter_load(const uint64_t* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline size_t nexchat_histogram_index(uint64_t value)
+{
+    if (value < 2 * NEXCHAT_HISTOGRAM_SUB)
+    {
+        return (size_t)value;
+    }
+
+    size_t shift = (size_t)(63 - __builtin_clzll(value)) - NEXCHAT_HISTOGRAM_SUB_BITS;
+    return shift * NEXCHAT_HISTOGRAM_SUB + (size_t)(value >> shift);
+}
+
+static inline void nexchat_histogram_record(nexchat_histogram_t* hist, uint64_t value)
+{
+    nexchat_counter_add(&hist->counts[nexchat_histogram_index(value)], 1);
+    nexchat_counter_add(&hist->total, 1);
+    nexchat_counter_add(&hist->sum, value);
+
+    if (value > nexchat_counter_load(&hist->max))
+    {
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+// the largest value that lands in bucket `index`
+uint64_t nexchat_histogram_bucket_value(size_t index);
+
+// adds a snapshot of `src` into `dst`, `src` may be recorded into concurrently
+void nexchat_histogram_merge(nexchat_histogram_t* dst, const nexchat_histogram_t* src);
+
+// value at `quantile` (0..1), reported as the upper bound of its bucket
+uint64_t nexchat_histogram_percentile(const nexchat_histogram_t* hist, double quantile);
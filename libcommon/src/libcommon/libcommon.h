@@ -4,12 +4,54 @@
 #include <stdbool.h>
 #include <pthread.h>
 
+#include "buffer.h"
+#include "frame.h"
+#include "msgbuf.h"
+#include "outqueue.h"
+#include "strmap.h"
+#include "mpsc.h"
+#include "session.h"
+#include "histogram.h"
+#include "epoch.h"
+#include "pool.h"
+#include "arena.h"
+#include "log.h"
+#include "timer.h"
+
+// server side lifecycle of a connection, the username is the first frame a client sends
+typedef enum nexchat_client_phase_t
+{
+    NEXCHAT_CLIENT_ACCEPTED,
+    NEXCHAT_CLIENT_AWAITING_USERNAME,
+    NEXCHAT_CLIENT_ACTIVE,
+} nexchat_client_phase_t;
+
 typedef struct nexchat_client_state_t
 {
     int32_t sockfd;
+    uint64_t id;
     char username[64];
-    pthread_t recv_thread;
-    size_t kicks_requested;
+    nexchat_frame_decoder_t decoder;
+    nexchat_outqueue_t outqueue;
+    nexchat_arena_t scratch; // server only, handshake replies, dropped once the client is active
+    bool admin;
+    uint32_t admin_failures;     // server only, wrong /admin tokens so far, ADMIN_ATTEMPTS ends the connection
+    nexchat_client_phase_t phase;
+    struct nexchat_room_t* room; // server only, the room plain messages go to
+    size_t room_slot;            // index in that room's member array on the owning shard
+    bool subscribed;             // server only, /presence on, a member of the server's presence room
+    size_t presence_slot;        // index in the presence room's member array on the owning shard
+    bool corked;                 // server only, written under TCP_CORK and not pushed out yet
+    bool lagging;                // server only, crossed the high watermark, new frames are dropped until below the low one
+    bool evicting;               // server only, disconnected for not reading at the end of the iteration
+    bool read_paused;            // server only, input left unread while the server is over its memory budget
+    bool recv_parked;            // server only, io_uring recv ended while paused and must be rearmed on resume
+    struct nexchat_server_send_t* send; // server only, io_uring sendmsg in flight
+    nexchat_timer_t timer;       // server only, the handshake deadline, then heartbeats and the idle check
+    nexchat_timer_t vote_timer;  // server only, votes to kick this client expire when it fires
+    uint64_t heard_ns;           // server only, when the last frame arrived
+    uint64_t spoke_ns;           // server only, when the last text frame arrived, pongs don't count
+    uint64_t pinged_ns;          // server only, when the unanswered ping went out, 0 when none is
     bool connected;
 } nexchat_client_state_t;
 
@@ -0,0 +1,523 @@
+#include "log.h"
+#include "buffer.h"
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define NEXCHAT_LOG_RING_MASK ((uint64_t)NEXCHAT_LOG_RING_SIZE - 1)
+#define NEXCHAT_LOG_PAD       0xff // level of the filler that skips the end of the ring
+
+// a record in a ring, the text follows unterminated and the whole is padded to 8 bytes
+typedef struct nexchat_log_record_t
+{
+    uint32_t size;      // bytes up to the next record
+    uint16_t length;    // text bytes
+    uint8_t level;
+    uint8_t unused;
+    uint64_t timestamp; // CLOCK_REALTIME, ns
+} nexchat_log_record_t;
+
+#define NEXCHAT_LOG_RECORD_SPACE ((sizeof(nexchat_log_record_t) + NEXCHAT_LOG_RECORD_MAX + 1 + 7) & ~(size_t)7)
+
+typedef struct nexchat_log_ring_t
+{
+    struct nexchat_log_ring_t* next; // every ring, newest first
+
+    uint64_t head __attribute__((aligned(64))); // bytes ever written, owning thread only
+    uint64_t dropped;                           // owning thread only
+
+    uint64_t tail __attribute__((aligned(64))); // bytes ever consumed, writer only
+    uint64_t reported;                          // drops already reported, writer only
+
+    uint8_t data[NEXCHAT_LOG_RING_SIZE] __attribute__((aligned(64)));
+} nexchat_log_ring_t;
+
+// a ring and how far the writer drains it this time
+typedef struct nexchat_log_cursor_t
+{
+    nexchat_log_ring_t* ring;
+    uint64_t head;
+} nexchat_log_cursor_t;
+
+static struct
+{
+    nexchat_log_level_t level;
+    bool open;          // rings are only handed out while set
+    uint64_t generation; // bumped by every open, rings of an earlier one are gone
+
+    pthread_mutex_t mutex; // serialises ring registration
+    nexchat_log_ring_t* rings;
+    size_t ring_count;
+
+    int32_t fd; // -1 for stdout and stderr
+    int32_t eventfd;
+    pthread_t thread;
+    bool running;
+
+    // writer thread only
+    nexchat_buffer_t out;
+    nexchat_buffer_t err;
+    nexchat_log_cursor_t* cursors;
+    size_t cursor_capacity;
+    int64_t second;     // the second `stamp` renders
+    char stamp[32];
+
+    uint64_t written;
+    uint64_t batches;
+} nexchat_logger = {.level = NEXCHAT_LOG_INFO, .mutex = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .eventfd = -1, .second = -1};
+
+static __thread nexchat_log_ring_t* nexchat_log_ring = NULL;
+static __thread uint64_t nexchat_log_ring_generation = 0;
+
+static const char* nexchat_log_level_names[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+static uint64_t nexchat_log_wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void nexchat_log_write_all(int32_t fd, const uint8_t* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return;
+        }
+
+        data += written;
+        size -= (size_t)written;
+    }
+}
+
+// "2026-01-31 23:59:59.123456 INFO  text\n", `stamp` and `second` cache the date part
+static size_t nexchat_log_render(char* line, size_t size, char* stamp, int64_t* second, uint64_t timestamp, uint8_t level, const char* text, size_t length)
+{
+    int64_t now = (int64_t)(timestamp / 1000000000ull);
+    if (now != *second)
+    {
+        time_t seconds = (time_t)now;
+        struct tm local;
+        localtime_r(&seconds, &local);
+        strftime(stamp, 32, "%Y-%m-%d %H:%M:%S", &local);
+        *second = now;
+    }
+
+    int32_t prefix = snprintf(line, size, "%s.%06u %s ", stamp, (unsigned)(timestamp % 1000000000ull / 1000), nexchat_log_level_names[level]);
+    if (prefix < 0 || (size_t)prefix + length + 1 > size)
+    {
+        return 0;
+    }
+
+    memcpy(line + prefix, text, length);
+    line[(size_t)prefix + length] = '\n';
+
+    return (size_t)prefix + length + 1;
+}
+
+static nexchat_log_ring_t* nexchat_log_thread_ring(void)
+{
+    if (!__atomic_load_n(&nexchat_logger.open, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    uint64_t generation = __atomic_load_n(&nexchat_logger.generation, __ATOMIC_RELAXED);
+    if (nexchat_log_ring != NULL && nexchat_log_ring_generation == generation)
+    {
+        return nexchat_log_ring;
+    }
+
+    nexchat_log_ring_t* ring = NULL;
+    if (posix_memalign((void**)&ring, 64, sizeof(nexchat_log_ring_t)) != 0)
+    {
+        return NULL;
+    }
+
+    ring->head = 0;
+    ring->dropped = 0;
+    ring->tail = 0;
+    ring->reported = 0;
+
+    // the writer walks the list without the lock, a ring is complete before it is linked
+    pthread_mutex_lock(&nexchat_logger.mutex);
+    ring->next = nexchat_logger.rings;
+    __atomic_store_n(&nexchat_logger.rings, ring, __ATOMIC_RELEASE);
+    nexchat_logger.ring_count++;
+    pthread_mutex_unlock(&nexchat_logger.mutex);
+
+    nexchat_log_ring = ring;
+    nexchat_log_ring_generation = generation;
+
+    return ring;
+}
+
+static void nexchat_log_direct(nexchat_log_level_t level, const char* text, size_t length)
+{
+    char stamp[32];
+    int64_t second = -1;
+    char line[NEXCHAT_LOG_RECORD_MAX + 64];
+
+    size_t size = nexchat_log_render(line, sizeof line, stamp, &second, nexchat_log_wall_ns(), (uint8_t)level, text, length);
+    nexchat_log_write_all(nexchat_logger.fd != -1 ? nexchat_logger.fd : level >= NEXCHAT_LOG_WARN ? STDERR_FILENO : STDOUT_FILENO, (const uint8_t*)line, size);
+}
+
+static void nexchat_log_vlog(nexchat_log_level_t level, const char* format, va_list args)
+{
+    nexchat_log_ring_t* ring = nexchat_log_thread_ring();
+    if (ring == NULL)
+    {
+        char text[NEXCHAT_LOG_RECORD_MAX + 1];
+        int32_t length = vsnprintf(text, sizeof text, format, args);
+        nexchat_log_direct(level, text, length < 0 ? 0 : length > NEXCHAT_LOG_RECORD_MAX ? NEXCHAT_LOG_RECORD_MAX : (size_t)length);
+        return;
+    }
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = (size_t)(head & NEXCHAT_LOG_RING_MASK);
+
+    // a record never wraps, room for the longest one is wanted in one piece
+    size_t skip = NEXCHAT_LOG_RING_SIZE - offset < NEXCHAT_LOG_RECORD_SPACE ? NEXCHAT_LOG_RING_SIZE - offset : 0;
+    if (NEXCHAT_LOG_RING_SIZE - (head - tail) < skip + NEXCHAT_LOG_RECORD_SPACE)
+    {
+        nexchat_counter_add(&ring->dropped, 1);
+        return;
+    }
+
+    if (skip > 0)
+    {
+        nexchat_log_record_t* pad = (nexchat_log_record_t*)(ring->data + offset);
+        pad->size = (uint32_t)skip;
+        pad->level = NEXCHAT_LOG_PAD;
+        offset = 0;
+    }
+
+    nexchat_log_record_t* record = (nexchat_log_record_t*)(ring->data + offset);
+    int32_t length = vsnprintf((char*)(record + 1), NEXCHAT_LOG_RECORD_MAX + 1, format, args);
+    length = length < 0 ? 0 : length > NEXCHAT_LOG_RECORD_MAX ? NEXCHAT_LOG_RECORD_MAX : length;
+
+    record->size = (uint32_t)((sizeof(nexchat_log_record_t) + (size_t)length + 7) & ~(size_t)7);
+    record->length = (uint16_t)length;
+    record->level = (uint8_t)level;
+    record->timestamp = nexchat_log_wall_ns();
+
+    uint64_t used = head + skip + record->size - tail;
+    __atomic_store_n(&ring->head, head + skip + record->size, __ATOMIC_RELEASE);
+
+    // the writer comes by on its own every NEXCHAT_LOG_FLUSH_MS, a burst calls it early once
+    if (used > NEXCHAT_LOG_RING_SIZE / 2 && used - record->size - skip <= NEXCHAT_LOG_RING_SIZE / 2)
+    {
+        uint64_t one = 1;
+        if (write(nexchat_logger.eventfd, &one, sizeof one) == -1)
+        {
+            // the writer is awake already
+        }
+    }
+}
+
+void nexchat_log(nexchat_log_level_t level, const char* format, ...)
+{
+    if (!nexchat_log_enabled(level))
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    nexchat_log_vlog(level, format, args);
+    va_end(args);
+}
+
+void nexchat_log_errno(const char* what)
+{
+    int32_t error = errno;
+    if (!nexchat_log_enabled(NEXCHAT_LOG_ERROR))
+    {
+        return;
+    }
+
+    char reason[128];
+    if (strerror_r(error, reason, sizeof reason) != 0)
+    {
+        snprintf(reason, sizeof reason, "error %d", error);
+    }
+
+    nexchat_log(NEXCHAT_LOG_ERROR, "%s: %s", what, reason);
+    errno = error;
+}
+
+bool nexchat_log_enabled(nexchat_log_level_t level)
+{
+    return level >= __atomic_load_n(&nexchat_logger.level, __ATOMIC_RELAXED) && level < NEXCHAT_LOG_OFF;
+}
+
+int32_t nexchat_log_parse_level(const char* name, nexchat_log_level_t* level)
+{
+    static const char* names[] = {"debug", "info", "warn", "error"};
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            *level = (nexchat_log_level_t)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// moves everything the rings hold into the output buffers, oldest first across threads.
+// Returns the most any one ring held
+static uint64_t nexchat_log_drain(void)
+{
+    uint64_t fullest = 0;
+    // records logged after the heads are read wait for the next drain, which keeps a busy
+    // thread from holding the writer here forever
+    size_t count = 0;
+    for (nexchat_log_ring_t* ring = __atomic_load_n(&nexchat_logger.rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        if (count == nexchat_logger.cursor_capacity)
+        {
+            size_t capacity = nexchat_logger.cursor_capacity == 0 ? 16 : nexchat_logger.cursor_capacity * 2;
+            nexchat_log_cursor_t* cursors = (nexchat_log_cursor_t*)realloc(nexchat_logger.cursors, capacity * sizeof(nexchat_log_cursor_t));
+            if (cursors == NULL)
+            {
+                break;
+            }
+
+            nexchat_logger.cursors = cursors;
+            nexchat_logger.cursor_capacity = capacity;
+        }
+
+        nexchat_logger.cursors[count].ring = ring;
+        nexchat_logger.cursors[count].head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        fullest = nexchat_logger.cursors[count].head - ring->tail > fullest ? nexchat_logger.cursors[count].head - ring->tail : fullest;
+        count++;
+
+        uint64_t dropped = nexchat_counter_load(&ring->dropped);
+        if (dropped != ring->reported)
+        {
+            nexchat_log(NEXCHAT_LOG_WARN, "log: a thread dropped %llu record(s), its ring was full", (unsigned long long)(dropped - ring->reported));
+            ring->reported = dropped;
+        }
+    }
+
+    char line[NEXCHAT_LOG_RECORD_MAX + 64];
+
+    for (;;)
+    {
+        nexchat_log_ring_t* oldest = NULL;
+        nexchat_log_record_t* next = NULL;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            nexchat_log_ring_t* ring = nexchat_logger.cursors[i].ring;
+            nexchat_log_record_t* record = NULL;
+
+            while (ring->tail != nexchat_logger.cursors[i].head)
+            {
+                record = (nexchat_log_record_t*)(ring->data + (ring->tail & NEXCHAT_LOG_RING_MASK));
+                if (record->level != NEXCHAT_LOG_PAD)
+                {
+                    break;
+                }
+
+                __atomic_store_n(&ring->tail, ring->tail + record->size, __ATOMIC_RELEASE);
+                record = NULL;
+            }
+
+            if (record != NULL && (next == NULL || record->timestamp < next->timestamp))
+            {
+                oldest = ring;
+                next = record;
+            }
+        }
+
+        if (next == NULL)
+        {
+            break;
+        }
+
+        size_t size = nexchat_log_render(line, sizeof line, nexchat_logger.stamp, &nexchat_logger.second, next->timestamp, next->level,
+                                         (const char*)(next + 1), next->length);
+        nexchat_buffer_t* target = nexchat_logger.fd == -1 && next->level >= NEXCHAT_LOG_WARN ? &nexchat_logger.err : &nexchat_logger.out;
+        nexchat_buffer_append(target, line, size);
+        nexchat_counter_add(&nexchat_logger.written, 1);
+
+        __atomic_store_n(&oldest->tail, oldest->tail + next->size, __ATOMIC_RELEASE);
+    }
+
+    return fullest;
+}
+
+static void nexchat_log_flush(void)
+{
+    nexchat_buffer_t* buffers[2] = {&nexchat_logger.out, &nexchat_logger.err};
+    int32_t fds[2] = {nexchat_logger.fd != -1 ? nexchat_logger.fd : STDOUT_FILENO, STDERR_FILENO};
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        size_t size = nexchat_buffer_readable(buffers[i]);
+        if (size == 0)
+        {
+            continue;
+        }
+
+        nexchat_log_write_all(fds[i], nexchat_buffer_head(buffers[i]), size);
+        nexchat_buffer_clear(buffers[i]);
+        nexchat_counter_add(&nexchat_logger.batches, 1);
+    }
+}
+
+static void* nexchat_log_run(void* arg)
+{
+    (void)arg;
+
+    uint64_t fullest = 0;
+
+    while (__atomic_load_n(&nexchat_logger.running, __ATOMIC_ACQUIRE))
+    {
+        // a ring that was filling up faster than this thread drains it is only woken for once,
+        // when it crossed half full, so after a big batch there is no waiting
+        struct pollfd pfd = {.fd = nexchat_logger.eventfd, .events = POLLIN, .revents = 0};
+        if (poll(&pfd, 1, fullest > NEXCHAT_LOG_RING_SIZE / 4 ? 0 : NEXCHAT_LOG_FLUSH_MS) > 0)
+        {
+            uint64_t count = 0;
+            if (read(nexchat_logger.eventfd, &count, sizeof count) == -1)
+            {
+                // drained by an earlier wakeup
+            }
+        }
+
+        fullest = nexchat_log_drain();
+        nexchat_log_flush();
+    }
+
+    nexchat_log_drain();
+    nexchat_log_flush();
+
+    return NULL;
+}
+
+int32_t nexchat_log_open(const nexchat_log_config_t* config)
+{
+    nexchat_logger.level = config->level;
+    nexchat_logger.fd = -1;
+
+    if (config->path != NULL)
+    {
+        // appended to, a hot upgrade's new process writes to the same file
+        nexchat_logger.fd = open(config->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (nexchat_logger.fd == -1)
+        {
+            nexchat_log_errno(config->path);
+            return -1;
+        }
+    }
+
+    nexchat_logger.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (nexchat_logger.eventfd == -1)
+    {
+        nexchat_log_errno("log: eventfd");
+        nexchat_log_close();
+        return -1;
+    }
+
+    nexchat_buffer_init(&nexchat_logger.out, 64 * 1024);
+    nexchat_buffer_init(&nexchat_logger.err, 4 * 1024);
+
+    nexchat_logger.running = true;
+    if (pthread_create(&nexchat_logger.thread, NULL, nexchat_log_run, NULL) != 0)
+    {
+        nexchat_logger.running = false;
+        nexchat_log(NEXCHAT_LOG_ERROR, "log: failed to start the writer");
+        nexchat_log_close();
+        return -1;
+    }
+
+    __atomic_add_fetch(&nexchat_logger.generation, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&nexchat_logger.open, true, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void nexchat_log_close(void)
+{
+    // every thread that logs has stopped by now, nothing is writing to the rings
+    __atomic_store_n(&nexchat_logger.open, false, __ATOMIC_RELEASE);
+
+    if (nexchat_logger.running)
+    {
+        __atomic_store_n(&nexchat_logger.running, false, __ATOMIC_RELEASE);
+
+        uint64_t one = 1;
+        if (write(nexchat_logger.eventfd, &one, sizeof one) == -1)
+        {
+            // it wakes up within NEXCHAT_LOG_FLUSH_MS anyway
+        }
+
+        pthread_join(nexchat_logger.thread, NULL);
+    }
+
+    nexchat_log_ring_t* ring = nexchat_logger.rings;
+    while (ring != NULL)
+    {
+        nexchat_log_ring_t* next = ring->next;
+        free(ring);
+        ring = next;
+    }
+
+    nexchat_logger.rings = NULL;
+    nexchat_logger.ring_count = 0;
+
+    free(nexchat_logger.cursors);
+    nexchat_logger.cursors = NULL;
+    nexchat_logger.cursor_capacity = 0;
+    nexchat_buffer_free(&nexchat_logger.out);
+    nexchat_buffer_free(&nexchat_logger.err);
+
+    if (nexchat_logger.eventfd != -1) close(nexchat_logger.eventfd);
+    if (nexchat_logger.fd != -1) close(nexchat_logger.fd);
+    nexchat_logger.eventfd = -1;
+    nexchat_logger.fd = -1;
+}
+
+void nexchat_log_stats(nexchat_log_stats_t* stats)
+{
+    memset(stats, 0, sizeof(nexchat_log_stats_t));
+
+    pthread_mutex_lock(&nexchat_logger.mutex);
+
+    for (nexchat_log_ring_t* ring = nexchat_logger.rings; ring != NULL; ring = ring->next)
+    {
+        stats->dropped += nexchat_counter_load(&ring->dropped);
+    }
+
+    stats->threads = nexchat_logger.ring_count;
+
+    pthread_mutex_unlock(&nexchat_logger.mutex);
+
+    stats->written = nexchat_counter_load(&nexchat_logger.written);
+    stats->batches = nexchat_counter_load(&nexchat_logger.batches);
+}
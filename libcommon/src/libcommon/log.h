@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Asynchronous logger. Every thread that logs gets its own ring of NEXCHAT_LOG_RING_SIZE bytes
+// and formats straight into it: a record is a header with the level and a binary wall clock
+// timestamp, followed by the text. The thread is the ring's only producer and a background
+// writer its only consumer, so logging is a vsnprintf and two atomic stores, with no lock, no
+// stdio and no system call on the calling thread.
+//
+// The writer wakes every NEXCHAT_LOG_FLUSH_MS, or sooner once a ring is half full, merges what
+// the rings hold by timestamp, renders the timestamps and hands each destination the whole
+// batch in one write. A ring that is full drops the record and counts it, the writer reports
+// the count, logging never waits.
+//
+// Before nexchat_log_open and after nexchat_log_close records are written out directly.
+#define NEXCHAT_LOG_RING_SIZE  (512 * 1024) // bytes per thread, a power of two
+#define NEXCHAT_LOG_RECORD_MAX 1024        // text bytes per record, longer text is truncated
+#define NEXCHAT_LOG_FLUSH_MS   20
+
+typedef enum nexchat_log_level_t
+{
+    NEXCHAT_LOG_DEBUG,
+    NEXCHAT_LOG_INFO,
+    NEXCHAT_LOG_WARN,
+    NEXCHAT_LOG_ERROR,
+    NEXCHAT_LOG_OFF,
+} nexchat_log_level_t;
+
+typedef struct nexchat_log_config_t
+{
+    const char* path;          // appended to, NULL for stdout with warnings and errors on stderr
+    nexchat_log_level_t level; // records below it are skipped before they are formatted
+} nexchat_log_config_t;
+
+typedef struct nexchat_log_stats_t
+{
+    uint64_t written; // records the writer has written out
+    uint64_t dropped; // records lost to a full ring
+    uint64_t batches; // writes per destination, records / batches is the batching factor
+    size_t threads;   // threads holding a ring
+} nexchat_log_stats_t;
+
+// starts the writer thread, -1 when `config->path` can't be opened
+int32_t nexchat_log_open(const nexchat_log_config_t* config);
+
+// writes out every record logged so far, stops the writer and frees the rings
+void nexchat_log_close(void);
+
+void nexchat_log(nexchat_log_level_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// like perror, an error record "`what`: <strerror(errno)>"
+void nexchat_log_errno(const char* what);
+
+bool nexchat_log_enabled(nexchat_log_level_t level);
+
+// "debug", "info", "warn" or "error", -1 for anything else
+int32_t nexchat_log_parse_level(const char* name, nexchat_log_level_t* level);
+
+void nexchat_log_stats(nexchat_log_stats_t* stats);
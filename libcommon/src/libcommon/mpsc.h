@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Intrusive multi-producer single-consumer queue. Producers push with a CAS on the head,
+// the consumer detaches the whole list at once, so there is no ABA problem and no lock.
+typedef struct nexchat_mpsc_node_t
+{
+    struct nexchat_mpsc_node_t* next;
+} nexchat_mpsc_node_t;
+
+typedef struct nexchat_mpsc_t
+{
+    nexchat_mpsc_node_t* head;
+} nexchat_mpsc_t;
+
+static inline void nexchat_mpsc_init(nexchat_mpsc_t* queue)
+{
+    queue->head = NULL;
+}
+
+// returns true when the queue was empty, i.e. the consumer may need waking
+static inline bool nexchat_mpsc_push(nexchat_mpsc_t* queue, nexchat_mpsc_node_t* node)
+{
+    nexchat_mpsc_node_t* head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    do
+    {
+        node->next = head;
+    } while (!__atomic_compare_exchange_n(&queue->head, &head, node, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return head == NULL;
+}
+
+// detaches every queued node and returns them oldest first
+static inline nexchat_mpsc_node_t* nexchat_mpsc_take_all(nexchat_mpsc_t* queue)
+{
+    nexchat_mpsc_node_t* node = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+    nexchat_mpsc_node_t* reversed = NULL;
+
+    while (node != NULL)
+    {
+        nexchat_mpsc_node_t* next = node->next;
+        node->next = reversed;
+        reversed = node;
+        node = next;
+    }
+
+    return reversed;
+}
@@ -0,0 +1,35 @@
+#include "msgbuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+nexchat_msgbuf_t* nexchat_msgbuf_create(const void* data, size_t size)
+{
+    if (size > UINT32_MAX)
+    {
+        return NULL;
+    }
+
+    nexchat_msgbuf_t* msg = (nexchat_msgbuf_t*)nexchat_pool_alloc(sizeof(nexchat_msgbuf_t) + size);
+    if (msg == NULL)
+    {
+        return NULL;
+    }
+
+    msg->refcount = 1;
+    msg->size = (uint32_t)size;
+    memcpy(msg->data, data, size);
+
+    return msg;
+}
+
+void nexchat_msgbuf_release(nexchat_msgbuf_t* msg)
+{
+    // acq_rel so the freeing thread observes every write made through other references
+    if (__atomic_sub_fetch(&msg->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        nexchat_pool_free(msg);
+    }
+}
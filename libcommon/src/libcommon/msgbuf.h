@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Immutable, reference counted encoded message. A broadcast is serialized into one of these
+// once and every recipient's outbound queue holds a reference to the same bytes.
+// The count is atomic so references can be handed between threads.
+typedef struct nexchat_msgbuf_t
+{
+    uint32_t refcount;
+    uint32_t size;
+    uint8_t data[];
+} nexchat_msgbuf_t;
+
+// returns a buffer holding a copy of `data` with a reference count of one, or NULL
+nexchat_msgbuf_t* nexchat_msgbuf_create(const void* data, size_t size);
+
+static inline nexchat_msgbuf_t* nexchat_msgbuf_retain(nexchat_msgbuf_t* msg)
+{
+    __atomic_add_fetch(&msg->refcount, 1, __ATOMIC_RELAXED);
+    return msg;
+}
+
+// frees the buffer when the last reference is dropped
+void nexchat_msgbuf_release(nexchat_msgbuf_t* msg);
@@ -0,0 +1,191 @@
+#include "outqueue.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/uio.h>
+
+#include "pool.h"
+
+void nexchat_outqueue_init(nexchat_outqueue_t* queue)
+{
+    memset(queue, 0, sizeof(nexchat_outqueue_t));
+}
+
+static inline void nexchat_outqueue_tally(nexchat_outqueue_t* queue, size_t added, size_t removed)
+{
+    if (queue->tally != NULL)
+    {
+        __atomic_store_n(queue->tally, __atomic_load_n(queue->tally, __ATOMIC_RELAXED) + added - removed, __ATOMIC_RELAXED);
+    }
+}
+
+static void nexchat_outqueue_pop(nexchat_outqueue_t* queue)
+{
+    nexchat_msgbuf_release(queue->entries[queue->head]);
+    queue->entries[queue->head] = NULL;
+
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    queue->count--;
+    queue->head_offset = 0;
+}
+
+void nexchat_outqueue_free(nexchat_outqueue_t* queue)
+{
+    nexchat_outqueue_tally(queue, 0, queue->bytes);
+
+    while (queue->count > 0)
+    {
+        nexchat_outqueue_pop(queue);
+    }
+
+    nexchat_pool_free(queue->entries);
+    memset(queue, 0, sizeof(nexchat_outqueue_t));
+}
+
+static int32_t nexchat_outqueue_grow(nexchat_outqueue_t* queue)
+{
+    size_t capacity = queue->capacity > 0 ? queue->capacity * 2 : 16;
+    nexchat_msgbuf_t** entries = (nexchat_msgbuf_t**)nexchat_pool_alloc(capacity * sizeof(nexchat_msgbuf_t*));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+
+    // unwrap the ring while copying
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        entries[i] = queue->entries[(queue->head + i) & (queue->capacity - 1)];
+    }
+
+    nexchat_pool_free(queue->entries);
+    queue->entries = entries;
+    queue->capacity = capacity;
+    queue->head = 0;
+
+    return 0;
+}
+
+int32_t nexchat_outqueue_push(nexchat_outqueue_t* queue, nexchat_msgbuf_t* msg)
+{
+    if (queue->count == queue->capacity && nexchat_outqueue_grow(queue) == -1)
+    {
+        return -1;
+    }
+
+    queue->entries[(queue->head + queue->count) & (queue->capacity - 1)] = nexchat_msgbuf_retain(msg);
+
+    queue->count++;
+    queue->bytes += msg->size;
+    nexchat_outqueue_tally(queue, msg->size, 0);
+
+    return 0;
+}
+
+size_t nexchat_outqueue_peek(const nexchat_outqueue_t* queue, struct iovec* iov, nexchat_msgbuf_t** frames, size_t max)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < queue->count && count < max; i++)
+    {
+        nexchat_msgbuf_t* msg = queue->entries[(queue->head + i) & (queue->capacity - 1)];
+        size_t skip = i == 0 ? queue->head_offset : 0;
+
+        iov[count].iov_base = msg->data + skip;
+        iov[count].iov_len = msg->size - skip;
+
+        if (frames != NULL)
+        {
+            frames[count] = msg;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+size_t nexchat_outqueue_trim(nexchat_outqueue_t* queue, size_t keep, size_t target)
+{
+    size_t mask = queue->capacity - 1;
+    size_t before = queue->bytes;
+    size_t dropped = 0;
+
+    if (queue->head_offset > 0 && keep == 0)
+    {
+        keep = 1;
+    }
+
+    while (queue->bytes > target && keep + dropped < queue->count)
+    {
+        nexchat_msgbuf_t** entry = &queue->entries[(queue->head + keep + dropped) & mask];
+        queue->bytes -= (*entry)->size;
+        nexchat_msgbuf_release(*entry);
+        *entry = NULL;
+        dropped++;
+    }
+
+    // close the gap by sliding the kept entries up to the first survivor
+    for (size_t i = keep; i > 0 && dropped > 0; i--)
+    {
+        queue->entries[(queue->head + i - 1 + dropped) & mask] = queue->entries[(queue->head + i - 1) & mask];
+        queue->entries[(queue->head + i - 1) & mask] = NULL;
+    }
+
+    queue->head = (queue->head + dropped) & mask;
+    queue->count -= dropped;
+    nexchat_outqueue_tally(queue, 0, before - queue->bytes);
+
+    return dropped;
+}
+
+void nexchat_outqueue_consume(nexchat_outqueue_t* queue, size_t written)
+{
+    queue->bytes -= written;
+    nexchat_outqueue_tally(queue, 0, written);
+
+    while (written > 0)
+    {
+        size_t remaining = queue->entries[queue->head]->size - queue->head_offset;
+
+        if (written < remaining)
+        {
+            queue->head_offset += written;
+            break;
+        }
+
+        written -= remaining;
+        nexchat_outqueue_pop(queue);
+    }
+}
+
+int32_t nexchat_outqueue_flush(nexchat_outqueue_t* queue, int32_t sockfd)
+{
+    while (queue->count > 0)
+    {
+        struct iovec iov[NEXCHAT_OUTQUEUE_MAXIOV];
+        int32_t iovcnt = (int32_t)nexchat_outqueue_peek(queue, iov, NULL, NEXCHAT_OUTQUEUE_MAXIOV);
+
+        ssize_t bytessent = writev(sockfd, iov, iovcnt);
+
+        if (bytessent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+
+            return -1;
+        }
+
+        nexchat_outqueue_consume(queue, (size_t)bytessent);
+    }
+
+    return 0;
+}
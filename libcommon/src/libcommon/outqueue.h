@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <sys/uio.h>
+
+#include "msgbuf.h"
+
+#define NEXCHAT_OUTQUEUE_MAXIOV 64
+
+// FIFO of encoded frames waiting to be written to a socket. Entries are references to
+// shared message buffers living in a power of two ring, so a flush can hand many of them to one writev.
+typedef struct nexchat_outqueue_t
+{
+    nexchat_msgbuf_t** entries;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t head_offset; // bytes of the head entry already written
+    size_t bytes;       // unwritten bytes across all entries
+    uint64_t* tally;    // optional, every change to `bytes` is applied here too, single writer
+} nexchat_outqueue_t;
+
+void nexchat_outqueue_init(nexchat_outqueue_t* queue);
+void nexchat_outqueue_free(nexchat_outqueue_t* queue);
+
+// takes a new reference to `msg` onto the tail of the queue, returns -1 on allocation failure
+int32_t nexchat_outqueue_push(nexchat_outqueue_t* queue, nexchat_msgbuf_t* msg);
+
+// fills up to `max` iovecs with the unwritten bytes at the head of the queue and, when `frames`
+// is not NULL, the buffers they point into. Returns how many were filled
+size_t nexchat_outqueue_peek(const nexchat_outqueue_t* queue, struct iovec* iov, nexchat_msgbuf_t** frames, size_t max);
+
+// drops whole entries, oldest first, until at most `target` bytes are left. The first `keep`
+// entries stay (a write in flight points into them), as does a partly written head.
+// Returns how many entries were dropped
+size_t nexchat_outqueue_trim(nexchat_outqueue_t* queue, size_t keep, size_t target);
+
+// drops `written` bytes from the head of the queue, for writes made outside of nexchat_outqueue_flush
+void nexchat_outqueue_consume(nexchat_outqueue_t* queue, size_t written);
+
+// writes as much as the socket accepts without blocking.
+// returns 0 when the socket would block or the queue drained, -1 on a socket error
+int32_t nexchat_outqueue_flush(nexchat_outqueue_t* queue, int32_t sockfd);
+
+static inline bool nexchat_outqueue_empty(const nexchat_outqueue_t* queue) { return queue->count == 0; }
@@ -0,0 +1,437 @@
+#include "pool.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#include "histogram.h"
+
+#if NEXCHAT_POOL
+
+// precedes every block, keeps the payload 16 byte aligned like malloc's
+typedef struct nexchat_pool_header_t
+{
+    uint32_t size_class; // NEXCHAT_POOL_CLASSES for blocks from malloc
+    uint32_t reserved;
+    uint64_t size;       // requested size of a large block
+} nexchat_pool_header_t;
+
+// free blocks are linked through their payload
+typedef struct nexchat_pool_free_t
+{
+    struct nexchat_pool_free_t* next;
+} nexchat_pool_free_t;
+
+typedef struct nexchat_pool_slab_t
+{
+    struct nexchat_pool_slab_t* next;
+    size_t size;
+} nexchat_pool_slab_t;
+
+typedef struct nexchat_pool_cache_t
+{
+    struct nexchat_pool_cache_t* next;
+    struct nexchat_pool_cache_t* prev;
+
+    void* blocks[NEXCHAT_POOL_CLASSES][NEXCHAT_POOL_CACHE_MAX];
+    size_t counts[NEXCHAT_POOL_CLASSES]; // atomic, read by nexchat_pool_stats
+
+    // single writer, see nexchat_counter_add
+    uint64_t allocs[NEXCHAT_POOL_CLASSES];
+    uint64_t frees[NEXCHAT_POOL_CLASSES];
+    uint64_t refills[NEXCHAT_POOL_CLASSES];
+    uint64_t large_allocs;
+    uint64_t large_frees;
+} nexchat_pool_cache_t;
+
+static struct
+{
+    pthread_once_t once;
+    pthread_key_t key; // only for its destructor, the cache itself is found through the __thread pointer
+
+    pthread_mutex_t mutex; // guards everything below
+    nexchat_pool_free_t* depot[NEXCHAT_POOL_CLASSES];
+    size_t depot_count[NEXCHAT_POOL_CLASSES];
+    size_t reserved[NEXCHAT_POOL_CLASSES];
+    nexchat_pool_slab_t* slabs;
+    size_t slab_bytes;
+
+    nexchat_pool_cache_t* caches;
+    size_t cache_count;
+
+    // counters of caches whose thread has exited
+    uint64_t allocs[NEXCHAT_POOL_CLASSES];
+    uint64_t frees[NEXCHAT_POOL_CLASSES];
+    uint64_t refills[NEXCHAT_POOL_CLASSES];
+    uint64_t large_allocs;
+    uint64_t large_frees;
+} nexchat_pool = {.once = PTHREAD_ONCE_INIT, .mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread nexchat_pool_cache_t* nexchat_pool_cache = NULL;
+
+static inline size_t nexchat_pool_class_size(size_t size_class)
+{
+    return (size_t)1 << (NEXCHAT_POOL_MIN_SHIFT + size_class);
+}
+
+static inline size_t nexchat_pool_class_of(size_t size)
+{
+    if (size <= ((size_t)1 << NEXCHAT_POOL_MIN_SHIFT))
+    {
+        return 0;
+    }
+
+    return (size_t)(64 - __builtin_clzll((unsigned long long)(size - 1))) - NEXCHAT_POOL_MIN_SHIFT;
+}
+
+static inline void nexchat_pool_set_count(nexchat_pool_cache_t* cache, size_t size_class, size_t count)
+{
+    __atomic_store_n(&cache->counts[size_class], count, __ATOMIC_RELAXED);
+}
+
+static void nexchat_pool_release_cache(nexchat_pool_cache_t* cache)
+{
+    pthread_mutex_lock(&nexchat_pool.mutex);
+
+    for (size_t c = 0; c < NEXCHAT_POOL_CLASSES; c++)
+    {
+        for (size_t i = 0; i < cache->counts[c]; i++)
+        {
+            nexchat_pool_free_t* block = (nexchat_pool_free_t*)cache->blocks[c][i];
+            block->next = nexchat_pool.depot[c];
+            nexchat_pool.depot[c] = block;
+        }
+
+        nexchat_pool.depot_count[c] += cache->counts[c];
+        nexchat_pool_set_count(cache, c, 0);
+    }
+
+    pthread_mutex_unlock(&nexchat_pool.mutex);
+}
+
+static void nexchat_pool_thread_exit(void* arg)
+{
+    nexchat_pool_cache_t* cache = (nexchat_pool_cache_t*)arg;
+    nexchat_pool_release_cache(cache);
+
+    pthread_mutex_lock(&nexchat_pool.mutex);
+
+    for (size_t c = 0; c < NEXCHAT_POOL_CLASSES; c++)
+    {
+        nexchat_pool.allocs[c] += cache->allocs[c];
+        nexchat_pool.frees[c] += cache->frees[c];
+        nexchat_pool.refills[c] += cache->refills[c];
+    }
+
+    nexchat_pool.large_allocs += cache->large_allocs;
+    nexchat_pool.large_frees += cache->large_frees;
+
+    if (cache->prev != NULL) cache->prev->next = cache->next;
+    else nexchat_pool.caches = cache->next;
+    if (cache->next != NULL) cache->next->prev = cache->prev;
+    nexchat_pool.cache_count--;
+
+    pthread_mutex_unlock(&nexchat_pool.mutex);
+
+    nexchat_pool_cache = NULL;
+    free(cache);
+}
+
+static void nexchat_pool_init_once(void)
+{
+    pthread_key_create(&nexchat_pool.key, nexchat_pool_thread_exit);
+}
+
+static nexchat_pool_cache_t* nexchat_pool_thread_cache(void)
+{
+    if (nexchat_pool_cache != NULL)
+    {
+        return nexchat_pool_cache;
+    }
+
+    pthread_once(&nexchat_pool.once, nexchat_pool_init_once);
+
+    nexchat_pool_cache_t* cache = (nexchat_pool_cache_t*)calloc(1, sizeof(nexchat_pool_cache_t));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&nexchat_pool.mutex);
+    cache->next = nexchat_pool.caches;
+    if (cache->next != NULL) cache->next->prev = cache;
+    nexchat_pool.caches = cache;
+    nexchat_pool.cache_count++;
+    pthread_mutex_unlock(&nexchat_pool.mutex);
+
+    pthread_setspecific(nexchat_pool.key, cache);
+    nexchat_pool_cache = cache;
+
+    return cache;
+}
+
+// moves up to half a cache worth of blocks from the depot, carving a new slab when it ran dry
+static int32_t nexchat_pool_refill(nexchat_pool_cache_t* cache, size_t size_class)
+{
+    size_t stride = sizeof(nexchat_pool_header_t) + nexchat_pool_class_size(size_class);
+    size_t want = NEXCHAT_POOL_CACHE_MAX / 2;
+
+    pthread_mutex_lock(&nexchat_pool.mutex);
+
+    if (nexchat_pool.depot[size_class] == NULL)
+    {
+        size_t blocks = NEXCHAT_POOL_SLAB_SIZE / stride;
+        blocks = blocks < want ? want : blocks;
+
+        size_t size = sizeof(nexchat_pool_slab_t) + 16 + blocks * stride;
+        nexchat_pool_slab_t* slab = (nexchat_pool_slab_t*)malloc(size);
+        if (slab == NULL)
+        {
+            pthread_mutex_unlock(&nexchat_pool.mutex);
+            return -1;
+        }
+
+        slab->next = nexchat_pool.slabs;
+        slab->size = size;
+        nexchat_pool.slabs = slab;
+        nexchat_pool.slab_bytes += size;
+
+        // blocks start 16 byte aligned past the slab header
+        uint8_t* base = (uint8_t*)(((uintptr_t)(slab + 1) + 15) & ~(uintptr_t)15);
+        for (size_t i = blocks; i > 0; i--)
+        {
+            nexchat_pool_header_t* header = (nexchat_pool_header_t*)(base + (i - 1) * stride);
+            header->size_class = (uint32_t)size_class;
+            header->size = 0;
+
+            nexchat_pool_free_t* block = (nexchat_pool_free_t*)(header + 1);
+            block->next = nexchat_pool.depot[size_class];
+            nexchat_pool.depot[size_class] = block;
+        }
+
+        nexchat_pool.depot_count[size_class] += blocks;
+        nexchat_pool.reserved[size_class] += blocks;
+    }
+
+    size_t count = cache->counts[size_class];
+    while (count < want && nexchat_pool.depot[size_class] != NULL)
+    {
+        nexchat_pool_free_t* block = nexchat_pool.depot[size_class];
+        nexchat_pool.depot[size_class] = block->next;
+        nexchat_pool.depot_count[size_class]--;
+        cache->blocks[size_class][count++] = block;
+    }
+
+    pthread_mutex_unlock(&nexchat_pool.mutex);
+
+    nexchat_pool_set_count(cache, size_class, count);
+    nexchat_counter_add(&cache->refills[size_class], 1);
+
+    return 0;
+}
+
+// gives the older half of a full cache back to the depot
+static void nexchat_pool_spill(nexchat_pool_cache_t* cache, size_t size_class)
+{
+    size_t half = NEXCHAT_POOL_CACHE_MAX / 2;
+    void** blocks = cache->blocks[size_class];
+
+    pthread_mutex_lock(&nexchat_pool.mutex);
+
+    for (size_t i = 0; i < half; i++)
+    {
+        nexchat_pool_free_t* block = (nexchat_pool_free_t*)blocks[i];
+        block->next = nexchat_pool.depot[size_class];
+        nexchat_pool.depot[size_class] = block;
+    }
+
+    nexchat_pool.depot_count[size_class] += half;
+
+    pthread_mutex_unlock(&nexchat_pool.mutex);
+
+    memmove(blocks, blocks + half, (cache->counts[size_class] - half) * sizeof(void*));
+    nexchat_pool_set_count(cache, size_class, cache->counts[size_class] - half);
+}
+
+void* nexchat_pool_alloc(size_t size)
+{
+    nexchat_pool_cache_t* cache = nexchat_pool_thread_cache();
+    size_t size_class = nexchat_pool_class_of(size);
+
+    if (cache == NULL || size_class >= NEXCHAT_POOL_CLASSES)
+    {
+        nexchat_pool_header_t* header = (nexchat_pool_header_t*)malloc(sizeof(nexchat_pool_header_t) + size);
+        if (header == NULL)
+        {
+            return NULL;
+        }
+
+        header->size_class = NEXCHAT_POOL_CLASSES;
+        header->size = size;
+
+        if (cache != NULL)
+        {
+            nexchat_counter_add(&cache->large_allocs, 1);
+        }
+
+        return header + 1;
+    }
+
+    if (cache->counts[size_class] == 0 && nexchat_pool_refill(cache, size_class) == -1)
+    {
+        return NULL;
+    }
+
+    size_t count = cache->counts[size_class] - 1;
+    nexchat_pool_set_count(cache, size_class, count);
+    nexchat_counter_add(&cache->allocs[size_class], 1);
+
+    return cache->blocks[size_class][count];
+}
+
+void nexchat_pool_free(void* ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    nexchat_pool_header_t* header = (nexchat_pool_header_t*)ptr - 1;
+    nexchat_pool_cache_t* cache = nexchat_pool_thread_cache();
+    size_t size_class = header->size_class;
+
+    if (size_class >= NEXCHAT_POOL_CLASSES)
+    {
+        if (cache != NULL)
+        {
+            nexchat_counter_add(&cache->large_frees, 1);
+        }
+
+        free(header);
+        return;
+    }
+
+    if (cache == NULL)
+    {
+        // no cache to keep it in, the depot takes it directly
+        pthread_mutex_lock(&nexchat_pool.mutex);
+        nexchat_pool_free_t* block = (nexchat_pool_free_t*)ptr;
+        block->next = nexchat_pool.depot[size_class];
+        nexchat_pool.depot[size_class] = block;
+        nexchat_pool.depot_count[size_class]++;
+        pthread_mutex_unlock(&nexchat_pool.mutex);
+        return;
+    }
+
+    if (cache->counts[size_class] == NEXCHAT_POOL_CACHE_MAX)
+    {
+        nexchat_pool_spill(cache, size_class);
+    }
+
+    size_t count = cache->counts[size_class];
+    cache->blocks[size_class][count] = ptr;
+    nexchat_pool_set_count(cache, size_class, count + 1);
+    nexchat_counter_add(&cache->frees[size_class], 1);
+}
+
+void* nexchat_pool_realloc(void* ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return nexchat_pool_alloc(size);
+    }
+
+    nexchat_pool_header_t* header = (nexchat_pool_header_t*)ptr - 1;
+    size_t capacity = header->size_class < NEXCHAT_POOL_CLASSES ? nexchat_pool_class_size(header->size_class) : header->size;
+
+    // shrinking or growing within the class keeps the block
+    if (size <= capacity)
+    {
+        return ptr;
+    }
+
+    // large to large can let libc move or extend the mapping
+    if (header->size_class >= NEXCHAT_POOL_CLASSES)
+    {
+        nexchat_pool_header_t* grown = (nexchat_pool_header_t*)realloc(header, sizeof(nexchat_pool_header_t) + size);
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+
+        grown->size = size;
+        return grown + 1;
+    }
+
+    void* data = nexchat_pool_alloc(size);
+    if (data == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(data, ptr, capacity < size ? capacity : size);
+    nexchat_pool_free(ptr);
+
+    return data;
+}
+
+void nexchat_pool_thread_flush(void)
+{
+    if (nexchat_pool_cache != NULL)
+    {
+        nexchat_pool_release_cache(nexchat_pool_cache);
+    }
+}
+
+void nexchat_pool_stats(nexchat_pool_stats_t* stats)
+{
+    memset(stats, 0, sizeof(nexchat_pool_stats_t));
+
+    pthread_mutex_lock(&nexchat_pool.mutex);
+
+    for (size_t c = 0; c < NEXCHAT_POOL_CLASSES; c++)
+    {
+        nexchat_pool_class_stats_t* s = &stats->classes[c];
+        s->block_size = nexchat_pool_class_size(c);
+        s->allocs = nexchat_pool.allocs[c];
+        s->frees = nexchat_pool.frees[c];
+        s->refills = nexchat_pool.refills[c];
+        s->depot = nexchat_pool.depot_count[c];
+        s->reserved = nexchat_pool.reserved[c];
+    }
+
+    stats->large_allocs = nexchat_pool.large_allocs;
+    stats->large_frees = nexchat_pool.large_frees;
+    stats->slab_bytes = nexchat_pool.slab_bytes;
+    stats->threads = nexchat_pool.cache_count;
+
+    for (const nexchat_pool_cache_t* cache = nexchat_pool.caches; cache != NULL; cache = cache->next)
+    {
+        for (size_t c = 0; c < NEXCHAT_POOL_CLASSES; c++)
+        {
+            nexchat_pool_class_stats_t* s = &stats->classes[c];
+            s->allocs += nexchat_counter_load(&cache->allocs[c]);
+            s->frees += nexchat_counter_load(&cache->frees[c]);
+            s->refills += nexchat_counter_load(&cache->refills[c]);
+            s->cached += __atomic_load_n(&cache->counts[c], __ATOMIC_RELAXED);
+        }
+
+        stats->large_allocs += nexchat_counter_load(&cache->large_allocs);
+        stats->large_frees += nexchat_counter_load(&cache->large_frees);
+    }
+
+    pthread_mutex_unlock(&nexchat_pool.mutex);
+}
+
+#else
+
+void nexchat_pool_stats(nexchat_pool_stats_t* stats)
+{
+    memset(stats, 0, sizeof(nexchat_pool_stats_t));
+
+    for (size_t c = 0; c < NEXCHAT_POOL_CLASSES; c++)
+    {
+        stats->classes[c].block_size = (size_t)1 << (NEXCHAT_POOL_MIN_SHIFT + c);
+    }
+}
+
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+// Size-class pool allocator for message and connection buffers. Requests are rounded up to a
+// power of two class between 64 B and 128 KiB, anything larger goes straight to malloc.
+// Each thread keeps a small stack of free blocks per class, so the common alloc/free pair is a
+// few instructions with no lock; only when a stack runs empty or full does the thread trade
+// half of it with the shared depot. Blocks come from large slabs that are kept for reuse.
+//
+// Blocks may be freed on any thread, they simply join that thread's cache. A thread's cache is
+// handed back to the depot when it exits.
+//
+// Enabled by default, sanitizer builds turn it off so they keep tracking every allocation.
+// Override with -DNEXCHAT_POOL=0/1.
+#ifndef NEXCHAT_POOL
+    #if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+        #define NEXCHAT_POOL 0
+    #else
+        #define NEXCHAT_POOL 1
+    #endif
+#endif
+
+#define NEXCHAT_POOL_MIN_SHIFT  6     // 64 B, the smallest class
+#define NEXCHAT_POOL_CLASSES    12    // up to 128 KiB, a full frame plus its headers
+#define NEXCHAT_POOL_CACHE_MAX  64    // blocks per class a thread holds before giving half back
+#define NEXCHAT_POOL_SLAB_SIZE  (256 * 1024)
+
+typedef struct nexchat_pool_class_stats_t
+{
+    size_t block_size;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t refills;  // trips to the depot, high counts mean the thread caches are too small
+    size_t cached;     // free blocks sitting in thread caches
+    size_t depot;      // free blocks in the shared depot
+    size_t reserved;   // blocks carved from slabs so far
+} nexchat_pool_class_stats_t;
+
+typedef struct nexchat_pool_stats_t
+{
+    nexchat_pool_class_stats_t classes[NEXCHAT_POOL_CLASSES];
+    uint64_t large_allocs; // above the largest class
+    uint64_t large_frees;
+    size_t slab_bytes;
+    size_t threads;        // threads holding a cache
+} nexchat_pool_stats_t;
+
+#if NEXCHAT_POOL
+
+// same contracts as malloc/realloc/free, blocks must not be mixed with the libc heap
+void* nexchat_pool_alloc(size_t size);
+void* nexchat_pool_realloc(void* ptr, size_t size);
+void nexchat_pool_free(void* ptr);
+
+// gives this thread's cached blocks back to the depot, for threads about to idle for a long time
+void nexchat_pool_thread_flush(void);
+
+#else
+
+static inline void* nexchat_pool_alloc(size_t size) { return malloc(size); }
+static inline void* nexchat_pool_realloc(void* ptr, size_t size) { return realloc(ptr, size); }
+static inline void nexchat_pool_free(void* ptr) { free(ptr); }
+static inline void nexchat_pool_thread_flush(void) {}
+
+#endif
+
+// a consistent enough snapshot for sizing, counters of running threads are read without stopping them
+void nexchat_pool_stats(nexchat_pool_stats_t* stats);
@@ -0,0 +1,139 @@
+#include "session.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "libcommon.h"
+
+int32_t nexchat_session_connect(nexchat_client_state_t* state, const nexchat_inet_id_t* id)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* res = NULL;
+    int32_t status = getaddrinfo(id->ipaddr, id->service, &hints, &res);
+
+    if (status != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    struct addrinfo* it = NULL;
+
+    for (it = res; it != NULL; it = it->ai_next)
+    {
+        state->sockfd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (state->sockfd == -1)
+        {
+            perror("socket");
+            continue;
+        }
+
+        if (connect(state->sockfd, it->ai_addr, it->ai_addrlen) == -1)
+        {
+            perror("connect");
+            close(state->sockfd);
+            continue;
+        }
+
+        break;
+    }
+
+    freeaddrinfo(res);
+
+    if (it == NULL)
+    {
+        state->sockfd = -1;
+        return -1;
+    }
+
+    // chat lines are small and latency bound, don't let Nagle hold them back behind an unacked one
+    if (nexchat_socket_set_nodelay(state->sockfd, true) == -1)
+    {
+        perror("setsockopt");
+    }
+
+    nexchat_frame_decoder_init(&state->decoder);
+
+    return 0;
+}
+
+int32_t nexchat_session_handshake(nexchat_client_state_t* state, const char* username)
+{
+    memset(state->username, 0, sizeof(state->username));
+    snprintf(state->username, sizeof(state->username), "%s", username);
+
+    return nexchat_session_sendmsg(state->sockfd, state->username);
+}
+
+int32_t nexchat_session_sendmsg(int32_t sockfd, const char* msg)
+{
+    size_t len = strlen(msg) + 1;
+    if (len > NEXCHAT_FRAME_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "client: message is too long\n");
+        return -1;
+    }
+
+    uint8_t header[NEXCHAT_FRAME_HEADER_SIZE];
+    nexchat_frame_write_header(header, FRAME_TEXT, (uint32_t)len);
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof header;
+    iov[1].iov_base = (void*)msg;
+    iov[1].iov_len = len;
+
+    // the socket is blocking, so a short write only happens when interrupted
+    int32_t iovcnt = 2;
+    struct iovec* it = iov;
+
+    while (iovcnt > 0)
+    {
+        ssize_t bytessent = writev(sockfd, it, iovcnt);
+        if (bytessent == -1)
+        {
+            perror("send");
+            return -1;
+        }
+
+        size_t written = (size_t)bytessent;
+        while (iovcnt > 0 && written >= it->iov_len)
+        {
+            written -= it->iov_len;
+            it++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0)
+        {
+            it->iov_base = (uint8_t*)it->iov_base + written;
+            it->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+int32_t nexchat_socket_set_nodelay(int32_t sockfd, bool enabled)
+{
+    int32_t value = enabled ? 1 : 0;
+    return setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof value);
+}
+
+int32_t nexchat_socket_set_cork(int32_t sockfd, bool enabled)
+{
+    int32_t value = enabled ? 1 : 0;
+    return setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &value, sizeof value);
+}
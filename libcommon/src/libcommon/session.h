@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct nexchat_client_state_t nexchat_client_state_t;
+typedef struct nexchat_inet_id_t nexchat_inet_id_t;
+
+// Client side of the connection handshake, shared by the interactive client and the load generator.
+// Every call blocks; callers that want to multiplex switch the socket to non-blocking afterwards.
+
+// connects `state->sockfd` to the first address `id` resolves to and resets its frame decoder
+int32_t nexchat_session_connect(nexchat_client_state_t* state, const nexchat_inet_id_t* id);
+
+// sends `username` as the first frame, the server answers with any rename and the welcome text
+int32_t nexchat_session_handshake(nexchat_client_state_t* state, const char* username);
+
+// writes one text frame, looping over short writes
+int32_t nexchat_session_sendmsg(int32_t sockfd, const char* msg);
+
+// TCP_NODELAY, every write goes out as soon as it is made instead of waiting on Nagle
+int32_t nexchat_socket_set_nodelay(int32_t sockfd, bool enabled);
+
+// TCP_CORK, holds back partial segments until the cork is pulled, the kernel sends them after 200ms regardless
+int32_t nexchat_socket_set_cork(int32_t sockfd, bool enabled);
@@ -0,0 +1,154 @@
+#include "strmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+uint64_t nexchat_strhash(const char* str)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const uint8_t* it = (const uint8_t*)str; *it != '\0'; it++)
+    {
+        hash ^= *it;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+int32_t nexchat_strmap_init(nexchat_strmap_t* map, size_t capacity)
+{
+    size_t size = 16;
+    while (size < capacity * 2)
+    {
+        size *= 2;
+    }
+
+    map->entries = (nexchat_strmap_entry_t*)calloc(size, sizeof(nexchat_strmap_entry_t));
+    map->capacity = map->entries != NULL ? size : 0;
+    map->count = 0;
+
+    return map->entries != NULL ? 0 : -1;
+}
+
+void nexchat_strmap_free(nexchat_strmap_t* map)
+{
+    free(map->entries);
+    map->entries = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+static nexchat_strmap_entry_t* nexchat_strmap_probe(const nexchat_strmap_t* map, const char* key, uint64_t hash)
+{
+    size_t mask = map->capacity - 1;
+
+    for (size_t i = (size_t)hash & mask;; i = (i + 1) & mask)
+    {
+        nexchat_strmap_entry_t* entry = &map->entries[i];
+
+        if (entry->key == NULL || (entry->hash == hash && strcmp(entry->key, key) == 0))
+        {
+            return entry;
+        }
+    }
+}
+
+static int32_t nexchat_strmap_grow(nexchat_strmap_t* map)
+{
+    nexchat_strmap_t grown;
+    if (nexchat_strmap_init(&grown, map->capacity) == -1)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < map->capacity; i++)
+    {
+        nexchat_strmap_entry_t* entry = &map->entries[i];
+
+        if (entry->key != NULL)
+        {
+            *nexchat_strmap_probe(&grown, entry->key, entry->hash) = *entry;
+        }
+    }
+
+    grown.count = map->count;
+    free(map->entries);
+    *map = grown;
+
+    return 0;
+}
+
+void* nexchat_strmap_get(const nexchat_strmap_t* map, const char* key)
+{
+    if (map->count == 0)
+    {
+        return NULL;
+    }
+
+    nexchat_strmap_entry_t* entry = nexchat_strmap_probe(map, key, nexchat_strhash(key));
+    return entry->key != NULL ? entry->value : NULL;
+}
+
+int32_t nexchat_strmap_put(nexchat_strmap_t* map, const char* key, void* value)
+{
+    // keep the load factor at or below one half so probe sequences stay short
+    if ((map->count + 1) * 2 > map->capacity && nexchat_strmap_grow(map) == -1)
+    {
+        return -1;
+    }
+
+    uint64_t hash = nexchat_strhash(key);
+    nexchat_strmap_entry_t* entry = nexchat_strmap_probe(map, key, hash);
+
+    if (entry->key == NULL)
+    {
+        map->count++;
+    }
+
+    entry->key = key;
+    entry->hash = hash;
+    entry->value = value;
+
+    return 0;
+}
+
+void* nexchat_strmap_remove(nexchat_strmap_t* map, const char* key)
+{
+    if (map->count == 0)
+    {
+        return NULL;
+    }
+
+    nexchat_strmap_entry_t* entry = nexchat_strmap_probe(map, key, nexchat_strhash(key));
+    if (entry->key == NULL)
+    {
+        return NULL;
+    }
+
+    void* value = entry->value;
+    size_t mask = map->capacity - 1;
+    size_t hole = (size_t)(entry - map->entries);
+
+    // backward shift deletion: pull later entries of the cluster into the hole so no tombstones are needed
+    for (size_t i = (hole + 1) & mask; map->entries[i].key != NULL; i = (i + 1) & mask)
+    {
+        size_t home = (size_t)map->entries[i].hash & mask;
+
+        // the entry may move into the hole only if the hole lies on its probe path (home .. i, cyclically)
+        bool movable = hole <= i ? (home <= hole || home > i) : (home <= hole && home > i);
+        if (movable)
+        {
+            map->entries[hole] = map->entries[i];
+            hole = i;
+        }
+    }
+
+    map->entries[hole].key = NULL;
+    map->entries[hole].value = NULL;
+    map->count--;
+
+    return value;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Open addressing hash map from NUL-terminated strings to pointers.
+// Keys are not copied: the caller keeps each key alive and unchanged while it is in the map.
+typedef struct nexchat_strmap_entry_t
+{
+    const char* key; // NULL marks an empty bucket
+    uint64_t hash;
+    void* value;
+} nexchat_strmap_entry_t;
+
+typedef struct nexchat_strmap_t
+{
+    nexchat_strmap_entry_t* entries;
+    size_t capacity; // power of two
+    size_t count;
+} nexchat_strmap_t;
+
+uint64_t nexchat_strhash(const char* str);
+
+int32_t nexchat_strmap_init(nexchat_strmap_t* map, size_t capacity);
+void nexchat_strmap_free(nexchat_strmap_t* map);
+
+void* nexchat_strmap_get(const nexchat_strmap_t* map, const char* key);
+// inserts or replaces, returns -1 on allocation failure
+int32_t nexchat_strmap_put(nexchat_strmap_t* map, const char* key, void* value);
+// returns the removed value or NULL
+void* nexchat_strmap_remove(nexchat_strmap_t* map, const char* key);
@@ -0,0 +1,231 @@
+#include "timer.h"
+
+#include <string.h>
+
+#define NEXCHAT_TIMER_TICK_NS  ((uint64_t)NEXCHAT_TIMER_TICK_MS * 1000000ull)
+#define NEXCHAT_TIMER_MASK     ((uint64_t)NEXCHAT_TIMER_SLOTS - 1)
+#define NEXCHAT_TIMER_DETACHED 0xffff
+#define NEXCHAT_TIMER_SPAN     (1ull << (NEXCHAT_TIMER_BITS * NEXCHAT_TIMER_LEVELS)) // ticks the top level reaches
+
+static inline uint64_t nexchat_timer_rotr(uint64_t bits, uint32_t shift)
+{
+    shift &= 63;
+    return shift == 0 ? bits : (bits >> shift) | (bits << (64 - shift));
+}
+
+static void nexchat_timer_link(nexchat_timer_wheel_t* wheel, nexchat_timer_t* timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+
+    size_t level = 0;
+    while (level + 1 < NEXCHAT_TIMER_LEVELS && delta >= (1ull << (NEXCHAT_TIMER_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    size_t index = (size_t)((timer->expires >> (NEXCHAT_TIMER_BITS * level)) & NEXCHAT_TIMER_MASK);
+    size_t slot = level * NEXCHAT_TIMER_SLOTS + index;
+
+    timer->slot = (uint16_t)slot;
+    timer->next = wheel->slots[slot];
+    if (timer->next != NULL)
+    {
+        timer->next->pprev = &timer->next;
+    }
+
+    timer->pprev = &wheel->slots[slot];
+    wheel->slots[slot] = timer;
+    wheel->occupied[level] |= 1ull << index;
+}
+
+static void nexchat_timer_unlink(nexchat_timer_wheel_t* wheel, nexchat_timer_t* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+
+    if (timer->slot != NEXCHAT_TIMER_DETACHED && wheel->slots[timer->slot] == NULL)
+    {
+        wheel->occupied[timer->slot / NEXCHAT_TIMER_SLOTS] &= ~(1ull << (timer->slot % NEXCHAT_TIMER_SLOTS));
+    }
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// takes the whole list out of `slot`, its timers stay armed, cancelling one unlinks it from `list`
+static void nexchat_timer_detach(nexchat_timer_wheel_t* wheel, size_t slot, nexchat_timer_t** list)
+{
+    *list = wheel->slots[slot];
+    wheel->slots[slot] = NULL;
+    wheel->occupied[slot / NEXCHAT_TIMER_SLOTS] &= ~(1ull << (slot % NEXCHAT_TIMER_SLOTS));
+
+    if (*list != NULL)
+    {
+        (*list)->pprev = list;
+    }
+
+    for (nexchat_timer_t* timer = *list; timer != NULL; timer = timer->next)
+    {
+        timer->slot = NEXCHAT_TIMER_DETACHED;
+    }
+}
+
+void nexchat_timer_wheel_init(nexchat_timer_wheel_t* wheel, uint64_t now_ns, void* ctx)
+{
+    memset(wheel, 0, sizeof(nexchat_timer_wheel_t));
+    wheel->now = now_ns / NEXCHAT_TIMER_TICK_NS;
+    wheel->ctx = ctx;
+}
+
+void nexchat_timer_init(nexchat_timer_t* timer, nexchat_timer_fn fire, void* owner)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->slot = NEXCHAT_TIMER_DETACHED;
+    timer->fire = fire;
+    timer->owner = owner;
+}
+
+void nexchat_timer_schedule(nexchat_timer_wheel_t* wheel, nexchat_timer_t* timer, uint64_t deadline_ns)
+{
+    if (nexchat_timer_armed(timer))
+    {
+        nexchat_timer_unlink(wheel, timer);
+        wheel->count--;
+    }
+
+    // rounded up, and no earlier than the next tick, the current one has been processed
+    uint64_t expires = (deadline_ns + NEXCHAT_TIMER_TICK_NS - 1) / NEXCHAT_TIMER_TICK_NS;
+    if (expires <= wheel->now)
+    {
+        expires = wheel->now + 1;
+    }
+    else if (expires - wheel->now >= NEXCHAT_TIMER_SPAN)
+    {
+        expires = wheel->now + NEXCHAT_TIMER_SPAN - 1;
+    }
+
+    timer->expires = expires;
+    nexchat_timer_link(wheel, timer);
+    wheel->count++;
+}
+
+void nexchat_timer_cancel(nexchat_timer_wheel_t* wheel, nexchat_timer_t* timer)
+{
+    if (nexchat_timer_armed(timer))
+    {
+        nexchat_timer_unlink(wheel, timer);
+        wheel->count--;
+    }
+}
+
+// the first tick after `now` at which the wheel touches an occupied slot, UINT64_MAX when none is
+static uint64_t nexchat_timer_next_event(const nexchat_timer_wheel_t* wheel)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (size_t level = 0; level < NEXCHAT_TIMER_LEVELS; level++)
+    {
+        uint64_t occupied = wheel->occupied[level];
+        if (occupied == 0)
+        {
+            continue;
+        }
+
+        // slots of this level are visited on multiples of `width`, the lowest level on every tick
+        uint32_t shift = (uint32_t)(NEXCHAT_TIMER_BITS * level);
+        uint64_t boundary = ((wheel->now >> shift) + 1) << shift;
+        uint64_t index = (boundary >> shift) & NEXCHAT_TIMER_MASK;
+        uint64_t steps = (uint64_t)__builtin_ctzll(nexchat_timer_rotr(occupied, (uint32_t)index));
+        uint64_t tick = boundary + (steps << shift);
+
+        next = tick < next ? tick : next;
+    }
+
+    return next;
+}
+
+static void nexchat_timer_cascade(nexchat_timer_wheel_t* wheel, size_t level)
+{
+    size_t index = (size_t)((wheel->now >> (NEXCHAT_TIMER_BITS * level)) & NEXCHAT_TIMER_MASK);
+
+    nexchat_timer_t* list = NULL;
+    nexchat_timer_detach(wheel, level * NEXCHAT_TIMER_SLOTS + index, &list);
+
+    while (list != NULL)
+    {
+        nexchat_timer_t* timer = list;
+        nexchat_timer_unlink(wheel, timer);
+        nexchat_timer_link(wheel, timer);
+    }
+}
+
+size_t nexchat_timer_wheel_advance(nexchat_timer_wheel_t* wheel, uint64_t now_ns)
+{
+    uint64_t target = now_ns / NEXCHAT_TIMER_TICK_NS;
+    size_t fired = 0;
+
+    while (wheel->now < target)
+    {
+        // ticks where no occupied slot is visited change nothing, jump over them
+        uint64_t next = nexchat_timer_next_event(wheel);
+        if (next > target)
+        {
+            wheel->now = target;
+            break;
+        }
+
+        wheel->now = next;
+
+        // the higher levels pour into the lower ones first, a timer may go down several at once
+        for (size_t level = NEXCHAT_TIMER_LEVELS - 1; level > 0; level--)
+        {
+            uint64_t below = (1ull << (NEXCHAT_TIMER_BITS * level)) - 1;
+            if ((wheel->now & below) == 0)
+            {
+                nexchat_timer_cascade(wheel, level);
+            }
+        }
+
+        nexchat_timer_t* list = NULL;
+        nexchat_timer_detach(wheel, (size_t)(wheel->now & NEXCHAT_TIMER_MASK), &list);
+
+        // callbacks may arm and cancel anything, this list included
+        while (list != NULL)
+        {
+            nexchat_timer_t* timer = list;
+            nexchat_timer_unlink(wheel, timer);
+            wheel->count--;
+            wheel->fired++;
+            fired++;
+
+            timer->fire(wheel->ctx, timer);
+        }
+    }
+
+    return fired;
+}
+
+int32_t nexchat_timer_wheel_timeout(const nexchat_timer_wheel_t* wheel, uint64_t now_ns)
+{
+    if (wheel->count == 0)
+    {
+        return -1;
+    }
+
+    uint64_t next = nexchat_timer_next_event(wheel);
+    uint64_t deadline = next * NEXCHAT_TIMER_TICK_NS;
+
+    // rounded up so epoll doesn't wake a hair early and spin
+    if (deadline <= now_ns)
+    {
+        return 0;
+    }
+
+    uint64_t ms = (deadline - now_ns + 999999) / 1000000;
+    return ms > INT32_MAX ? INT32_MAX : (int32_t)ms;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Hierarchical timer wheel. Time advances in ticks of NEXCHAT_TIMER_TICK_MS; a timer sits in one
+// of NEXCHAT_TIMER_SLOTS slots on the first of NEXCHAT_TIMER_LEVELS levels whose span covers its
+// deadline, each level's slots being NEXCHAT_TIMER_SLOTS times wider than the one below. When
+// the lowest level comes round, a slot of the level above is emptied into it. Arming and
+// cancelling unlink or link one node, and a timer is moved at most once per level before it
+// fires, so the cost doesn't depend on how many timers there are.
+//
+// A bitmap of occupied slots per level tells how long the owner may sleep without scanning
+// anything. A wheel has a single owner thread and no locking.
+//
+// Deadlines are rounded up to a tick, a timer never fires early, except that deadlines beyond
+// the top level's span (NEXCHAT_TIMER_TICK_MS * 64^4, about 46 hours) are clamped to it. Callbacks
+// that may be scheduled that far out check their own deadline and arm again.
+#define NEXCHAT_TIMER_TICK_MS 10
+#define NEXCHAT_TIMER_BITS    6
+#define NEXCHAT_TIMER_SLOTS   (1 << NEXCHAT_TIMER_BITS)
+#define NEXCHAT_TIMER_LEVELS  4
+
+typedef struct nexchat_timer_t nexchat_timer_t;
+
+// `ctx` is the wheel's, the timer is no longer armed when it runs and may be armed again
+typedef void (*nexchat_timer_fn)(void* ctx, nexchat_timer_t* timer);
+
+struct nexchat_timer_t
+{
+    nexchat_timer_t* next;
+    nexchat_timer_t** pprev; // the pointer that points at this timer, NULL while not armed
+    uint64_t expires;        // tick
+    uint16_t slot;           // level * NEXCHAT_TIMER_SLOTS + slot, or NEXCHAT_TIMER_DETACHED
+    nexchat_timer_fn fire;
+    void* owner;
+};
+
+typedef struct nexchat_timer_wheel_t
+{
+    nexchat_timer_t* slots[NEXCHAT_TIMER_LEVELS * NEXCHAT_TIMER_SLOTS];
+    uint64_t occupied[NEXCHAT_TIMER_LEVELS]; // bit per non-empty slot
+    uint64_t now;   // the last tick processed
+    size_t count;   // armed timers
+    uint64_t fired; // timers run so far
+    void* ctx;      // passed to every callback
+} nexchat_timer_wheel_t;
+
+void nexchat_timer_wheel_init(nexchat_timer_wheel_t* wheel, uint64_t now_ns, void* ctx);
+
+void nexchat_timer_init(nexchat_timer_t* timer, nexchat_timer_fn fire, void* owner);
+
+// arms `timer` for `deadline_ns` (CLOCK_MONOTONIC), moving it if it was armed already
+void nexchat_timer_schedule(nexchat_timer_wheel_t* wheel, nexchat_timer_t* timer, uint64_t deadline_ns);
+void nexchat_timer_cancel(nexchat_timer_wheel_t* wheel, nexchat_timer_t* timer);
+
+static inline bool nexchat_timer_armed(const nexchat_timer_t* timer)
+{
+    return timer->pprev != NULL;
+}
+
+// runs every timer whose deadline has passed by `now_ns`, returns how many
+size_t nexchat_timer_wheel_advance(nexchat_timer_wheel_t* wheel, uint64_t now_ns);
+
+// milliseconds until the wheel next has work to do, for epoll_wait, -1 when nothing is armed
+int32_t nexchat_timer_wheel_timeout(const nexchat_timer_wheel_t* wheel, uint64_t now_ns);
@@ -0,0 +1,56 @@
+project "nexchat-microbench"
+   kind "ConsoleApp"
+   language "C"
+   cdialect "gnu99"
+   targetdir "bin/%{cfg.buildcfg}"
+   staticruntime "off"
+
+   files
+   {
+      "src/**.h",
+      "src/**.c",
+
+      -- the server pieces under measurement, built in rather than linked, the server is not a library
+      "../server/src/commands.c",
+      "../server/src/client_table.c",
+      "../server/src/roster.c",
+      "../server/src/rooms.c",
+      "../server/src/broadcast.c",
+   }
+
+   includedirs
+   {
+      "src",
+
+	  -- include libcommon
+	  "../libcommon/src",
+
+	  -- include the server's headers
+	  "../server/src",
+   }
+
+   links
+   {
+      "libcommon",
+      "pthread",
+   }
+
+   targetdir ("../bin/" .. OutputDir .. "/%{prj.name}")
+   objdir ("../bin/int/" .. OutputDir .. "/%{prj.name}")
+
+   filter "configurations:Debug"
+       defines { "DEBUG" }
+       runtime "Debug"
+       symbols "On"
+
+   filter "configurations:Release"
+       defines { "RELEASE" }
+       runtime "Release"
+       optimize "On"
+       symbols "On"
+
+   filter "configurations:Dist"
+       defines { "DIST" }
+       runtime "Release"
+       optimize "On"
+       symbols "Off"
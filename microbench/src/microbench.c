@@ -0,0 +1,791 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "libcommon/libcommon.h"
+
+#include "commands.h"
+#include "client_table.h"
+#include "roster.h"
+#include "rooms.h"
+#include "server.h"
+
+// Times the primitives every message goes through on the server, one at a time and without
+// sockets, so a change to one of them shows up as a number rather than as noise in a
+// nexchat-bench run. Each benchmark runs in batches of a calibrated size until --time has
+// passed; the median batch is the result. The report is JSON on stdout (or --output), a
+// readable summary goes to stderr.
+#define MICROBENCH_BATCH_NS   (5 * 1000000ull) // calibrated batches take at least this long
+#define MICROBENCH_MIN_BATCHES 5
+#define MICROBENCH_MAX_BATCHES 1024
+#define MICROBENCH_STREAM_FRAMES 256
+#define MICROBENCH_STRANGERS 256
+
+#if defined(DEBUG)
+    #define MICROBENCH_BUILD "Debug"
+#elif defined(RELEASE)
+    #define MICROBENCH_BUILD "Release"
+#else
+    #define MICROBENCH_BUILD "Dist"
+#endif
+
+typedef struct nexchat_microbench_config_t
+{
+    double time;       // seconds per benchmark
+    size_t users;      // roster and client table size
+    size_t members;    // recipients of a fanned out broadcast
+    size_t size;       // chat message bytes
+    const char* filter; // only benchmarks whose name contains it
+    const char* output; // NULL for stdout
+    const char* label;  // free text copied into the report, a version or commit
+} nexchat_microbench_config_t;
+
+typedef struct nexchat_microbench_state_t
+{
+    const nexchat_microbench_config_t* config;
+    uint64_t seed;
+
+    char* message;
+    nexchat_buffer_t scratch;
+    nexchat_server_shard_t* shard; // only its sendbuf is set up, for nexchat_server_encode_broadcast
+
+    // a recv stream of text frames, replayed into the decoder a chunk at a time
+    nexchat_buffer_t stream;
+    size_t stream_offset;
+    nexchat_frame_decoder_t decoder;
+
+    nexchat_outqueue_t* members;
+
+    nexchat_client_table_t clients;
+    nexchat_roster_t roster;
+    char (*usernames)[64];
+    char (*strangers)[64]; // MICROBENCH_STRANGERS names nobody has
+    int32_t* sockfds;
+
+    nexchat_strmap_t rooms;
+    nexchat_room_t** room_list;
+    size_t room_count;
+} nexchat_microbench_state_t;
+
+// runs `iterations` operations and returns something derived from their results, so the
+// compiler can't drop the work
+typedef uint64_t (*nexchat_microbench_fn)(nexchat_microbench_state_t* state, uint64_t iterations);
+
+typedef struct nexchat_microbench_t
+{
+    const char* name;
+    const char* desc;
+    nexchat_microbench_fn run;
+} nexchat_microbench_t;
+
+typedef struct nexchat_microbench_result_t
+{
+    uint64_t iterations; // across every batch
+    size_t batches;
+    double median_ns;    // per operation
+    double min_ns;
+    double max_ns;
+    double mean_ns;
+} nexchat_microbench_result_t;
+
+static volatile uint64_t nexchat_microbench_sink;
+
+static const char* nexchat_microbench_commands[] =
+{
+    "/users",
+    "/kick user42",
+    "/join \"red room\"",
+    "/presence on",
+    "/set-username someone",
+    "/leave",
+    "/nosuchcommand with args",
+    "/stats",
+};
+
+#define MICROBENCH_COMMAND_COUNT (sizeof nexchat_microbench_commands / sizeof nexchat_microbench_commands[0])
+
+static uint64_t nexchat_microbench_random(nexchat_microbench_state_t* state)
+{
+    // xorshift64, the lookups only need an order the branch predictor can't learn
+    uint64_t x = state->seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    state->seed = x;
+    return x;
+}
+
+static uint64_t nexchat_microbench_frame_encode(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        nexchat_buffer_clear(&state->scratch);
+        nexchat_frame_encode_text(&state->scratch, state->message);
+        sum += nexchat_buffer_readable(&state->scratch);
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_frame_decode(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    nexchat_frame_decoder_t* decoder = &state->decoder;
+    nexchat_frame_t frame;
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iterations; )
+    {
+        int32_t status = nexchat_frame_decoder_next(decoder, &frame);
+        if (status == 1)
+        {
+            sum += frame.size;
+            i++;
+            continue;
+        }
+
+        // what one recv would hand over, chunks end mid-frame like they do off the socket
+        size_t space = 0;
+        uint8_t* dst = nexchat_frame_decoder_prepare(decoder, &space);
+
+        size_t stream_size = nexchat_buffer_readable(&state->stream);
+        size_t chunk = stream_size - state->stream_offset;
+        chunk = chunk < space ? chunk : space;
+        chunk = chunk < NEXCHAT_FRAME_RECV_CHUNK ? chunk : NEXCHAT_FRAME_RECV_CHUNK;
+
+        memcpy(dst, nexchat_buffer_head(&state->stream) + state->stream_offset, chunk);
+        nexchat_frame_decoder_commit(decoder, chunk);
+
+        state->stream_offset = (state->stream_offset + chunk) % stream_size;
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_command_lookup(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    (void)state;
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        const nexchat_command_info_t* info = nexchat_client_command_info((nexchat_client_command_t)(1 + i % (CMD_MAXCOMMANDS - 1)));
+        sum += (uint64_t)nexchat_client_command_lookup(info->name, info->namelen);
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_command_dispatch(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    (void)state;
+    nexchat_command_args_t args;
+    uint64_t sum = 0;
+
+    // what nexchat_server_handle_msg does before it reaches nexchat_server_exec_cmd
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        const char* line = nexchat_microbench_commands[i % MICROBENCH_COMMAND_COUNT];
+
+        if (nexchat_command_tokenize(&line[1], &args) != 0 || args.argc == 0)
+        {
+            continue;
+        }
+
+        nexchat_client_command_t cmd = nexchat_client_command_lookup(args.argv[0], strlen(args.argv[0]));
+        const nexchat_command_info_t* info = nexchat_client_command_info(cmd);
+        size_t argc = args.argc - 1;
+
+        sum += cmd != CMD_NONE && argc >= info->minargs && argc <= info->maxargs ? (uint64_t)cmd : 0;
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_broadcast_encode(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        nexchat_msgbuf_t* shared = nexchat_server_encode_broadcast(state->shard, state->usernames[i % state->config->users], state->message);
+        if (shared != NULL)
+        {
+            sum += shared->size;
+            nexchat_msgbuf_release(shared);
+        }
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_broadcast_fanout(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    size_t members = state->config->members;
+    uint64_t sum = 0;
+
+    // one encode, a reference on every member's queue, then every queue written out
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        nexchat_msgbuf_t* shared = nexchat_server_encode_broadcast(state->shard, state->usernames[i % state->config->users], state->message);
+        if (shared == NULL)
+        {
+            continue;
+        }
+
+        for (size_t m = 0; m < members; m++)
+        {
+            nexchat_outqueue_push(&state->members[m], shared);
+        }
+
+        nexchat_msgbuf_release(shared);
+
+        for (size_t m = 0; m < members; m++)
+        {
+            sum += state->members[m].bytes;
+            nexchat_outqueue_consume(&state->members[m], state->members[m].bytes);
+        }
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_client_find(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        int32_t sockfd = state->sockfds[nexchat_microbench_random(state) % state->config->users];
+        nexchat_client_state_t* client = nexchat_client_table_find(&state->clients, sockfd);
+        sum += client != NULL ? client->id : 0;
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_roster_find(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        const char* username = state->usernames[nexchat_microbench_random(state) % state->config->users];
+
+        // /kick's lookup, the epoch enter and exit included
+        const nexchat_roster_snapshot_t* roster = nexchat_roster_read_begin(&state->roster, 0);
+        nexchat_roster_entry_t* entry = nexchat_roster_find(roster, username);
+        sum += entry != NULL ? entry->client_id : 0;
+        nexchat_roster_read_end(&state->roster, 0);
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_roster_miss(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        const char* username = state->strangers[i % MICROBENCH_STRANGERS];
+
+        const nexchat_roster_snapshot_t* roster = nexchat_roster_read_begin(&state->roster, 0);
+        sum += nexchat_roster_find(roster, username) == NULL;
+        nexchat_roster_read_end(&state->roster, 0);
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_roster_rename(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        const char* username = state->usernames[nexchat_microbench_random(state) % state->config->users];
+
+        // /nick's write, swapping a user's entry for a fresh one under the writer lock
+        pthread_mutex_lock(&state->roster.writer);
+        nexchat_roster_entry_t* old = nexchat_roster_find(state->roster.current, username);
+        nexchat_roster_entry_t* renamed = nexchat_roster_entry_create(username, old->client);
+        if (renamed != NULL && nexchat_roster_update(&state->roster, old, renamed) == -1)
+        {
+            free(renamed);
+            renamed = NULL;
+        }
+
+        sum += renamed != NULL ? renamed->client_id : 0;
+        pthread_mutex_unlock(&state->roster.writer);
+    }
+
+    return sum;
+}
+
+static uint64_t nexchat_microbench_room_find(nexchat_microbench_state_t* state, uint64_t iterations)
+{
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        const nexchat_room_t* room = state->room_list[nexchat_microbench_random(state) % state->room_count];
+        nexchat_room_t* found = (nexchat_room_t*)nexchat_strmap_get(&state->rooms, room->name);
+        sum += found != NULL ? found->name[0] : 0;
+    }
+
+    return sum;
+}
+
+static const nexchat_microbench_t nexchat_microbenches[] =
+{
+    {"frame_encode",       "encode one text frame",                                   nexchat_microbench_frame_encode},
+    {"frame_decode",       "decode one text frame out of recv sized chunks",          nexchat_microbench_frame_decode},
+    {"command_lookup",     "look up one command name",                                nexchat_microbench_command_lookup},
+    {"command_dispatch",   "tokenize a command line, look it up and check its arguments", nexchat_microbench_command_dispatch},
+    {"broadcast_encode",   "format a chat line into a shared frame",                  nexchat_microbench_broadcast_encode},
+    {"broadcast_fanout",   "encode a broadcast and queue it for every member",        nexchat_microbench_broadcast_fanout},
+    {"client_find",        "find a client by socket",                                 nexchat_microbench_client_find},
+    {"roster_find",        "find a connected user by name",                           nexchat_microbench_roster_find},
+    {"roster_miss",        "look up a name nobody has",                               nexchat_microbench_roster_miss},
+    {"roster_rename",      "replace a user's roster entry, the cost of every roster write", nexchat_microbench_roster_rename},
+    {"room_find",          "find a room by name",                                     nexchat_microbench_room_find},
+};
+
+#define MICROBENCH_COUNT (sizeof nexchat_microbenches / sizeof nexchat_microbenches[0])
+
+static int32_t nexchat_microbench_setup(nexchat_microbench_state_t* state, const nexchat_microbench_config_t* config)
+{
+    memset(state, 0, sizeof(nexchat_microbench_state_t));
+    state->config = config;
+    state->seed = 0x9e3779b97f4a7c15ull;
+
+    state->message = (char*)malloc(config->size + 1);
+    state->members = (nexchat_outqueue_t*)calloc(config->members, sizeof(nexchat_outqueue_t));
+    state->usernames = (char (*)[64])calloc(config->users, sizeof *state->usernames);
+    state->strangers = (char (*)[64])calloc(MICROBENCH_STRANGERS, sizeof *state->strangers);
+    state->sockfds = (int32_t*)calloc(config->users, sizeof(int32_t));
+    state->shard = (nexchat_server_shard_t*)calloc(1, sizeof(nexchat_server_shard_t));
+
+    if (state->message == NULL || state->members == NULL || state->usernames == NULL || state->strangers == NULL || state->sockfds == NULL ||
+        state->shard == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < MICROBENCH_STRANGERS; i++)
+    {
+        snprintf(state->strangers[i], sizeof state->strangers[i], "nobody%zu", i);
+    }
+
+    memset(state->message, 'x', config->size);
+    state->message[config->size] = '\0';
+
+    nexchat_buffer_init(&state->scratch, config->size + 128);
+    nexchat_buffer_init(&state->shard->sendbuf, 1024);
+    nexchat_frame_decoder_init(&state->decoder);
+
+    for (size_t i = 0; i < config->members; i++)
+    {
+        nexchat_outqueue_init(&state->members[i]);
+    }
+
+    nexchat_buffer_init(&state->stream, MICROBENCH_STREAM_FRAMES * (config->size + NEXCHAT_FRAME_HEADER_SIZE + 1));
+
+    for (size_t i = 0; i < MICROBENCH_STREAM_FRAMES; i++)
+    {
+        if (nexchat_frame_encode_text(&state->stream, state->message) == -1)
+        {
+            return -1;
+        }
+    }
+
+    // sockets are spread out the way the kernel hands them out under churn, not packed from 0
+    if (nexchat_client_table_init(&state->clients, config->users) == -1 || nexchat_roster_init(&state->roster, 1) == -1)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < config->users; i++)
+    {
+        snprintf(state->usernames[i], sizeof state->usernames[i], "user%zu", i);
+        state->sockfds[i] = (int32_t)(16 + i * 3);
+
+        nexchat_client_state_t* client = nexchat_client_table_alloc(&state->clients, state->sockfds[i]);
+        if (client == NULL)
+        {
+            return -1;
+        }
+
+        client->sockfd = state->sockfds[i];
+        client->id = i + 1;
+        client->connected = true;
+        memcpy(client->username, state->usernames[i], sizeof client->username);
+
+        pthread_mutex_lock(&state->roster.writer);
+        nexchat_roster_entry_t* entry = nexchat_roster_entry_create(client->username, client);
+        int32_t status = entry != NULL ? nexchat_roster_update(&state->roster, NULL, entry) : -1;
+        pthread_mutex_unlock(&state->roster.writer);
+
+        if (status == -1)
+        {
+            return -1;
+        }
+    }
+
+    state->room_count = config->users / 16 + 1;
+    state->room_list = (nexchat_room_t**)calloc(state->room_count, sizeof(nexchat_room_t*));
+    if (state->room_list == NULL || nexchat_strmap_init(&state->rooms, 16) == -1)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < state->room_count; i++)
+    {
+        char name[ROOM_NAME_MAX];
+        snprintf(name, sizeof name, "room%zu", i);
+
+        state->room_list[i] = nexchat_room_create(name, 1);
+        if (state->room_list[i] == NULL || nexchat_strmap_put(&state->rooms, state->room_list[i]->name, state->room_list[i]) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void nexchat_microbench_teardown(nexchat_microbench_state_t* state)
+{
+    for (size_t i = 0; i < state->room_count && state->room_list != NULL; i++)
+    {
+        if (state->room_list[i] != NULL)
+        {
+            nexchat_room_free(state->room_list[i]);
+        }
+    }
+
+    for (size_t i = 0; i < state->config->members && state->members != NULL; i++)
+    {
+        nexchat_outqueue_free(&state->members[i]);
+    }
+
+    // setup may have failed before the roster existed
+    if (state->roster.current != NULL)
+    {
+        nexchat_roster_free(&state->roster);
+    }
+
+    nexchat_strmap_free(&state->rooms);
+    nexchat_client_table_free(&state->clients);
+    nexchat_frame_decoder_free(&state->decoder);
+    nexchat_buffer_free(&state->stream);
+    nexchat_buffer_free(&state->scratch);
+
+    if (state->shard != NULL)
+    {
+        nexchat_buffer_free(&state->shard->sendbuf);
+        free(state->shard);
+    }
+
+    free(state->room_list);
+    free(state->sockfds);
+    free(state->strangers);
+    free(state->usernames);
+    free(state->members);
+    free(state->message);
+}
+
+static int nexchat_microbench_compare(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void nexchat_microbench_run(nexchat_microbench_state_t* state, const nexchat_microbench_t* bench, nexchat_microbench_result_t* result)
+{
+    static double samples[MICROBENCH_MAX_BATCHES];
+
+    // double the batch until it is long enough for the clock not to matter, this warms up too
+    uint64_t batch = 1;
+    while (true)
+    {
+        uint64_t start = nexchat_clock_now_ns();
+        nexchat_microbench_sink += bench->run(state, batch);
+        uint64_t elapsed = nexchat_clock_now_ns() - start;
+
+        if (elapsed >= MICROBENCH_BATCH_NS || batch >= (1ull << 40))
+        {
+            break;
+        }
+
+        batch *= 2;
+    }
+
+    uint64_t budget = (uint64_t)(state->config->time * 1e9);
+    uint64_t spent = 0;
+    size_t count = 0;
+
+    while (count < MICROBENCH_MAX_BATCHES && (count < MICROBENCH_MIN_BATCHES || spent < budget))
+    {
+        uint64_t start = nexchat_clock_now_ns();
+        nexchat_microbench_sink += bench->run(state, batch);
+        uint64_t elapsed = nexchat_clock_now_ns() - start;
+
+        samples[count++] = (double)elapsed / (double)batch;
+        spent += elapsed;
+    }
+
+    qsort(samples, count, sizeof(double), nexchat_microbench_compare);
+
+    double sum = 0.0;
+    for (size_t i = 0; i < count; i++)
+    {
+        sum += samples[i];
+    }
+
+    result->iterations = batch * count;
+    result->batches = count;
+    result->median_ns = count % 2 == 1 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2.0;
+    result->min_ns = samples[0];
+    result->max_ns = samples[count - 1];
+    result->mean_ns = sum / (double)count;
+}
+
+static void nexchat_microbench_write_string(FILE* out, const char* str)
+{
+    fputc('"', out);
+
+    for (const char* it = str; *it != '\0'; it++)
+    {
+        unsigned char c = (unsigned char)*it;
+
+        if (c == '"' || c == '\\')
+        {
+            fprintf(out, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(out, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, out);
+        }
+    }
+
+    fputc('"', out);
+}
+
+static void nexchat_microbench_write_report(FILE* out, const nexchat_microbench_config_t* config,
+    const nexchat_microbench_t** benches, const nexchat_microbench_result_t* results, size_t count)
+{
+    char timestamp[32];
+    time_t now = time(NULL);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    strftime(timestamp, sizeof timestamp, "%Y-%m-%dT%H:%M:%SZ", &utc);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"tool\": \"nexchat-microbench\",\n");
+    fprintf(out, "  \"label\": ");
+    nexchat_microbench_write_string(out, config->label);
+    fprintf(out, ",\n");
+    fprintf(out, "  \"build\": \"%s\",\n", MICROBENCH_BUILD);
+    fprintf(out, "  \"timestamp\": \"%s\",\n", timestamp);
+    fprintf(out, "  \"config\": {\"time\": %.3f, \"users\": %zu, \"members\": %zu, \"size\": %zu},\n",
+            config->time, config->users, config->members, config->size);
+    fprintf(out, "  \"benchmarks\": [\n");
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const nexchat_microbench_result_t* result = &results[i];
+
+        fprintf(out, "    {\"name\": \"%s\", \"iterations\": %llu, \"batches\": %zu, \"ns_per_op\": %.3f, "
+                     "\"min_ns_per_op\": %.3f, \"max_ns_per_op\": %.3f, \"mean_ns_per_op\": %.3f, \"ops_per_sec\": %.1f}%s\n",
+                benches[i]->name, (unsigned long long)result->iterations, result->batches, result->median_ns,
+                result->min_ns, result->max_ns, result->mean_ns, result->median_ns > 0.0 ? 1e9 / result->median_ns : 0.0,
+                i + 1 < count ? "," : "");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+static void nexchat_microbench_print_usage(const char* program)
+{
+    printf("usage: %s [options]\n", program);
+    printf("  -t, --time <secs>        measurement length per benchmark (default 0.5)\n");
+    printf("  -n, --users <n>          connected users in the roster and client table (default 4096)\n");
+    printf("  -m, --members <n>        recipients of a fanned out broadcast (default 64)\n");
+    printf("  -s, --size <bytes>       chat message size (default 64)\n");
+    printf("  -f, --filter <text>      only run benchmarks whose name contains <text>\n");
+    printf("  -o, --output <file>      write the JSON report to <file> instead of stdout\n");
+    printf("  -l, --label <text>       recorded in the report, e.g. the version or commit measured\n");
+    printf("  -L, --list               list the benchmarks and exit\n");
+    printf("  -h, --help               show this message\n");
+}
+
+static int32_t nexchat_microbench_parse_number(const char* name, const char* arg, double min, double* value)
+{
+    char* end = NULL;
+    *value = strtod(arg, &end);
+
+    if (*end != '\0' || *value < min)
+    {
+        fprintf(stderr, "nexchat-microbench: invalid --%s '%s'\n", name, arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+// 1 when the program should exit without running anything
+static int32_t nexchat_microbench_parse_args(nexchat_microbench_config_t* config, int argc, char** argv)
+{
+    static const struct option options[] =
+    {
+        {"time",    required_argument, NULL, 't'},
+        {"users",   required_argument, NULL, 'n'},
+        {"members", required_argument, NULL, 'm'},
+        {"size",    required_argument, NULL, 's'},
+        {"filter",  required_argument, NULL, 'f'},
+        {"output",  required_argument, NULL, 'o'},
+        {"label",   required_argument, NULL, 'l'},
+        {"list",    no_argument,       NULL, 'L'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    config->time = 0.5;
+    config->users = 4096;
+    config->members = 64;
+    config->size = 64;
+    config->filter = NULL;
+    config->output = NULL;
+    config->label = "";
+
+    int32_t opt = 0;
+    double value = 0.0;
+
+    while ((opt = getopt_long(argc, argv, "t:n:m:s:f:o:l:Lh", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+            {
+                if (nexchat_microbench_parse_number("time", optarg, 0.001, &value) == -1) return -1;
+                config->time = value;
+            } break;
+            case 'n':
+            {
+                if (nexchat_microbench_parse_number("users", optarg, 1, &value) == -1) return -1;
+                config->users = (size_t)value;
+            } break;
+            case 'm':
+            {
+                if (nexchat_microbench_parse_number("members", optarg, 1, &value) == -1) return -1;
+                config->members = (size_t)value;
+            } break;
+            case 's':
+            {
+                if (nexchat_microbench_parse_number("size", optarg, 1, &value) == -1) return -1;
+                config->size = (size_t)value;
+            } break;
+            case 'f': config->filter = optarg; break;
+            case 'o': config->output = optarg; break;
+            case 'l': config->label = optarg; break;
+            case 'L':
+            {
+                for (size_t i = 0; i < MICROBENCH_COUNT; i++)
+                {
+                    printf("%-20s %s\n", nexchat_microbenches[i].name, nexchat_microbenches[i].desc);
+                }
+            } return 1;
+            case 'h':
+            default:
+                nexchat_microbench_print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (config->size + 128 > NEXCHAT_FRAME_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "nexchat-microbench: --size must be below %d\n", NEXCHAT_FRAME_MAX_PAYLOAD - 128);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    nexchat_microbench_config_t config;
+    int32_t parsed = nexchat_microbench_parse_args(&config, argc, argv);
+    if (parsed != 0)
+    {
+        return parsed == 1 ? 0 : 1;
+    }
+
+    const nexchat_microbench_t* selected[MICROBENCH_COUNT];
+    nexchat_microbench_result_t results[MICROBENCH_COUNT];
+    size_t count = 0;
+
+    for (size_t i = 0; i < MICROBENCH_COUNT; i++)
+    {
+        if (config.filter == NULL || strstr(nexchat_microbenches[i].name, config.filter) != NULL)
+        {
+            selected[count++] = &nexchat_microbenches[i];
+        }
+    }
+
+    if (count == 0)
+    {
+        fprintf(stderr, "nexchat-microbench: no benchmark matches '%s'\n", config.filter);
+        return 1;
+    }
+
+    FILE* out = config.output != NULL ? fopen(config.output, "w") : stdout;
+    if (out == NULL)
+    {
+        perror(config.output);
+        return 1;
+    }
+
+    nexchat_microbench_state_t state;
+    if (nexchat_microbench_setup(&state, &config) == -1)
+    {
+        fprintf(stderr, "nexchat-microbench: out of memory setting up\n");
+        nexchat_microbench_teardown(&state);
+        return 1;
+    }
+
+    fprintf(stderr, "nexchat-microbench: %s build, %zu users, %zu members, %zu byte messages, %.2f s each\n",
+            MICROBENCH_BUILD, config.users, config.members, config.size, config.time);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        nexchat_microbench_run(&state, selected[i], &results[i]);
+
+        fprintf(stderr, "  %-20s %12.1f ns/op  %14.0f ops/s  (min %.1f, max %.1f)\n", selected[i]->name,
+                results[i].median_ns, results[i].median_ns > 0.0 ? 1e9 / results[i].median_ns : 0.0,
+                results[i].min_ns, results[i].max_ns);
+    }
+
+    nexchat_microbench_write_report(out, &config, selected, results, count);
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    nexchat_microbench_teardown(&state);
+
+    return 0;
+}
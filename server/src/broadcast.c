@@ -0,0 +1,19 @@
+#include "server.h"
+
+// Apart from server.c so nexchat-microbench can build the encoder in and time the code every
+// chat line goes through, rather than a copy of it. Only `shard->sendbuf` is touched.
+nexchat_msgbuf_t* nexchat_server_encode_broadcast(nexchat_server_shard_t* shard, const char* username, const char* msg)
+{
+    // serialize once into a shared buffer, every recipient's queue holds a reference to it
+    nexchat_buffer_t* sendbuf = &shard->sendbuf;
+    nexchat_buffer_clear(sendbuf);
+
+    int32_t status = username ? nexchat_frame_printf(sendbuf, "%s: %s", username, msg) : nexchat_frame_printf(sendbuf, "%s", msg);
+    nexchat_msgbuf_t* shared = status == 0 ? nexchat_msgbuf_create(nexchat_buffer_head(sendbuf), nexchat_buffer_readable(sendbuf)) : NULL;
+    if (shared == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to encode broadcast");
+    }
+
+    return shared;
+}
@@ -0,0 +1,118 @@
+#include "client_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int32_t nexchat_client_table_init(nexchat_client_table_t* table, size_t capacity)
+{
+    memset(table, 0, sizeof(nexchat_client_table_t));
+
+    size_t chunk_count = (capacity + CLIENT_TABLE_CHUNK_SIZE - 1) / CLIENT_TABLE_CHUNK_SIZE;
+
+    table->chunks = (nexchat_client_state_t**)calloc(chunk_count, sizeof(nexchat_client_state_t*));
+    table->freelist = (nexchat_client_state_t**)malloc(capacity * sizeof(nexchat_client_state_t*));
+
+    if (table->chunks == NULL || table->freelist == NULL)
+    {
+        nexchat_client_table_free(table);
+        return -1;
+    }
+
+    table->capacity = capacity;
+
+    return 0;
+}
+
+void nexchat_client_table_free(nexchat_client_table_t* table)
+{
+    for (size_t i = 0; i < table->chunk_count; i++)
+    {
+        free(table->chunks[i]);
+    }
+
+    free(table->chunks);
+    free(table->freelist);
+    free(table->fdtable);
+
+    memset(table, 0, sizeof(nexchat_client_table_t));
+}
+
+static int32_t nexchat_client_table_map_fd(nexchat_client_table_t* table, int32_t sockfd, nexchat_client_state_t* client)
+{
+    if ((size_t)sockfd >= table->fdtable_size)
+    {
+        size_t size = table->fdtable_size > 0 ? table->fdtable_size : 1024;
+        while (size <= (size_t)sockfd)
+        {
+            size *= 2;
+        }
+
+        nexchat_client_state_t** fdtable = (nexchat_client_state_t**)realloc(table->fdtable, size * sizeof(nexchat_client_state_t*));
+        if (fdtable == NULL)
+        {
+            return -1;
+        }
+
+        memset(fdtable + table->fdtable_size, 0, (size - table->fdtable_size) * sizeof(nexchat_client_state_t*));
+        table->fdtable = fdtable;
+        table->fdtable_size = size;
+    }
+
+    table->fdtable[sockfd] = client;
+
+    return 0;
+}
+
+nexchat_client_state_t* nexchat_client_table_alloc(nexchat_client_table_t* table, int32_t sockfd)
+{
+    if (sockfd < 0 || table->live >= table->capacity)
+    {
+        return NULL;
+    }
+
+    nexchat_client_state_t* client = NULL;
+
+    if (table->free_count > 0)
+    {
+        client = table->freelist[--table->free_count];
+    }
+    else
+    {
+        // no released slot to reuse, carve the next one, adding a chunk when crossing a boundary
+        size_t chunk = table->allocated / CLIENT_TABLE_CHUNK_SIZE;
+        if (chunk == table->chunk_count)
+        {
+            table->chunks[chunk] = (nexchat_client_state_t*)calloc(CLIENT_TABLE_CHUNK_SIZE, sizeof(nexchat_client_state_t));
+            if (table->chunks[chunk] == NULL)
+            {
+                return NULL;
+            }
+
+            table->chunk_count++;
+        }
+
+        client = nexchat_client_table_at(table, table->allocated);
+        table->allocated++;
+    }
+
+    if (nexchat_client_table_map_fd(table, sockfd, client) == -1)
+    {
+        table->freelist[table->free_count++] = client;
+        return NULL;
+    }
+
+    table->live++;
+
+    return client;
+}
+
+void nexchat_client_table_release(nexchat_client_table_t* table, nexchat_client_state_t* client)
+{
+    if (nexchat_client_table_find(table, client->sockfd) == client)
+    {
+        table->fdtable[client->sockfd] = NULL;
+    }
+
+    table->freelist[table->free_count++] = client;
+    table->live--;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "libcommon/libcommon.h"
+
+#define CLIENT_TABLE_CHUNK_SIZE 256
+
+// Slab of client records. Records are allocated in fixed size chunks so their
+// addresses never change (epoll and the flush list hold raw pointers to them),
+// freed records go on a free-list for reuse and an fd-indexed table gives O(1) lookup.
+typedef struct nexchat_client_table_t
+{
+    nexchat_client_state_t** chunks;
+    size_t chunk_count;
+    size_t allocated; // records ever handed out, the high-water mark for iteration
+    size_t capacity;  // maximum number of live records
+    size_t live;
+
+    nexchat_client_state_t** freelist;
+    size_t free_count;
+
+    nexchat_client_state_t** fdtable;
+    size_t fdtable_size;
+} nexchat_client_table_t;
+
+int32_t nexchat_client_table_init(nexchat_client_table_t* table, size_t capacity);
+void nexchat_client_table_free(nexchat_client_table_t* table);
+
+// returns NULL when the table is full or out of memory
+nexchat_client_state_t* nexchat_client_table_alloc(nexchat_client_table_t* table, int32_t sockfd);
+void nexchat_client_table_release(nexchat_client_table_t* table, nexchat_client_state_t* client);
+
+static inline nexchat_client_state_t* nexchat_client_table_find(const nexchat_client_table_t* table, int32_t sockfd)
+{
+    return sockfd >= 0 && (size_t)sockfd < table->fdtable_size ? table->fdtable[sockfd] : NULL;
+}
+
+// slots 0..allocated-1 may be iterated, check `connected` on each
+static inline nexchat_client_state_t* nexchat_client_table_at(const nexchat_client_table_t* table, size_t index)
+{
+    return &table->chunks[index / CLIENT_TABLE_CHUNK_SIZE][index % CLIENT_TABLE_CHUNK_SIZE];
+}
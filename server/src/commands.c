@@ -0,0 +1,153 @@
+#include "commands.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#include "libcommon/libcommon.h"
+
+#define NEXCHAT_COMMAND_INFO(cmd, name, minargs, maxargs, usage, desc) [cmd] = {name, sizeof(name) - 1, minargs, maxargs, usage, desc},
+
+static const nexchat_command_info_t nexchat_command_table[CMD_MAXCOMMANDS] =
+{
+    [CMD_NONE] = {"none", 4, 0, 0, "", "none"},
+    NEXCHAT_CLIENT_COMMANDS(NEXCHAT_COMMAND_INFO)
+};
+
+#undef NEXCHAT_COMMAND_INFO
+
+// Perfect hash over the command names. The table is fixed at compile time, so on first use
+// we search for a seed that sends every name to its own slot; a lookup is then one hash,
+// one length check and one memcmp no matter how many commands there are.
+#define NEXCHAT_COMMAND_SLOTS 64
+
+_Static_assert(CMD_MAXCOMMANDS <= NEXCHAT_COMMAND_SLOTS / 2, "grow NEXCHAT_COMMAND_SLOTS");
+
+static uint8_t nexchat_command_slots[NEXCHAT_COMMAND_SLOTS];
+static uint32_t nexchat_command_seed;
+static pthread_once_t nexchat_command_once = PTHREAD_ONCE_INIT;
+
+static uint32_t nexchat_command_hash(const char* name, size_t len, uint32_t seed)
+{
+    // FNV-1a with the seed folded into the offset basis
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash ^ (hash >> 15);
+}
+
+static void nexchat_command_build_index(void)
+{
+    for (uint32_t seed = 0; ; seed++)
+    {
+        memset(nexchat_command_slots, CMD_NONE, sizeof nexchat_command_slots);
+        bool collided = false;
+
+        for (size_t i = CMD_NONE + 1; i < CMD_MAXCOMMANDS && !collided; i++)
+        {
+            const nexchat_command_info_t* info = &nexchat_command_table[i];
+            uint32_t slot = nexchat_command_hash(info->name, info->namelen, seed) & (NEXCHAT_COMMAND_SLOTS - 1);
+
+            collided = nexchat_command_slots[slot] != CMD_NONE;
+            nexchat_command_slots[slot] = (uint8_t)i;
+        }
+
+        if (!collided)
+        {
+            nexchat_command_seed = seed;
+            return;
+        }
+    }
+}
+
+const nexchat_command_info_t* nexchat_client_command_info(nexchat_client_command_t cmd)
+{
+    return &nexchat_command_table[cmd < CMD_MAXCOMMANDS ? cmd : CMD_NONE];
+}
+
+const char* nexchat_client_command_to_str(nexchat_client_command_t cmd)
+{
+    return nexchat_client_command_info(cmd)->name;
+}
+
+const char* nexchat_client_command_get_desc(nexchat_client_command_t cmd)
+{
+    return nexchat_client_command_info(cmd)->desc;
+}
+
+nexchat_client_command_t nexchat_client_command_lookup(const char* name, size_t len)
+{
+    pthread_once(&nexchat_command_once, nexchat_command_build_index);
+
+    uint32_t slot = nexchat_command_hash(name, len, nexchat_command_seed) & (NEXCHAT_COMMAND_SLOTS - 1);
+    nexchat_client_command_t cmd = (nexchat_client_command_t)nexchat_command_slots[slot];
+    const nexchat_command_info_t* info = &nexchat_command_table[cmd];
+
+    // the whole word has to match, "/usersfoo" is not "/users"
+    if (cmd == CMD_NONE || info->namelen != len || memcmp(info->name, name, len) != 0)
+    {
+        return CMD_NONE;
+    }
+
+    return cmd;
+}
+
+int32_t nexchat_command_tokenize(const char* line, nexchat_command_args_t* args)
+{
+    args->argc = 0;
+
+    size_t out = 0;
+    const char* it = line;
+
+    while (true)
+    {
+        while (*it == ' ' || *it == '\t')
+        {
+            it++;
+        }
+
+        if (*it == '\0')
+        {
+            return 0;
+        }
+
+        if (args->argc == NEXCHAT_COMMAND_MAXARGS)
+        {
+            return NEXCHAT_COMMAND_TOO_MANY;
+        }
+
+        if (out >= sizeof args->storage)
+        {
+            return NEXCHAT_COMMAND_TOO_LONG;
+        }
+
+        args->argv[args->argc++] = &args->storage[out];
+        bool quoted = false;
+
+        for (; *it != '\0' && (quoted || (*it != ' ' && *it != '\t')); it++)
+        {
+            if (*it == '"')
+            {
+                quoted = !quoted;
+                continue;
+            }
+
+            if (out + 1 >= sizeof args->storage)
+            {
+                return NEXCHAT_COMMAND_TOO_LONG;
+            }
+
+            args->storage[out++] = *it;
+        }
+
+        if (quoted)
+        {
+            return NEXCHAT_COMMAND_MALFORMED;
+        }
+
+        args->storage[out++] = '\0';
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Every client command, in one place. Adding a command is one line here plus its case
+// in nexchat_server_exec_cmd: the enum, names, usage, descriptions, argument counts,
+// /commands listing and lookup all come from this table.
+//
+//   X(enum, name, min args, max args, arguments for the usage text, description)
+#define NEXCHAT_CLIENT_COMMANDS(X) \
+    X(CMD_COMMANDS,    "commands",     0, 0, "",           "List all commands") \
+    X(CMD_SETUSERNAME, "set-username", 1, 1, "<username>", "Set a new username") \
+    X(CMD_LISTUSERS,   "users",        0, 0, "",           "List all users in the chat") \
+    X(CMD_KICKUSER,    "kick",         1, 1, "<username>", "Vote to kick a user from the chat. If the majority agrees, the user will be kicked.") \
+    X(CMD_JOIN,        "join",         1, 1, "<room>",     "Join a room, creating it if it doesn't exist") \
+    X(CMD_LEAVE,       "leave",        0, 0, "",           "Leave the current room and return to the lobby") \
+    X(CMD_ROOMS,       "rooms",        0, 0, "",           "List rooms that have members") \
+    X(CMD_PRESENCE,    "presence",     1, 1, "on|off",     "Stream users joining, leaving and renaming (on) instead of polling /users, or stop (off)") \
+    X(CMD_ADMIN,       "admin",        1, 1, "<token>",    "Unlock admin commands with the server's admin token") \
+    X(CMD_STATS,       "stats",        0, 0, "",           "Show server metrics (admin only)")
+
+#define NEXCHAT_COMMAND_ENUM(cmd, name, minargs, maxargs, usage, desc) cmd,
+
+typedef enum nexchat_client_command_t
+{
+    CMD_NONE,
+    NEXCHAT_CLIENT_COMMANDS(NEXCHAT_COMMAND_ENUM)
+    CMD_MAXCOMMANDS,
+} nexchat_client_command_t;
+
+#undef NEXCHAT_COMMAND_ENUM
+
+#define NEXCHAT_COMMAND_MAXARGS 8
+#define NEXCHAT_COMMAND_MAXLEN  1024
+
+typedef struct nexchat_command_info_t
+{
+    const char* name;
+    size_t namelen;
+    size_t minargs;
+    size_t maxargs;
+    const char* usage; // the arguments, "" for none
+    const char* desc;
+} nexchat_command_info_t;
+
+// a command line split into words, argv points into `storage`
+typedef struct nexchat_command_args_t
+{
+    size_t argc;
+    const char* argv[NEXCHAT_COMMAND_MAXARGS];
+    char storage[NEXCHAT_COMMAND_MAXLEN];
+} nexchat_command_args_t;
+
+const nexchat_command_info_t* nexchat_client_command_info(nexchat_client_command_t cmd);
+const char* nexchat_client_command_to_str(nexchat_client_command_t cmd);
+const char* nexchat_client_command_get_desc(nexchat_client_command_t cmd);
+
+// O(1) lookup of `name` (without the leading '/'), CMD_NONE when it isn't a command
+nexchat_client_command_t nexchat_client_command_lookup(const char* name, size_t len);
+
+// what nexchat_command_tokenize returns when it fails
+#define NEXCHAT_COMMAND_MALFORMED -1 // an unterminated quote
+#define NEXCHAT_COMMAND_TOO_LONG  -2 // the words don't fit in NEXCHAT_COMMAND_MAXLEN
+#define NEXCHAT_COMMAND_TOO_MANY  -3 // more than NEXCHAT_COMMAND_MAXARGS words, the first ones are in `args`
+
+// splits `line` on whitespace into `args`, double quotes group words containing spaces.
+// returns 0 or one of the errors above
+int32_t nexchat_command_tokenize(const char* line, nexchat_command_args_t* args);
@@ -0,0 +1,1363 @@
+#include "federation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include "server.h"
+
+#define FEDERATION_MAXEVENTS 64
+
+static void nexchat_federation_put_u16(uint8_t* dst, uint16_t value)
+{
+    dst[0] = (uint8_t)(value >> 8);
+    dst[1] = (uint8_t)value;
+}
+
+static void nexchat_federation_put_u64(uint8_t* dst, uint64_t value)
+{
+    for (int32_t i = 7; i >= 0; i--)
+    {
+        *dst++ = (uint8_t)(value >> (i * 8));
+    }
+}
+
+static uint16_t nexchat_federation_get_u16(const uint8_t* src)
+{
+    return (uint16_t)((src[0] << 8) | src[1]);
+}
+
+static uint64_t nexchat_federation_get_u64(const uint8_t* src)
+{
+    uint64_t value = 0;
+    for (int32_t i = 0; i < 8; i++)
+    {
+        value = (value << 8) | src[i];
+    }
+
+    return value;
+}
+
+// a record as it sits in a frame, `a` and `b` point into the frame
+typedef struct nexchat_relay_record_t
+{
+    nexchat_relay_kind_t kind;
+    uint8_t hops;
+    uint64_t origin;
+    uint64_t seq;
+    const char* a;
+    size_t alen;
+    const char* b;
+    size_t blen;
+} nexchat_relay_record_t;
+
+static const char* nexchat_federation_peer_name(const nexchat_federation_peer_t* peer, char* out, size_t size)
+{
+    if (peer->address != NULL)
+    {
+        snprintf(out, size, "%s", peer->address);
+    }
+    else
+    {
+        snprintf(out, size, "server %016llx", (unsigned long long)peer->node);
+    }
+
+    return out;
+}
+
+static bool nexchat_federation_peer_up(const nexchat_federation_peer_t* peer)
+{
+    return peer->sockfd != -1 && !peer->connecting;
+}
+
+static int32_t nexchat_federation_seal(nexchat_federation_t* fed, nexchat_federation_peer_t* peer)
+{
+    size_t readable = nexchat_buffer_readable(&peer->batch);
+    if (readable <= NEXCHAT_FRAME_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    // the header space was reserved when the first record went in
+    uint8_t* frame = nexchat_buffer_head(&peer->batch);
+    nexchat_frame_write_header(frame, FRAME_RELAY, (uint32_t)(readable - NEXCHAT_FRAME_HEADER_SIZE));
+
+    nexchat_msgbuf_t* msg = nexchat_msgbuf_create(frame, readable);
+    nexchat_buffer_clear(&peer->batch);
+
+    if (msg == NULL || nexchat_outqueue_push(&peer->outqueue, msg) == -1)
+    {
+        if (msg != NULL)
+        {
+            nexchat_msgbuf_release(msg);
+        }
+
+        return -1;
+    }
+
+    nexchat_msgbuf_release(msg);
+    __atomic_store_n(&fed->frames_out, fed->frames_out + 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static void nexchat_federation_append(nexchat_federation_t* fed, nexchat_federation_peer_t* peer, const nexchat_relay_record_t* record)
+{
+    size_t size = RELAY_RECORD_HEADER + record->alen + record->blen;
+    if (size > NEXCHAT_FRAME_MAX_PAYLOAD)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "federation: dropping a %zu byte record, too large to relay", size);
+        return;
+    }
+
+    // a full batch goes out as its own frame, the next one starts behind a fresh header
+    if (nexchat_buffer_readable(&peer->batch) + size > NEXCHAT_FRAME_HEADER_SIZE + NEXCHAT_FRAME_MAX_PAYLOAD &&
+        nexchat_federation_seal(fed, peer) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory relaying a record");
+        return;
+    }
+
+    bool empty = nexchat_buffer_readable(&peer->batch) == 0;
+    if (nexchat_buffer_reserve(&peer->batch, size + (empty ? NEXCHAT_FRAME_HEADER_SIZE : 0)) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory relaying a record");
+        return;
+    }
+
+    if (empty)
+    {
+        nexchat_buffer_commit(&peer->batch, NEXCHAT_FRAME_HEADER_SIZE);
+    }
+
+    uint8_t* dst = nexchat_buffer_tail(&peer->batch);
+    dst[0] = (uint8_t)record->kind;
+    dst[1] = record->hops;
+    nexchat_federation_put_u64(dst + 2, record->origin);
+    nexchat_federation_put_u64(dst + 10, record->seq);
+    nexchat_federation_put_u16(dst + 18, (uint16_t)record->alen);
+    nexchat_federation_put_u16(dst + 20 + record->alen, (uint16_t)record->blen);
+
+    if (record->alen > 0)
+    {
+        memcpy(dst + 20, record->a, record->alen);
+    }
+
+    if (record->blen > 0)
+    {
+        memcpy(dst + 22 + record->alen, record->b, record->blen);
+    }
+    nexchat_buffer_commit(&peer->batch, size);
+}
+
+// to every link that has said hello, except the one the record came in on
+static void nexchat_federation_flood(nexchat_federation_t* fed, const nexchat_relay_record_t* record, const nexchat_federation_peer_t* from)
+{
+    for (size_t i = 0; i < fed->peer_count; i++)
+    {
+        nexchat_federation_peer_t* peer = fed->peers[i];
+
+        if (peer != from && peer->node != 0 && nexchat_federation_peer_up(peer))
+        {
+            nexchat_federation_append(fed, peer, record);
+            __atomic_store_n(&fed->records_out, fed->records_out + 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// stamps a record that starts on this server and floods it
+static void nexchat_federation_originate(nexchat_federation_t* fed, nexchat_relay_kind_t kind, const char* a, size_t alen, const char* b, size_t blen)
+{
+    nexchat_relay_record_t record = {
+        .kind = kind, .hops = 0, .origin = fed->node, .seq = ++fed->seq,
+        .a = a, .alen = alen, .b = b, .blen = blen,
+    };
+
+    nexchat_federation_flood(fed, &record, NULL);
+}
+
+static void nexchat_federation_send_snapshot(nexchat_federation_t* fed)
+{
+    nexchat_server_state_t* state = fed->server;
+
+    // copied out under the writer lock, the names are relayed after it is released
+    pthread_mutex_lock(&state->roster.writer);
+
+    const nexchat_roster_snapshot_t* roster = state->roster.current;
+    size_t count = 0;
+    char (*names)[64] = (char (*)[64])malloc((roster->count > 0 ? roster->count : 1) * sizeof(*names));
+
+    for (size_t b = 0; names != NULL && b <= roster->bucket_mask; b++)
+    {
+        const nexchat_roster_bucket_t* bucket = roster->buckets[b];
+        for (size_t i = 0; bucket != NULL && i < bucket->count; i++)
+        {
+            if (bucket->entries[i]->client != NULL)
+            {
+                memcpy(names[count++], bucket->entries[i]->username, sizeof(names[0]));
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&state->roster.writer);
+
+    if (names == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory listing users");
+        return;
+    }
+
+    nexchat_federation_originate(fed, RELAY_SNAPSHOT, NULL, 0, NULL, 0);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        nexchat_federation_originate(fed, RELAY_JOIN, names[i], strlen(names[i]), NULL, 0);
+    }
+
+    nexchat_federation_originate(fed, RELAY_SNAPSHOT_END, NULL, 0, NULL, 0);
+
+    free(names);
+}
+
+static void nexchat_federation_add_user(nexchat_federation_t* fed, const char* username, uint64_t node, uint64_t seq)
+{
+    nexchat_server_state_t* state = fed->server;
+    pthread_mutex_lock(&state->roster.writer);
+
+    nexchat_roster_entry_t* entry = nexchat_roster_find(state->roster.current, username);
+    uint64_t version = 0;
+
+    if (entry == NULL)
+    {
+        entry = nexchat_roster_entry_create_remote(username, node);
+        if (entry != NULL)
+        {
+            entry->listed = seq;
+        }
+
+        if (entry == NULL || nexchat_roster_update(&state->roster, NULL, entry) == -1)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory indexing username '%s'", username);
+            free(entry);
+        }
+        else
+        {
+            version = state->roster.current->version;
+        }
+    }
+    else if (entry->node == node)
+    {
+        // listed again by a snapshot, it stays
+        entry->listed = seq;
+    }
+    else
+    {
+        // both servers handed the name out before hearing of each other, each keeps its own
+        nexchat_log(NEXCHAT_LOG_WARN, "federation: username '%s' is in use on server %016llx as well", username, (unsigned long long)node);
+    }
+
+    pthread_mutex_unlock(&state->roster.writer);
+
+    if (version != 0)
+    {
+        nexchat_server_publish_presence(state, NULL, nexchat_server_encode_presence("+%llu %s", (unsigned long long)version, username));
+    }
+}
+
+static void nexchat_federation_remove_user(nexchat_federation_t* fed, const char* username, uint64_t node)
+{
+    nexchat_server_state_t* state = fed->server;
+    pthread_mutex_lock(&state->roster.writer);
+
+    nexchat_roster_entry_t* entry = nexchat_roster_find(state->roster.current, username);
+    bool listed = entry != NULL && entry->client == NULL && entry->node == node;
+
+    if (listed && nexchat_roster_update(&state->roster, entry, NULL) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory unlisting '%s'", username);
+        listed = false;
+    }
+
+    uint64_t version = state->roster.current->version;
+    pthread_mutex_unlock(&state->roster.writer);
+
+    if (listed)
+    {
+        nexchat_server_publish_presence(state, NULL, nexchat_server_encode_presence("-%llu %s", (unsigned long long)version, username));
+    }
+}
+
+static void nexchat_federation_rename_user(nexchat_federation_t* fed, const char* username, const char* newname, uint64_t node, uint64_t seq)
+{
+    nexchat_server_state_t* state = fed->server;
+    pthread_mutex_lock(&state->roster.writer);
+
+    nexchat_roster_entry_t* entry = nexchat_roster_find(state->roster.current, username);
+    bool listed = entry != NULL && entry->client == NULL && entry->node == node;
+    nexchat_roster_entry_t* renamed = NULL;
+
+    // one update and one presence event, unless the new name collides with another user
+    if (listed && nexchat_roster_find(state->roster.current, newname) == NULL)
+    {
+        renamed = nexchat_roster_entry_create_remote(newname, node);
+        if (renamed != NULL)
+        {
+            renamed->listed = seq;
+        }
+
+        if (renamed == NULL || nexchat_roster_update(&state->roster, entry, renamed) == -1)
+        {
+            free(renamed);
+            renamed = NULL;
+        }
+    }
+
+    uint64_t version = state->roster.current->version;
+    pthread_mutex_unlock(&state->roster.writer);
+
+    if (renamed == NULL)
+    {
+        nexchat_federation_remove_user(fed, username, node);
+        nexchat_federation_add_user(fed, newname, node, seq);
+        return;
+    }
+
+    nexchat_server_publish_presence(state, NULL, nexchat_server_encode_presence("~%llu %s\n%s", (unsigned long long)version, username, newname));
+}
+
+// drops the users of `node` listed before `listed`, UINT64_MAX for all of them
+static void nexchat_federation_remove_node(nexchat_federation_t* fed, uint64_t node, uint64_t listed)
+{
+    nexchat_server_state_t* state = fed->server;
+
+    pthread_mutex_lock(&state->roster.writer);
+
+    // the names go out as presence events once the lock is released
+    const nexchat_roster_snapshot_t* roster = state->roster.current;
+    size_t count = 0;
+    char (*names)[64] = (char (*)[64])malloc((roster->count > 0 ? roster->count : 1) * sizeof(*names));
+
+    for (size_t b = 0; names != NULL && b <= roster->bucket_mask; b++)
+    {
+        const nexchat_roster_bucket_t* bucket = roster->buckets[b];
+        for (size_t i = 0; bucket != NULL && i < bucket->count; i++)
+        {
+            const nexchat_roster_entry_t* entry = bucket->entries[i];
+
+            if (entry->client == NULL && entry->node == node && entry->listed < listed)
+            {
+                memcpy(names[count++], entry->username, sizeof(names[0]));
+            }
+        }
+    }
+
+    int32_t removed = nexchat_roster_remove_node(&state->roster, node, listed);
+    uint64_t version = state->roster.current->version;
+    pthread_mutex_unlock(&state->roster.writer);
+
+    if (removed == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory unlisting the users of server %016llx", (unsigned long long)node);
+    }
+    else if (names == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory listing the users of server %016llx, presence events are lost", (unsigned long long)node);
+    }
+
+    for (size_t i = 0; removed > 0 && i < count; i++)
+    {
+        nexchat_server_publish_presence(state, NULL, nexchat_server_encode_presence("-%llu %s", (unsigned long long)version, names[i]));
+    }
+
+    free(names);
+}
+
+// hands a relayed text frame to every shard with members in the room, like a broadcast from another shard
+static void nexchat_federation_deliver(nexchat_federation_t* fed, const char* roomname, const char* text, size_t len, bool chat)
+{
+    nexchat_server_state_t* state = fed->server;
+
+    nexchat_buffer_clear(&fed->scratch);
+    if (nexchat_frame_encode(&fed->scratch, FRAME_TEXT, text, len) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: failed to encode relayed message");
+        return;
+    }
+
+    nexchat_msgbuf_t* shared = nexchat_msgbuf_create(nexchat_buffer_head(&fed->scratch), nexchat_buffer_readable(&fed->scratch));
+    if (shared == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory delivering relayed message");
+        return;
+    }
+
+    // every server keeps the history of the whole chat, rooms without local members included
+    if (chat && state->logging)
+    {
+        nexchat_msglog_append(&state->log, roomname, shared);
+    }
+
+    // held while posting, the last local member may leave meanwhile
+    pthread_mutex_lock(&state->rooms_mutex);
+    nexchat_room_t* room = (nexchat_room_t*)nexchat_strmap_get(&state->rooms, roomname);
+    if (room != NULL)
+    {
+        nexchat_room_retain(room);
+    }
+    pthread_mutex_unlock(&state->rooms_mutex);
+
+    for (size_t i = 0; room != NULL && i < state->shard_count; i++)
+    {
+        if (nexchat_room_count_on(room, i) == 0)
+        {
+            continue;
+        }
+
+        nexchat_shard_msg_t* post = (nexchat_shard_msg_t*)nexchat_pool_alloc(sizeof(nexchat_shard_msg_t));
+        if (post == NULL)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory relaying broadcast to worker %zu", i);
+            continue;
+        }
+
+        memset(post, 0, sizeof(nexchat_shard_msg_t));
+        post->type = SHARD_MSG_BROADCAST;
+        post->msg = nexchat_msgbuf_retain(shared);
+        post->room = nexchat_room_retain(room);
+        nexchat_server_post(&state->shards[i], post);
+    }
+
+    if (room != NULL)
+    {
+        nexchat_room_release(room);
+    }
+
+    nexchat_msgbuf_release(shared);
+}
+
+static nexchat_federation_node_t* nexchat_federation_find_node(nexchat_federation_t* fed, uint64_t node)
+{
+    for (size_t i = 0; i < fed->node_count; i++)
+    {
+        if (fed->nodes[i].node == node)
+        {
+            return &fed->nodes[i];
+        }
+    }
+
+    return NULL;
+}
+
+static nexchat_federation_node_t* nexchat_federation_add_node(nexchat_federation_t* fed, uint64_t node)
+{
+    if (fed->node_count == fed->node_capacity)
+    {
+        size_t capacity = fed->node_capacity > 0 ? fed->node_capacity * 2 : 16;
+        nexchat_federation_node_t* nodes = (nexchat_federation_node_t*)realloc(fed->nodes, capacity * sizeof(nexchat_federation_node_t));
+        if (nodes == NULL)
+        {
+            return NULL;
+        }
+
+        fed->nodes = nodes;
+        fed->node_capacity = capacity;
+    }
+
+    nexchat_federation_node_t* entry = &fed->nodes[fed->node_count];
+    entry->node = node;
+    entry->seq = 0;
+    entry->snapshot = 0;
+    entry->heard_ns = nexchat_clock_now_ns();
+    __atomic_store_n(&fed->node_count, fed->node_count + 1, __ATOMIC_RELAXED);
+
+    return entry;
+}
+
+static void nexchat_federation_apply(nexchat_federation_t* fed, nexchat_federation_node_t* origin, const nexchat_relay_record_t* record)
+{
+    char a[64];
+    char b[64];
+    snprintf(a, sizeof a, "%.*s", (int)record->alen, record->a);
+    snprintf(b, sizeof b, "%.*s", (int)(record->kind == RELAY_RENAME ? record->blen : 0), record->b);
+
+    switch (record->kind)
+    {
+        case RELAY_CHAT:
+        case RELAY_NOTICE:
+        {
+            nexchat_federation_deliver(fed, a, record->b, record->blen, record->kind == RELAY_CHAT);
+        } break;
+        case RELAY_JOIN:
+        {
+            nexchat_federation_add_user(fed, a, record->origin, record->seq);
+        } break;
+        case RELAY_LEAVE:
+        {
+            nexchat_federation_remove_user(fed, a, record->origin);
+        } break;
+        case RELAY_RENAME:
+        {
+            nexchat_federation_rename_user(fed, a, b, record->origin, record->seq);
+        } break;
+        case RELAY_SNAPSHOT:
+        {
+            origin->snapshot = record->seq;
+        } break;
+        case RELAY_SNAPSHOT_END:
+        {
+            nexchat_federation_remove_node(fed, record->origin, origin->snapshot);
+        } break;
+        case RELAY_RESYNC:
+        {
+            char self[17];
+            snprintf(self, sizeof self, "%016llx", (unsigned long long)fed->node);
+
+            if (record->alen == 0 || strcmp(a, self) == 0)
+            {
+                nexchat_federation_send_snapshot(fed);
+            }
+        } break;
+        default:
+            break;
+    }
+}
+
+static void nexchat_federation_hello(nexchat_federation_t* fed, nexchat_federation_peer_t* peer)
+{
+    nexchat_relay_record_t hello = {.kind = RELAY_HELLO, .origin = fed->node};
+    nexchat_federation_append(fed, peer, &hello);
+}
+
+static void nexchat_federation_drop(nexchat_federation_t* fed, nexchat_federation_peer_t* peer, const char* reason)
+{
+    char name[128];
+
+    if (peer->node != 0 || peer->address == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_INFO, "federation: link to %s closed, %s", nexchat_federation_peer_name(peer, name, sizeof name), reason);
+    }
+
+    if (peer->up)
+    {
+        __atomic_store_n(&fed->links_up, fed->links_up - 1, __ATOMIC_RELAXED);
+    }
+
+    // the users behind it stay until their servers go quiet, other links may still reach them
+    epoll_ctl(fed->epollfd, EPOLL_CTL_DEL, peer->sockfd, NULL);
+    close(peer->sockfd);
+    nexchat_frame_decoder_free(&peer->decoder);
+    nexchat_outqueue_free(&peer->outqueue);
+    nexchat_buffer_free(&peer->batch);
+
+    peer->sockfd = -1;
+    peer->connecting = false;
+    peer->node = 0;
+    peer->up = false;
+    peer->retry_ns = nexchat_clock_now_ns() + FEDERATION_RETRY_MS * 1000000ull;
+}
+
+static int32_t nexchat_federation_receive(nexchat_federation_t* fed, nexchat_federation_peer_t* peer, const nexchat_frame_t* frame)
+{
+    const uint8_t* data = (const uint8_t*)frame->payload;
+    size_t offset = 0;
+
+    while (offset < frame->size)
+    {
+        if (frame->size - offset < RELAY_RECORD_HEADER)
+        {
+            return -1;
+        }
+
+        nexchat_relay_record_t record;
+        record.kind = (nexchat_relay_kind_t)data[offset];
+        record.hops = data[offset + 1];
+        record.origin = nexchat_federation_get_u64(data + offset + 2);
+        record.seq = nexchat_federation_get_u64(data + offset + 10);
+        record.alen = nexchat_federation_get_u16(data + offset + 18);
+
+        if (frame->size - offset < RELAY_RECORD_HEADER + record.alen)
+        {
+            return -1;
+        }
+
+        record.a = (const char*)data + offset + 20;
+        record.blen = nexchat_federation_get_u16(data + offset + 20 + record.alen);
+        record.b = (const char*)data + offset + 22 + record.alen;
+        offset += RELAY_RECORD_HEADER + record.alen;
+
+        if (frame->size - offset < record.blen || record.kind == RELAY_NONE || record.kind >= RELAY_MAXKINDS ||
+            record.alen >= 64 || record.origin == 0)
+        {
+            return -1;
+        }
+
+        offset += record.blen;
+
+        // texts arrive as frame payloads and are delivered as they are
+        if ((record.kind == RELAY_CHAT || record.kind == RELAY_NOTICE) &&
+            (record.alen >= ROOM_NAME_MAX || record.blen == 0 || record.b[record.blen - 1] != '\0'))
+        {
+            return -1;
+        }
+
+        if ((record.kind == RELAY_JOIN || record.kind == RELAY_LEAVE || record.kind == RELAY_RENAME) && record.alen == 0)
+        {
+            return -1;
+        }
+
+        if (record.kind == RELAY_RENAME && (record.blen == 0 || record.blen >= 64))
+        {
+            return -1;
+        }
+
+        __atomic_store_n(&fed->records_in, fed->records_in + 1, __ATOMIC_RELAXED);
+
+        if (record.kind == RELAY_HELLO)
+        {
+            char name[128];
+
+            if (record.origin == fed->node)
+            {
+                // a --link pointing back at this server, there's no use in dialing it again
+                nexchat_log(NEXCHAT_LOG_WARN, "federation: %s is this server, not linking to it", nexchat_federation_peer_name(peer, name, sizeof name));
+                peer->address = NULL;
+                nexchat_federation_drop(fed, peer, "it is this server");
+                return -1;
+            }
+
+            // a peer that says hello again is already linked and already resynced
+            if (peer->up)
+            {
+                continue;
+            }
+
+            peer->node = record.origin;
+            peer->up = true;
+            __atomic_store_n(&fed->links_up, fed->links_up + 1, __ATOMIC_RELAXED);
+            if (peer->address != NULL)
+            {
+                nexchat_log(NEXCHAT_LOG_INFO, "federation: linked to %s, server %016llx", peer->address, (unsigned long long)peer->node);
+            }
+            else
+            {
+                nexchat_log(NEXCHAT_LOG_INFO, "federation: linked to %s", nexchat_federation_peer_name(peer, name, sizeof name));
+            }
+
+            // whatever either side missed while apart, every server lists its users again
+            nexchat_federation_originate(fed, RELAY_RESYNC, NULL, 0, NULL, 0);
+            nexchat_federation_send_snapshot(fed);
+            continue;
+        }
+
+        if (peer->node == 0)
+        {
+            return -1;
+        }
+
+        if (record.origin == fed->node)
+        {
+            continue;
+        }
+
+        nexchat_federation_node_t* origin = nexchat_federation_find_node(fed, record.origin);
+        if (origin != NULL && record.seq <= origin->seq)
+        {
+            continue;
+        }
+
+        if (origin == NULL)
+        {
+            origin = nexchat_federation_add_node(fed, record.origin);
+            if (origin == NULL)
+            {
+                nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory tracking server %016llx", (unsigned long long)record.origin);
+                continue;
+            }
+
+            // its users may have come and gone before we heard of it, ask for them. A resync or
+            // snapshot from it is followed by that list anyway
+            if (record.kind != RELAY_RESYNC && record.kind != RELAY_SNAPSHOT)
+            {
+                char target[17];
+                snprintf(target, sizeof target, "%016llx", (unsigned long long)record.origin);
+                nexchat_federation_originate(fed, RELAY_RESYNC, target, 16, NULL, 0);
+            }
+        }
+
+        origin->seq = record.seq;
+        origin->heard_ns = nexchat_clock_now_ns();
+
+        nexchat_federation_apply(fed, origin, &record);
+
+        if (record.hops + 1 < FEDERATION_MAX_HOPS)
+        {
+            record.hops++;
+            nexchat_federation_flood(fed, &record, peer);
+        }
+    }
+
+    return 0;
+}
+
+static void nexchat_federation_read(nexchat_federation_t* fed, nexchat_federation_peer_t* peer)
+{
+    while (peer->sockfd != -1)
+    {
+        size_t space = 0;
+        uint8_t* dst = nexchat_frame_decoder_prepare(&peer->decoder, &space);
+        if (dst == NULL)
+        {
+            nexchat_federation_drop(fed, peer, "out of memory");
+            return;
+        }
+
+        ssize_t received = recv(peer->sockfd, dst, space, 0);
+
+        if (received == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                nexchat_federation_drop(fed, peer, strerror(errno));
+            }
+
+            return;
+        }
+
+        if (received == 0)
+        {
+            nexchat_federation_drop(fed, peer, "closed by the other side");
+            return;
+        }
+
+        nexchat_frame_decoder_commit(&peer->decoder, (size_t)received);
+
+        nexchat_frame_t frame;
+        int32_t status = 0;
+
+        while ((status = nexchat_frame_decoder_next(&peer->decoder, &frame)) == 1)
+        {
+            if (frame.type != FRAME_RELAY || nexchat_federation_receive(fed, peer, &frame) == -1)
+            {
+                status = -1;
+                break;
+            }
+        }
+
+        if (status == -1)
+        {
+            if (peer->sockfd != -1)
+            {
+                nexchat_federation_drop(fed, peer, "malformed relay frame");
+            }
+
+            return;
+        }
+    }
+}
+
+static void nexchat_federation_flush(nexchat_federation_t* fed, nexchat_federation_peer_t* peer)
+{
+    if (nexchat_federation_seal(fed, peer) == -1)
+    {
+        nexchat_federation_drop(fed, peer, "out of memory");
+        return;
+    }
+
+    if (nexchat_outqueue_flush(&peer->outqueue, peer->sockfd) == -1)
+    {
+        nexchat_federation_drop(fed, peer, strerror(errno));
+        return;
+    }
+
+    if (peer->outqueue.bytes > FEDERATION_MAX_QUEUED)
+    {
+        nexchat_federation_drop(fed, peer, "it is not keeping up");
+    }
+}
+
+static int32_t nexchat_federation_link_up(nexchat_federation_t* fed, nexchat_federation_peer_t* peer)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = peer;
+
+    if (epoll_ctl(fed->epollfd, EPOLL_CTL_ADD, peer->sockfd, &ev) == -1)
+    {
+        nexchat_log_errno("federation: epoll_ctl");
+        return -1;
+    }
+
+    nexchat_socket_set_nodelay(peer->sockfd, true);
+    nexchat_frame_decoder_init(&peer->decoder);
+    nexchat_outqueue_init(&peer->outqueue);
+    nexchat_buffer_init(&peer->batch, 1024);
+    peer->node = 0;
+    peer->up = false;
+
+    nexchat_federation_hello(fed, peer);
+
+    return 0;
+}
+
+static void nexchat_federation_dial(nexchat_federation_t* fed, nexchat_federation_peer_t* peer)
+{
+    peer->retry_ns = nexchat_clock_now_ns() + FEDERATION_RETRY_MS * 1000000ull;
+
+    // host:port, the last colon splits them so bracketless ipv6 hosts still work
+    char host[256];
+    const char* colon = strrchr(peer->address, ':');
+    if (colon == NULL || (size_t)(colon - peer->address) >= sizeof host)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: invalid link '%s', expected host:port", peer->address);
+        peer->address = NULL;
+        return;
+    }
+
+    snprintf(host, sizeof host, "%.*s", (int)(colon - peer->address), peer->address);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0 || res == NULL)
+    {
+        return;
+    }
+
+    int32_t sockfd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, res->ai_protocol);
+    if (sockfd == -1)
+    {
+        nexchat_log_errno("federation: socket");
+        freeaddrinfo(res);
+        return;
+    }
+
+    int32_t status = connect(sockfd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+
+    if (status == -1 && errno != EINPROGRESS)
+    {
+        close(sockfd);
+        return;
+    }
+
+    // the hello is queued now and written once the connect completes
+    peer->sockfd = sockfd;
+    peer->connecting = status == -1;
+
+    if (nexchat_federation_link_up(fed, peer) == -1)
+    {
+        close(sockfd);
+        peer->sockfd = -1;
+        peer->connecting = false;
+    }
+}
+
+static void nexchat_federation_connected(nexchat_federation_t* fed, nexchat_federation_peer_t* peer)
+{
+    int32_t error = 0;
+    socklen_t len = sizeof error;
+
+    if (getsockopt(peer->sockfd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+    {
+        // nobody listening yet, try again on a later tick without a word
+        nexchat_federation_drop(fed, peer, error != 0 ? strerror(error) : "connect failed");
+        return;
+    }
+
+    peer->connecting = false;
+}
+
+static void nexchat_federation_accept(nexchat_federation_t* fed)
+{
+    while (true)
+    {
+        int32_t sockfd = accept(fed->listenfd, NULL, NULL);
+        if (sockfd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                nexchat_log_errno("federation: accept");
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return;
+        }
+
+        if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) == -1)
+        {
+            nexchat_log_errno("federation: fcntl");
+            close(sockfd);
+            continue;
+        }
+
+        if (fed->peer_count == FEDERATION_MAX_PEERS)
+        {
+            nexchat_log(NEXCHAT_LOG_WARN, "federation: refusing link, %d are up already", FEDERATION_MAX_PEERS);
+            close(sockfd);
+            continue;
+        }
+
+        nexchat_federation_peer_t* peer = (nexchat_federation_peer_t*)calloc(1, sizeof(nexchat_federation_peer_t));
+        if (peer == NULL)
+        {
+            close(sockfd);
+            continue;
+        }
+
+        peer->sockfd = sockfd;
+
+        if (nexchat_federation_link_up(fed, peer) == -1)
+        {
+            close(sockfd);
+            free(peer);
+            continue;
+        }
+
+        fed->peers[fed->peer_count++] = peer;
+    }
+}
+
+static void nexchat_federation_drain_inbox(nexchat_federation_t* fed)
+{
+    uint64_t count = 0;
+    if (read(fed->eventfd, &count, sizeof count) == -1 && errno != EAGAIN)
+    {
+        nexchat_log_errno("federation: read");
+    }
+
+    nexchat_mpsc_node_t* node = nexchat_mpsc_take_all(&fed->inbox);
+
+    while (node != NULL)
+    {
+        nexchat_relay_event_t* event = (nexchat_relay_event_t*)node;
+        node = node->next;
+
+        switch (event->kind)
+        {
+            case RELAY_CHAT:
+            case RELAY_NOTICE:
+            {
+                // the frame payload as it is, NUL included
+                const char* text = (const char*)event->msg->data + NEXCHAT_FRAME_HEADER_SIZE;
+                size_t len = event->msg->size - NEXCHAT_FRAME_HEADER_SIZE;
+                nexchat_federation_originate(fed, event->kind, event->room, strlen(event->room), text, len);
+                nexchat_msgbuf_release(event->msg);
+            } break;
+            case RELAY_RENAME:
+            {
+                nexchat_federation_originate(fed, event->kind, event->username, strlen(event->username), event->newname, strlen(event->newname));
+            } break;
+            default:
+            {
+                nexchat_federation_originate(fed, event->kind, event->username, strlen(event->username), NULL, 0);
+            } break;
+        }
+
+        nexchat_pool_free(event);
+    }
+}
+
+static void nexchat_federation_tick(nexchat_federation_t* fed)
+{
+    uint64_t expirations = 0;
+    if (read(fed->timerfd, &expirations, sizeof expirations) == -1 && errno != EAGAIN)
+    {
+        nexchat_log_errno("federation: read");
+    }
+
+    uint64_t now = nexchat_clock_now_ns();
+
+    nexchat_federation_originate(fed, RELAY_HEARTBEAT, NULL, 0, NULL, 0);
+
+    for (size_t i = 0; i < fed->peer_count; i++)
+    {
+        nexchat_federation_peer_t* peer = fed->peers[i];
+
+        if (peer->sockfd == -1 && peer->address != NULL && now >= peer->retry_ns)
+        {
+            nexchat_federation_dial(fed, peer);
+        }
+    }
+
+    for (size_t i = 0; i < fed->node_count; )
+    {
+        nexchat_federation_node_t* node = &fed->nodes[i];
+
+        if (now - node->heard_ns < FEDERATION_NODE_TIMEOUT * 1000000ull)
+        {
+            i++;
+            continue;
+        }
+
+        nexchat_log(NEXCHAT_LOG_INFO, "federation: no word from server %016llx in %d ms, dropping its users", (unsigned long long)node->node, FEDERATION_NODE_TIMEOUT);
+        nexchat_federation_remove_node(fed, node->node, UINT64_MAX);
+
+        *node = fed->nodes[fed->node_count - 1];
+        __atomic_store_n(&fed->node_count, fed->node_count - 1, __ATOMIC_RELAXED);
+    }
+}
+
+// accepted links are forgotten once down, dialed ones stay to be dialed again
+static void nexchat_federation_reap(nexchat_federation_t* fed)
+{
+    for (size_t i = 0; i < fed->peer_count; )
+    {
+        nexchat_federation_peer_t* peer = fed->peers[i];
+
+        if (peer->sockfd != -1 || peer->address != NULL)
+        {
+            i++;
+            continue;
+        }
+
+        free(peer);
+        fed->peers[i] = fed->peers[--fed->peer_count];
+    }
+}
+
+static void* nexchat_federation_run(void* arg)
+{
+    nexchat_federation_t* fed = (nexchat_federation_t*)arg;
+    struct epoll_event events[FEDERATION_MAXEVENTS];
+
+    while (__atomic_load_n(&fed->running, __ATOMIC_ACQUIRE))
+    {
+        int32_t nevents = epoll_wait(fed->epollfd, events, FEDERATION_MAXEVENTS, -1);
+
+        if (nevents == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            nexchat_log_errno("federation: epoll_wait");
+            break;
+        }
+
+        for (int32_t i = 0; i < nevents; i++)
+        {
+            void* ptr = events[i].data.ptr;
+
+            if (ptr == &fed->listenfd)
+            {
+                nexchat_federation_accept(fed);
+                continue;
+            }
+
+            if (ptr == &fed->eventfd)
+            {
+                nexchat_federation_drain_inbox(fed);
+                continue;
+            }
+
+            if (ptr == &fed->timerfd)
+            {
+                nexchat_federation_tick(fed);
+                continue;
+            }
+
+            nexchat_federation_peer_t* peer = (nexchat_federation_peer_t*)ptr;
+
+            // dropped by an earlier event in this batch
+            if (peer->sockfd == -1)
+            {
+                continue;
+            }
+
+            if (peer->connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                nexchat_federation_connected(fed, peer);
+            }
+
+            if (nexchat_federation_peer_up(peer) && events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+            {
+                nexchat_federation_read(fed, peer);
+            }
+        }
+
+        // everything relayed during this wakeup leaves in one frame per link
+        for (size_t i = 0; i < fed->peer_count; i++)
+        {
+            nexchat_federation_peer_t* peer = fed->peers[i];
+
+            if (nexchat_federation_peer_up(peer))
+            {
+                nexchat_federation_flush(fed, peer);
+            }
+        }
+
+        nexchat_federation_reap(fed);
+    }
+
+    return NULL;
+}
+
+static int32_t nexchat_federation_listen(nexchat_federation_t* fed, const char* ipaddr)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo* res = NULL;
+    int32_t status = getaddrinfo(ipaddr, fed->config.port, &hints, &res);
+    if (status != 0)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "federation: getaddrinfo: %s", gai_strerror(status));
+        return -1;
+    }
+
+    for (struct addrinfo* it = res; it != NULL; it = it->ai_next)
+    {
+        int32_t sockfd = socket(it->ai_family, it->ai_socktype | SOCK_NONBLOCK, it->ai_protocol);
+        if (sockfd == -1)
+        {
+            continue;
+        }
+
+        int32_t yes = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+        if (bind(sockfd, it->ai_addr, it->ai_addrlen) == -1 || listen(sockfd, SOMAXCONN) == -1)
+        {
+            close(sockfd);
+            continue;
+        }
+
+        fed->listenfd = sockfd;
+        break;
+    }
+
+    freeaddrinfo(res);
+
+    if (fed->listenfd == -1)
+    {
+        nexchat_log_errno("federation: bind");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &fed->listenfd;
+
+    return epoll_ctl(fed->epollfd, EPOLL_CTL_ADD, fed->listenfd, &ev);
+}
+
+int32_t nexchat_federation_open(nexchat_federation_t* fed, nexchat_server_state_t* server, const nexchat_federation_config_t* config)
+{
+    memset(fed, 0, sizeof(nexchat_federation_t));
+    fed->server = server;
+    fed->config = *config;
+    fed->epollfd = -1;
+    fed->eventfd = -1;
+    fed->timerfd = -1;
+    fed->listenfd = -1;
+    nexchat_mpsc_init(&fed->inbox);
+    nexchat_buffer_init(&fed->scratch, 1024);
+
+    // a hot upgrade keeps the id and sequence, the other servers see one server reconnect.
+    // otherwise ids only need to differ between the servers of one federation, and between runs of one server
+    fed->node = config->node;
+    fed->seq = config->seq;
+
+    while (fed->node == 0)
+    {
+        if (getrandom(&fed->node, sizeof fed->node, 0) != sizeof fed->node)
+        {
+            fed->node = nexchat_clock_now_ns() ^ ((uint64_t)getpid() << 32);
+        }
+    }
+
+    fed->peers = (nexchat_federation_peer_t**)calloc(FEDERATION_MAX_PEERS, sizeof(nexchat_federation_peer_t*));
+    fed->peer_capacity = FEDERATION_MAX_PEERS;
+    fed->epollfd = epoll_create1(0);
+    fed->eventfd = eventfd(0, EFD_NONBLOCK);
+    fed->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+    if (fed->peers == NULL || fed->epollfd == -1 || fed->eventfd == -1 || fed->timerfd == -1)
+    {
+        nexchat_log_errno("federation");
+        nexchat_federation_close(fed);
+        return -1;
+    }
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = FEDERATION_HEARTBEAT_MS / 1000;
+    spec.it_interval.tv_nsec = (FEDERATION_HEARTBEAT_MS % 1000) * 1000000l;
+    spec.it_value = spec.it_interval;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &fed->eventfd;
+    int32_t status = epoll_ctl(fed->epollfd, EPOLL_CTL_ADD, fed->eventfd, &ev);
+
+    ev.data.ptr = &fed->timerfd;
+    if (status == -1 || timerfd_settime(fed->timerfd, 0, &spec, NULL) == -1 || epoll_ctl(fed->epollfd, EPOLL_CTL_ADD, fed->timerfd, &ev) == -1)
+    {
+        nexchat_log_errno("federation");
+        nexchat_federation_close(fed);
+        return -1;
+    }
+
+    if (config->port != NULL && nexchat_federation_listen(fed, server->config.ipaddr) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: failed to listen on port %s", config->port);
+        nexchat_federation_close(fed);
+        return -1;
+    }
+
+    for (size_t i = 0; i < config->link_count && fed->peer_count < FEDERATION_MAX_PEERS; i++)
+    {
+        nexchat_federation_peer_t* peer = (nexchat_federation_peer_t*)calloc(1, sizeof(nexchat_federation_peer_t));
+        if (peer == NULL)
+        {
+            nexchat_federation_close(fed);
+            return -1;
+        }
+
+        peer->address = config->links[i];
+        peer->sockfd = -1;
+        fed->peers[fed->peer_count++] = peer;
+        nexchat_federation_dial(fed, peer);
+    }
+
+    fed->running = true;
+
+    if (pthread_create(&fed->thread, NULL, nexchat_federation_run, fed) != 0)
+    {
+        fed->running = false;
+        nexchat_federation_close(fed);
+        return -1;
+    }
+
+    nexchat_log(NEXCHAT_LOG_INFO, "federation: server %016llx, %s%s, %zu link(s) to dial", (unsigned long long)fed->node,
+           config->port != NULL ? "accepting links on port " : "not accepting links", config->port != NULL ? config->port : "", config->link_count);
+
+    return 0;
+}
+
+void nexchat_federation_close(nexchat_federation_t* fed)
+{
+    if (fed->running)
+    {
+        __atomic_store_n(&fed->running, false, __ATOMIC_RELEASE);
+
+        uint64_t one = 1;
+        if (write(fed->eventfd, &one, sizeof one) == -1)
+        {
+            nexchat_log_errno("federation: write");
+        }
+
+        pthread_join(fed->thread, NULL);
+    }
+
+    for (size_t i = 0; i < fed->peer_count; i++)
+    {
+        nexchat_federation_peer_t* peer = fed->peers[i];
+
+        if (peer->sockfd != -1)
+        {
+            close(peer->sockfd);
+            nexchat_frame_decoder_free(&peer->decoder);
+            nexchat_outqueue_free(&peer->outqueue);
+            nexchat_buffer_free(&peer->batch);
+        }
+
+        free(peer);
+    }
+
+    nexchat_mpsc_node_t* node = nexchat_mpsc_take_all(&fed->inbox);
+    while (node != NULL)
+    {
+        nexchat_relay_event_t* event = (nexchat_relay_event_t*)node;
+        node = node->next;
+
+        if (event->msg != NULL)
+        {
+            nexchat_msgbuf_release(event->msg);
+        }
+
+        nexchat_pool_free(event);
+    }
+
+    if (fed->listenfd != -1) close(fed->listenfd);
+    if (fed->timerfd != -1) close(fed->timerfd);
+    if (fed->eventfd != -1) close(fed->eventfd);
+    if (fed->epollfd != -1) close(fed->epollfd);
+
+    free(fed->peers);
+    free(fed->nodes);
+    nexchat_buffer_free(&fed->scratch);
+
+    // a hot upgrade hands these to the new process once the thread is gone
+    uint64_t id = fed->node;
+    uint64_t seq = fed->seq;
+    memset(fed, 0, sizeof(nexchat_federation_t));
+    fed->node = id;
+    fed->seq = seq;
+}
+
+void nexchat_federation_relay(nexchat_federation_t* fed, nexchat_relay_kind_t kind, const char* room, nexchat_msgbuf_t* msg,
+                              const char* username, const char* newname)
+{
+    nexchat_relay_event_t* event = (nexchat_relay_event_t*)nexchat_pool_alloc(sizeof(nexchat_relay_event_t));
+    if (event == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "federation: out of memory relaying to other servers");
+        return;
+    }
+
+    memset(event, 0, sizeof(nexchat_relay_event_t));
+    event->kind = kind;
+    event->msg = msg != NULL ? nexchat_msgbuf_retain(msg) : NULL;
+    snprintf(event->room, sizeof event->room, "%s", room != NULL ? room : "");
+    snprintf(event->username, sizeof event->username, "%s", username != NULL ? username : "");
+    snprintf(event->newname, sizeof event->newname, "%s", newname != NULL ? newname : "");
+
+    // only the push that finds the inbox empty needs to wake the thread
+    if (nexchat_mpsc_push(&fed->inbox, &event->node))
+    {
+        uint64_t one = 1;
+        if (write(fed->eventfd, &one, sizeof one) == -1 && errno != EAGAIN)
+        {
+            nexchat_log_errno("federation: write");
+        }
+    }
+}
+
+size_t nexchat_federation_format(nexchat_federation_t* fed, char* out, size_t size)
+{
+    int32_t written = snprintf(out, size, "server %016llx, %llu link(s) up, %zu server(s) heard, %llu records in, %llu out in %llu frames",
+                               (unsigned long long)fed->node,
+                               (unsigned long long)__atomic_load_n(&fed->links_up, __ATOMIC_RELAXED),
+                               __atomic_load_n(&fed->node_count, __ATOMIC_RELAXED),
+                               (unsigned long long)__atomic_load_n(&fed->records_in, __ATOMIC_RELAXED),
+                               (unsigned long long)__atomic_load_n(&fed->records_out, __ATOMIC_RELAXED),
+                               (unsigned long long)__atomic_load_n(&fed->frames_out, __ATOMIC_RELAXED));
+
+    return written < 0 ? 0 : (size_t)written < size ? (size_t)written : size - 1;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "libcommon/libcommon.h"
+
+#include "rooms.h"
+
+#define FEDERATION_MAX_LINKS    16               // --link may be given this many times
+#define FEDERATION_MAX_PEERS    64               // links up at once, dialed and accepted
+#define FEDERATION_RETRY_MS     1000             // between attempts to (re)dial a --link
+#define FEDERATION_HEARTBEAT_MS 1000             // every server floods one this often
+#define FEDERATION_NODE_TIMEOUT 5000             // ms without hearing from a server before its users are dropped
+#define FEDERATION_MAX_HOPS     32               // records are flooded no further, a backstop for the dedup below
+#define FEDERATION_MAX_QUEUED   (16 * 1024 * 1024) // unwritten bytes on a link before it is dropped
+
+// Server to server links. Servers peer over TCP and flood each other with records describing
+// what their own clients do, so users spread over several processes see one chat.
+//
+// Every record is stamped with the id of the server it started on (its origin) and a sequence
+// number that origin increments per record. A server applies and forwards a record only if its
+// sequence is newer than the last one seen from that origin, and never back over the link it
+// came from, so records can't loop however the servers are linked. Links are FIFO, so whichever
+// path a record takes first, every earlier record of its origin has already arrived.
+//
+// Records are batched: everything a server relays during one wakeup of the federation thread
+// leaves in one FRAME_RELAY frame per link. A frame's payload is a run of records:
+//
+//   [u8 kind][u8 hops][u64 origin][u64 seq][u16 a length][a][u16 b length][b]
+//
+// integers big-endian. `a` and `b` depend on the kind, see nexchat_relay_kind_t.
+//
+// Users on other servers are kept in the roster with the id of their server, so /users and
+// username checks see the whole federation. A server's users are dropped when it goes silent
+// for FEDERATION_NODE_TIMEOUT, and every new link makes all servers flood a fresh snapshot of
+// their users. A snapshot only drops the users it no longer lists, so presence subscribers see
+// no churn for those still there. Usernames are only checked against what a server has heard so far, two servers
+// can still hand out the same name at the same time.
+typedef enum nexchat_relay_kind_t
+{
+    RELAY_NONE,
+    RELAY_HELLO,     // first record on a link, origin is the sender, never forwarded
+    RELAY_HEARTBEAT, // origin is alive
+    RELAY_CHAT,      // a room, b a text frame payload, delivered and written to the message log
+    RELAY_NOTICE,    // a room, b a text frame payload, delivered only
+    RELAY_JOIN,      // a username, connected to origin
+    RELAY_LEAVE,     // a username
+    RELAY_RENAME,    // a old username, b new username
+    RELAY_SNAPSHOT,  // the joins that follow list every user of origin
+    RELAY_SNAPSHOT_END, // users of origin the snapshot didn't list are forgotten
+    RELAY_RESYNC,    // every server floods a snapshot of its users
+    RELAY_MAXKINDS,
+} nexchat_relay_kind_t;
+
+#define RELAY_RECORD_HEADER 22 // kind, hops, origin, seq and both lengths
+
+typedef struct nexchat_federation_config_t
+{
+    const char* port;                         // accept links on this port, disabled when NULL
+    const char* links[FEDERATION_MAX_LINKS];  // host:port of servers to dial and keep dialing
+    size_t link_count;
+    uint64_t node; // hot upgrade, go on as the server this process replaced, 0 for a fresh id
+    uint64_t seq;
+} nexchat_federation_config_t;
+
+// what a shard hands the federation thread, relayed to every link once stamped
+typedef struct nexchat_relay_event_t
+{
+    nexchat_mpsc_node_t node;
+    nexchat_relay_kind_t kind;
+    nexchat_msgbuf_t* msg; // RELAY_CHAT and RELAY_NOTICE, an encoded text frame, holds a reference
+    char room[ROOM_NAME_MAX];
+    char username[64];
+    char newname[64];     // RELAY_RENAME
+} nexchat_relay_event_t;
+
+// one TCP link to another server
+typedef struct nexchat_federation_peer_t
+{
+    const char* address; // --link this was dialed from, NULL when accepted
+    int32_t sockfd;      // -1 while down
+    bool connecting;     // non-blocking connect in progress
+    uint64_t node;       // the other server's id, 0 until its hello arrives
+    bool up;             // counted in links_up, set by the first hello only
+    uint64_t retry_ns;   // when a down --link is dialed again
+    nexchat_frame_decoder_t decoder;
+    nexchat_outqueue_t outqueue;
+    nexchat_buffer_t batch; // records since the last flush, behind room for the frame header
+} nexchat_federation_peer_t;
+
+// the newest record applied from one origin
+typedef struct nexchat_federation_node_t
+{
+    uint64_t node;
+    uint64_t seq;
+    uint64_t heard_ns;
+    uint64_t snapshot; // sequence of its last RELAY_SNAPSHOT
+} nexchat_federation_node_t;
+
+typedef struct nexchat_server_state_t nexchat_server_state_t;
+
+typedef struct nexchat_federation_t
+{
+    nexchat_server_state_t* server;
+    nexchat_federation_config_t config;
+    uint64_t node; // this server's id, random per run
+    uint64_t seq;  // last sequence number stamped, federation thread only
+
+    pthread_t thread;
+    bool running;
+    int32_t epollfd;
+    int32_t eventfd; // signalled when the inbox goes from empty to non-empty
+    int32_t timerfd; // heartbeats, redials and node timeouts
+    int32_t listenfd;
+    nexchat_mpsc_t inbox;
+
+    nexchat_federation_peer_t** peers; // dialed links stay in the list while down
+    size_t peer_count;
+    size_t peer_capacity;
+
+    nexchat_federation_node_t* nodes; // every origin heard from recently
+    size_t node_count;
+    size_t node_capacity;
+
+    nexchat_buffer_t scratch; // frames built for local delivery
+
+    // atomic, single writer, read by /stats
+    uint64_t links_up;
+    uint64_t records_in;
+    uint64_t records_out;
+    uint64_t frames_out;
+} nexchat_federation_t;
+
+// binds the listening port, dials every --link and starts the federation thread
+int32_t nexchat_federation_open(nexchat_federation_t* fed, nexchat_server_state_t* server, const nexchat_federation_config_t* config);
+
+// stops the thread and closes every link
+void nexchat_federation_close(nexchat_federation_t* fed);
+
+// queues a record for every link, `msg` is retained for RELAY_CHAT and RELAY_NOTICE. Any thread
+void nexchat_federation_relay(nexchat_federation_t* fed, nexchat_relay_kind_t kind, const char* room, nexchat_msgbuf_t* msg,
+                              const char* username, const char* newname);
+
+// the /stats line
+size_t nexchat_federation_format(nexchat_federation_t* fed, char* out, size_t size);
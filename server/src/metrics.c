@@ -0,0 +1,201 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "server.h"
+
+#if NEXCHAT_METRICS
+
+_Static_assert(CMD_MAXCOMMANDS <= NEXCHAT_METRICS_MAXCOMMANDS, "command histograms are indexed by command");
+
+static size_t nexchat_metrics_appendf(char* out, size_t size, size_t offset, const char* fmt, ...)
+{
+    if (offset >= size)
+    {
+        return offset;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int32_t written = vsnprintf(out + offset, size - offset, fmt, args);
+    va_end(args);
+
+    if (written < 0)
+    {
+        return offset;
+    }
+
+    return offset + (size_t)written < size ? offset + (size_t)written : size - 1;
+}
+
+static size_t nexchat_metrics_append_histogram(char* out, size_t size, size_t offset, const char* name, const nexchat_histogram_t* hist)
+{
+    return nexchat_metrics_appendf(out, size, offset, "  %-14s n=%llu p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n", name,
+                                   (unsigned long long)hist->total,
+                                   (double)nexchat_histogram_percentile(hist, 0.50) / 1e3,
+                                   (double)nexchat_histogram_percentile(hist, 0.99) / 1e3,
+                                   (double)nexchat_histogram_percentile(hist, 0.999) / 1e3,
+                                   (double)hist->max / 1e3);
+}
+
+static size_t nexchat_metrics_append_pool(char* out, size_t size, size_t offset)
+{
+    nexchat_pool_stats_t stats;
+    nexchat_pool_stats(&stats);
+    const nexchat_pool_stats_t* pool = &stats;
+
+#if NEXCHAT_POOL
+    offset = nexchat_metrics_appendf(out, size, offset, "  %-14s %zu thread cache(s), %zu KiB in slabs, %llu large allocs, %llu live\n", "pool",
+                                     pool->threads, pool->slab_bytes / 1024, (unsigned long long)pool->large_allocs,
+                                     (unsigned long long)(pool->large_allocs - pool->large_frees));
+
+    // only the classes in use, one line each so the pools can be sized from a dump
+    for (size_t i = 0; i < NEXCHAT_POOL_CLASSES; i++)
+    {
+        const nexchat_pool_class_stats_t* c = &pool->classes[i];
+        if (c->reserved == 0)
+        {
+            continue;
+        }
+
+        char name[32];
+        snprintf(name, sizeof name, "pool %zu", c->block_size);
+        offset = nexchat_metrics_appendf(out, size, offset, "  %-14s %llu allocs, %llu live, %zu cached, %zu in depot, %zu reserved, %llu refills\n", name,
+                                         (unsigned long long)c->allocs, (unsigned long long)(c->allocs - c->frees), c->cached, c->depot,
+                                         c->reserved, (unsigned long long)c->refills);
+    }
+#else
+    offset = nexchat_metrics_appendf(out, size, offset, "  %-14s disabled, buffers come from malloc\n", "pool");
+#endif
+
+    return offset;
+}
+
+size_t nexchat_server_metrics_format(nexchat_server_state_t* state, char* out, size_t size)
+{
+    // too big for the stack of a reactor thread, and only built on demand
+    nexchat_server_metrics_t* total = (nexchat_server_metrics_t*)calloc(1, sizeof(nexchat_server_metrics_t));
+    if (total == NULL)
+    {
+        return (size_t)snprintf(out, size, "server: out of memory collecting stats");
+    }
+
+    for (size_t s = 0; s < state->shard_count; s++)
+    {
+        const nexchat_server_metrics_t* m = &state->shards[s].metrics;
+
+        total->accepts += nexchat_counter_load(&m->accepts);
+        total->rejects += nexchat_counter_load(&m->rejects);
+        total->disconnects += nexchat_counter_load(&m->disconnects);
+        total->frames_in += nexchat_counter_load(&m->frames_in);
+        total->bytes_in += nexchat_counter_load(&m->bytes_in);
+        total->bytes_out += nexchat_counter_load(&m->bytes_out);
+        total->broadcasts += nexchat_counter_load(&m->broadcasts);
+        total->deliveries += nexchat_counter_load(&m->deliveries);
+        total->drops += nexchat_counter_load(&m->drops);
+        total->evictions += nexchat_counter_load(&m->evictions);
+        total->read_pauses += nexchat_counter_load(&m->read_pauses);
+
+        nexchat_histogram_merge(&total->fanout_ns, &m->fanout_ns);
+        for (size_t i = 0; i < CMD_MAXCOMMANDS; i++)
+        {
+            nexchat_histogram_merge(&total->command_ns[i], &m->command_ns[i]);
+        }
+    }
+
+    double uptime = (double)(nexchat_clock_now_ns() - state->started_ns) / 1e9;
+    size_t connected = __atomic_load_n(&state->connected_clients, __ATOMIC_RELAXED);
+    size_t active = __atomic_load_n(&state->active_clients, __ATOMIC_RELAXED);
+    size_t offset = 0;
+
+    offset = nexchat_metrics_appendf(out, size, offset, "server: stats, %zu worker(s), up %.0f s\n", state->shard_count, uptime);
+    offset = nexchat_metrics_appendf(out, size, offset, "  %-14s %zu active, %zu in handshake, %llu accepted, %llu rejected, %llu disconnected\n", "clients",
+                                     active, connected > active ? connected - active : 0, (unsigned long long)total->accepts, (unsigned long long)total->rejects, (unsigned long long)total->disconnects);
+    offset = nexchat_metrics_appendf(out, size, offset, "  %-14s %llu frames, %llu bytes\n", "in",
+                                     (unsigned long long)total->frames_in, (unsigned long long)total->bytes_in);
+    offset = nexchat_metrics_appendf(out, size, offset, "  %-14s %llu bytes\n", "out", (unsigned long long)total->bytes_out);
+    offset = nexchat_metrics_appendf(out, size, offset, "  %-14s %llu messages, %llu deliveries\n", "broadcast",
+                                     (unsigned long long)total->broadcasts, (unsigned long long)total->deliveries);
+    offset = nexchat_metrics_appendf(out, size, offset, "  %-14s %zu KiB unread of a %zu KiB budget, %llu dropped, %llu disconnected, %llu read pauses\n", "backpressure",
+                                     nexchat_server_buffered_bytes(state) / 1024, state->config.memory_budget / 1024, (unsigned long long)total->drops,
+                                     (unsigned long long)total->evictions, (unsigned long long)total->read_pauses);
+    if (state->federating)
+    {
+        char line[256];
+        nexchat_federation_format(&state->federation, line, sizeof line);
+        offset = nexchat_metrics_appendf(out, size, offset, "  %-14s %s\n", "federation", line);
+    }
+
+    nexchat_log_stats_t logged;
+    nexchat_log_stats(&logged);
+    offset = nexchat_metrics_appendf(out, size, offset, "  %-14s %llu written in %llu batch(es), %llu dropped, %zu thread ring(s)\n", "log",
+                                     (unsigned long long)logged.written, (unsigned long long)logged.batches, (unsigned long long)logged.dropped, logged.threads);
+
+    offset = nexchat_metrics_append_histogram(out, size, offset, "fanout", &total->fanout_ns);
+    offset = nexchat_metrics_append_pool(out, size, offset);
+
+    for (size_t i = CMD_NONE + 1; i < CMD_MAXCOMMANDS; i++)
+    {
+        if (total->command_ns[i].total == 0)
+        {
+            continue;
+        }
+
+        char name[32];
+        snprintf(name, sizeof name, "/%s", nexchat_client_command_to_str((nexchat_client_command_t)i));
+        offset = nexchat_metrics_append_histogram(out, size, offset, name, &total->command_ns[i]);
+    }
+
+    free(total);
+
+    return offset;
+}
+
+int32_t nexchat_server_metrics_dump(nexchat_server_state_t* state, const char* path)
+{
+    char text[4096];
+    size_t len = nexchat_server_metrics_format(state, text, sizeof text);
+
+    // write beside the target and rename over it so readers never see a partial dump
+    char tmppath[4096];
+    snprintf(tmppath, sizeof tmppath, "%s.tmp", path);
+
+    FILE* file = fopen(tmppath, "w");
+    if (file == NULL)
+    {
+        nexchat_log_errno(tmppath);
+        return -1;
+    }
+
+    fprintf(file, "time %lld\n", (long long)time(NULL));
+    fwrite(text, 1, len, file);
+
+    if (fclose(file) != 0 || rename(tmppath, path) != 0)
+    {
+        nexchat_log_errno("server: stats dump");
+        return -1;
+    }
+
+    return 0;
+}
+
+#else
+
+size_t nexchat_server_metrics_format(nexchat_server_state_t* state, char* out, size_t size)
+{
+    (void)state;
+    return (size_t)snprintf(out, size, "server: metrics are compiled out of this build");
+}
+
+int32_t nexchat_server_metrics_dump(nexchat_server_state_t* state, const char* path)
+{
+    (void)state;
+    (void)path;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "libcommon/libcommon.h"
+
+// Instrumentation is compiled into Debug and Release and out of Dist, where every
+// NEXCHAT_METRIC_* macro below expands to nothing. Override with -DNEXCHAT_METRICS=0/1.
+#ifndef NEXCHAT_METRICS
+    #ifdef DIST
+        #define NEXCHAT_METRICS 0
+    #else
+        #define NEXCHAT_METRICS 1
+    #endif
+#endif
+
+#define NEXCHAT_METRICS_MAXCOMMANDS 16
+
+// Per-shard counters and histograms. Only the owning shard writes them, so they need no
+// locked instructions; /stats and the periodic dump read every shard's copy and sum them.
+typedef struct nexchat_server_metrics_t
+{
+    uint64_t accepts;
+    uint64_t rejects;
+    uint64_t disconnects;
+    uint64_t frames_in;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t broadcasts; // messages broadcast by this shard's clients
+    uint64_t deliveries; // frames queued to this shard's clients by any broadcast
+    uint64_t drops;      // frames not delivered to clients over their high watermark
+    uint64_t evictions;  // clients disconnected for not reading
+    uint64_t read_pauses;
+
+    nexchat_histogram_t fanout_ns;
+    nexchat_histogram_t command_ns[NEXCHAT_METRICS_MAXCOMMANDS];
+} nexchat_server_metrics_t;
+
+#if NEXCHAT_METRICS
+    #define NEXCHAT_METRIC_ADD(shard, counter, n)   nexchat_counter_add(&(shard)->metrics.counter, (uint64_t)(n))
+    #define NEXCHAT_METRIC_START(var)               uint64_t var = nexchat_clock_now_ns()
+    #define NEXCHAT_METRIC_RECORD(shard, hist, var) nexchat_histogram_record(&(shard)->metrics.hist, nexchat_clock_now_ns() - (var))
+#else
+    #define NEXCHAT_METRIC_ADD(shard, counter, n)   ((void)sizeof(n))
+    #define NEXCHAT_METRIC_START(var)               ((void)0)
+    #define NEXCHAT_METRIC_RECORD(shard, hist, var) ((void)0)
+#endif
+
+typedef struct nexchat_server_state_t nexchat_server_state_t;
+
+// writes a readable summary of all shards into `out`, returns the length written
+size_t nexchat_server_metrics_format(nexchat_server_state_t* state, char* out, size_t size);
+
+// replaces `path` with the current summary
+int32_t nexchat_server_metrics_dump(nexchat_server_state_t* state, const char* path);
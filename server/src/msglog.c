@@ -0,0 +1,677 @@
+#include "msglog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MSGLOG_RECORD_HEADER 5 // u32 size + u8 room length
+
+static uint32_t nexchat_msglog_read_u32(const uint8_t* src)
+{
+    return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | (uint32_t)src[3];
+}
+
+static void nexchat_msglog_write_u32(uint8_t* dst, uint32_t value)
+{
+    dst[0] = (uint8_t)(value >> 24);
+    dst[1] = (uint8_t)(value >> 16);
+    dst[2] = (uint8_t)(value >> 8);
+    dst[3] = (uint8_t)value;
+}
+
+static void nexchat_msglog_segment_path(const nexchat_msglog_t* log, uint64_t seq, char* path, size_t size)
+{
+    snprintf(path, size, "%s/%020llu.log", log->config.dir, (unsigned long long)seq);
+}
+
+static int32_t nexchat_msglog_map_segment(nexchat_msglog_t* log, uint64_t seq, bool create, nexchat_msglog_segment_t* segment)
+{
+    char path[4096];
+    nexchat_msglog_segment_path(log, seq, path, sizeof path);
+
+    segment->seq = seq;
+    segment->used = 0;
+    segment->fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (segment->fd == -1)
+    {
+        nexchat_log_errno("msglog: open");
+        return -1;
+    }
+
+    struct stat info;
+    if (fstat(segment->fd, &info) == -1)
+    {
+        nexchat_log_errno("msglog: fstat");
+        close(segment->fd);
+        return -1;
+    }
+
+    // new segments are sized up front, the zero filled tail doubles as the end marker
+    segment->size = create ? log->config.segment_size : (size_t)info.st_size;
+    if (create && ftruncate(segment->fd, (off_t)segment->size) == -1)
+    {
+        nexchat_log_errno("msglog: ftruncate");
+        close(segment->fd);
+        unlink(path);
+        return -1;
+    }
+
+    segment->map = segment->size > 0 ? (uint8_t*)mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0) : NULL;
+    if (segment->map == MAP_FAILED)
+    {
+        nexchat_log_errno("msglog: mmap");
+        close(segment->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void nexchat_msglog_unmap_segment(nexchat_msglog_segment_t* segment)
+{
+    if (segment->map != NULL)
+    {
+        munmap(segment->map, segment->size);
+    }
+
+    close(segment->fd);
+}
+
+static nexchat_msglog_segment_t* nexchat_msglog_segment_find(nexchat_msglog_t* log, uint64_t seq)
+{
+    // segments are consecutive, so the position follows from the oldest sequence number
+    if (log->segment_count == 0 || seq < log->segments[0].seq)
+    {
+        return NULL;
+    }
+
+    size_t index = (size_t)(seq - log->segments[0].seq);
+    return index < log->segment_count ? &log->segments[index] : NULL;
+}
+
+static int32_t nexchat_msglog_index(nexchat_msglog_t* log, const char* name, size_t namelen, const nexchat_msglog_entry_t* entry)
+{
+    char key[MSGLOG_ROOM_MAX];
+    snprintf(key, sizeof key, "%.*s", (int)namelen, name);
+
+    nexchat_msglog_room_t* room = (nexchat_msglog_room_t*)nexchat_strmap_get(&log->rooms, key);
+
+    if (room == NULL)
+    {
+        room = (nexchat_msglog_room_t*)calloc(1, sizeof(nexchat_msglog_room_t));
+        nexchat_msglog_entry_t* entries = (nexchat_msglog_entry_t*)malloc(log->config.replay * sizeof(nexchat_msglog_entry_t));
+
+        if (room == NULL || entries == NULL)
+        {
+            free(room);
+            free(entries);
+            return -1;
+        }
+
+        memcpy(room->name, key, sizeof key);
+        room->entries = entries;
+
+        if (nexchat_strmap_put(&log->rooms, room->name, room) == -1)
+        {
+            free(entries);
+            free(room);
+            return -1;
+        }
+    }
+
+    // overwrite the oldest once the ring is full
+    size_t slot = (room->head + room->count) % log->config.replay;
+    room->entries[slot] = *entry;
+
+    if (room->count < log->config.replay)
+    {
+        room->count++;
+    }
+    else
+    {
+        room->head = (room->head + 1) % log->config.replay;
+    }
+
+    return 0;
+}
+
+static void nexchat_msglog_scan(nexchat_msglog_t* log, nexchat_msglog_segment_t* segment)
+{
+    size_t offset = 0;
+
+    while (offset + MSGLOG_RECORD_HEADER <= segment->size)
+    {
+        const uint8_t* record = segment->map + offset;
+        uint32_t size = nexchat_msglog_read_u32(record);
+        uint8_t roomlen = record[4];
+
+        // a zero size is the unwritten tail, anything that doesn't fit is a torn write
+        if (size == 0 || size < 1u + roomlen || offset + 4 + size > segment->size)
+        {
+            break;
+        }
+
+        nexchat_msglog_entry_t entry;
+        entry.seq = segment->seq;
+        entry.offset = (uint32_t)(offset + MSGLOG_RECORD_HEADER + roomlen);
+        entry.size = size - 1 - roomlen;
+
+        if (log->config.replay > 0)
+        {
+            nexchat_msglog_index(log, (const char*)record + MSGLOG_RECORD_HEADER, roomlen, &entry);
+        }
+
+        offset += 4 + size;
+    }
+
+    segment->used = offset;
+}
+
+static int32_t nexchat_msglog_compare_seq(const void* a, const void* b)
+{
+    uint64_t lhs = *(const uint64_t*)a;
+    uint64_t rhs = *(const uint64_t*)b;
+    return lhs < rhs ? -1 : lhs > rhs;
+}
+
+// drops the oldest segments beyond the retention limit, the caller holds the mutex
+static void nexchat_msglog_retire(nexchat_msglog_t* log)
+{
+    while (log->segment_count > log->config.retention)
+    {
+        nexchat_msglog_segment_t* oldest = &log->segments[0];
+
+        char path[4096];
+        nexchat_msglog_segment_path(log, oldest->seq, path, sizeof path);
+
+        nexchat_msglog_unmap_segment(oldest);
+        unlink(path);
+
+        // index entries into it are skipped on replay, its sequence number is below the oldest
+        memmove(&log->segments[0], &log->segments[1], (log->segment_count - 1) * sizeof(nexchat_msglog_segment_t));
+        log->segment_count--;
+    }
+}
+
+static int32_t nexchat_msglog_roll(nexchat_msglog_t* log)
+{
+    uint64_t seq = log->segment_count > 0 ? log->segments[log->segment_count - 1].seq + 1 : 1;
+
+    nexchat_msglog_segment_t segment;
+    if (nexchat_msglog_map_segment(log, seq, true, &segment) == -1)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&log->mutex);
+
+    nexchat_msglog_segment_t* segments = (nexchat_msglog_segment_t*)realloc(log->segments, (log->segment_count + 1) * sizeof(nexchat_msglog_segment_t));
+    if (segments == NULL)
+    {
+        pthread_mutex_unlock(&log->mutex);
+        nexchat_msglog_unmap_segment(&segment);
+        return -1;
+    }
+
+    log->segments = segments;
+    log->segments[log->segment_count++] = segment;
+    nexchat_msglog_retire(log);
+
+    pthread_mutex_unlock(&log->mutex);
+
+    return 0;
+}
+
+static int32_t nexchat_msglog_recover(nexchat_msglog_t* log)
+{
+    DIR* dir = opendir(log->config.dir);
+    if (dir == NULL)
+    {
+        nexchat_log_errno("msglog: opendir");
+        return -1;
+    }
+
+    uint64_t* seqs = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent* it = NULL;
+
+    while ((it = readdir(dir)) != NULL)
+    {
+        unsigned long long seq = 0;
+        char suffix[8] = {0};
+
+        if (strlen(it->d_name) != 24 || sscanf(it->d_name, "%20llu%7s", &seq, suffix) != 2 || strcmp(suffix, ".log") != 0)
+        {
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity > 0 ? capacity * 2 : 16;
+            uint64_t* grown = (uint64_t*)realloc(seqs, capacity * sizeof(uint64_t));
+            if (grown == NULL)
+            {
+                free(seqs);
+                closedir(dir);
+                return -1;
+            }
+            seqs = grown;
+        }
+
+        seqs[count++] = (uint64_t)seq;
+    }
+
+    closedir(dir);
+    qsort(seqs, count, sizeof(uint64_t), nexchat_msglog_compare_seq);
+
+    // a gap means segments went missing, only the run ending at the newest one is usable
+    size_t first = count;
+    while (first > 0 && (first == count || seqs[first - 1] + 1 == seqs[first]))
+    {
+        first--;
+    }
+
+    if (count - first > log->config.retention)
+    {
+        first = count - log->config.retention;
+    }
+
+    // the rest is never mapped, so retirement would never reach it and it would stay on disk
+    for (size_t i = 0; i < first; i++)
+    {
+        char path[4096];
+        nexchat_msglog_segment_path(log, seqs[i], path, sizeof path);
+
+        nexchat_log(NEXCHAT_LOG_WARN, "msglog: deleting segment %llu, it is older than a gap or past the retention limit",
+            (unsigned long long)seqs[i]);
+
+        if (unlink(path) == -1)
+        {
+            nexchat_log_errno("msglog: unlink");
+        }
+    }
+
+    log->segments = (nexchat_msglog_segment_t*)calloc(count - first + 1, sizeof(nexchat_msglog_segment_t));
+    if (log->segments == NULL)
+    {
+        free(seqs);
+        return -1;
+    }
+
+    for (size_t i = first; i < count; i++)
+    {
+        nexchat_msglog_segment_t* segment = &log->segments[log->segment_count];
+
+        if (nexchat_msglog_map_segment(log, seqs[i], false, segment) == -1)
+        {
+            // the ones mapped so far go too, the index built from them with them
+            for (size_t j = 0; j < log->segment_count; j++)
+            {
+                nexchat_msglog_unmap_segment(&log->segments[j]);
+            }
+
+            free(log->segments);
+            log->segments = NULL;
+            log->segment_count = 0;
+            free(seqs);
+            return -1;
+        }
+
+        log->segment_count++;
+        nexchat_msglog_scan(log, segment);
+    }
+
+    free(seqs);
+
+    return 0;
+}
+
+// -1 when some of the batch was written but could not be indexed, it is missing from replay
+// until the index is rebuilt from disk on the next start
+static int32_t nexchat_msglog_commit(nexchat_msglog_t* log, nexchat_msglog_record_t* records)
+{
+    // index updates are published only once the whole batch is written
+    nexchat_msglog_entry_t* entries = NULL;
+    nexchat_msglog_record_t** indexed = NULL;
+    size_t batch = 0;
+
+    for (nexchat_msglog_record_t* it = records; it != NULL; it = (nexchat_msglog_record_t*)it->node.next)
+    {
+        batch++;
+    }
+
+    int32_t status = 0;
+
+    if (log->config.replay > 0)
+    {
+        entries = (nexchat_msglog_entry_t*)malloc(batch * sizeof(nexchat_msglog_entry_t));
+        indexed = (nexchat_msglog_record_t**)malloc(batch * sizeof(nexchat_msglog_record_t*));
+
+        // the messages are still written, durable is worth more than replayable
+        if (entries == NULL || indexed == NULL)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "msglog: out of memory indexing a batch of %zu message(s)", batch);
+            status = -1;
+        }
+    }
+
+    size_t written = 0;
+    nexchat_msglog_segment_t* dirty = NULL;
+    size_t dirty_start = 0;
+
+    for (nexchat_msglog_record_t* record = records; record != NULL; record = (nexchat_msglog_record_t*)record->node.next)
+    {
+        size_t size = 1 + record->roomlen + record->frame->size;
+        nexchat_msglog_segment_t* segment = &log->segments[log->segment_count - 1];
+
+        if (4 + size > log->config.segment_size)
+        {
+            nexchat_log(NEXCHAT_LOG_WARN, "msglog: %zu byte message doesn't fit in a segment, dropping it", size);
+            continue;
+        }
+
+        if (segment->used + 4 + size > segment->size)
+        {
+            // seal the full segment before moving on, a batch may straddle two
+            if (log->config.sync && dirty == segment)
+            {
+                msync(segment->map, segment->size, MS_SYNC);
+            }
+
+            if (nexchat_msglog_roll(log) == -1)
+            {
+                nexchat_log(NEXCHAT_LOG_ERROR, "msglog: failed to start a new segment, dropping message");
+                continue;
+            }
+
+            segment = &log->segments[log->segment_count - 1];
+            dirty = NULL;
+        }
+
+        if (dirty != segment)
+        {
+            dirty = segment;
+            dirty_start = segment->used;
+        }
+
+        uint8_t* dst = segment->map + segment->used;
+        memcpy(dst + MSGLOG_RECORD_HEADER, record->room, record->roomlen);
+        memcpy(dst + MSGLOG_RECORD_HEADER + record->roomlen, record->frame->data, record->frame->size);
+        dst[4] = record->roomlen;
+
+        // the size goes in last, a crash mid-copy leaves a zero and the record is never seen
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        nexchat_msglog_write_u32(dst, (uint32_t)size);
+
+        if (entries != NULL && indexed != NULL)
+        {
+            entries[written].seq = segment->seq;
+            entries[written].offset = (uint32_t)(segment->used + MSGLOG_RECORD_HEADER + record->roomlen);
+            entries[written].size = record->frame->size;
+            indexed[written] = record;
+            written++;
+        }
+
+        segment->used += 4 + size;
+        log->appended++;
+    }
+
+    // one flush for the whole batch, however many messages it carried
+    if (log->config.sync && dirty != NULL)
+    {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = dirty_start & ~(page - 1);
+        msync(dirty->map + start, dirty->used - start, MS_SYNC);
+    }
+
+    log->commits++;
+
+    if (log->config.replay > 0 && entries != NULL && indexed != NULL)
+    {
+        pthread_mutex_lock(&log->mutex);
+
+        for (size_t i = 0; i < written; i++)
+        {
+            if (nexchat_msglog_index(log, indexed[i]->room, indexed[i]->roomlen, &entries[i]) == -1)
+            {
+                nexchat_log(NEXCHAT_LOG_ERROR, "msglog: out of memory indexing room '%s'", indexed[i]->room);
+                status = -1;
+            }
+        }
+
+        pthread_mutex_unlock(&log->mutex);
+    }
+
+    free(entries);
+    free(indexed);
+
+    return status;
+}
+
+static void* nexchat_msglog_run(void* arg)
+{
+    nexchat_msglog_t* log = (nexchat_msglog_t*)arg;
+
+    while (true)
+    {
+        uint64_t count = 0;
+        bool running = __atomic_load_n(&log->running, __ATOMIC_ACQUIRE);
+
+        // everything queued while the previous batch was being written becomes the next batch
+        nexchat_msglog_record_t* records = (nexchat_msglog_record_t*)nexchat_mpsc_take_all(&log->queue);
+
+        if (records != NULL)
+        {
+            if (nexchat_msglog_commit(log, records) == -1)
+            {
+                nexchat_log(NEXCHAT_LOG_WARN, "msglog: messages written without an index entry are not replayed until restart");
+            }
+
+            while (records != NULL)
+            {
+                nexchat_msglog_record_t* next = (nexchat_msglog_record_t*)records->node.next;
+                nexchat_msgbuf_release(records->frame);
+                nexchat_pool_free(records);
+                records = next;
+            }
+
+            continue;
+        }
+
+        if (!running)
+        {
+            break;
+        }
+
+        if (read(log->eventfd, &count, sizeof count) == -1 && errno != EINTR)
+        {
+            nexchat_log_errno("msglog: read");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int32_t nexchat_msglog_open(nexchat_msglog_t* log, const nexchat_msglog_config_t* config)
+{
+    memset(log, 0, sizeof(nexchat_msglog_t));
+    log->config = *config;
+    log->eventfd = -1;
+
+    if (mkdir(config->dir, 0755) == -1 && errno != EEXIST)
+    {
+        nexchat_log_errno("msglog: mkdir");
+        return -1;
+    }
+
+    pthread_mutex_init(&log->mutex, NULL);
+    nexchat_mpsc_init(&log->queue);
+
+    if (nexchat_strmap_init(&log->rooms, 64) == -1 || nexchat_msglog_recover(log) == -1)
+    {
+        nexchat_msglog_close(log);
+        return -1;
+    }
+
+    if (log->segment_count == 0 && nexchat_msglog_roll(log) == -1)
+    {
+        nexchat_msglog_close(log);
+        return -1;
+    }
+
+    // the blocking writer only wakes when there is something to write
+    log->eventfd = eventfd(0, 0);
+    if (log->eventfd == -1)
+    {
+        nexchat_log_errno("msglog: eventfd");
+        nexchat_msglog_close(log);
+        return -1;
+    }
+
+    log->running = true;
+
+    if (pthread_create(&log->thread, NULL, nexchat_msglog_run, log) != 0)
+    {
+        log->running = false;
+        nexchat_msglog_close(log);
+        return -1;
+    }
+
+    return 0;
+}
+
+void nexchat_msglog_close(nexchat_msglog_t* log)
+{
+    if (log->running)
+    {
+        __atomic_store_n(&log->running, false, __ATOMIC_RELEASE);
+
+        uint64_t one = 1;
+        if (write(log->eventfd, &one, sizeof one) == -1)
+        {
+            nexchat_log_errno("msglog: write");
+        }
+
+        pthread_join(log->thread, NULL);
+    }
+
+    if (log->eventfd != -1)
+    {
+        close(log->eventfd);
+    }
+
+    for (size_t i = 0; i < log->segment_count; i++)
+    {
+        nexchat_msglog_unmap_segment(&log->segments[i]);
+    }
+
+    for (size_t i = 0; i < log->rooms.capacity; i++)
+    {
+        if (log->rooms.entries != NULL && log->rooms.entries[i].key != NULL)
+        {
+            nexchat_msglog_room_t* room = (nexchat_msglog_room_t*)log->rooms.entries[i].value;
+            free(room->entries);
+            free(room);
+        }
+    }
+
+    free(log->segments);
+    nexchat_strmap_free(&log->rooms);
+    pthread_mutex_destroy(&log->mutex);
+
+    memset(log, 0, sizeof(nexchat_msglog_t));
+    log->eventfd = -1;
+}
+
+void nexchat_msglog_append(nexchat_msglog_t* log, const char* room, nexchat_msgbuf_t* frame)
+{
+    nexchat_msglog_record_t* record = (nexchat_msglog_record_t*)nexchat_pool_alloc(sizeof(nexchat_msglog_record_t));
+    if (record == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "msglog: out of memory, message not logged");
+        return;
+    }
+
+    size_t roomlen = strlen(room);
+    roomlen = roomlen < MSGLOG_ROOM_MAX - 1 ? roomlen : MSGLOG_ROOM_MAX - 1;
+
+    memcpy(record->room, room, roomlen);
+    record->room[roomlen] = '\0';
+    record->roomlen = (uint8_t)roomlen;
+    record->frame = nexchat_msgbuf_retain(frame);
+
+    if (nexchat_mpsc_push(&log->queue, &record->node))
+    {
+        uint64_t one = 1;
+        if (write(log->eventfd, &one, sizeof one) == -1)
+        {
+            nexchat_log_errno("msglog: write");
+        }
+    }
+}
+
+size_t nexchat_msglog_replay(nexchat_msglog_t* log, const char* room, size_t limit, nexchat_msglog_visit_fn visit, void* ctx)
+{
+    // the ring never holds more than the configured replay count
+    limit = limit < log->config.replay ? limit : log->config.replay;
+    if (limit == 0)
+    {
+        return 0;
+    }
+
+    nexchat_msgbuf_t** frames = (nexchat_msgbuf_t**)malloc(limit * sizeof(nexchat_msgbuf_t*));
+    if (frames == NULL)
+    {
+        return 0;
+    }
+
+    size_t copied = 0;
+
+    // only copied out under the lock, the segment may be retired as soon as it is released
+    pthread_mutex_lock(&log->mutex);
+
+    nexchat_msglog_room_t* index = (nexchat_msglog_room_t*)nexchat_strmap_get(&log->rooms, room);
+
+    if (index != NULL)
+    {
+        size_t count = index->count < limit ? index->count : limit;
+
+        for (size_t i = index->count - count; i < index->count; i++)
+        {
+            const nexchat_msglog_entry_t* entry = &index->entries[(index->head + i) % log->config.replay];
+            const nexchat_msglog_segment_t* segment = nexchat_msglog_segment_find(log, entry->seq);
+
+            // retired along with its segment
+            if (segment == NULL)
+            {
+                continue;
+            }
+
+            frames[copied] = nexchat_msgbuf_create(segment->map + entry->offset, entry->size);
+            copied += frames[copied] != NULL ? 1 : 0;
+        }
+    }
+
+    pthread_mutex_unlock(&log->mutex);
+
+    for (size_t i = 0; i < copied; i++)
+    {
+        visit(ctx, frames[i]);
+        nexchat_msgbuf_release(frames[i]);
+    }
+
+    free(frames);
+
+    return copied;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "libcommon/libcommon.h"
+
+#define MSGLOG_SEGMENT_SIZE (64ull * 1024 * 1024) // default, override with --log-segment-size
+#define MSGLOG_RETENTION    8                     // segments kept on disk
+#define MSGLOG_REPLAY       20                    // messages replayed to a client joining a room
+#define MSGLOG_SEGMENT_MIN  (128 * 1024)         // fits the largest frame
+#define MSGLOG_ROOM_MAX     32
+
+// Append-only log of chat messages, split into fixed size segment files named by sequence
+// number. Segments are preallocated and mapped shared, so records are written with memcpy,
+// made durable with one msync per batch (group commit) and replayed straight from the mapping.
+//
+// Each record on disk:
+//
+//   [u32 record size, big-endian][u8 room length][room name][encoded frame]
+//
+// A zero size marks the end of the written part of a segment.
+typedef struct nexchat_msglog_config_t
+{
+    const char* dir;
+    size_t segment_size;
+    size_t retention; // maximum number of segments, the oldest is deleted to make room
+    size_t replay;    // messages remembered per room
+    bool sync;        // msync every batch before it is visible to replay
+} nexchat_msglog_config_t;
+
+typedef struct nexchat_msglog_segment_t
+{
+    uint64_t seq;
+    int32_t fd;
+    uint8_t* map;
+    size_t size;
+    size_t used;
+} nexchat_msglog_segment_t;
+
+// where a message's frame lives
+typedef struct nexchat_msglog_entry_t
+{
+    uint64_t seq;
+    uint32_t offset;
+    uint32_t size;
+} nexchat_msglog_entry_t;
+
+// the last `replay` messages of one room, a ring
+typedef struct nexchat_msglog_room_t
+{
+    char name[MSGLOG_ROOM_MAX];
+    nexchat_msglog_entry_t* entries;
+    size_t head;
+    size_t count;
+} nexchat_msglog_room_t;
+
+// a message waiting for the writer thread
+typedef struct nexchat_msglog_record_t
+{
+    nexchat_mpsc_node_t node;
+    nexchat_msgbuf_t* frame; // holds a reference
+    uint8_t roomlen;
+    char room[MSGLOG_ROOM_MAX];
+} nexchat_msglog_record_t;
+
+typedef struct nexchat_msglog_t
+{
+    nexchat_msglog_config_t config;
+
+    nexchat_mpsc_t queue;
+    int32_t eventfd; // signalled when the queue goes from empty to non-empty
+    pthread_t thread;
+    bool running;
+
+    // guards the segment list and the room index, writers hold it only to publish a batch
+    pthread_mutex_t mutex;
+    nexchat_msglog_segment_t* segments; // oldest first
+    size_t segment_count;
+    nexchat_strmap_t rooms; // name -> nexchat_msglog_room_t
+
+    uint64_t appended; // records written, writer thread only
+    uint64_t commits;  // batches written, writer thread only
+} nexchat_msglog_t;
+
+// called for every replayed frame, oldest first, after the log is unlocked. The frame is a copy
+// taken out of the mapping, the visitor retains it to keep it
+typedef void (*nexchat_msglog_visit_fn)(void* ctx, nexchat_msgbuf_t* frame);
+
+// opens or creates the log in `config->dir`, rebuilds the room index from the segments
+// on disk and starts the writer thread
+int32_t nexchat_msglog_open(nexchat_msglog_t* log, const nexchat_msglog_config_t* config);
+
+// writes out everything queued so far and releases the log
+void nexchat_msglog_close(nexchat_msglog_t* log);
+
+// queues `frame` for the writer, never touches the disk on the calling thread
+void nexchat_msglog_append(nexchat_msglog_t* log, const char* room, nexchat_msgbuf_t* frame);
+
+// visits up to `limit` of the most recent committed messages of `room`, returns how many
+size_t nexchat_msglog_replay(nexchat_msglog_t* log, const char* room, size_t limit, nexchat_msglog_visit_fn visit, void* ctx);
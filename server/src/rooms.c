@@ -0,0 +1,107 @@
+#include "rooms.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+nexchat_room_t* nexchat_room_create(const char* name, size_t shard_count)
+{
+    nexchat_room_t* room = (nexchat_room_t*)calloc(1, sizeof(nexchat_room_t));
+    if (room == NULL)
+    {
+        return NULL;
+    }
+
+    room->shards = (nexchat_room_members_t*)calloc(shard_count, sizeof(nexchat_room_members_t));
+    if (room->shards == NULL)
+    {
+        free(room);
+        return NULL;
+    }
+
+    snprintf(room->name, sizeof(room->name), "%s", name);
+    room->refs = 1;
+    room->shard_count = shard_count;
+
+    return room;
+}
+
+void nexchat_room_free(nexchat_room_t* room)
+{
+    for (size_t i = 0; i < room->shard_count; i++)
+    {
+        free(room->shards[i].clients);
+    }
+
+    free(room->shards);
+    free(room);
+}
+
+void nexchat_room_release(nexchat_room_t* room)
+{
+    // acq_rel so the freeing thread observes every write made through other references
+    if (__atomic_sub_fetch(&room->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        nexchat_room_free(room);
+    }
+}
+
+int32_t nexchat_room_add(nexchat_room_t* room, size_t shard, nexchat_client_state_t* client)
+{
+    nexchat_room_members_t* members = &room->shards[shard];
+
+    if (members->count == members->capacity)
+    {
+        size_t capacity = members->capacity > 0 ? members->capacity * 2 : 8;
+        nexchat_client_state_t** clients = (nexchat_client_state_t**)realloc(members->clients, capacity * sizeof(nexchat_client_state_t*));
+        if (clients == NULL)
+        {
+            return -1;
+        }
+
+        members->clients = clients;
+        members->capacity = capacity;
+    }
+
+    if (room->presence)
+    {
+        client->subscribed = true;
+        client->presence_slot = members->count;
+    }
+    else
+    {
+        client->room = room;
+        client->room_slot = members->count;
+    }
+
+    members->clients[members->count] = client;
+    __atomic_store_n(&members->count, members->count + 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void nexchat_room_remove(nexchat_room_t* room, size_t shard, nexchat_client_state_t* client)
+{
+    nexchat_room_members_t* members = &room->shards[shard];
+    size_t last = members->count - 1;
+
+    // move the last member into the hole
+    nexchat_client_state_t* moved = members->clients[last];
+
+    if (room->presence)
+    {
+        members->clients[client->presence_slot] = moved;
+        moved->presence_slot = client->presence_slot;
+        client->subscribed = false;
+        client->presence_slot = 0;
+    }
+    else
+    {
+        members->clients[client->room_slot] = moved;
+        moved->room_slot = client->room_slot;
+        client->room = NULL;
+        client->room_slot = 0;
+    }
+
+    __atomic_store_n(&members->count, last, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "libcommon/libcommon.h"
+
+#define ROOM_NAME_MAX 32
+#define ROOM_LOBBY    "lobby"
+
+// Members of one room that live on one shard. Only that shard's thread touches the array;
+// `count` is also read by other shards to skip posting broadcasts to shards with no audience.
+typedef struct nexchat_room_members_t
+{
+    nexchat_client_state_t** clients;
+    size_t count;
+    size_t capacity;
+} nexchat_room_members_t;
+
+// A chat room. Rooms are created on first /join and leave the server's room table when their
+// last member does, the lobby excepted, so --max-rooms bounds the rooms in use rather than the
+// rooms ever made. The table holds one reference and every broadcast posted to another shard
+// holds one until it has been fanned out, so a room that empties with posts in flight is freed
+// by whoever drops the last one.
+typedef struct nexchat_room_t
+{
+    char name[ROOM_NAME_MAX];
+    uint32_t refs;                   // atomic
+    size_t members;                  // across all shards, guarded by the server's rooms_mutex
+    nexchat_room_members_t* shards;  // one entry per shard
+    size_t shard_count;
+    bool presence;                   // the /presence subscribers, members keep their own room and use presence_slot
+} nexchat_room_t;
+
+// returns a room holding one reference, or NULL
+nexchat_room_t* nexchat_room_create(const char* name, size_t shard_count);
+void nexchat_room_free(nexchat_room_t* room);
+
+static inline nexchat_room_t* nexchat_room_retain(nexchat_room_t* room)
+{
+    __atomic_add_fetch(&room->refs, 1, __ATOMIC_RELAXED);
+    return room;
+}
+
+// frees the room when the last reference is dropped
+void nexchat_room_release(nexchat_room_t* room);
+
+// adds `client` to the members on `shard`, returns -1 on allocation failure
+int32_t nexchat_room_add(nexchat_room_t* room, size_t shard, nexchat_client_state_t* client);
+
+// O(1) swap-remove, `client` must be a member on `shard`
+void nexchat_room_remove(nexchat_room_t* room, size_t shard, nexchat_client_state_t* client);
+
+static inline size_t nexchat_room_count_on(const nexchat_room_t* room, size_t shard)
+{
+    return __atomic_load_n(&room->shards[shard].count, __ATOMIC_RELAXED);
+}
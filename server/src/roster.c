@@ -0,0 +1,635 @@
+#include "roster.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static nexchat_roster_bucket_t* nexchat_roster_bucket_create(size_t count, size_t chunks)
+{
+    // keep the index at most half full so probes stay short
+    size_t capacity = 8;
+    while (capacity < count * 2)
+    {
+        capacity *= 2;
+    }
+
+    size_t size = sizeof(nexchat_roster_bucket_t) + count * sizeof(nexchat_roster_entry_t*) +
+                  chunks * sizeof(nexchat_roster_chunk_t) + capacity * sizeof(uint32_t);
+    nexchat_roster_bucket_t* bucket = (nexchat_roster_bucket_t*)malloc(size);
+    if (bucket == NULL)
+    {
+        return NULL;
+    }
+
+    // one allocation, the chunks and then the index follow the entry pointers
+    bucket->count = 0;
+    bucket->chunks = (nexchat_roster_chunk_t*)&bucket->entries[count];
+    bucket->chunk_count = 0;
+    bucket->index = (uint32_t*)&bucket->chunks[chunks];
+    bucket->index_mask = capacity - 1;
+    memset(bucket->index, 0xff, capacity * sizeof(uint32_t));
+
+    return bucket;
+}
+
+// frees the bucket and its references to the listing, entries are owned elsewhere
+static void nexchat_roster_bucket_free(void* ptr)
+{
+    nexchat_roster_bucket_t* bucket = (nexchat_roster_bucket_t*)ptr;
+
+    for (size_t i = 0; i < bucket->chunk_count; i++)
+    {
+        nexchat_msgbuf_release(bucket->chunks[i].frame);
+    }
+
+    free(bucket);
+}
+
+// a table of `buckets` empty buckets, or a copy of `old`'s table when it is the same width
+static nexchat_roster_snapshot_t* nexchat_roster_snapshot_create(const nexchat_roster_snapshot_t* old, size_t buckets)
+{
+    size_t size = sizeof(nexchat_roster_snapshot_t) + buckets * sizeof(nexchat_roster_bucket_t*);
+    nexchat_roster_snapshot_t* snapshot = (nexchat_roster_snapshot_t*)malloc(size);
+    if (snapshot == NULL)
+    {
+        return NULL;
+    }
+
+    snapshot->version = old != NULL ? old->version + 1 : 0;
+    snapshot->count = old != NULL ? old->count : 0;
+    snapshot->bucket_mask = buckets - 1;
+
+    if (old != NULL && old->bucket_mask == snapshot->bucket_mask)
+    {
+        memcpy(snapshot->buckets, old->buckets, buckets * sizeof(nexchat_roster_bucket_t*));
+    }
+    else
+    {
+        memset(snapshot->buckets, 0, buckets * sizeof(nexchat_roster_bucket_t*));
+    }
+
+    return snapshot;
+}
+
+// the buckets of `snapshot` that aren't `old`'s, those it built and nobody else can see yet
+static void nexchat_roster_snapshot_discard(nexchat_roster_snapshot_t* snapshot, const nexchat_roster_snapshot_t* old)
+{
+    bool shared = old->bucket_mask == snapshot->bucket_mask;
+
+    for (size_t i = 0; i <= snapshot->bucket_mask; i++)
+    {
+        if (snapshot->buckets[i] != NULL && (!shared || snapshot->buckets[i] != old->buckets[i]))
+        {
+            nexchat_roster_bucket_free(snapshot->buckets[i]);
+        }
+    }
+
+    free(snapshot);
+}
+
+// one text frame listing entries [first, first + count), `count` is never 0
+static nexchat_msgbuf_t* nexchat_roster_encode_chunk(const nexchat_roster_bucket_t* bucket, size_t first, size_t count)
+{
+    uint8_t frame[NEXCHAT_FRAME_HEADER_SIZE + NEXCHAT_ROSTER_CHUNK + 1];
+    size_t size = 0;
+
+    for (size_t i = first; i < first + count; i++)
+    {
+        const char* username = bucket->entries[i]->username;
+        size_t len = strlen(username);
+
+        memcpy(frame + NEXCHAT_FRAME_HEADER_SIZE + size, username, len);
+        frame[NEXCHAT_FRAME_HEADER_SIZE + size + len] = '\n';
+        size += len + 1;
+    }
+
+    // the last line ends the text rather than the line, clients print one frame per line
+    frame[NEXCHAT_FRAME_HEADER_SIZE + size - 1] = '\0';
+    nexchat_frame_write_header(frame, FRAME_TEXT, (uint32_t)size);
+
+    return nexchat_msgbuf_create(frame, NEXCHAT_FRAME_HEADER_SIZE + size);
+}
+
+// listing bytes a chunk holds, newlines between the names but not the terminator
+static size_t nexchat_roster_chunk_bytes(const nexchat_roster_chunk_t* chunk)
+{
+    return chunk->frame->size - NEXCHAT_FRAME_HEADER_SIZE - 1;
+}
+
+// packs the whole listing from scratch, every chunk but the last as full as it goes
+static int32_t nexchat_roster_build_listing(nexchat_roster_bucket_t* bucket)
+{
+    size_t first = 0;
+    size_t bytes = 0;
+
+    for (size_t i = 0; i <= bucket->count; i++)
+    {
+        size_t line = i < bucket->count ? strlen(bucket->entries[i]->username) + 1 : 0;
+
+        if (i > first && (i == bucket->count || bytes + line > NEXCHAT_ROSTER_CHUNK))
+        {
+            nexchat_roster_chunk_t* chunk = &bucket->chunks[bucket->chunk_count];
+            chunk->frame = nexchat_roster_encode_chunk(bucket, first, i - first);
+            if (chunk->frame == NULL)
+            {
+                return -1;
+            }
+
+            chunk->first = first;
+            chunk->count = i - first;
+            bucket->chunk_count++;
+
+            first = i;
+            bytes = 0;
+        }
+
+        bytes += line;
+    }
+
+    return 0;
+}
+
+// carries the listing of `old` over to `bucket`, which is `old` with the entry at `removed`
+// (SIZE_MAX for none) taken out and, when `added`, a new entry at the end. Only the chunk that
+// lost a name and the one that gains it are encoded again
+static int32_t nexchat_roster_patch_listing(nexchat_roster_bucket_t* bucket, const nexchat_roster_bucket_t* old, size_t removed, bool added)
+{
+    for (size_t i = 0; old != NULL && i < old->chunk_count; i++)
+    {
+        nexchat_roster_chunk_t chunk = old->chunks[i];
+
+        if (removed != SIZE_MAX && removed >= chunk.first && removed < chunk.first + chunk.count)
+        {
+            if (--chunk.count == 0)
+            {
+                continue;
+            }
+
+            chunk.frame = nexchat_roster_encode_chunk(bucket, chunk.first, chunk.count);
+            if (chunk.frame == NULL)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            chunk.first -= removed != SIZE_MAX && chunk.first > removed ? 1 : 0;
+            chunk.frame = nexchat_msgbuf_retain(chunk.frame);
+        }
+
+        bucket->chunks[bucket->chunk_count++] = chunk;
+    }
+
+    if (!added)
+    {
+        return 0;
+    }
+
+    size_t line = strlen(bucket->entries[bucket->count - 1]->username) + 1;
+    nexchat_roster_chunk_t* last = bucket->chunk_count > 0 ? &bucket->chunks[bucket->chunk_count - 1] : NULL;
+
+    if (last != NULL && nexchat_roster_chunk_bytes(last) + line <= NEXCHAT_ROSTER_CHUNK)
+    {
+        nexchat_msgbuf_t* frame = nexchat_roster_encode_chunk(bucket, last->first, last->count + 1);
+        if (frame == NULL)
+        {
+            return -1;
+        }
+
+        nexchat_msgbuf_release(last->frame);
+        last->frame = frame;
+        last->count++;
+        return 0;
+    }
+
+    nexchat_roster_chunk_t* chunk = &bucket->chunks[bucket->chunk_count];
+    chunk->frame = nexchat_roster_encode_chunk(bucket, bucket->count - 1, 1);
+    if (chunk->frame == NULL)
+    {
+        return -1;
+    }
+
+    chunk->first = bucket->count - 1;
+    chunk->count = 1;
+    bucket->chunk_count++;
+
+    return 0;
+}
+
+static void nexchat_roster_bucket_push(nexchat_roster_bucket_t* bucket, nexchat_roster_entry_t* entry)
+{
+    size_t slot = entry->hash & bucket->index_mask;
+    while (bucket->index[slot] != UINT32_MAX)
+    {
+        slot = (slot + 1) & bucket->index_mask;
+    }
+
+    bucket->index[slot] = (uint32_t)bucket->count;
+    bucket->entries[bucket->count++] = entry;
+}
+
+// chunks a freshly packed listing of `count` names may need. Every chunk but the last is closed
+// only when a line of at most 64 bytes won't fit, so it carries more than NEXCHAT_ROSTER_CHUNK - 64
+static size_t nexchat_roster_chunks_for(size_t count)
+{
+    return count / ((NEXCHAT_ROSTER_CHUNK - 64) / 64) + 1;
+}
+
+// `old` without `remove` and with `add` at the end, either may be NULL, as are `old` and the
+// result when empty. -1 when out of memory
+static int32_t nexchat_roster_bucket_update(const nexchat_roster_bucket_t* old, nexchat_roster_entry_t* remove, nexchat_roster_entry_t* add,
+                                            nexchat_roster_bucket_t** out)
+{
+    size_t before = old != NULL ? old->count : 0;
+    size_t count = before - (remove != NULL ? 1 : 0) + (add != NULL ? 1 : 0);
+
+    *out = NULL;
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // removing never adds a chunk, adding adds at most one
+    nexchat_roster_bucket_t* bucket = nexchat_roster_bucket_create(count, (old != NULL ? old->chunk_count : 0) + 1);
+    if (bucket == NULL)
+    {
+        return -1;
+    }
+
+    size_t removed = SIZE_MAX;
+
+    for (size_t i = 0; i < before; i++)
+    {
+        if (old->entries[i] != remove)
+        {
+            nexchat_roster_bucket_push(bucket, old->entries[i]);
+        }
+        else
+        {
+            removed = i;
+        }
+    }
+
+    if (add != NULL)
+    {
+        nexchat_roster_bucket_push(bucket, add);
+    }
+
+    if (nexchat_roster_patch_listing(bucket, old, removed, add != NULL) == -1)
+    {
+        nexchat_roster_bucket_free(bucket);
+        return -1;
+    }
+
+    *out = bucket;
+    return 0;
+}
+
+// every entry of `old` but `remove`, and `add`, spread over a table `buckets` wide, a multiple
+// of the old width. Each new bucket draws from a single old one, so join order within it holds
+static nexchat_roster_snapshot_t* nexchat_roster_repack(const nexchat_roster_snapshot_t* old, nexchat_roster_entry_t* remove, nexchat_roster_entry_t* add,
+                                                        size_t buckets)
+{
+    nexchat_roster_snapshot_t* snapshot = nexchat_roster_snapshot_create(old, buckets);
+    size_t* counts = (size_t*)calloc(buckets, sizeof(size_t));
+
+    if (snapshot == NULL || counts == NULL)
+    {
+        free(snapshot);
+        free(counts);
+        return NULL;
+    }
+
+    for (size_t b = 0; b <= old->bucket_mask; b++)
+    {
+        const nexchat_roster_bucket_t* bucket = old->buckets[b];
+        for (size_t i = 0; bucket != NULL && i < bucket->count; i++)
+        {
+            counts[nexchat_roster_bucket_of(snapshot, bucket->entries[i]->hash)] += bucket->entries[i] != remove ? 1 : 0;
+        }
+    }
+
+    if (add != NULL)
+    {
+        counts[nexchat_roster_bucket_of(snapshot, add->hash)]++;
+    }
+
+    bool failed = false;
+
+    for (size_t b = 0; b < buckets && !failed; b++)
+    {
+        if (counts[b] > 0)
+        {
+            snapshot->buckets[b] = nexchat_roster_bucket_create(counts[b], nexchat_roster_chunks_for(counts[b]));
+            failed = snapshot->buckets[b] == NULL;
+        }
+    }
+
+    free(counts);
+
+    for (size_t b = 0; b <= old->bucket_mask && !failed; b++)
+    {
+        const nexchat_roster_bucket_t* bucket = old->buckets[b];
+        for (size_t i = 0; bucket != NULL && i < bucket->count; i++)
+        {
+            if (bucket->entries[i] != remove)
+            {
+                nexchat_roster_bucket_push(snapshot->buckets[nexchat_roster_bucket_of(snapshot, bucket->entries[i]->hash)], bucket->entries[i]);
+            }
+        }
+    }
+
+    if (add != NULL && !failed)
+    {
+        nexchat_roster_bucket_push(snapshot->buckets[nexchat_roster_bucket_of(snapshot, add->hash)], add);
+    }
+
+    for (size_t b = 0; b < buckets && !failed; b++)
+    {
+        failed = snapshot->buckets[b] != NULL && nexchat_roster_build_listing(snapshot->buckets[b]) == -1;
+    }
+
+    if (failed)
+    {
+        nexchat_roster_snapshot_discard(snapshot, old);
+        return NULL;
+    }
+
+    snapshot->count = old->count - (remove != NULL ? 1 : 0) + (add != NULL ? 1 : 0);
+    return snapshot;
+}
+
+// hands `old` to the epoch along with each of its buckets `snapshot` no longer shares, -1 when
+// some of it couldn't be and is leaked, the only safe option left
+static int32_t nexchat_roster_retire(nexchat_roster_t* roster, nexchat_roster_snapshot_t* old, const nexchat_roster_snapshot_t* snapshot)
+{
+    bool shared = old->bucket_mask == snapshot->bucket_mask;
+    int32_t status = 0;
+
+    for (size_t b = 0; b <= old->bucket_mask; b++)
+    {
+        nexchat_roster_bucket_t* bucket = old->buckets[b];
+        if (bucket != NULL && (!shared || snapshot->buckets[b] != bucket) && nexchat_epoch_retire(&roster->epoch, bucket, nexchat_roster_bucket_free) == -1)
+        {
+            status = -1;
+        }
+    }
+
+    return nexchat_epoch_retire(&roster->epoch, old, free) == -1 ? -1 : status;
+}
+
+int32_t nexchat_roster_init(nexchat_roster_t* roster, size_t readers)
+{
+    if (nexchat_epoch_init(&roster->epoch, readers) == -1)
+    {
+        return -1;
+    }
+
+    roster->current = nexchat_roster_snapshot_create(NULL, NEXCHAT_ROSTER_MIN_BUCKETS);
+    if (roster->current == NULL)
+    {
+        nexchat_epoch_free(&roster->epoch);
+        return -1;
+    }
+
+    pthread_mutex_init(&roster->writer, NULL);
+
+    return 0;
+}
+
+void nexchat_roster_free(nexchat_roster_t* roster)
+{
+    // snapshots only share entries and buckets, the current one owns those still connected
+    nexchat_epoch_free(&roster->epoch);
+
+    nexchat_roster_snapshot_t* snapshot = roster->current;
+
+    for (size_t b = 0; b <= snapshot->bucket_mask; b++)
+    {
+        nexchat_roster_bucket_t* bucket = snapshot->buckets[b];
+        if (bucket == NULL)
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < bucket->count; i++)
+        {
+            free(bucket->entries[i]);
+        }
+
+        nexchat_roster_bucket_free(bucket);
+    }
+
+    free(snapshot);
+    pthread_mutex_destroy(&roster->writer);
+    roster->current = NULL;
+}
+
+nexchat_roster_entry_t* nexchat_roster_find(const nexchat_roster_snapshot_t* snapshot, const char* username)
+{
+    uint64_t hash = nexchat_strhash(username);
+    const nexchat_roster_bucket_t* bucket = snapshot->buckets[nexchat_roster_bucket_of(snapshot, hash)];
+    if (bucket == NULL)
+    {
+        return NULL;
+    }
+
+    size_t slot = hash & bucket->index_mask;
+
+    while (bucket->index[slot] != UINT32_MAX)
+    {
+        nexchat_roster_entry_t* entry = bucket->entries[bucket->index[slot]];
+        if (entry->hash == hash && strcmp(entry->username, username) == 0)
+        {
+            return entry;
+        }
+
+        slot = (slot + 1) & bucket->index_mask;
+    }
+
+    return NULL;
+}
+
+nexchat_roster_entry_t* nexchat_roster_entry_create(const char* username, nexchat_client_state_t* client)
+{
+    nexchat_roster_entry_t* entry = (nexchat_roster_entry_t*)calloc(1, sizeof(nexchat_roster_entry_t));
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    snprintf(entry->username, sizeof(entry->username), "%s", username);
+    entry->hash = nexchat_strhash(entry->username);
+    entry->client = client;
+    entry->client_id = client->id;
+    entry->sockfd = client->sockfd;
+
+    return entry;
+}
+
+nexchat_roster_entry_t* nexchat_roster_entry_create_remote(const char* username, uint64_t node)
+{
+    nexchat_roster_entry_t* entry = (nexchat_roster_entry_t*)calloc(1, sizeof(nexchat_roster_entry_t));
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    // nothing on this server to kick or message directly
+    snprintf(entry->username, sizeof(entry->username), "%s", username);
+    entry->hash = nexchat_strhash(entry->username);
+    entry->sockfd = -1;
+    entry->node = node;
+
+    return entry;
+}
+
+int32_t nexchat_roster_update(nexchat_roster_t* roster, nexchat_roster_entry_t* remove, nexchat_roster_entry_t* add)
+{
+    nexchat_roster_snapshot_t* old = roster->current;
+    size_t count = old->count - (remove != NULL ? 1 : 0) + (add != NULL ? 1 : 0);
+    size_t buckets = old->bucket_mask + 1;
+
+    // the table widens once the buckets would run deeper than it is wide
+    bool widen = count > buckets * buckets;
+    nexchat_roster_snapshot_t* snapshot = widen ? nexchat_roster_repack(old, remove, add, buckets * 2) : nexchat_roster_snapshot_create(old, buckets);
+    if (snapshot == NULL)
+    {
+        return -1;
+    }
+
+    if (!widen)
+    {
+        size_t from = remove != NULL ? nexchat_roster_bucket_of(old, remove->hash) : SIZE_MAX;
+        size_t to = add != NULL ? nexchat_roster_bucket_of(old, add->hash) : SIZE_MAX;
+        int32_t status = 0;
+
+        // a rename that stays in its bucket copies it once
+        if (from == to && from != SIZE_MAX)
+        {
+            status = nexchat_roster_bucket_update(old->buckets[from], remove, add, &snapshot->buckets[from]);
+        }
+        else
+        {
+            if (from != SIZE_MAX)
+            {
+                status = nexchat_roster_bucket_update(old->buckets[from], remove, NULL, &snapshot->buckets[from]);
+            }
+
+            if (status == 0 && to != SIZE_MAX)
+            {
+                status = nexchat_roster_bucket_update(old->buckets[to], NULL, add, &snapshot->buckets[to]);
+            }
+        }
+
+        if (status == -1)
+        {
+            nexchat_roster_snapshot_discard(snapshot, old);
+            return -1;
+        }
+
+        snapshot->count = count;
+    }
+
+    __atomic_store_n(&roster->current, snapshot, __ATOMIC_SEQ_CST);
+
+    // readers may still be walking the old roster, free what it no longer shares once they've left
+    if (nexchat_roster_retire(roster, old, snapshot) == -1 ||
+        (remove != NULL && nexchat_epoch_retire(&roster->epoch, remove, free) == -1))
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory retiring roster, leaking it");
+    }
+
+    return 0;
+}
+
+static bool nexchat_roster_unlisted(const nexchat_roster_entry_t* entry, uint64_t node, uint64_t listed)
+{
+    return entry->node == node && entry->client == NULL && entry->listed < listed;
+}
+
+int32_t nexchat_roster_remove_node(nexchat_roster_t* roster, uint64_t node, uint64_t listed)
+{
+    nexchat_roster_snapshot_t* old = roster->current;
+    nexchat_roster_snapshot_t* snapshot = NULL;
+    size_t removed = 0;
+
+    for (size_t b = 0; b <= old->bucket_mask; b++)
+    {
+        const nexchat_roster_bucket_t* bucket = old->buckets[b];
+        size_t gone = 0;
+
+        for (size_t i = 0; bucket != NULL && i < bucket->count; i++)
+        {
+            gone += nexchat_roster_unlisted(bucket->entries[i], node, listed) ? 1 : 0;
+        }
+
+        if (gone == 0)
+        {
+            continue;
+        }
+
+        // the table is copied with the first bucket that changes, untouched ones stay shared
+        if (snapshot == NULL && (snapshot = nexchat_roster_snapshot_create(old, old->bucket_mask + 1)) == NULL)
+        {
+            return -1;
+        }
+
+        removed += gone;
+        snapshot->buckets[b] = NULL;
+
+        if (gone == bucket->count)
+        {
+            continue;
+        }
+
+        nexchat_roster_bucket_t* kept = nexchat_roster_bucket_create(bucket->count - gone, nexchat_roster_chunks_for(bucket->count - gone));
+        snapshot->buckets[b] = kept;
+
+        for (size_t i = 0; kept != NULL && i < bucket->count; i++)
+        {
+            if (!nexchat_roster_unlisted(bucket->entries[i], node, listed))
+            {
+                nexchat_roster_bucket_push(kept, bucket->entries[i]);
+            }
+        }
+
+        if (kept == NULL || nexchat_roster_build_listing(kept) == -1)
+        {
+            nexchat_roster_snapshot_discard(snapshot, old);
+            return -1;
+        }
+    }
+
+    if (snapshot == NULL)
+    {
+        return 0;
+    }
+
+    snapshot->count = old->count - removed;
+
+    __atomic_store_n(&roster->current, snapshot, __ATOMIC_SEQ_CST);
+
+    bool leaked = false;
+
+    for (size_t b = 0; b <= old->bucket_mask; b++)
+    {
+        const nexchat_roster_bucket_t* bucket = old->buckets[b];
+        for (size_t i = 0; bucket != NULL && bucket != snapshot->buckets[b] && i < bucket->count; i++)
+        {
+            if (nexchat_roster_unlisted(bucket->entries[i], node, listed) && nexchat_epoch_retire(&roster->epoch, bucket->entries[i], free) == -1)
+            {
+                leaked = true;
+            }
+        }
+    }
+
+    leaked = nexchat_roster_retire(roster, old, snapshot) == -1 || leaked;
+
+    if (leaked)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory retiring roster, leaking it");
+    }
+
+    return (int32_t)removed;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "libcommon/libcommon.h"
+#include "libcommon/epoch.h"
+
+// one connected user, immutable once published except for the vote count
+typedef struct nexchat_roster_entry_t
+{
+    char username[64];
+    uint64_t hash; // nexchat_strhash(username), copying a snapshot doesn't hash every name again
+    nexchat_client_state_t* client; // owned by shard (client_id >> CLIENT_ID_SHARD_SHIFT), don't touch it
+    uint64_t client_id;
+    int32_t sockfd;
+    size_t kicks; // atomic, /kick votes against this user
+    uint64_t node; // federation, the server the user is connected to, 0 with `client` set for this one
+    uint64_t listed; // federation thread only, sequence of the snapshot of `node` that last listed the user
+} nexchat_roster_entry_t;
+
+#define NEXCHAT_ROSTER_CHUNK 4096 // most listing bytes per /users frame
+#define NEXCHAT_ROSTER_MIN_BUCKETS 16 // the table starts this wide and doubles as the roster grows
+
+// Part of the /users listing, an encoded text frame holding the names of `count` consecutive
+// entries of one bucket, one per line. Updates rebuild only the chunk they touch, the rest are
+// shared with the previous snapshot by reference, and /users queues them without formatting anything.
+typedef struct nexchat_roster_chunk_t
+{
+    nexchat_msgbuf_t* frame;
+    size_t first;
+    size_t count;
+} nexchat_roster_chunk_t;
+
+// The users whose hash picks this bucket, immutable once published and shared by every
+// snapshot until a write replaces it.
+typedef struct nexchat_roster_bucket_t
+{
+    size_t count;
+    nexchat_roster_chunk_t* chunks; // the bucket's listing, entries stay in join order so chunks cover them in turn
+    size_t chunk_count;
+    uint32_t* index;   // open addressing over `entries` by username hash, UINT32_MAX is empty
+    size_t index_mask; // index capacity - 1
+    nexchat_roster_entry_t* entries[];
+} nexchat_roster_bucket_t;
+
+// An immutable list of every active user. Writers build a new one and swap it in, so a reader
+// sees either the old or the new roster in full and never takes a lock.
+//
+// Lookups are O(1), one bucket and a short probe of its index. A write (join, leave, rename)
+// copies the bucket table and the one or two buckets it touches, rebuilding their index and
+// the listing chunk that changed, under roster->writer. The table is kept about as wide as the
+// buckets are deep, so a write is O(sqrt(N)), a hundred or so pointers each way at 10k users.
+// Widening it repacks every bucket, O(N), but only happens each time the roster quadruples.
+// /users lists the buckets in turn, so users come in join order only within a bucket.
+typedef struct nexchat_roster_snapshot_t
+{
+    uint64_t version;  // counts updates, presence events carry the version they produced
+    size_t count;
+    size_t bucket_mask; // bucket count - 1
+    nexchat_roster_bucket_t* buckets[]; // NULL while empty
+} nexchat_roster_snapshot_t;
+
+// the bucket a username hash belongs in, the index inside it uses the low bits. FNV-1a leaves
+// the middle bits of names differing only in their last characters nearly equal, a Fibonacci
+// multiply spreads them over the table
+static inline size_t nexchat_roster_bucket_of(const nexchat_roster_snapshot_t* snapshot, uint64_t hash)
+{
+    return (size_t)((hash * 0x9e3779b97f4a7c15ull) >> 40) & snapshot->bucket_mask;
+}
+
+typedef struct nexchat_roster_t
+{
+    nexchat_roster_snapshot_t* current; // atomic
+    pthread_mutex_t writer; // serializes writers, readers never take it
+    nexchat_epoch_t epoch;  // one reader slot per shard
+} nexchat_roster_t;
+
+int32_t nexchat_roster_init(nexchat_roster_t* roster, size_t readers);
+void nexchat_roster_free(nexchat_roster_t* roster);
+
+// the snapshot stays valid until the matching nexchat_roster_read_end
+static inline const nexchat_roster_snapshot_t* nexchat_roster_read_begin(nexchat_roster_t* roster, size_t reader)
+{
+    nexchat_epoch_enter(&roster->epoch, reader);
+    return __atomic_load_n(&roster->current, __ATOMIC_SEQ_CST);
+}
+
+static inline void nexchat_roster_read_end(nexchat_roster_t* roster, size_t reader)
+{
+    nexchat_epoch_exit(&roster->epoch, reader);
+}
+
+nexchat_roster_entry_t* nexchat_roster_find(const nexchat_roster_snapshot_t* snapshot, const char* username);
+
+// writers hold roster->writer around these, the current snapshot can be read directly in between
+nexchat_roster_entry_t* nexchat_roster_entry_create(const char* username, nexchat_client_state_t* client);
+nexchat_roster_entry_t* nexchat_roster_entry_create_remote(const char* username, uint64_t node);
+
+// publishes the current roster without `remove` and with `add`, either may be NULL, copying only
+// the buckets they touch, see nexchat_roster_snapshot_t.
+// `remove` and the old snapshot are reclaimed once no reader can see them. -1 when out of memory,
+// in which case nothing changed and the caller still owns `add`
+int32_t nexchat_roster_update(nexchat_roster_t* roster, nexchat_roster_entry_t* remove, nexchat_roster_entry_t* add);
+
+// publishes the current roster without the users of federation `node` listed before `listed`,
+// UINT64_MAX for all of them. Scans every bucket, O(N), and copies only those that lose a user.
+// Returns how many went or -1 when out of memory
+int32_t nexchat_roster_remove_node(nexchat_roster_t* roster, uint64_t node, uint64_t listed);
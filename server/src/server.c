@@ -1,98 +1,51 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <poll.h>
 
-#include "libcommon/libcommon.h"
+#include "server.h"
 
-#define IPADDR     "127.0.0.1"
-#define PORT       "3490"
-#define MAXCLIENTS 20
-
-typedef struct nexchat_server_state_t
-{
-    int32_t sockfd;
-    nexchat_client_state_t clients[MAXCLIENTS];
-    size_t connected_clients;
-    pthread_mutex_t clients_mutex;
-    bool running;
-} nexchat_server_state_t;
-
-typedef struct nexchat_client_thread_data_t
-{
-    nexchat_server_state_t* server_state;
-    size_t client_index;
-} nexchat_client_thread_data_t;
-
-typedef struct nexchat_conn_accept_result_t
-{
-    int32_t connfd;
-    char username[64];
-} nexchat_conn_accept_result_t;
-
-typedef enum nexchat_client_command_t
-{
-    CMD_NONE,
-    CMD_SETUSERNAME,
-    CMD_LISTUSERS,
-    CMD_KICKUSER,
-    CMD_MAXCOMMANDS,
-} nexchat_client_command_t;
-
-const char* nexchat_client_command_to_str(nexchat_client_command_t cmd)
-{
-    switch (cmd)
-    {
-        case CMD_SETUSERNAME: return "set-username";
-        case CMD_LISTUSERS: return "users";
-        case CMD_KICKUSER: return "kick";
-    }
-
-    return "none";
-}
-
-const char* nexchat_client_command_get_desc(nexchat_client_command_t cmd)
+const void* nexchat_get_inet_addr(struct sockaddr* sa)
 {
-    switch (cmd)
+    if (sa->sa_family == AF_INET) // IPv4
     {
-        case CMD_SETUSERNAME: return "Set a new username";
-        case CMD_LISTUSERS: return "List all users in the chat";
-        case CMD_KICKUSER: return "Vote to kick a user from the chat. If the majority agrees, the user will be kicked.";
+        return &((struct sockaddr_in*)sa)->sin_addr;
     }
 
-    return "none";
+    return &((struct sockaddr_in6*)sa)->sin6_addr;
 }
 
-const void* nexchat_get_inet_addr(struct sockaddr* sa)
+int32_t nexchat_set_nonblocking(int32_t fd)
 {
-    if (sa->sa_family == AF_INET) // IPv4
+    int32_t flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
     {
-        return &((struct sockaddr_in*)sa)->sin_addr;
+        return -1;
     }
 
-    return &((struct sockaddr_in6*)sa)->sin6_addr;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-int32_t nexchat_server_bind(nexchat_server_state_t* state, const nexchat_inet_id_t* id);
-void nexchat_server_launch(nexchat_server_state_t* state);
-void nexchat_server_shutdown(nexchat_server_state_t* state);
-nexchat_conn_accept_result_t nexchat_server_accept_connection(nexchat_server_state_t* state);
-void* nexchat_server_handle_client(void* arg);
-void nexchat_server_sendmsg(int32_t sockfd, const char* msg);
-int32_t nexchat_server_recvmsg(int32_t sockfd, char* recvbuf, size_t size);
-void nexchat_server_send_cmdlist_to_client(int32_t sockfd);
-void nexchat_server_exec_cmd(nexchat_server_state_t* state, nexchat_client_state_t* client, nexchat_client_command_t cmd, size_t argc, const char* argv);
-void nexchat_server_broadcast_msg(nexchat_server_state_t* state, nexchat_client_state_t* sender, const char* username, const char* msg);
-void nexchat_server_disconnect_client(nexchat_server_state_t* state, int32_t sockfd);
-void nexchat_server_kick_client(nexchat_server_state_t* state, int32_t sockfd);
-
-int32_t nexchat_server_bind(nexchat_server_state_t* state, const nexchat_inet_id_t* id)
+int32_t nexchat_server_bind(nexchat_server_shard_t* shard, const nexchat_inet_id_t* id)
 {
     struct addrinfo hints;
     memset(&hints, 0, sizeof hints);
@@ -105,7 +58,7 @@ int32_t nexchat_server_bind(nexchat_server_state_t* state, const nexchat_inet_id
 
     if (status != 0)
     {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        nexchat_log(NEXCHAT_LOG_ERROR, "getaddrinfo: %s", gai_strerror(status));
         return -1;
     }
 
@@ -114,24 +67,32 @@ int32_t nexchat_server_bind(nexchat_server_state_t* state, const nexchat_inet_id
     
     for (it = res; it != NULL; it = it->ai_next)
     {
-        state->sockfd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
-        if (state->sockfd == -1)
+        shard->sockfd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (shard->sockfd == -1)
+        {
+            nexchat_log_errno("socket");
+            continue;
+        }
+
+        if (setsockopt(shard->sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int32_t)) == -1)
         {
-            perror("socket");
+            nexchat_log_errno("setsockopt");
+            close(shard->sockfd);
             continue;
         }
 
-        if (setsockopt(state->sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int32_t)) == -1)
+        // every shard binds its own socket to the same address and the kernel spreads connections across them
+        if (shard->server->shard_count > 1 && setsockopt(shard->sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int32_t)) == -1)
         {
-            perror("setsockopt");
-            close(state->sockfd);
+            nexchat_log_errno("setsockopt");
+            close(shard->sockfd);
             continue;
         }
 
-        if (bind(state->sockfd, it->ai_addr, it->ai_addrlen) == -1)
+        if (bind(shard->sockfd, it->ai_addr, it->ai_addrlen) == -1)
         {
-            perror("bind");
-            close(state->sockfd);
+            nexchat_log_errno("bind");
+            close(shard->sockfd);
             continue;
         }
 
@@ -140,7 +101,9 @@ int32_t nexchat_server_bind(nexchat_server_state_t* state, const nexchat_inet_id
 
     if (it == NULL)
     {
-        fprintf(stderr, "server: failed to bind\n");
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to bind");
+        shard->sockfd = -1;
+        freeaddrinfo(res);
         return -1;
     }
 
@@ -151,461 +114,3529 @@ int32_t nexchat_server_bind(nexchat_server_state_t* state, const nexchat_inet_id
 
 void nexchat_server_launch(nexchat_server_state_t* state)
 {
-    if (listen(state->sockfd, MAXCLIENTS) == -1)
-    {
-        perror("listen");
-        fprintf(stderr, "server: failed to start listening\n");
-        return;
-    }
-    
     state->running = true;
     state->connected_clients = 0;
-    pthread_mutex_init(&state->clients_mutex, NULL);
+    state->active_clients = 0;
+    state->started_ns = nexchat_clock_now_ns();
+    pthread_mutex_init(&state->rooms_mutex, NULL);
 
-    for (size_t i = 0; i < MAXCLIENTS; i++)
+    if (nexchat_strmap_init(&state->rooms, 64) == -1)
     {
-        nexchat_client_state_t* client = &state->clients[i];
-        client->connected = false;
-        client->sockfd = 0;
-        memset(client->username, 0, sizeof(client->username));
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to allocate room registry");
+        return;
     }
-    
-    printf("server: listening for connections...\n");
 
-    while (state->running)
+    if (state->config.log.dir != NULL)
     {
-        nexchat_conn_accept_result_t result = nexchat_server_accept_connection(state);
-
-        if (result.connfd == -1)
+        if (nexchat_msglog_open(&state->log, &state->config.log) == -1)
         {
-            fprintf(stderr, "server: failed to accept connection\n");
-            continue;
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to open message log in '%s'", state->config.log.dir);
+            return;
         }
 
-        bool found_empty_slot = false;
+        state->logging = true;
+    }
 
-        for (size_t i = 0; i < MAXCLIENTS; i++)
-        {
-            nexchat_client_state_t* client = &state->clients[i];
+    if (state->config.backend == NEXCHAT_BACKEND_URING && !nexchat_uring_supported())
+    {
+        nexchat_log_errno("io_uring");
+        nexchat_log(NEXCHAT_LOG_WARN, "server: io_uring is not available, falling back to epoll");
+        state->config.backend = NEXCHAT_BACKEND_EPOLL;
+    }
 
-            if (client->connected)
-            {
-                continue;
-            }
+    state->shard_count = state->config.workers;
+    state->shards = (nexchat_server_shard_t*)calloc(state->shard_count, sizeof(nexchat_server_shard_t));
+    if (state->shards == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to allocate shards");
+        return;
+    }
 
-            pthread_mutex_lock(&state->clients_mutex);
-            
-            client->sockfd = result.connfd;
-            snprintf(client->username, sizeof(client->username) - 1, "%s\0", result.username);
-            client->connected = true;
+    // each shard reads the roster from its own thread and gets its own reader slot
+    if (nexchat_roster_init(&state->roster, state->shard_count) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to allocate user roster");
+        return;
+    }
 
-            // launch client recv thread
-            nexchat_client_thread_data_t client_thread_data = {.server_state=state, .client_index=i};
-            pthread_create(&client->recv_thread, NULL, nexchat_server_handle_client, &client_thread_data);
-            pthread_detach(client->recv_thread);
-            
-            state->connected_clients++;
+    state->presence = nexchat_room_create("presence", state->shard_count);
+    if (state->presence == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to allocate presence subscribers");
+        return;
+    }
 
-            pthread_mutex_unlock(&state->clients_mutex);
+    state->presence->presence = true;
 
-            char sendbuf[1024];
-            snprintf(sendbuf, sizeof(sendbuf) - 1, "%s connected\0", client->username);
-            nexchat_server_broadcast_msg(state, client, NULL, sendbuf);
+    // presence versions carry on from the process this one replaced
+    if (state->upgrade.inherited)
+    {
+        state->roster.current->version = state->upgrade.roster_version;
+    }
 
-            memset(sendbuf, 0, sizeof sendbuf);
-            snprintf(sendbuf, sizeof(sendbuf) - 1, "type /commands to see a list of commands.\0");
-            nexchat_server_sendmsg(client->sockfd, sendbuf);
+    nexchat_inet_id_t id = {.ipaddr=state->config.ipaddr, .service=state->config.port};
 
-            found_empty_slot = true;
-            break;
+    for (size_t i = 0; i < state->shard_count; i++)
+    {
+        nexchat_server_shard_t* shard = &state->shards[i];
+        shard->server = state;
+        shard->index = i;
+        shard->sockfd = -1;
+        shard->epollfd = -1;
+        shard->eventfd = -1;
+        shard->timerfd = -1;
+        shard->signalfd = -1;
+
+        // after a hot upgrade the listening sockets are the old process's, connections waiting in
+        // their backlog included
+        nexchat_upgrade_t* up = &state->upgrade;
+        if (i < up->listener_count)
+        {
+            shard->sockfd = up->listeners[i];
+            up->listeners[i] = -1;
         }
 
-        if (!found_empty_slot)
+        if ((shard->sockfd == -1 && nexchat_server_bind(shard, &id) == -1) || nexchat_server_init_shard(shard) == -1)
         {
-            printf("server: reached maximum number of clients, failed to accept new connection\n");
-            continue;
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to start worker %zu", i);
+            state->shard_count = i + 1;
+            return;
         }
     }
-}
 
-void nexchat_server_shutdown(nexchat_server_state_t* state)
-{
-    pthread_mutex_lock(&state->clients_mutex);
-    for (size_t i = 0; i < MAXCLIENTS; i++)
+    nexchat_log(NEXCHAT_LOG_INFO, "server: listening for connections on %zu %s worker(s) (up to %zu clients)...", state->shard_count,
+        state->config.backend == NEXCHAT_BACKEND_URING ? "io_uring" : "epoll", state->config.max_clients);
+
+    if (state->upgrade.inherited)
+    {
+        nexchat_server_adopt_clients(state);
+        state->config.federation.node = state->upgrade.node;
+        state->config.federation.seq = state->upgrade.seq;
+    }
+
+    if (state->config.federation.port != NULL || state->config.federation.link_count > 0)
+    {
+        if (nexchat_federation_open(&state->federation, state, &state->config.federation) == -1)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to start federation");
+            return;
+        }
+
+        state->federating = true;
+    }
+
+    // shard 0 runs on the calling thread
+    for (size_t i = 1; i < state->shard_count; i++)
     {
-        nexchat_client_state_t* client = &state->clients[i];
-        pthread_cancel(client->recv_thread);
+        nexchat_server_shard_t* shard = &state->shards[i];
+
+        if (pthread_create(&shard->thread, NULL, nexchat_server_run_shard, shard) != 0)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to launch worker %zu", i);
+            state->running = false;
+            state->shard_count = i;
+            break;
+        }
     }
-    pthread_mutex_unlock(&state->clients_mutex);
 
-    pthread_mutex_destroy(&state->clients_mutex);
+    nexchat_server_run_shard(&state->shards[0]);
 
-    printf("server: shutting down...\n");
+    for (size_t i = 1; i < state->shard_count; i++)
+    {
+        pthread_join(state->shards[i].thread, NULL);
+    }
 }
 
-nexchat_conn_accept_result_t nexchat_server_accept_connection(nexchat_server_state_t* state)
+int32_t nexchat_server_init_shard(nexchat_server_shard_t* shard)
 {
-    nexchat_conn_accept_result_t result;
+    if (listen(shard->sockfd, SOMAXCONN) == -1)
+    {
+        nexchat_log_errno("listen");
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to start listening");
+        return -1;
+    }
 
-    struct sockaddr_storage conninfo;
-    socklen_t conninfo_size = sizeof(struct sockaddr_storage);
-    
-    result.connfd = accept(state->sockfd, (struct sockaddr*)&conninfo, &conninfo_size);
-    if (result.connfd == -1)
+    if (nexchat_set_nonblocking(shard->sockfd) == -1)
     {
-        perror("accept");
-        return result;
+        nexchat_log_errno("fcntl");
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to make listening socket non-blocking");
+        return -1;
     }
 
-    // get the clients username
-    char recvbuf[1024];
-    int32_t bytesread = nexchat_server_recvmsg(result.connfd, recvbuf, sizeof recvbuf);
-    if (bytesread == -1)
+    shard->uring = shard->server->config.backend == NEXCHAT_BACKEND_URING;
+
+    if (shard->uring && nexchat_server_init_uring(shard) == -1)
     {
-        perror("recv");
-        result.connfd = -1;
-        return result;
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to create io_uring event loop");
+        return -1;
     }
-    else if (bytesread == 0)
+
+    shard->epollfd = shard->uring ? -1 : epoll_create1(0);
+    if (!shard->uring && shard->epollfd == -1)
     {
-        // client disconnected
+        nexchat_log_errno("epoll_create1");
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to create event loop");
+        return -1;
     }
 
-    recvbuf[bytesread] = '\0';
-    snprintf(result.username, sizeof(result.username) - 1, "%s\0", recvbuf);
+    shard->eventfd = eventfd(0, EFD_NONBLOCK);
+    if (shard->eventfd == -1)
+    {
+        nexchat_log_errno("eventfd");
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to create shard inbox");
+        return -1;
+    }
 
-    char ipstr[INET6_ADDRSTRLEN];
-    const void* addr = nexchat_get_inet_addr((struct sockaddr*)&conninfo);
+    nexchat_mpsc_init(&shard->inbox);
 
-    inet_ntop(conninfo.ss_family, addr, ipstr, sizeof ipstr);
-    printf("server: '%s' connected from (%s)\n", result.username, ipstr);
+    if (shard->uring)
+    {
+        nexchat_server_uring_accept(shard);
+        nexchat_server_uring_poll(shard, shard->eventfd, POLLIN, true, NEXCHAT_URING_DATA(URING_OP_INBOX, 0));
+    }
 
-    return result;
-}
+    // the listening socket and inbox are told apart from client slots by their address
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &shard->sockfd;
 
-void* nexchat_server_handle_client(void* arg)
-{
-    nexchat_client_thread_data_t* data = (nexchat_client_thread_data_t*)arg;
-    nexchat_client_state_t* client = &data->server_state->clients[data->client_index];
+    if (!shard->uring && epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->sockfd, &ev) == -1)
+    {
+        nexchat_log_errno("epoll_ctl");
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to register listening socket");
+        return -1;
+    }
 
-    char recvbuf[1024];
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &shard->eventfd;
 
-    while (client->connected && data->server_state->running)
+    if (!shard->uring && epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->eventfd, &ev) == -1)
     {
-        int32_t bytesread = nexchat_server_recvmsg(client->sockfd, recvbuf, sizeof recvbuf);
+        nexchat_log_errno("epoll_ctl");
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to register shard inbox");
+        return -1;
+    }
 
-        if (strlen(client->username) == 6)
+    // one shard is enough to write the periodic dump, it reads every shard's metrics
+    if (shard->index == 0 && shard->server->config.stats_file != NULL)
+    {
+        if (nexchat_server_start_stats_timer(shard) == -1)
         {
-            int a = 10;
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to schedule stats dump");
+            return -1;
         }
+    }
 
-        if (bytesread == -1)
-        {
-            perror("recv");
-            continue;
-        }
-        else if (bytesread == 0) // client disconnected
+    // one shard is enough to hear SIGUSR2, every thread has it blocked
+    if (shard->index == 0)
+    {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGUSR2);
+
+        shard->signalfd = signalfd(-1, &mask, SFD_NONBLOCK);
+        if (shard->signalfd == -1)
         {
-            nexchat_server_disconnect_client(data->server_state, client->sockfd);
-            break;
+            nexchat_log_errno("signalfd");
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to listen for upgrade requests");
+            return -1;
         }
 
-        recvbuf[bytesread] = '\0';
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &shard->signalfd;
 
-        if (recvbuf[0] == '/')
+        if (shard->uring)
         {
-            if (strcmp(recvbuf, "/commands") == 0)
-            {
-                nexchat_server_send_cmdlist_to_client(client->sockfd);
-            }
-            else
-            {
-                bool foundcmd = false;
-
-                for (size_t i = CMD_NONE + 1; i < CMD_MAXCOMMANDS; i++)
-                {
-                    nexchat_client_command_t cmd = (nexchat_client_command_t)i;
-					const char* cmdstr = nexchat_client_command_to_str(cmd);
-					size_t len = strlen(cmdstr);
-
-                    if (memcmp(&recvbuf[1], cmdstr, len) != 0)
-                    {
-                        continue;
-                    }
-
-					const char* args = NULL;
-					const char* space = strchr(recvbuf, ' ');
-					size_t argc = 0;
-					
-					if (space)
-					{
-						args = &recvbuf[(size_t)(space - recvbuf) + 1];
-						argc++;
-					}
-					
-                    nexchat_server_exec_cmd(data->server_state, client, cmd, argc, args);
-                    foundcmd = true;
-                    break;
-                }
-
-                if (!foundcmd)
-                {
-                    char sendbuf[1024];
-                    snprintf(sendbuf, sizeof(sendbuf) - 1, "server: unknown command '%s'\0", recvbuf);
-                    nexchat_server_sendmsg(client->sockfd, sendbuf);
-                }
-            }
+            nexchat_server_uring_poll(shard, shard->signalfd, POLLIN, true, NEXCHAT_URING_DATA(URING_OP_SIGNAL, 0));
         }
-        else
+        else if (epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->signalfd, &ev) == -1)
         {
-            printf("%s: %s\n", client->username, recvbuf);
-            nexchat_server_broadcast_msg(data->server_state, client, client->username, recvbuf);
+            nexchat_log_errno("epoll_ctl");
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to register upgrade requests");
+            return -1;
         }
     }
 
-    return NULL;
+    // any shard may end up holding every client, the global limit is enforced on accept
+    if (nexchat_client_table_init(&shard->clients, shard->server->config.max_clients) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to allocate client table");
+        return -1;
+    }
+
+    shard->next_client_id = 0;
+    nexchat_buffer_init(&shard->sendbuf, 1024);
+    shard->flushlist = NULL;
+    shard->flushlist_count = 0;
+    shard->flushlist_capacity = 0;
+    shard->corklist = NULL;
+    shard->corklist_count = 0;
+    shard->corklist_capacity = 0;
+    shard->now = nexchat_clock_now_ns();
+    nexchat_timer_wheel_init(&shard->timers, shard->now, shard);
+
+    return 0;
 }
 
-void nexchat_server_sendmsg(int32_t sockfd, const char* msg)
+int32_t nexchat_server_start_stats_timer(nexchat_server_shard_t* shard)
 {
-    int32_t bytessent = send(sockfd, msg, strlen(msg), 0);
-    if (bytessent == -1)
+    shard->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (shard->timerfd == -1)
     {
-        perror("send");
-        return;
+        nexchat_log_errno("timerfd_create");
+        return -1;
     }
-}
 
-int32_t nexchat_server_recvmsg(int32_t sockfd, char* recvbuf, size_t size)
-{
-    return recv(sockfd, recvbuf, size, 0);
-}
+    double interval = shard->server->config.stats_interval;
 
-void nexchat_server_send_cmdlist_to_client(int32_t sockfd)
-{
-    char sendbuf[1024];
-    size_t offset = 0;
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = (time_t)interval;
+    spec.it_interval.tv_nsec = (long)((interval - (double)spec.it_interval.tv_sec) * 1e9);
+    spec.it_value = spec.it_interval;
+
+    if (timerfd_settime(shard->timerfd, 0, &spec, NULL) == -1)
+    {
+        nexchat_log_errno("timerfd_settime");
+        return -1;
+    }
 
-    for (size_t i = CMD_NONE + 1; i < CMD_MAXCOMMANDS; i++)
+    if (shard->uring)
     {
-        nexchat_client_command_t cmd = (nexchat_client_command_t)i;
-        const char* cmdstr = nexchat_client_command_to_str(cmd);
-        const char* cmddesc = nexchat_client_command_get_desc(cmd);
-        offset += snprintf(sendbuf + offset, sizeof(sendbuf) - 1, "  /%s - %s\n", cmdstr, cmddesc);
+        nexchat_server_uring_poll(shard, shard->timerfd, POLLIN, true, NEXCHAT_URING_DATA(URING_OP_TIMER, 0));
+        return 0;
     }
 
-    nexchat_server_sendmsg(sockfd, sendbuf);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &shard->timerfd;
+
+    if (epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->timerfd, &ev) == -1)
+    {
+        nexchat_log_errno("epoll_ctl");
+        return -1;
+    }
+
+    return 0;
 }
 
-void nexchat_server_exec_cmd(nexchat_server_state_t* state, nexchat_client_state_t* client, nexchat_client_command_t cmd, size_t argc, const char* args)
+void* nexchat_server_run_shard(void* arg)
 {
-    char sendbuf[1024];
+    nexchat_server_shard_t* shard = (nexchat_server_shard_t*)arg;
+    struct epoll_event events[MAXEVENTS];
 
-    switch (cmd)
+    if (shard->uring)
     {
-        case CMD_SETUSERNAME:
+        nexchat_server_run_uring(shard);
+        return NULL;
+    }
+
+    while (shard->server->running)
+    {
+        // sleep no longer than the next deadline of any client has left
+        int32_t timeout = nexchat_server_run_timers(shard);
+        if (shard->paused_count > 0 && (timeout == -1 || timeout > RESUME_POLL_MS))
         {
-            if (argc != 1)
-			{
-				const char* cmdstr = nexchat_client_command_to_str(cmd);
-				snprintf(sendbuf, sizeof(sendbuf) + 1, "server: expected '1' argument to /%s got '%s'\0", cmdstr, argc);
-				nexchat_server_sendmsg(client->sockfd, sendbuf);
-			}
-			else
-			{
-				size_t usernamelen = strlen(args);
-				if (usernamelen >= sizeof client->username)
-				{
-					nexchat_server_sendmsg(client->sockfd, "server: username is too long");
-				}
-				else
-				{
-					size_t oldusernamelen = strlen(client->username);
-					char oldusername[64];
-					memcpy(oldusername, client->username, strlen(client->username));
-					oldusername[oldusernamelen] = '\0';
-
-					pthread_mutex_lock(&state->clients_mutex);
-
-					memcpy(client->username, args, usernamelen);
-
-					pthread_mutex_unlock(&state->clients_mutex);
-
-					printf("server: '%s' set username -> '%s'\n", oldusername, client->username);
-					nexchat_server_sendmsg(client->sockfd, "server: new username set");
-
-					snprintf(sendbuf, sizeof(sendbuf) - 1, "'%s' set username -> '%s'\0", oldusername, client->username);
-					nexchat_server_broadcast_msg(state, client, "server", sendbuf);
-				}
-			}
-        } break;
-        case CMD_LISTUSERS:
+            timeout = RESUME_POLL_MS;
+        }
+
+        int32_t nevents = epoll_wait(shard->epollfd, events, MAXEVENTS, timeout);
+
+        if (nevents == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            nexchat_log_errno("epoll_wait");
+            break;
+        }
+
+        // what arrives in this batch arrived now, not when the shard went to sleep
+        shard->now = nexchat_clock_now_ns();
+
+        for (int32_t i = 0; i < nevents; i++)
         {
-            size_t offset = 0;
+            void* ptr = events[i].data.ptr;
+
+            if (ptr == &shard->sockfd)
+            {
+                nexchat_server_accept_pending(shard);
+                continue;
+            }
+
+            if (ptr == &shard->eventfd)
+            {
+                nexchat_server_drain_inbox(shard);
+                continue;
+            }
 
-            for (size_t i = 0; i < MAXCLIENTS; i++)
+            if (ptr == &shard->timerfd)
             {
-                nexchat_client_state_t* c = &state->clients[i];
-                
-                if (!c->connected)
+                uint64_t expirations = 0;
+                if (read(shard->timerfd, &expirations, sizeof expirations) > 0)
                 {
-                    continue;
+                    nexchat_server_metrics_dump(shard->server, shard->server->config.stats_file);
                 }
+                continue;
+            }
 
-				const char* fmt = c->sockfd == client->sockfd ? "%s (you)\n" : "%s\n";
-                offset += snprintf(sendbuf + offset, sizeof(sendbuf) - 1, fmt, c->username);
+            if (ptr == &shard->signalfd)
+            {
+                nexchat_server_handle_signal(shard);
+                continue;
             }
 
-			nexchat_server_sendmsg(client->sockfd, sendbuf);
-        } break;
-        case CMD_KICKUSER:
+            nexchat_client_state_t* client = (nexchat_client_state_t*)ptr;
+
+            // the slot may have been kicked by an earlier event in this batch
+            if (!client->connected)
+            {
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                nexchat_server_disconnect_client(shard, client->sockfd);
+                continue;
+            }
+
+            // the socket drained some of its send buffer, continue where the last flush stopped
+            if ((events[i].events & EPOLLOUT) && !nexchat_outqueue_empty(&client->outqueue))
+            {
+                nexchat_server_flush_client(shard, client);
+            }
+
+            if (client->connected && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+            {
+                nexchat_server_handle_client(shard, client);
+            }
+        }
+
+        // everything enqueued while handling this batch goes out now, one writev per client
+        nexchat_server_flush_pending(shard);
+        nexchat_server_resume_reading(shard);
+
+        // a short batch means the shard is keeping up, stop holding back partial segments
+        if (nevents < MAXEVENTS)
         {
-            if (argc != 1)
-			{
-				const char* cmdstr = nexchat_client_command_to_str(cmd);
-				snprintf(sendbuf, sizeof(sendbuf) - 1, "server: expected 1 argument to /%s, got '%zu'\0", cmdstr, argc);
-				nexchat_server_sendmsg(client->sockfd, sendbuf);
-			}
-			else
-			{
-				bool foundclient = false;
-
-				for (size_t i = 0; i < MAXCLIENTS; i++)
-				{
-					nexchat_client_state_t* c = &state->clients[i];
-
-					if (!c->connected || c->sockfd == client->sockfd)
-					{
-						continue;
-					}
-
-					if (strcmp(c->username, args) != 0)
-					{
-						continue;
-					}
-
-					c->kicks_requested++;
-					size_t majority = (state->connected_clients / 2) + state->connected_clients % 2;
-
-					if (c->kicks_requested >= majority)
-					{
-						nexchat_server_kick_client(state, c->sockfd);
-					}
-
-					foundclient = true;
-					break;
-				}
-
-				if (!foundclient)
-				{
-					snprintf(sendbuf, sizeof(sendbuf) + 1, "server: no users named '%s' in the chat\0", args);
-					nexchat_server_sendmsg(client->sockfd, sendbuf);
-				}
-			}
-        } break;
+            nexchat_server_push_corked(shard);
+        }
     }
+
+    return NULL;
 }
 
-void nexchat_server_broadcast_msg(nexchat_server_state_t* state, nexchat_client_state_t* sender, const char* username, const char* msg)
-{
-    char sendbuf[1024];
-	if (username)
-	{
-    	snprintf(sendbuf, sizeof(sendbuf) - 1, "%s: %s\0", username, msg);
-	}
-	else
-	{
-		snprintf(sendbuf, sizeof(sendbuf) - 1, "%s\0", msg);
-	}
+#if NEXCHAT_URING
 
-    for (size_t i = 0; i < MAXCLIENTS; i++)
+int32_t nexchat_server_init_uring(nexchat_server_shard_t* shard)
+{
+    if (nexchat_uring_init(&shard->ring, NEXCHAT_URING_ENTRIES) == -1)
     {
-        nexchat_client_state_t* client = &state->clients[i];
+        nexchat_log_errno("io_uring_setup");
+        return -1;
+    }
 
-        if (!client->connected || client->sockfd == sender->sockfd)
-        {
-            continue;
-        }
+    shard->accept_multishot = true;
+    shard->recv_multishot = true;
 
-        nexchat_server_sendmsg(client->sockfd, sendbuf);
-    }
+    return 0;
 }
 
-void nexchat_server_disconnect_client(nexchat_server_state_t* state, int32_t sockfd)
+void nexchat_server_run_uring(nexchat_server_shard_t* shard)
 {
-    for (size_t i = 0; i < MAXCLIENTS; i++)
+    while (shard->server->running)
     {
-        nexchat_client_state_t* client = &state->clients[i];
+        // everything queued by the last iteration goes to the kernel with the wait, one syscall
+        int32_t timeout = nexchat_server_run_timers(shard);
+        if (shard->paused_count > 0 && (timeout == -1 || timeout > RESUME_POLL_MS))
+        {
+            timeout = RESUME_POLL_MS;
+        }
 
-        if (!client->connected || client->sockfd != sockfd)
+        if (nexchat_uring_submit_and_wait(&shard->ring, timeout) == -1)
         {
-            continue;
+            nexchat_log_errno("io_uring_enter");
+            break;
         }
 
-        printf("server: %s disconnected\n", client->username);
-        char sendbuf[1024];
-        snprintf(sendbuf, sizeof(sendbuf) - 1, "%s disconnected\0", client->username);
-        nexchat_server_broadcast_msg(state, client, NULL, sendbuf);
+        shard->now = nexchat_clock_now_ns();
+
+        size_t completions = 0;
+        struct io_uring_cqe* cqe = NULL;
 
-        pthread_mutex_lock(&state->clients_mutex);
+        while ((cqe = nexchat_uring_peek(&shard->ring)) != NULL)
+        {
+            // handlers may queue new requests, so the slot is handed back before they run
+            uint64_t user_data = cqe->user_data;
+            int32_t res = cqe->res;
+            uint32_t flags = cqe->flags;
+            nexchat_uring_advance(&shard->ring);
+
+            nexchat_server_uring_complete(shard, user_data, res, flags);
+            completions++;
+        }
 
-        client->connected = false;
-        pthread_cancel(client->recv_thread);
-        close(client->sockfd);
-        client->sockfd = 0;
-        memset(client->username, 0, sizeof(client->username));
+        nexchat_server_flush_pending(shard);
+        nexchat_server_resume_reading(shard);
 
-        state->connected_clients--;
+        if (completions < MAXEVENTS)
+        {
+            nexchat_server_push_corked(shard);
+        }
+    }
 
-        pthread_mutex_unlock(&state->clients_mutex);
+    if (shard->server->upgrading)
+    {
+        nexchat_server_uring_quiesce(shard);
     }
 }
 
-void nexchat_server_kick_client(nexchat_server_state_t* state, int32_t sockfd)
+void nexchat_server_uring_quiesce(nexchat_server_shard_t* shard)
 {
-    for (size_t i = 0; i < MAXCLIENTS; i++)
+    // bytes a request took from a socket or queued on it only exist in this process, so every
+    // request is cancelled or allowed to finish before the connections are handed over. Receives
+    // that end now are parked rather than rearmed, see nexchat_server_uring_received
+    nexchat_server_uring_cancel(shard, NEXCHAT_URING_DATA(URING_OP_ACCEPT, 0));
+
+    for (size_t i = 0; i < shard->clients.allocated; i++)
     {
-        nexchat_client_state_t* client = &state->clients[i];
+        nexchat_client_state_t* client = nexchat_client_table_at(&shard->clients, i);
 
-        if (!client->connected || client->sockfd != sockfd)
+        if (client->connected)
         {
-            continue;
+            nexchat_server_uring_cancel(shard, NEXCHAT_URING_CLIENT_DATA(URING_OP_RECV, client));
         }
+    }
 
-        printf("server: kicked '%s' from chat\n", client->username);
-        char sendbuf[1024];
-        snprintf(sendbuf, sizeof(sendbuf) - 1, "kicked '%s' from chat\0", client->username);
-        nexchat_server_broadcast_msg(state, client, "server", sendbuf);
+    // writes keep going until the queues drain or stall, a stalled one waits for POLLOUT with
+    // nothing written and its frames are handed over whole
+    uint64_t deadline = nexchat_clock_now_ns() + UPGRADE_QUIESCE_MS * 1000000ull;
 
-		nexchat_server_sendmsg(client->sockfd, "server: you have been kicked from chat");
+    while (nexchat_clock_now_ns() < deadline)
+    {
+        if (nexchat_uring_submit_and_wait(&shard->ring, 20) == -1)
+        {
+            nexchat_log_errno("io_uring_enter");
+            break;
+        }
 
-        pthread_mutex_lock(&state->clients_mutex);
+        size_t completions = 0;
+        struct io_uring_cqe* cqe = NULL;
 
-        client->connected = false;
-        pthread_cancel(client->recv_thread);
-        close(client->sockfd);
-        client->sockfd = 0;
-        memset(client->username, 0, sizeof(client->username));
+        while ((cqe = nexchat_uring_peek(&shard->ring)) != NULL)
+        {
+            uint64_t user_data = cqe->user_data;
+            int32_t res = cqe->res;
+            uint32_t flags = cqe->flags;
+            nexchat_uring_advance(&shard->ring);
 
-        state->connected_clients--;
+            nexchat_server_uring_complete(shard, user_data, res, flags);
+            completions++;
+        }
 
-        pthread_mutex_unlock(&state->clients_mutex);
+        if (completions == 0)
+        {
+            break;
+        }
 
-        break;
+        nexchat_server_flush_pending(shard);
     }
 }
 
-int main(int argc, char** argv)
+void nexchat_server_uring_complete(nexchat_server_shard_t* shard, uint64_t user_data, int32_t res, uint32_t flags)
 {
-    nexchat_server_state_t server;
-    nexchat_inet_id_t id = {.ipaddr=IPADDR, .service=PORT};
+    bool more = (flags & IORING_CQE_F_MORE) != 0;
+    void* ptr = (void*)(uintptr_t)(user_data & ((1ull << URING_OP_SHIFT) - 1));
 
-    if (nexchat_server_bind(&server, &id) == -1)
+    switch (user_data >> URING_OP_SHIFT)
     {
-        return 1;
-    }
-
+        case URING_OP_ACCEPT:
+        {
+            if (res >= 0)
+            {
+                nexchat_server_print_connection(res, NULL);
+                nexchat_server_add_client(shard, res);
+            }
+            else if (res == -EINVAL && shard->accept_multishot)
+            {
+                shard->accept_multishot = false;
+            }
+            else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED)
+            {
+                errno = -res;
+                nexchat_log_errno("accept");
+            }
+
+            if (!more && shard->server->running)
+            {
+                nexchat_server_uring_accept(shard);
+            }
+        } break;
+        case URING_OP_INBOX:
+        {
+            nexchat_server_drain_inbox(shard);
+
+            if (!more)
+            {
+                nexchat_server_uring_poll(shard, shard->eventfd, POLLIN, true, user_data);
+            }
+        } break;
+        case URING_OP_TIMER:
+        {
+            uint64_t expirations = 0;
+            if (read(shard->timerfd, &expirations, sizeof expirations) > 0)
+            {
+                nexchat_server_metrics_dump(shard->server, shard->server->config.stats_file);
+            }
+
+            if (!more)
+            {
+                nexchat_server_uring_poll(shard, shard->timerfd, POLLIN, true, user_data);
+            }
+        } break;
+        case URING_OP_SIGNAL:
+        {
+            nexchat_server_handle_signal(shard);
+
+            if (!more && shard->server->running)
+            {
+                nexchat_server_uring_poll(shard, shard->signalfd, POLLIN, true, user_data);
+            }
+        } break;
+        case URING_OP_RECV:
+        {
+            nexchat_server_uring_received(shard, user_data, res, flags);
+        } break;
+        case URING_OP_SEND:
+        case URING_OP_POLLOUT:
+        {
+            nexchat_server_uring_sent(shard, (nexchat_server_send_t*)ptr, (user_data >> URING_OP_SHIFT) == URING_OP_POLLOUT, res);
+        } break;
+        default: break;
+    }
+}
+
+void nexchat_server_uring_accept(nexchat_server_shard_t* shard)
+{
+    struct io_uring_sqe* sqe = nexchat_uring_get_sqe(&shard->ring);
+    if (sqe == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: io_uring submission queue is full, not accepting");
+        return;
+    }
+
+    // one request keeps accepting until it fails, the new fds come back as completions
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard->sockfd;
+    sqe->ioprio = shard->accept_multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = NEXCHAT_URING_DATA(URING_OP_ACCEPT, 0);
+}
+
+void nexchat_server_uring_poll(nexchat_server_shard_t* shard, int32_t fd, uint32_t events, bool multishot, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = nexchat_uring_get_sqe(&shard->ring);
+    if (sqe == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: io_uring submission queue is full, dropping poll");
+        return;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = (events << 16) | (events >> 16);
+#endif
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+}
+
+void nexchat_server_uring_recv(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    struct io_uring_sqe* sqe = nexchat_uring_get_sqe(&shard->ring);
+    if (sqe == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: io_uring submission queue is full, can't read from '%s'", client->username);
+        return;
+    }
+
+    // the kernel picks a buffer from the shard's group as data arrives, nothing is pinned per client
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->sockfd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NEXCHAT_URING_BUFFER_GROUP;
+    sqe->ioprio = shard->recv_multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->len = shard->recv_multishot ? 0 : NEXCHAT_URING_BUFFER_SIZE;
+    sqe->user_data = NEXCHAT_URING_CLIENT_DATA(URING_OP_RECV, client);
+}
+
+void nexchat_server_uring_received(nexchat_server_shard_t* shard, uint64_t user_data, int32_t res, uint32_t flags)
+{
+    int32_t sockfd = (int32_t)(uint32_t)(user_data >> URING_ID_BITS);
+    nexchat_client_state_t* client = nexchat_client_table_find(&shard->clients, sockfd);
+    bool buffered = (flags & IORING_CQE_F_BUFFER) != 0;
+    uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+
+    // completions can still arrive for a client released earlier in the batch
+    if (client == NULL || !client->connected || NEXCHAT_URING_CLIENT_DATA(URING_OP_RECV, client) != user_data)
+    {
+        if (buffered)
+        {
+            nexchat_uring_recycle(&shard->ring, bid);
+        }
+        return;
+    }
+
+    if (res > 0 && buffered)
+    {
+        // into the decoder, then the buffer goes straight back to the kernel
+        const uint8_t* data = nexchat_uring_buffer(&shard->ring, bid);
+        size_t remaining = (size_t)res;
+
+        while (remaining > 0)
+        {
+            size_t space = 0;
+            uint8_t* dst = nexchat_frame_decoder_prepare(&client->decoder, &space);
+            if (dst == NULL)
+            {
+                break;
+            }
+
+            size_t chunk = remaining < space ? remaining : space;
+            memcpy(dst, data, chunk);
+            nexchat_frame_decoder_commit(&client->decoder, chunk);
+            data += chunk;
+            remaining -= chunk;
+        }
+
+        nexchat_uring_recycle(&shard->ring, bid);
+        NEXCHAT_METRIC_ADD(shard, bytes_in, res);
+
+        if (remaining > 0)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory reading from '%s'", client->username);
+            nexchat_server_disconnect_client(shard, client->sockfd);
+            return;
+        }
+
+        // paused input stays in the decoder until the budget frees up
+        if (!nexchat_server_reads_paused(shard, client) && nexchat_server_dispatch_frames(shard, client) == -1)
+        {
+            return;
+        }
+    }
+    else if (res == 0) // client disconnected
+    {
+        nexchat_server_disconnect_client(shard, client->sockfd);
+        return;
+    }
+    else if (res == -EINVAL && shard->recv_multishot)
+    {
+        shard->recv_multishot = false;
+    }
+    else if (res < 0 && res != -ENOBUFS && res != -EAGAIN && res != -EINTR && res != -ECANCELED)
+    {
+        errno = -res;
+        nexchat_log_errno("recv");
+        nexchat_server_disconnect_client(shard, client->sockfd);
+        return;
+    }
+
+    // terminated, by running out of provided buffers, by the kernel not doing multishot, by a pause
+    // or by an upgrade stopping the shard
+    if ((flags & IORING_CQE_F_MORE) == 0)
+    {
+        if (client->read_paused || !shard->server->running)
+        {
+            client->recv_parked = true;
+        }
+        else
+        {
+            nexchat_server_uring_recv(shard, client);
+        }
+    }
+}
+
+void nexchat_server_uring_send(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    // one write in flight per client keeps the stream in order, its completion starts the next
+    if (client->send != NULL || nexchat_outqueue_empty(&client->outqueue))
+    {
+        return;
+    }
+
+    nexchat_server_send_t* send = (nexchat_server_send_t*)calloc(1, sizeof(nexchat_server_send_t));
+    if (send == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory writing to '%s'", client->username);
+        return;
+    }
+
+    send->client = client;
+    send->client_id = client->id;
+    send->count = nexchat_outqueue_peek(&client->outqueue, send->iov, send->frames, NEXCHAT_OUTQUEUE_MAXIOV);
+
+    for (size_t i = 0; i < send->count; i++)
+    {
+        nexchat_msgbuf_retain(send->frames[i]);
+    }
+
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = send->count;
+
+    client->send = send;
+    nexchat_server_uring_sendmsg(shard, send);
+}
+
+void nexchat_server_uring_sendmsg(nexchat_server_shard_t* shard, nexchat_server_send_t* send)
+{
+    struct io_uring_sqe* sqe = nexchat_uring_get_sqe(&shard->ring);
+    if (sqe == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: io_uring submission queue is full, can't write to '%s'", send->client->username);
+        nexchat_server_disconnect_client(shard, send->client->sockfd);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = send->client->sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = NEXCHAT_URING_DATA(URING_OP_SEND, send);
+}
+
+void nexchat_server_uring_sent(nexchat_server_shard_t* shard, nexchat_server_send_t* send, bool polled, int32_t res)
+{
+    nexchat_client_state_t* client = send->client;
+
+    // released or cancelled while in flight, only the frames it held are left to drop
+    if (!client->connected || client->id != send->client_id || client->send != send)
+    {
+        nexchat_server_free_send(send);
+        return;
+    }
+
+    // the socket buffer was full, wait for room and retry the same write
+    if (!polled && res == -EAGAIN)
+    {
+        nexchat_server_uring_poll(shard, client->sockfd, POLLOUT, false, NEXCHAT_URING_DATA(URING_OP_POLLOUT, send));
+        return;
+    }
+
+    if (polled && res >= 0)
+    {
+        nexchat_server_uring_sendmsg(shard, send);
+        return;
+    }
+
+    client->send = NULL;
+    nexchat_server_free_send(send);
+
+    if (res < 0)
+    {
+        errno = -res;
+        nexchat_log_errno("send");
+        nexchat_server_disconnect_client(shard, client->sockfd);
+        return;
+    }
+
+    NEXCHAT_METRIC_ADD(shard, bytes_out, res);
+    nexchat_outqueue_consume(&client->outqueue, (size_t)res);
+
+    if (res > 0)
+    {
+        nexchat_server_track_corked(shard, client);
+    }
+
+    // a short write or frames queued meanwhile, keep going
+    nexchat_server_uring_send(shard, client);
+}
+
+void nexchat_server_uring_cancel(nexchat_server_shard_t* shard, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = nexchat_uring_get_sqe(&shard->ring);
+    if (sqe == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: io_uring submission queue is full, can't cancel request");
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = NEXCHAT_URING_DATA(URING_OP_CANCEL, 0);
+}
+
+void nexchat_server_free_send(nexchat_server_send_t* send)
+{
+    for (size_t i = 0; i < send->count; i++)
+    {
+        nexchat_msgbuf_release(send->frames[i]);
+    }
+
+    free(send);
+}
+
+#else
+
+// built without io_uring headers, nexchat_uring_supported() is false so none of these are reached
+int32_t nexchat_server_init_uring(nexchat_server_shard_t* shard) { (void)shard; return -1; }
+void nexchat_server_run_uring(nexchat_server_shard_t* shard) { (void)shard; }
+void nexchat_server_uring_quiesce(nexchat_server_shard_t* shard) { (void)shard; }
+void nexchat_server_uring_accept(nexchat_server_shard_t* shard) { (void)shard; }
+void nexchat_server_uring_poll(nexchat_server_shard_t* shard, int32_t fd, uint32_t events, bool multishot, uint64_t user_data) { (void)shard; (void)fd; (void)events; (void)multishot; (void)user_data; }
+void nexchat_server_uring_recv(nexchat_server_shard_t* shard, nexchat_client_state_t* client) { (void)shard; (void)client; }
+void nexchat_server_uring_send(nexchat_server_shard_t* shard, nexchat_client_state_t* client) { (void)shard; (void)client; }
+void nexchat_server_uring_cancel(nexchat_server_shard_t* shard, uint64_t user_data) { (void)shard; (void)user_data; }
+void nexchat_server_free_send(nexchat_server_send_t* send) { free(send); }
+
+#endif
+
+void nexchat_server_post(nexchat_server_shard_t* shard, nexchat_shard_msg_t* msg)
+{
+    // only the push that finds the inbox empty needs to wake the shard
+    if (nexchat_mpsc_push(&shard->inbox, &msg->node))
+    {
+        uint64_t one = 1;
+        if (write(shard->eventfd, &one, sizeof one) == -1 && errno != EAGAIN)
+        {
+            nexchat_log_errno("write");
+        }
+    }
+}
+
+void nexchat_server_drain_inbox(nexchat_server_shard_t* shard)
+{
+    uint64_t count = 0;
+    if (read(shard->eventfd, &count, sizeof count) == -1 && errno != EAGAIN)
+    {
+        nexchat_log_errno("read");
+    }
+
+    nexchat_mpsc_node_t* node = nexchat_mpsc_take_all(&shard->inbox);
+
+    while (node != NULL)
+    {
+        nexchat_shard_msg_t* msg = (nexchat_shard_msg_t*)node;
+        node = node->next;
+
+        switch (msg->type)
+        {
+            case SHARD_MSG_BROADCAST:
+            {
+                nexchat_server_fanout(shard, msg->room, NULL, msg->msg);
+                nexchat_msgbuf_release(msg->msg);
+                nexchat_room_release(msg->room);
+            } break;
+            case SHARD_MSG_KICK:
+            {
+                nexchat_client_state_t* client = nexchat_client_table_find(&shard->clients, msg->sockfd);
+                if (client != NULL && client->connected && client->id == msg->client_id)
+                {
+                    nexchat_server_kick_client(shard, msg->sockfd);
+                }
+            } break;
+            case SHARD_MSG_VOTE:
+            {
+                nexchat_server_arm_vote(shard, msg->sockfd, msg->client_id);
+            } break;
+        }
+
+        nexchat_pool_free(msg);
+    }
+}
+
+void nexchat_server_shutdown(nexchat_server_state_t* state)
+{
+    // it posts to the shards, stop it before they go away
+    if (state->federating)
+    {
+        nexchat_federation_close(&state->federation);
+        state->federating = false;
+    }
+
+    // a hot upgrade takes the connections along, what is closed below are this process's copies
+    if (state->upgrading)
+    {
+        nexchat_server_hand_off(state);
+    }
+
+    for (size_t s = 0; s < state->shard_count; s++)
+    {
+        nexchat_server_shard_t* shard = &state->shards[s];
+
+        for (size_t i = 0; i < shard->clients.allocated; i++)
+        {
+            nexchat_client_state_t* client = nexchat_client_table_at(&shard->clients, i);
+
+            if (!client->connected)
+            {
+                continue;
+            }
+
+            if (client->send != NULL)
+            {
+                nexchat_server_free_send(client->send);
+                client->send = NULL;
+            }
+
+            close(client->sockfd);
+            nexchat_frame_decoder_free(&client->decoder);
+            nexchat_outqueue_free(&client->outqueue);
+            client->connected = false;
+        }
+
+        nexchat_mpsc_node_t* node = nexchat_mpsc_take_all(&shard->inbox);
+        while (node != NULL)
+        {
+            nexchat_shard_msg_t* msg = (nexchat_shard_msg_t*)node;
+            node = node->next;
+
+            if (msg->type == SHARD_MSG_BROADCAST)
+            {
+                nexchat_msgbuf_release(msg->msg);
+                nexchat_room_release(msg->room);
+            }
+
+            nexchat_pool_free(msg);
+        }
+
+        nexchat_buffer_free(&shard->sendbuf);
+        free(shard->flushlist);
+        free(shard->corklist);
+        free(shard->paused);
+        nexchat_client_table_free(&shard->clients);
+
+        if (shard->eventfd != -1) close(shard->eventfd);
+        if (shard->timerfd != -1) close(shard->timerfd);
+        if (shard->signalfd != -1) close(shard->signalfd);
+        if (shard->epollfd != -1) close(shard->epollfd);
+        if (shard->uring) nexchat_uring_free(&shard->ring);
+        if (shard->sockfd != -1) close(shard->sockfd);
+    }
+
+    for (size_t i = 0; i < state->rooms.capacity; i++)
+    {
+        if (state->rooms.entries != NULL && state->rooms.entries[i].key != NULL)
+        {
+            nexchat_room_free((nexchat_room_t*)state->rooms.entries[i].value);
+        }
+    }
+
+    if (state->presence != NULL)
+    {
+        nexchat_room_free(state->presence);
+        state->presence = NULL;
+    }
+
+    // every shard is stopped, nothing can append anymore, the writer drains what's left
+    if (state->logging)
+    {
+        nexchat_msglog_close(&state->log);
+        state->logging = false;
+    }
+
+    free(state->shards);
+    if (state->roster.current != NULL)
+    {
+        nexchat_roster_free(&state->roster);
+    }
+
+    nexchat_strmap_free(&state->rooms);
+    pthread_mutex_destroy(&state->rooms_mutex);
+
+    // the message log is closed, the new process may open it now
+    if (state->upgrading)
+    {
+        nexchat_log(NEXCHAT_LOG_INFO, "server: handing over to process %d", (int)state->upgrade.child);
+        nexchat_upgrade_finish(&state->upgrade);
+    }
+
+    nexchat_log(NEXCHAT_LOG_INFO, "server: shutting down...");
+}
+
+void nexchat_server_stop(nexchat_server_state_t* state)
+{
+    __atomic_store_n(&state->running, false, __ATOMIC_SEQ_CST);
+
+    // every shard wakes up through its inbox and leaves its loop
+    for (size_t i = 0; i < state->shard_count; i++)
+    {
+        uint64_t one = 1;
+        if (write(state->shards[i].eventfd, &one, sizeof one) == -1 && errno != EAGAIN)
+        {
+            nexchat_log_errno("write");
+        }
+    }
+}
+
+void nexchat_server_handle_signal(nexchat_server_shard_t* shard)
+{
+    nexchat_server_state_t* state = shard->server;
+    struct signalfd_siginfo info;
+    bool upgrade = false;
+
+    while (read(shard->signalfd, &info, sizeof info) == sizeof info)
+    {
+        upgrade = upgrade || info.ssi_signo == SIGUSR2;
+    }
+
+    if (!upgrade || state->upgrading)
+    {
+        return;
+    }
+
+    nexchat_log(NEXCHAT_LOG_INFO, "server: upgrade requested, starting '%s'", state->config.exe);
+
+    if (nexchat_upgrade_spawn(&state->upgrade, state->config.exe, state->config.argv) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: upgrade abandoned, still serving");
+        return;
+    }
+
+    state->upgrading = true;
+    nexchat_server_stop(state);
+}
+
+void nexchat_server_hand_off(nexchat_server_state_t* state)
+{
+    nexchat_upgrade_t* up = &state->upgrade;
+    size_t handed = 0;
+
+    // shards stopped one after another, broadcasts posted to one that had already stopped are
+    // still in its inbox. They are queued like any other output and go along with the connection
+    for (size_t i = 0; i < state->shard_count; i++)
+    {
+        nexchat_server_drain_inbox(&state->shards[i]);
+        nexchat_server_push_corked(&state->shards[i]);
+    }
+
+    int32_t status = nexchat_upgrade_send_state(up, state->roster.current->version, state->federation.node, state->federation.seq);
+
+    for (size_t i = 0; status == 0 && i < state->shard_count; i++)
+    {
+        status = nexchat_upgrade_send_listener(up, state->shards[i].sockfd);
+    }
+
+    for (size_t s = 0; status == 0 && s < state->shard_count; s++)
+    {
+        nexchat_server_shard_t* shard = &state->shards[s];
+
+        for (size_t i = 0; status == 0 && i < shard->clients.allocated; i++)
+        {
+            nexchat_client_state_t* client = nexchat_client_table_at(&shard->clients, i);
+            bool handshaking = client->phase == NEXCHAT_CLIENT_AWAITING_USERNAME;
+
+            if (!client->connected || client->evicting || (!handshaking && client->phase != NEXCHAT_CLIENT_ACTIVE))
+            {
+                continue;
+            }
+
+            nexchat_roster_entry_t* entry = handshaking ? NULL : nexchat_roster_find(state->roster.current, client->username);
+            uint64_t kicks = entry != NULL && entry->client == client ? entry->kicks : 0;
+            const char* room = client->room != NULL ? client->room->name : "";
+
+            status = nexchat_upgrade_send_client(up, client, client->subscribed, kicks, room);
+
+            // a frame cut short on the wire continues where it stopped, so does one half received
+            nexchat_buffer_t* input = &client->decoder.buffer;
+            if (status == 0)
+            {
+                status = nexchat_upgrade_send_bytes(up, UPGRADE_INPUT, nexchat_buffer_head(input), nexchat_buffer_readable(input));
+            }
+
+            while (status == 0 && !nexchat_outqueue_empty(&client->outqueue))
+            {
+                struct iovec iov[NEXCHAT_OUTQUEUE_MAXIOV];
+                nexchat_msgbuf_t* frames[NEXCHAT_OUTQUEUE_MAXIOV];
+                size_t count = nexchat_outqueue_peek(&client->outqueue, iov, frames, NEXCHAT_OUTQUEUE_MAXIOV);
+                size_t bytes = 0;
+
+                for (size_t f = 0; status == 0 && f < count; f++)
+                {
+                    status = nexchat_upgrade_send_bytes(up, UPGRADE_OUTPUT, iov[f].iov_base, iov[f].iov_len);
+                    bytes += iov[f].iov_len;
+                }
+
+                nexchat_outqueue_consume(&client->outqueue, bytes);
+            }
+
+            handed += status == 0 ? 1 : 0;
+        }
+    }
+
+    // the new process keeps what it got this far, it learns the handoff stopped short from the
+    // socket closing without an UPGRADE_END
+    if (status == -1)
+    {
+        up->failed = true;
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: handoff failed after %zu connection(s), the rest are closed", handed);
+        return;
+    }
+
+    nexchat_log(NEXCHAT_LOG_INFO, "server: handed %zu connection(s) over", handed);
+}
+
+void nexchat_server_adopt_clients(nexchat_server_state_t* state)
+{
+    nexchat_upgrade_t* up = &state->upgrade;
+    size_t adopted = 0;
+
+    // spread over the shards afresh, the worker count may have changed with the upgrade
+    for (size_t i = 0; i < up->client_count; i++)
+    {
+        // closed by nexchat_upgrade_inherit, it was cut short
+        if (up->clients[i].sockfd == -1)
+        {
+            continue;
+        }
+
+        if (nexchat_server_adopt_client(&state->shards[i % state->shard_count], &up->clients[i]) == 0)
+        {
+            adopted++;
+        }
+    }
+
+    // frames that were complete but not handled yet, now that everyone is back in their rooms
+    for (size_t s = 0; s < state->shard_count; s++)
+    {
+        nexchat_server_shard_t* shard = &state->shards[s];
+
+        for (size_t i = 0; i < shard->clients.allocated; i++)
+        {
+            nexchat_client_state_t* client = nexchat_client_table_at(&shard->clients, i);
+
+            if (client->connected && nexchat_buffer_readable(&client->decoder.buffer) > 0)
+            {
+                nexchat_server_dispatch_frames(shard, client);
+            }
+        }
+    }
+
+    if (up->listener_count > state->shard_count)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: %zu listening socket(s) more than workers, connections waiting on them are dropped",
+            up->listener_count - state->shard_count);
+    }
+
+    nexchat_log(NEXCHAT_LOG_INFO, "server: took over %zu of %zu connection(s) from the previous process", adopted, up->client_count);
+
+    nexchat_upgrade_free(up);
+}
+
+int32_t nexchat_server_adopt_client(nexchat_server_shard_t* shard, nexchat_upgrade_client_t* adopted)
+{
+    nexchat_server_state_t* state = shard->server;
+    int32_t sockfd = adopted->sockfd;
+
+    // set up like a fresh connection, which also restarts its handshake deadline
+    adopted->sockfd = -1;
+    nexchat_server_add_client(shard, sockfd);
+
+    nexchat_client_state_t* client = nexchat_client_table_find(&shard->clients, sockfd);
+    if (client == NULL || !client->connected)
+    {
+        return -1;
+    }
+
+    size_t pending = nexchat_buffer_readable(&adopted->input);
+    const uint8_t* data = nexchat_buffer_head(&adopted->input);
+
+    while (pending > 0)
+    {
+        size_t space = 0;
+        uint8_t* dst = nexchat_frame_decoder_prepare(&client->decoder, &space);
+        if (dst == NULL)
+        {
+            nexchat_server_release_client(shard, client);
+            return -1;
+        }
+
+        size_t chunk = pending < space ? pending : space;
+        memcpy(dst, data, chunk);
+        nexchat_frame_decoder_commit(&client->decoder, chunk);
+        data += chunk;
+        pending -= chunk;
+    }
+
+    if (nexchat_buffer_readable(&adopted->output) > 0)
+    {
+        nexchat_msgbuf_t* output = nexchat_msgbuf_create(nexchat_buffer_head(&adopted->output), nexchat_buffer_readable(&adopted->output));
+        if (output == NULL)
+        {
+            nexchat_server_release_client(shard, client);
+            return -1;
+        }
+
+        nexchat_server_enqueue(shard, client, output);
+        nexchat_msgbuf_release(output);
+    }
+
+    if (adopted->phase != NEXCHAT_CLIENT_ACTIVE)
+    {
+        return 0;
+    }
+
+    // back under the same name with the same votes against it, nobody is told it was ever gone
+    snprintf(client->username, sizeof(client->username), "%s", adopted->username);
+
+    pthread_mutex_lock(&state->roster.writer);
+
+    nexchat_roster_entry_t* entry = nexchat_roster_entry_create(client->username, client);
+    if (entry != NULL)
+    {
+        entry->kicks = adopted->kicks;
+    }
+
+    int32_t listed = entry != NULL && nexchat_roster_find(state->roster.current, client->username) == NULL ? nexchat_roster_update(&state->roster, NULL, entry) : -1;
+
+    pthread_mutex_unlock(&state->roster.writer);
+
+    if (listed == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to list '%s' again after the upgrade", adopted->username);
+        free(entry);
+        nexchat_server_release_client(shard, client);
+        return -1;
+    }
+
+    client->phase = NEXCHAT_CLIENT_ACTIVE;
+    client->admin = adopted->admin;
+    __atomic_add_fetch(&state->active_clients, 1, __ATOMIC_RELAXED);
+
+    if (nexchat_server_enter_room(shard, client, adopted->room[0] != '\0' ? adopted->room : ROOM_LOBBY) == NULL ||
+        (adopted->subscribed && nexchat_room_add(state->presence, shard->index, client) == -1))
+    {
+        nexchat_server_release_client(shard, client);
+        return -1;
+    }
+
+    // deadlines start over, votes against it get a fresh window
+    nexchat_server_check_liveness(shard, client);
+    if (adopted->kicks > 0)
+    {
+        nexchat_server_arm_vote(shard, client->sockfd, client->id);
+    }
+
+    return 0;
+}
+
+int32_t nexchat_server_accept_connection(nexchat_server_shard_t* shard)
+{
+    struct sockaddr_storage conninfo;
+    socklen_t conninfo_size = sizeof(struct sockaddr_storage);
+    
+    int32_t connfd = accept(shard->sockfd, (struct sockaddr*)&conninfo, &conninfo_size);
+    if (connfd == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            nexchat_log_errno("accept");
+        }
+
+        return -1;
+    }
+
+    nexchat_server_print_connection(connfd, &conninfo);
+
+    return connfd;
+}
+
+void nexchat_server_print_connection(int32_t connfd, const struct sockaddr_storage* conninfo)
+{
+    struct sockaddr_storage peer;
+
+    // multishot accept doesn't report the address, ask the socket
+    if (conninfo == NULL)
+    {
+        socklen_t size = sizeof peer;
+        if (getpeername(connfd, (struct sockaddr*)&peer, &size) == -1)
+        {
+            return;
+        }
+
+        conninfo = &peer;
+    }
+
+    char ipstr[INET6_ADDRSTRLEN];
+    const void* addr = nexchat_get_inet_addr((struct sockaddr*)conninfo);
+
+    inet_ntop(conninfo->ss_family, addr, ipstr, sizeof ipstr);
+    nexchat_log(NEXCHAT_LOG_INFO, "server: connection from (%s)", ipstr);
+}
+
+void nexchat_server_accept_pending(nexchat_server_shard_t* shard)
+{
+    // edge-triggered, so drain the whole accept backlog. Nothing here waits on the peer,
+    // the username arrives later through the event loop like any other frame
+    while (shard->server->running)
+    {
+        int32_t connfd = nexchat_server_accept_connection(shard);
+
+        if (connfd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            // EAGAIN once the backlog is empty, anything else (EMFILE...) is retried on the next wakeup
+            break;
+        }
+
+        nexchat_server_add_client(shard, connfd);
+    }
+}
+
+void nexchat_server_add_client(nexchat_server_shard_t* shard, int32_t connfd)
+{
+    nexchat_server_state_t* state = shard->server;
+
+    // the capacity is global and includes handshakes in flight, the table of whichever shard accepted the connection only holds it
+    size_t connected = __atomic_add_fetch(&state->connected_clients, 1, __ATOMIC_RELAXED);
+    nexchat_client_state_t* client = connected <= state->config.max_clients ? nexchat_client_table_alloc(&shard->clients, connfd) : NULL;
+
+    if (client == NULL)
+    {
+        __atomic_sub_fetch(&state->connected_clients, 1, __ATOMIC_RELAXED);
+        NEXCHAT_METRIC_ADD(shard, rejects, 1);
+        nexchat_log(NEXCHAT_LOG_WARN, "server: reached maximum number of clients, failed to accept new connection");
+        close(connfd);
+        return;
+    }
+
+    // set before anything can fail, release clears the fd table entry of the slot's sockfd
+    client->sockfd = connfd;
+
+    if (nexchat_set_nonblocking(connfd) == -1)
+    {
+        nexchat_log_errno("fcntl");
+        close(connfd);
+        nexchat_client_table_release(&shard->clients, client);
+        __atomic_sub_fetch(&state->connected_clients, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (nexchat_socket_set_nodelay(connfd, true) == -1 ||
+        (state->config.send_mode == NEXCHAT_SEND_CORK && nexchat_socket_set_cork(connfd, true) == -1))
+    {
+        nexchat_log_errno("setsockopt");
+    }
+
+    // EPOLLOUT is edge-triggered too, it only fires once a full send buffer frees up again.
+    // registering reports readiness right away, so a username that is already here is not missed
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = client;
+
+    if (!shard->uring && epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, connfd, &ev) == -1)
+    {
+        nexchat_log_errno("epoll_ctl");
+        close(connfd);
+        nexchat_client_table_release(&shard->clients, client);
+        __atomic_sub_fetch(&state->connected_clients, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    client->corked = false;
+    client->lagging = false;
+    client->evicting = false;
+    client->read_paused = false;
+    client->recv_parked = false;
+    client->send = NULL;
+    client->id = ((uint64_t)shard->index << CLIENT_ID_SHARD_SHIFT) | ++shard->next_client_id;
+    nexchat_frame_decoder_init(&client->decoder);
+    nexchat_outqueue_init(&client->outqueue);
+    client->outqueue.tally = &shard->buffered;
+    nexchat_arena_init(&client->scratch);
+    memset(client->username, 0, sizeof(client->username));
+    client->admin = false;
+    client->admin_failures = 0;
+    client->phase = NEXCHAT_CLIENT_ACCEPTED;
+    client->room = NULL;
+    client->room_slot = 0;
+    client->subscribed = false;
+    nexchat_timer_init(&client->timer, nexchat_server_client_timer, client);
+    nexchat_timer_init(&client->vote_timer, nexchat_server_expire_votes, client);
+    client->heard_ns = shard->now;
+    client->spoke_ns = shard->now;
+    client->pinged_ns = 0;
+    client->connected = true;
+    NEXCHAT_METRIC_ADD(shard, accepts, 1);
+
+    nexchat_server_track_handshake(shard, client);
+
+    client->phase = NEXCHAT_CLIENT_AWAITING_USERNAME;
+
+    // the first completion carries whatever already arrived, like registering with epoll reports it
+    if (shard->uring)
+    {
+        nexchat_server_uring_recv(shard, client);
+    }
+}
+
+void nexchat_server_activate_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* username)
+{
+    nexchat_server_state_t* state = shard->server;
+
+    pthread_mutex_lock(&state->roster.writer);
+    int32_t claimed = nexchat_server_claim_username(state, client, username);
+    uint64_t version = state->roster.current->version;
+    pthread_mutex_unlock(&state->roster.writer);
+
+    if (claimed == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: no free username for '%s'", username);
+        nexchat_server_sendmsg(shard, client, "server: username is taken");
+
+        // with a write in flight a direct one could overtake it
+        if (client->send == NULL)
+        {
+            nexchat_outqueue_flush(&client->outqueue, client->sockfd);
+        }
+
+        nexchat_server_release_client(shard, client);
+        return;
+    }
+
+    client->phase = NEXCHAT_CLIENT_ACTIVE;
+    __atomic_add_fetch(&state->active_clients, 1, __ATOMIC_RELAXED);
+    nexchat_log(NEXCHAT_LOG_INFO, "server: '%s' joined", client->username);
+
+    // the handshake deadline gives way to heartbeats and the idle check
+    client->spoke_ns = shard->now;
+    nexchat_server_check_liveness(shard, client);
+
+    // other servers list the user before they see it connect
+    if (state->federating)
+    {
+        nexchat_federation_relay(&state->federation, RELAY_JOIN, NULL, NULL, client->username, NULL);
+    }
+
+    nexchat_server_publish_presence(state, shard, nexchat_server_encode_presence("+%llu %s", (unsigned long long)version, client->username));
+
+    if (nexchat_server_join_room(shard, client, ROOM_LOBBY) == -1)
+    {
+        nexchat_server_release_client(shard, client);
+        return;
+    }
+
+    // handshake replies are built in the connection's scratch arena, dropped in one go below
+    nexchat_arena_t* scratch = &client->scratch;
+
+    if (strcmp(client->username, username) != 0)
+    {
+        const char* taken = nexchat_arena_printf(scratch, "server: username '%.63s' is taken, you are '%s'", username, client->username);
+        if (taken != NULL)
+        {
+            nexchat_server_sendmsg(shard, client, taken);
+        }
+    }
+
+    const char* joined = nexchat_arena_printf(scratch, "%s connected", client->username);
+    if (joined != NULL)
+    {
+        nexchat_server_broadcast_msg(shard, client->room, client, NULL, joined);
+    }
+
+    nexchat_server_sendmsg(shard, client, "type /commands to see a list of commands.");
+    nexchat_arena_free(scratch);
+}
+
+void nexchat_server_track_handshake(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    uint64_t timeout = (uint64_t)(shard->server->config.handshake_timeout * 1e9);
+    nexchat_timer_schedule(&shard->timers, &client->timer, shard->now + timeout);
+}
+
+int32_t nexchat_server_run_timers(nexchat_server_shard_t* shard)
+{
+    shard->now = nexchat_clock_now_ns();
+
+    // pings queued by the callbacks go out now, not after whatever next wakes the shard
+    if (nexchat_timer_wheel_advance(&shard->timers, shard->now) > 0)
+    {
+        nexchat_server_flush_pending(shard);
+    }
+
+    return nexchat_timer_wheel_timeout(&shard->timers, shard->now);
+}
+
+void nexchat_server_client_timer(void* ctx, nexchat_timer_t* timer)
+{
+    nexchat_server_shard_t* shard = (nexchat_server_shard_t*)ctx;
+    nexchat_client_state_t* client = (nexchat_client_state_t*)timer->owner;
+
+    if (client->phase != NEXCHAT_CLIENT_ACTIVE)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: handshake timed out, closing connection");
+        nexchat_server_release_client(shard, client);
+        return;
+    }
+
+    nexchat_server_check_liveness(shard, client);
+}
+
+void nexchat_server_check_liveness(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    const nexchat_server_config_t* config = &shard->server->config;
+    uint64_t heartbeat = (uint64_t)(config->heartbeat * 1e9);
+    uint64_t answer = (uint64_t)(HEARTBEAT_TIMEOUT * 1e9);
+    uint64_t idle = (uint64_t)(config->idle_timeout * 1e9);
+    uint64_t now = shard->now;
+
+    if (idle > 0 && now - client->spoke_ns >= idle)
+    {
+        nexchat_log(NEXCHAT_LOG_INFO, "server: '%s' has been idle for %.0f s, disconnecting", client->username, config->idle_timeout);
+        nexchat_server_sendmsg(shard, client, "server: disconnected for being idle");
+
+        if (client->send == NULL)
+        {
+            nexchat_outqueue_flush(&client->outqueue, client->sockfd);
+        }
+
+        nexchat_server_disconnect_client(shard, client->sockfd);
+        return;
+    }
+
+    if (client->pinged_ns != 0 && now - client->pinged_ns >= answer)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: '%s' did not answer a ping, disconnecting", client->username);
+        nexchat_server_disconnect_client(shard, client->sockfd);
+        return;
+    }
+
+    // the next check is whichever of the deadlines comes first, a frame arriving in between
+    // only moves `heard_ns` and the check then finds there is nothing to do yet
+    uint64_t deadline = UINT64_MAX;
+
+    if (heartbeat > 0 && client->pinged_ns != 0)
+    {
+        deadline = client->pinged_ns + answer;
+    }
+    else if (heartbeat > 0 && now - client->heard_ns >= heartbeat)
+    {
+        nexchat_buffer_t* sendbuf = &shard->sendbuf;
+        nexchat_buffer_clear(sendbuf);
+
+        nexchat_msgbuf_t* ping = nexchat_frame_encode(sendbuf, FRAME_PING, NULL, 0) == 0
+                               ? nexchat_msgbuf_create(nexchat_buffer_head(sendbuf), nexchat_buffer_readable(sendbuf)) : NULL;
+        if (ping != NULL)
+        {
+            nexchat_server_enqueue(shard, client, ping);
+            nexchat_msgbuf_release(ping);
+        }
+
+        client->pinged_ns = now;
+        deadline = now + answer;
+    }
+    else if (heartbeat > 0)
+    {
+        deadline = client->heard_ns + heartbeat;
+    }
+
+    if (idle > 0 && client->spoke_ns + idle < deadline)
+    {
+        deadline = client->spoke_ns + idle;
+    }
+
+    if (deadline == UINT64_MAX)
+    {
+        nexchat_timer_cancel(&shard->timers, &client->timer);
+        return;
+    }
+
+    nexchat_timer_schedule(&shard->timers, &client->timer, deadline);
+}
+
+void nexchat_server_arm_vote(nexchat_server_shard_t* shard, int32_t sockfd, uint64_t client_id)
+{
+    nexchat_client_state_t* client = nexchat_client_table_find(&shard->clients, sockfd);
+    if (client == NULL || !client->connected || client->id != client_id || nexchat_timer_armed(&client->vote_timer))
+    {
+        return;
+    }
+
+    uint64_t window = (uint64_t)(shard->server->config.vote_window * 1e9);
+    nexchat_timer_schedule(&shard->timers, &client->vote_timer, shard->now + window);
+}
+
+void nexchat_server_expire_votes(void* ctx, nexchat_timer_t* timer)
+{
+    nexchat_server_shard_t* shard = (nexchat_server_shard_t*)ctx;
+    nexchat_server_state_t* state = shard->server;
+    nexchat_client_state_t* client = (nexchat_client_state_t*)timer->owner;
+
+    // the entry is swapped out on a rename, the votes move along with it
+    const nexchat_roster_snapshot_t* roster = nexchat_roster_read_begin(&state->roster, shard->index);
+
+    nexchat_roster_entry_t* entry = nexchat_roster_find(roster, client->username);
+    size_t expired = 0;
+    if (entry != NULL && entry->client == client)
+    {
+        expired = __atomic_exchange_n(&entry->kicks, 0, __ATOMIC_RELAXED);
+    }
+
+    nexchat_roster_read_end(&state->roster, shard->index);
+
+    if (expired > 0)
+    {
+        nexchat_log(NEXCHAT_LOG_INFO, "server: %zu vote(s) to kick '%s' expired", expired, client->username);
+    }
+}
+
+void nexchat_server_handle_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    int32_t sockfd = client->sockfd;
+
+    // edge-triggered, so keep reading until the socket would block
+    while (client->connected && client->sockfd == sockfd && shard->server->running)
+    {
+        // a paused client is read again by nexchat_server_resume_reading, the edge isn't needed
+        if (nexchat_server_reads_paused(shard, client))
+        {
+            return;
+        }
+
+        if (nexchat_server_dispatch_frames(shard, client) == -1)
+        {
+            return;
+        }
+
+        size_t space = 0;
+        uint8_t* recvbuf = nexchat_frame_decoder_prepare(&client->decoder, &space);
+        if (recvbuf == NULL)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory reading from '%s'", client->username);
+            nexchat_server_disconnect_client(shard, client->sockfd);
+            break;
+        }
+
+        int32_t bytesread = nexchat_server_recvmsg(client->sockfd, (char*)recvbuf, space);
+
+        if (bytesread == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                nexchat_log_errno("recv");
+                nexchat_server_disconnect_client(shard, client->sockfd);
+            }
+
+            break;
+        }
+        else if (bytesread == 0) // client disconnected
+        {
+            nexchat_server_disconnect_client(shard, client->sockfd);
+            break;
+        }
+
+        NEXCHAT_METRIC_ADD(shard, bytes_in, bytesread);
+        nexchat_frame_decoder_commit(&client->decoder, (size_t)bytesread);
+    }
+}
+
+int32_t nexchat_server_dispatch_frames(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    int32_t sockfd = client->sockfd;
+
+    // one recv may carry many frames, dispatch them all straight out of the decoder buffer
+    nexchat_frame_t frame;
+    int32_t status = 0;
+
+    while ((status = nexchat_frame_decoder_next(&client->decoder, &frame)) == 1)
+    {
+        NEXCHAT_METRIC_ADD(shard, frames_in, 1);
+
+        // any frame shows the peer is alive, the liveness timer sees it when it next fires
+        client->heard_ns = shard->now;
+        client->pinged_ns = 0;
+
+        if (frame.type == FRAME_PONG)
+        {
+            // the answer deadline is moot now, the check moves the timer on to the next ping
+            if (client->phase == NEXCHAT_CLIENT_ACTIVE)
+            {
+                nexchat_server_check_liveness(shard, client);
+            }
+        }
+        else if (client->phase != NEXCHAT_CLIENT_ACTIVE)
+        {
+            if (frame.type != FRAME_TEXT)
+            {
+                nexchat_log(NEXCHAT_LOG_WARN, "server: client did not send a username");
+                nexchat_server_release_client(shard, client);
+                return -1;
+            }
+
+            nexchat_server_activate_client(shard, client, frame.payload);
+        }
+        else if (frame.type != FRAME_TEXT)
+        {
+            // relay frames only travel between servers
+            nexchat_log(NEXCHAT_LOG_WARN, "server: unexpected frame type %d from '%s'", (int)frame.type, client->username);
+            nexchat_server_disconnect_client(shard, client->sockfd);
+            return -1;
+        }
+        else
+        {
+            client->spoke_ns = shard->now;
+            nexchat_server_handle_msg(shard, client, frame.payload);
+        }
+
+        if (!client->connected || client->sockfd != sockfd)
+        {
+            return -1;
+        }
+    }
+
+    if (status == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: malformed frame from '%s'", client->username);
+        nexchat_server_disconnect_client(shard, client->sockfd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void nexchat_server_handle_msg(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* recvbuf)
+{
+    if (recvbuf[0] == '/')
+    {
+        char sendbuf[1024];
+        nexchat_command_args_t args;
+        int32_t status = nexchat_command_tokenize(&recvbuf[1], &args);
+
+        if (status == NEXCHAT_COMMAND_TOO_LONG)
+        {
+            snprintf(sendbuf, sizeof(sendbuf) - 1, "server: command '%.64s' is too long, commands are at most %d bytes", recvbuf, NEXCHAT_COMMAND_MAXLEN);
+            nexchat_server_sendmsg(shard, client, sendbuf);
+            return;
+        }
+
+        // with too many words the first ones are still there, enough to tell which command it was
+        if ((status != 0 && status != NEXCHAT_COMMAND_TOO_MANY) || args.argc == 0)
+        {
+            snprintf(sendbuf, sizeof(sendbuf) - 1, "server: malformed command '%.64s'", recvbuf);
+            nexchat_server_sendmsg(shard, client, sendbuf);
+            return;
+        }
+
+        nexchat_client_command_t cmd = nexchat_client_command_lookup(args.argv[0], strlen(args.argv[0]));
+        const nexchat_command_info_t* info = nexchat_client_command_info(cmd);
+        size_t argc = args.argc - 1;
+        bool toomany = status == NEXCHAT_COMMAND_TOO_MANY;
+
+        if (cmd == CMD_NONE)
+        {
+            snprintf(sendbuf, sizeof(sendbuf) - 1, "server: unknown command '/%.64s'", args.argv[0]);
+            nexchat_server_sendmsg(shard, client, sendbuf);
+        }
+        else if (toomany || argc < info->minargs || argc > info->maxargs)
+        {
+            int32_t offset = info->minargs == info->maxargs ?
+                snprintf(sendbuf, sizeof(sendbuf) - 1, "server: /%s expects %zu argument(s)", info->name, info->maxargs) :
+                snprintf(sendbuf, sizeof(sendbuf) - 1, "server: /%s expects %zu to %zu arguments", info->name, info->minargs, info->maxargs);
+
+            snprintf(sendbuf + offset, sizeof(sendbuf) - 1 - offset, toomany ? ", got more than %zu, usage: /%s%s%s" : ", got %zu, usage: /%s%s%s",
+                argc, info->name, info->usage[0] != '\0' ? " " : "", info->usage);
+            nexchat_server_sendmsg(shard, client, sendbuf);
+        }
+        else
+        {
+            nexchat_server_exec_cmd(shard, client, cmd, argc, &args.argv[1]);
+        }
+    }
+    else
+    {
+        nexchat_log(NEXCHAT_LOG_INFO, "%s: %s", client->username, recvbuf);
+
+        nexchat_msgbuf_t* shared = client->room != NULL ? nexchat_server_encode_broadcast(shard, client->username, recvbuf) : NULL;
+        if (shared == NULL)
+        {
+            return;
+        }
+
+        nexchat_server_broadcast_shared(shard, client->room, client, shared);
+
+        // handed to the log writer after the fan-out, the disk never holds up delivery
+        if (shard->server->logging)
+        {
+            nexchat_msglog_append(&shard->server->log, client->room->name, shared);
+        }
+
+        if (shard->server->federating)
+        {
+            nexchat_federation_relay(&shard->server->federation, RELAY_CHAT, client->room->name, shared, NULL, NULL);
+        }
+
+        nexchat_msgbuf_release(shared);
+    }
+}
+
+void nexchat_server_sendmsg(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* msg)
+{
+    nexchat_buffer_t* sendbuf = &shard->sendbuf;
+    nexchat_buffer_clear(sendbuf);
+
+    if (nexchat_frame_encode_text(sendbuf, msg) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: failed to encode message");
+        return;
+    }
+
+    nexchat_msgbuf_t* frame = nexchat_msgbuf_create(nexchat_buffer_head(sendbuf), nexchat_buffer_readable(sendbuf));
+    if (frame == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory queueing message for '%s'", client->username);
+        return;
+    }
+
+    nexchat_server_enqueue(shard, client, frame);
+    nexchat_msgbuf_release(frame);
+}
+
+void nexchat_server_enqueue(nexchat_server_shard_t* shard, nexchat_client_state_t* client, nexchat_msgbuf_t* msg)
+{
+    const nexchat_server_config_t* config = &shard->server->config;
+    nexchat_outqueue_t* queue = &client->outqueue;
+
+    if (client->lagging && queue->bytes <= config->outbound_low)
+    {
+        client->lagging = false;
+    }
+
+    // a burst fanned out in one wakeup can pass the high mark before the flush list runs,
+    // so give the socket what it will take before calling the client slow
+    if (!client->lagging && !client->evicting && client->send == NULL && queue->bytes + msg->size > config->outbound_high)
+    {
+        size_t pending = queue->bytes;
+
+        // a failed write is left for the scheduled flush, this may be in the middle of a fanout
+        nexchat_outqueue_flush(queue, client->sockfd);
+        NEXCHAT_METRIC_ADD(shard, bytes_out, pending - queue->bytes);
+
+        if (pending != queue->bytes)
+        {
+            nexchat_server_track_corked(shard, client);
+        }
+    }
+
+    if ((client->lagging || client->evicting || queue->bytes + msg->size > config->outbound_high) &&
+        !nexchat_server_apply_slow_policy(shard, client, msg))
+    {
+        return;
+    }
+
+    // a non-empty queue is either already on the flush list or waiting for EPOLLOUT
+    bool was_empty = nexchat_outqueue_empty(queue);
+
+    if (nexchat_outqueue_push(queue, msg) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory queueing message for '%s'", client->username);
+        return;
+    }
+
+    if (was_empty && nexchat_server_schedule_flush(shard, client) == -1)
+    {
+        // can't defer it, write what we can right away
+        nexchat_server_flush_client(shard, client);
+    }
+}
+
+int32_t nexchat_server_schedule_flush(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    if (shard->flushlist_count == shard->flushlist_capacity)
+    {
+        size_t capacity = shard->flushlist_capacity > 0 ? shard->flushlist_capacity * 2 : 64;
+        nexchat_client_state_t** flushlist = (nexchat_client_state_t**)realloc(shard->flushlist, capacity * sizeof(nexchat_client_state_t*));
+        if (flushlist == NULL)
+        {
+            return -1;
+        }
+
+        shard->flushlist = flushlist;
+        shard->flushlist_capacity = capacity;
+    }
+
+    shard->flushlist[shard->flushlist_count++] = client;
+
+    return 0;
+}
+
+bool nexchat_server_apply_slow_policy(nexchat_server_shard_t* shard, nexchat_client_state_t* client, nexchat_msgbuf_t* msg)
+{
+    const nexchat_server_config_t* config = &shard->server->config;
+    nexchat_outqueue_t* queue = &client->outqueue;
+
+    // frames an io_uring send is writing from can't be dropped
+    size_t pinned = client->send != NULL ? client->send->count : 0;
+
+    if (client->evicting)
+    {
+        NEXCHAT_METRIC_ADD(shard, drops, 1);
+        return false;
+    }
+
+    switch (config->slow_policy)
+    {
+        case NEXCHAT_SLOW_DROP_OLDEST:
+        {
+            // down to the low mark with room for this frame, so the next ones don't trim again
+            size_t target = msg->size < config->outbound_low ? config->outbound_low - msg->size : 0;
+            NEXCHAT_METRIC_ADD(shard, drops, nexchat_outqueue_trim(queue, pinned, target));
+
+            if (queue->bytes + msg->size <= config->outbound_high)
+            {
+                return true;
+            }
+
+            // what's left is in flight or bigger than the watermark, this one has to go instead
+            NEXCHAT_METRIC_ADD(shard, drops, 1);
+            return false;
+        }
+        case NEXCHAT_SLOW_DROP_NEW:
+        {
+            client->lagging = true;
+            NEXCHAT_METRIC_ADD(shard, drops, 1);
+            return false;
+        }
+        case NEXCHAT_SLOW_DISCONNECT:
+        {
+            // this may be called from a fanout walking the room, so the disconnect waits for the flush
+            client->evicting = true;
+            NEXCHAT_METRIC_ADD(shard, drops, 1);
+
+            if (nexchat_server_schedule_flush(shard, client) == -1)
+            {
+                nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory scheduling disconnect of '%s'", client->username);
+            }
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void nexchat_server_evict_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    // everything it hasn't read goes, the reason follows a partly written frame if there's room
+    nexchat_outqueue_trim(&client->outqueue, client->send != NULL ? client->send->count : 0, 0);
+    client->evicting = false;
+    client->lagging = false;
+
+    nexchat_log(NEXCHAT_LOG_WARN, "server: '%s' is not reading, disconnecting", client->username);
+    nexchat_server_sendmsg(shard, client, "server: disconnected, too much unread data");
+
+    if (client->send == NULL)
+    {
+        nexchat_outqueue_flush(&client->outqueue, client->sockfd);
+    }
+
+    NEXCHAT_METRIC_ADD(shard, evictions, 1);
+    nexchat_server_disconnect_client(shard, client->sockfd);
+}
+
+size_t nexchat_server_buffered_bytes(nexchat_server_state_t* state)
+{
+    uint64_t total = 0;
+
+    for (size_t i = 0; i < state->shard_count; i++)
+    {
+        total += __atomic_load_n(&state->shards[i].buffered, __ATOMIC_RELAXED);
+    }
+
+    return (size_t)total;
+}
+
+bool nexchat_server_reads_paused(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    if (client->read_paused)
+    {
+        return true;
+    }
+
+    // only clients that send while the server is over budget stop, readers and handshakes carry on
+    if (client->phase != NEXCHAT_CLIENT_ACTIVE || nexchat_server_buffered_bytes(shard->server) <= shard->server->config.memory_budget)
+    {
+        return false;
+    }
+
+    if (shard->paused_count == shard->paused_capacity)
+    {
+        size_t capacity = shard->paused_capacity > 0 ? shard->paused_capacity * 2 : 64;
+        nexchat_client_state_t** paused = (nexchat_client_state_t**)realloc(shard->paused, capacity * sizeof(nexchat_client_state_t*));
+        if (paused == NULL)
+        {
+            // nowhere to remember it, keep reading
+            return false;
+        }
+
+        shard->paused = paused;
+        shard->paused_capacity = capacity;
+    }
+
+    shard->paused[shard->paused_count++] = client;
+    client->read_paused = true;
+    NEXCHAT_METRIC_ADD(shard, read_pauses, 1);
+
+    // a multishot recv would keep filling the decoder, stop it and rearm on resume
+    if (shard->uring)
+    {
+        nexchat_server_uring_cancel(shard, NEXCHAT_URING_CLIENT_DATA(URING_OP_RECV, client));
+    }
+
+    return true;
+}
+
+void nexchat_server_resume_reading(nexchat_server_shard_t* shard)
+{
+    size_t budget = shard->server->config.memory_budget;
+
+    // resume a quarter below the budget so readers don't flap around it
+    if (shard->paused_count == 0 || nexchat_server_buffered_bytes(shard->server) > budget - budget / 4)
+    {
+        return;
+    }
+
+    // reading can pause clients again, they go on a fresh list
+    nexchat_client_state_t** paused = shard->paused;
+    size_t count = shard->paused_count;
+    size_t capacity = shard->paused_capacity;
+    shard->paused = NULL;
+    shard->paused_count = 0;
+    shard->paused_capacity = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        nexchat_client_state_t* client = paused[i];
+
+        if (!client->connected || !client->read_paused)
+        {
+            continue;
+        }
+
+        client->read_paused = false;
+
+        if (!shard->uring)
+        {
+            nexchat_server_handle_client(shard, client);
+        }
+        else if (nexchat_server_dispatch_frames(shard, client) == 0 && client->recv_parked && !client->read_paused)
+        {
+            client->recv_parked = false;
+            nexchat_server_uring_recv(shard, client);
+        }
+    }
+
+    if (shard->paused == NULL)
+    {
+        shard->paused = paused;
+        shard->paused_capacity = capacity;
+    }
+    else
+    {
+        free(paused);
+    }
+}
+
+void nexchat_server_flush_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    if (shard->uring)
+    {
+        nexchat_server_uring_send(shard, client);
+        return;
+    }
+
+    size_t pending = client->outqueue.bytes;
+    int32_t status = nexchat_outqueue_flush(&client->outqueue, client->sockfd);
+    NEXCHAT_METRIC_ADD(shard, bytes_out, pending - client->outqueue.bytes);
+
+    if (status == -1)
+    {
+        nexchat_log_errno("send");
+        nexchat_server_disconnect_client(shard, client->sockfd);
+        return;
+    }
+
+    if (pending != client->outqueue.bytes)
+    {
+        nexchat_server_track_corked(shard, client);
+    }
+}
+
+void nexchat_server_track_corked(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    if (shard->server->config.send_mode != NEXCHAT_SEND_CORK || client->corked)
+    {
+        return;
+    }
+
+    // remember it so the tail is pushed once the shard catches up
+    if (shard->corklist_count == shard->corklist_capacity)
+    {
+        size_t capacity = shard->corklist_capacity > 0 ? shard->corklist_capacity * 2 : 64;
+        nexchat_client_state_t** corklist = (nexchat_client_state_t**)realloc(shard->corklist, capacity * sizeof(nexchat_client_state_t*));
+        if (corklist == NULL)
+        {
+            // left to the kernel's cork timer
+            return;
+        }
+
+        shard->corklist = corklist;
+        shard->corklist_capacity = capacity;
+    }
+
+    client->corked = true;
+    shard->corklist[shard->corklist_count++] = client;
+}
+
+void nexchat_server_flush_pending(nexchat_server_shard_t* shard)
+{
+    // flushing can disconnect a client, which broadcasts and may append to the list as we go
+    for (size_t i = 0; i < shard->flushlist_count; i++)
+    {
+        nexchat_client_state_t* client = shard->flushlist[i];
+
+        if (client->connected && client->evicting)
+        {
+            nexchat_server_evict_client(shard, client);
+            continue;
+        }
+
+        if (!client->connected || nexchat_outqueue_empty(&client->outqueue))
+        {
+            continue;
+        }
+
+        nexchat_server_flush_client(shard, client);
+    }
+
+    shard->flushlist_count = 0;
+}
+
+void nexchat_server_push_corked(nexchat_server_shard_t* shard)
+{
+    for (size_t i = 0; i < shard->corklist_count; i++)
+    {
+        nexchat_client_state_t* client = shard->corklist[i];
+
+        if (!client->connected || !client->corked)
+        {
+            continue;
+        }
+
+        // pulling the cork sends whatever partial segment is left, then it goes straight back in
+        if (nexchat_socket_set_cork(client->sockfd, false) == -1 || nexchat_socket_set_cork(client->sockfd, true) == -1)
+        {
+            nexchat_log_errno("setsockopt");
+        }
+
+        client->corked = false;
+    }
+
+    shard->corklist_count = 0;
+}
+
+int32_t nexchat_server_recvmsg(int32_t sockfd, char* recvbuf, size_t size)
+{
+    return recv(sockfd, recvbuf, size, 0);
+}
+
+void nexchat_server_send_cmdlist_to_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    char sendbuf[1024];
+    size_t offset = 0;
+
+    for (size_t i = CMD_NONE + 1; i < CMD_MAXCOMMANDS && offset < sizeof(sendbuf) - 1; i++)
+    {
+        const nexchat_command_info_t* info = nexchat_client_command_info((nexchat_client_command_t)i);
+        offset += snprintf(sendbuf + offset, sizeof(sendbuf) - offset, "  /%s - %s\n", info->name, info->desc);
+    }
+
+    nexchat_server_sendmsg(shard, client, sendbuf);
+}
+
+// compares a token in time that depends only on the length of `given`, which the client already
+// knows, so neither how long `token` is nor how much of it was guessed right shows in the reply time
+static bool nexchat_server_token_equal(const char* given, const char* token, size_t tokenlen)
+{
+    size_t givenlen = strlen(given);
+    volatile uint8_t diff = givenlen != tokenlen;
+
+    for (size_t i = 0; i < givenlen; i++)
+    {
+        diff |= (uint8_t)given[i] ^ (uint8_t)(tokenlen > 0 ? token[i % tokenlen] : 0);
+    }
+
+    return diff == 0;
+}
+
+void nexchat_server_exec_cmd(nexchat_server_shard_t* shard, nexchat_client_state_t* client, nexchat_client_command_t cmd, size_t argc, const char** argv)
+{
+    nexchat_server_state_t* state = shard->server;
+    char sendbuf[1024];
+
+    // argument counts were checked against the command table, most commands take one word
+    const char* args = argc > 0 ? argv[0] : NULL;
+
+    NEXCHAT_METRIC_START(started);
+
+    switch (cmd)
+    {
+        case CMD_COMMANDS:
+        {
+            nexchat_server_send_cmdlist_to_client(shard, client);
+        } break;
+        case CMD_SETUSERNAME:
+        {
+            size_t usernamelen = strlen(args);
+            if (usernamelen >= sizeof client->username)
+            {
+                nexchat_server_sendmsg(shard, client, "server: username is too long");
+            }
+            else if (usernamelen == 0)
+            {
+                nexchat_server_sendmsg(shard, client, "server: username must not be empty");
+            }
+            else
+            {
+                size_t oldusernamelen = strlen(client->username);
+                char oldusername[64];
+                memcpy(oldusername, client->username, strlen(client->username));
+                oldusername[oldusernamelen] = '\0';
+
+                pthread_mutex_lock(&state->roster.writer);
+                bool taken = nexchat_roster_find(state->roster.current, args) != NULL;
+                bool failed = false;
+                uint64_t version = 0;
+
+                if (!taken)
+                {
+                    // published entries are immutable, swap in a renamed copy that keeps the votes
+                    nexchat_roster_entry_t* old = nexchat_roster_find(state->roster.current, client->username);
+                    nexchat_roster_entry_t* renamed = nexchat_roster_entry_create(args, client);
+
+                    if (renamed != NULL && old != NULL)
+                    {
+                        renamed->kicks = __atomic_load_n(&old->kicks, __ATOMIC_RELAXED);
+                    }
+
+                    if (renamed == NULL || nexchat_roster_update(&state->roster, old, renamed) == -1)
+                    {
+                        nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory indexing username '%s'", args);
+                        free(renamed);
+                        failed = true;
+                    }
+                    else
+                    {
+                        // the roster files the client under this name now, keep the two in step
+                        version = state->roster.current->version;
+                        memcpy(client->username, args, usernamelen + 1);
+                    }
+                }
+
+                pthread_mutex_unlock(&state->roster.writer);
+
+                if (taken)
+                {
+                    snprintf(sendbuf, sizeof(sendbuf) - 1, "server: username '%s' is already taken", args);
+                    nexchat_server_sendmsg(shard, client, sendbuf);
+                    break;
+                }
+
+                if (failed)
+                {
+                    nexchat_server_sendmsg(shard, client, "server: could not change your username, try again later");
+                    break;
+                }
+
+                nexchat_log(NEXCHAT_LOG_INFO, "server: '%s' set username -> '%s'", oldusername, client->username);
+
+                if (state->federating)
+                {
+                    nexchat_federation_relay(&state->federation, RELAY_RENAME, NULL, NULL, oldusername, client->username);
+                }
+
+                if (version != 0)
+                {
+                    nexchat_msgbuf_t* event = nexchat_server_encode_presence("~%llu %s\n%s", (unsigned long long)version, oldusername, client->username);
+                    nexchat_server_publish_presence(state, shard, event);
+                }
+                nexchat_server_sendmsg(shard, client, "server: new username set");
+
+                snprintf(sendbuf, sizeof(sendbuf), "'%s' set username -> '%s'", oldusername, client->username);
+                nexchat_server_broadcast_msg(shard, client->room, client, "server", sendbuf);
+            }
+        } break;
+        case CMD_LISTUSERS:
+        {
+            // clients live on every shard, the roster is the one place that sees them all
+            const nexchat_roster_snapshot_t* roster = nexchat_roster_read_begin(&state->roster, shard->index);
+
+            snprintf(sendbuf, sizeof(sendbuf) - 1, "server: %zu user(s) in the chat, you are '%s'", roster->count, client->username);
+            nexchat_server_sendmsg(shard, client, sendbuf);
+            nexchat_server_send_listing(shard, client, roster);
+
+            nexchat_roster_read_end(&state->roster, shard->index);
+        } break;
+        case CMD_PRESENCE:
+        {
+            if (strcmp(args, "on") != 0 && strcmp(args, "off") != 0)
+            {
+                nexchat_server_sendmsg(shard, client, "server: usage /presence on|off");
+                break;
+            }
+
+            nexchat_server_subscribe_presence(shard, client, strcmp(args, "on") == 0);
+        } break;
+        case CMD_KICKUSER:
+        {
+            const nexchat_roster_snapshot_t* roster = nexchat_roster_read_begin(&state->roster, shard->index);
+
+            nexchat_roster_entry_t* c = nexchat_roster_find(roster, args);
+            bool foundclient = c != NULL && c->client != client;
+            bool remote = foundclient && c->client == NULL;
+            bool kick = false;
+            bool first = false;
+            int32_t sockfd = -1;
+            uint64_t id = 0;
+
+            if (foundclient && !remote)
+            {
+                size_t kicks = __atomic_add_fetch(&c->kicks, 1, __ATOMIC_RELAXED);
+                size_t live = __atomic_load_n(&state->active_clients, __ATOMIC_RELAXED);
+                size_t majority = (live / 2) + live % 2;
+
+                kick = kicks >= majority;
+                first = kicks == 1;
+                sockfd = c->sockfd;
+                id = c->client_id;
+            }
+
+            nexchat_roster_read_end(&state->roster, shard->index);
+
+            // the first vote starts the window in which the others have to come in
+            if (kick || first)
+            {
+                size_t owner = (size_t)(id >> CLIENT_ID_SHARD_SHIFT);
+
+                if (owner == shard->index && kick)
+                {
+                    nexchat_server_kick_client(shard, sockfd);
+                }
+                else if (owner == shard->index)
+                {
+                    nexchat_server_arm_vote(shard, sockfd, id);
+                }
+                else
+                {
+                    // the target belongs to another reactor, only its own thread may touch it
+                    nexchat_shard_msg_t* msg = (nexchat_shard_msg_t*)nexchat_pool_alloc(sizeof(nexchat_shard_msg_t));
+                    if (msg != NULL)
+                    {
+                        memset(msg, 0, sizeof(nexchat_shard_msg_t));
+                        msg->type = kick ? SHARD_MSG_KICK : SHARD_MSG_VOTE;
+                        msg->sockfd = sockfd;
+                        msg->client_id = id;
+                        nexchat_server_post(&state->shards[owner], msg);
+                    }
+                }
+            }
+            else if (remote)
+            {
+                // votes are counted where the user is connected
+                snprintf(sendbuf, sizeof(sendbuf) - 1, "server: '%s' is connected to another server, only its users can vote to kick", args);
+                nexchat_server_sendmsg(shard, client, sendbuf);
+            }
+            else if (!foundclient)
+            {
+                snprintf(sendbuf, sizeof(sendbuf), "server: no users named '%s' in the chat", args);
+                nexchat_server_sendmsg(shard, client, sendbuf);
+            }
+        } break;
+        case CMD_JOIN:
+        {
+            if (client->room != NULL && strcmp(client->room->name, args) == 0)
+            {
+                nexchat_server_sendmsg(shard, client, "server: you are already in that room");
+                break;
+            }
+
+            // held across the move, the room is released as it empties and is told after
+            nexchat_room_t* old = client->room != NULL ? nexchat_room_retain(client->room) : NULL;
+
+            if (nexchat_server_join_room(shard, client, args) == 0)
+            {
+                snprintf(sendbuf, sizeof(sendbuf) - 1, "'%s' left the room", client->username);
+                nexchat_server_broadcast_msg(shard, old, client, "server", sendbuf);
+
+                snprintf(sendbuf, sizeof(sendbuf) - 1, "'%s' joined the room", client->username);
+                nexchat_server_broadcast_msg(shard, client->room, client, "server", sendbuf);
+
+                snprintf(sendbuf, sizeof(sendbuf) - 1, "server: you are now in '%s'", client->room->name);
+                nexchat_server_sendmsg(shard, client, sendbuf);
+            }
+
+            if (old != NULL)
+            {
+                nexchat_room_release(old);
+            }
+        } break;
+        case CMD_LEAVE:
+        {
+            if (client->room != NULL && strcmp(client->room->name, ROOM_LOBBY) == 0)
+            {
+                nexchat_server_sendmsg(shard, client, "server: you are already in the lobby");
+                break;
+            }
+
+            nexchat_room_t* old = client->room != NULL ? nexchat_room_retain(client->room) : NULL;
+
+            if (nexchat_server_join_room(shard, client, ROOM_LOBBY) == 0)
+            {
+                snprintf(sendbuf, sizeof(sendbuf) - 1, "'%s' left the room", client->username);
+                nexchat_server_broadcast_msg(shard, old, client, "server", sendbuf);
+                nexchat_server_sendmsg(shard, client, "server: you are back in the lobby");
+            }
+
+            if (old != NULL)
+            {
+                nexchat_room_release(old);
+            }
+        } break;
+        case CMD_ROOMS:
+        {
+            nexchat_server_send_roomlist_to_client(shard, client);
+        } break;
+        case CMD_ADMIN:
+        {
+            if (state->config.admin_token == NULL)
+            {
+                nexchat_server_sendmsg(shard, client, "server: admin access is disabled");
+            }
+            else if (!nexchat_server_token_equal(args, state->config.admin_token, state->config.admin_token_len))
+            {
+                nexchat_log(NEXCHAT_LOG_WARN, "server: '%s' failed admin authentication", client->username);
+
+                // guessing costs a reconnect and a fresh handshake every few tries
+                if (++client->admin_failures >= ADMIN_ATTEMPTS)
+                {
+                    nexchat_log(NEXCHAT_LOG_WARN, "server: '%s' sent %u wrong admin tokens, disconnecting", client->username, client->admin_failures);
+                    nexchat_server_sendmsg(shard, client, "server: too many invalid admin tokens");
+
+                    if (client->send == NULL)
+                    {
+                        size_t pending = client->outqueue.bytes;
+                        nexchat_outqueue_flush(&client->outqueue, client->sockfd);
+                        NEXCHAT_METRIC_ADD(shard, bytes_out, pending - client->outqueue.bytes);
+                    }
+
+                    nexchat_server_disconnect_client(shard, client->sockfd);
+                    return;
+                }
+
+                nexchat_server_sendmsg(shard, client, "server: invalid admin token");
+            }
+            else
+            {
+                nexchat_log(NEXCHAT_LOG_INFO, "server: '%s' authenticated as admin", client->username);
+                client->admin = true;
+                nexchat_server_sendmsg(shard, client, "server: admin access granted");
+            }
+        } break;
+        case CMD_STATS:
+        {
+            if (!client->admin)
+            {
+                nexchat_server_sendmsg(shard, client, "server: /stats requires admin access, see /admin");
+                break;
+            }
+
+            char stats[4096];
+            nexchat_server_metrics_format(state, stats, sizeof stats);
+            nexchat_server_sendmsg(shard, client, stats);
+        } break;
+        case CMD_NONE:
+        case CMD_MAXCOMMANDS:
+        default:
+        {
+            // nexchat_server_handle_msg only passes commands from the table, nothing to time here
+            nexchat_server_sendmsg(shard, client, "server: unknown command");
+            return;
+        }
+    }
+
+    NEXCHAT_METRIC_RECORD(shard, command_ns[cmd], started);
+}
+
+void nexchat_server_broadcast_msg(nexchat_server_shard_t* shard, nexchat_room_t* room, nexchat_client_state_t* sender, const char* username, const char* msg)
+{
+    if (room == NULL)
+    {
+        return;
+    }
+
+    nexchat_msgbuf_t* shared = nexchat_server_encode_broadcast(shard, username, msg);
+    if (shared == NULL)
+    {
+        return;
+    }
+
+    nexchat_server_broadcast_shared(shard, room, sender, shared);
+
+    if (shard->server->federating)
+    {
+        nexchat_federation_relay(&shard->server->federation, RELAY_NOTICE, room->name, shared, NULL, NULL);
+    }
+
+    // the last queue to finish writing it frees the buffer
+    nexchat_msgbuf_release(shared);
+}
+
+void nexchat_server_broadcast_shared(nexchat_server_shard_t* shard, nexchat_room_t* room, nexchat_client_state_t* sender, nexchat_msgbuf_t* shared)
+{
+    NEXCHAT_METRIC_ADD(shard, broadcasts, 1);
+    nexchat_server_fanout(shard, room, sender, shared);
+
+    // shards with members in the room each get a reference and fan it out to their own members
+    nexchat_server_state_t* state = shard->server;
+
+    for (size_t i = 0; i < state->shard_count; i++)
+    {
+        if (i == shard->index || nexchat_room_count_on(room, i) == 0)
+        {
+            continue;
+        }
+
+        nexchat_shard_msg_t* post = (nexchat_shard_msg_t*)nexchat_pool_alloc(sizeof(nexchat_shard_msg_t));
+        if (post == NULL)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory relaying broadcast to worker %zu", i);
+            continue;
+        }
+
+        memset(post, 0, sizeof(nexchat_shard_msg_t));
+        post->type = SHARD_MSG_BROADCAST;
+        post->msg = nexchat_msgbuf_retain(shared);
+        post->room = nexchat_room_retain(room);
+        nexchat_server_post(&state->shards[i], post);
+    }
+}
+
+void nexchat_server_fanout(nexchat_server_shard_t* shard, nexchat_room_t* room, nexchat_client_state_t* sender, nexchat_msgbuf_t* msg)
+{
+    NEXCHAT_METRIC_START(started);
+    size_t deliveries = 0;
+
+    // only the room's members on this shard, the cost follows the audience rather than the user count
+    nexchat_room_members_t* members = &room->shards[shard->index];
+
+    for (size_t i = 0; i < members->count; i++)
+    {
+        nexchat_client_state_t* client = members->clients[i];
+
+        if (client == sender)
+        {
+            continue;
+        }
+
+        nexchat_server_enqueue(shard, client, msg);
+        deliveries++;
+    }
+
+    NEXCHAT_METRIC_ADD(shard, deliveries, deliveries);
+    NEXCHAT_METRIC_RECORD(shard, fanout_ns, started);
+}
+
+int32_t nexchat_server_join_room(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* name)
+{
+    nexchat_room_t* room = nexchat_server_enter_room(shard, client, name);
+    if (room == NULL)
+    {
+        return -1;
+    }
+
+    nexchat_server_replay_room(shard, client, room);
+
+    return 0;
+}
+
+nexchat_room_t* nexchat_server_enter_room(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* name)
+{
+    nexchat_server_state_t* state = shard->server;
+    size_t namelen = strlen(name);
+
+    if (namelen == 0 || namelen >= ROOM_NAME_MAX)
+    {
+        nexchat_server_sendmsg(shard, client, "server: room names must be 1 to 31 characters");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&state->rooms_mutex);
+
+    nexchat_room_t* room = (nexchat_room_t*)nexchat_strmap_get(&state->rooms, name);
+
+    // the table's reference is the one the room is created with
+    if (room == NULL && state->rooms.count < state->config.max_rooms)
+    {
+        room = nexchat_room_create(name, state->shard_count);
+
+        if (room != NULL && nexchat_strmap_put(&state->rooms, room->name, room) == -1)
+        {
+            nexchat_room_free(room);
+            room = NULL;
+        }
+    }
+
+    if (room != NULL)
+    {
+        room->members++;
+    }
+
+    pthread_mutex_unlock(&state->rooms_mutex);
+
+    if (room == NULL)
+    {
+        nexchat_server_sendmsg(shard, client, "server: can't create any more rooms");
+        return NULL;
+    }
+
+    // the member arrays for this shard are only ever touched from this thread, no lock needed
+    nexchat_server_leave_room(shard, client);
+
+    if (nexchat_room_add(room, shard->index, client) == -1)
+    {
+        nexchat_server_room_departed(state, room);
+
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory joining '%s'", name);
+        nexchat_server_sendmsg(shard, client, "server: failed to join room");
+        return NULL;
+    }
+
+    return room;
+}
+
+// where nexchat_server_replay_room delivers the frames it reads back from the log
+typedef struct nexchat_server_replay_ctx_t
+{
+    nexchat_server_shard_t* shard;
+    nexchat_client_state_t* client;
+} nexchat_server_replay_ctx_t;
+
+static void nexchat_server_replay_visit(void* ctx, nexchat_msgbuf_t* frame)
+{
+    nexchat_server_replay_ctx_t* replay = (nexchat_server_replay_ctx_t*)ctx;
+    nexchat_server_enqueue(replay->shard, replay->client, frame);
+}
+
+void nexchat_server_replay_room(nexchat_server_shard_t* shard, nexchat_client_state_t* client, nexchat_room_t* room)
+{
+    nexchat_server_state_t* state = shard->server;
+
+    if (!state->logging || state->config.log.replay == 0)
+    {
+        return;
+    }
+
+    nexchat_server_replay_ctx_t replay = {.shard=shard, .client=client};
+    nexchat_msglog_replay(&state->log, room->name, state->config.log.replay, nexchat_server_replay_visit, &replay);
+}
+
+void nexchat_server_leave_room(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    nexchat_room_t* room = client->room;
+
+    if (room == NULL)
+    {
+        return;
+    }
+
+    nexchat_room_remove(room, shard->index, client);
+    nexchat_server_room_departed(shard->server, room);
+}
+
+void nexchat_server_room_departed(nexchat_server_state_t* state, nexchat_room_t* room)
+{
+    bool emptied = false;
+
+    // under the lock, so a /join either finds the room with its member count already raised or
+    // doesn't find it at all and makes a new one
+    pthread_mutex_lock(&state->rooms_mutex);
+
+    room->members--;
+
+    if (room->members == 0 && strcmp(room->name, ROOM_LOBBY) != 0)
+    {
+        nexchat_strmap_remove(&state->rooms, room->name);
+        emptied = true;
+    }
+
+    pthread_mutex_unlock(&state->rooms_mutex);
+
+    // the table's reference, broadcasts still on their way to other shards keep it until they land
+    if (emptied)
+    {
+        nexchat_room_release(room);
+    }
+}
+
+void nexchat_server_send_roomlist_to_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    nexchat_server_state_t* state = shard->server;
+    char sendbuf[4096];
+    size_t offset = 0;
+    sendbuf[0] = '\0';
+
+    pthread_mutex_lock(&state->rooms_mutex);
+
+    for (size_t i = 0; i < state->rooms.capacity && offset < sizeof(sendbuf) - 1; i++)
+    {
+        const nexchat_strmap_entry_t* entry = &state->rooms.entries[i];
+        const nexchat_room_t* room = (const nexchat_room_t*)entry->value;
+
+        if (entry->key == NULL || room->members == 0)
+        {
+            continue;
+        }
+
+        const char* fmt = room == client->room ? "%s (%zu, you are here)\n" : "%s (%zu)\n";
+        offset += snprintf(sendbuf + offset, sizeof(sendbuf) - offset, fmt, room->name, room->members);
+    }
+
+    pthread_mutex_unlock(&state->rooms_mutex);
+
+    nexchat_server_sendmsg(shard, client, sendbuf);
+}
+
+void nexchat_server_send_listing(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const nexchat_roster_snapshot_t* roster)
+{
+    // already encoded and shared by every reader of the snapshot, only references are queued
+    for (size_t b = 0; b <= roster->bucket_mask; b++)
+    {
+        const nexchat_roster_bucket_t* bucket = roster->buckets[b];
+        for (size_t i = 0; bucket != NULL && i < bucket->chunk_count; i++)
+        {
+            nexchat_server_enqueue(shard, client, bucket->chunks[i].frame);
+        }
+    }
+}
+
+void nexchat_server_subscribe_presence(nexchat_server_shard_t* shard, nexchat_client_state_t* client, bool on)
+{
+    nexchat_server_state_t* state = shard->server;
+
+    if (!on)
+    {
+        if (client->subscribed)
+        {
+            nexchat_room_remove(state->presence, shard->index, client);
+        }
+
+        nexchat_server_sendmsg(shard, client, "server: presence events off");
+        return;
+    }
+
+    if (!client->subscribed && nexchat_room_add(state->presence, shard->index, client) == -1)
+    {
+        nexchat_server_sendmsg(shard, client, "server: out of memory subscribing to presence events");
+        return;
+    }
+
+    // pairs with the fence in nexchat_server_publish_presence: a change either made it into
+    // the listing below or its publisher sees this subscriber and sends the event
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    const nexchat_roster_snapshot_t* roster = nexchat_roster_read_begin(&state->roster, shard->index);
+
+    nexchat_msgbuf_t* header = nexchat_server_encode_presence("=%llu %zu", (unsigned long long)roster->version, roster->count);
+    if (header != NULL)
+    {
+        nexchat_server_enqueue(shard, client, header);
+        nexchat_msgbuf_release(header);
+        nexchat_server_send_listing(shard, client, roster);
+    }
+
+    nexchat_roster_read_end(&state->roster, shard->index);
+}
+
+// Presence events are FRAME_PRESENCE frames, one per roster change, holding an operation, the
+// roster version the change produced and the names involved:
+//
+//   +<version> <name>         joined
+//   -<version> <name>         left
+//   ~<version> <old>\n<new>   renamed
+//   =<version> <count>        sent on /presence on, the listing follows in text frames
+//
+// Changes made on different shards can reach a subscriber out of order. Applied in version
+// order on top of the listing, skipping those at or below its version, they give the roster.
+nexchat_msgbuf_t* nexchat_server_encode_presence(const char* fmt, ...)
+{
+    uint8_t frame[NEXCHAT_FRAME_HEADER_SIZE + 160];
+    char* text = (char*)frame + NEXCHAT_FRAME_HEADER_SIZE;
+
+    va_list args;
+    va_start(args, fmt);
+    int32_t len = vsnprintf(text, sizeof(frame) - NEXCHAT_FRAME_HEADER_SIZE, fmt, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= sizeof(frame) - NEXCHAT_FRAME_HEADER_SIZE)
+    {
+        return NULL;
+    }
+
+    nexchat_frame_write_header(frame, FRAME_PRESENCE, (uint32_t)len + 1);
+
+    return nexchat_msgbuf_create(frame, NEXCHAT_FRAME_HEADER_SIZE + (size_t)len + 1);
+}
+
+void nexchat_server_publish_presence(nexchat_server_state_t* state, nexchat_server_shard_t* shard, nexchat_msgbuf_t* event)
+{
+    if (event == NULL)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory encoding presence event");
+        return;
+    }
+
+    // the roster change is published, now look for subscribers, see nexchat_server_subscribe_presence
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (shard != NULL)
+    {
+        nexchat_server_broadcast_shared(shard, state->presence, NULL, event);
+        nexchat_msgbuf_release(event);
+        return;
+    }
+
+    // from the federation thread, every shard with subscribers fans it out itself
+    for (size_t i = 0; i < state->shard_count; i++)
+    {
+        if (nexchat_room_count_on(state->presence, i) == 0)
+        {
+            continue;
+        }
+
+        nexchat_shard_msg_t* post = (nexchat_shard_msg_t*)nexchat_pool_alloc(sizeof(nexchat_shard_msg_t));
+        if (post == NULL)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory relaying presence event to worker %zu", i);
+            continue;
+        }
+
+        memset(post, 0, sizeof(nexchat_shard_msg_t));
+        post->type = SHARD_MSG_BROADCAST;
+        post->msg = nexchat_msgbuf_retain(event);
+        post->room = nexchat_room_retain(state->presence);
+        nexchat_server_post(&state->shards[i], post);
+    }
+
+    nexchat_msgbuf_release(event);
+}
+
+void nexchat_server_disconnect_client(nexchat_server_shard_t* shard, int32_t sockfd)
+{
+    nexchat_client_state_t* client = nexchat_client_table_find(&shard->clients, sockfd);
+
+    if (client == NULL || !client->connected)
+    {
+        return;
+    }
+
+    // nobody was told about a connection that never finished its handshake
+    if (client->phase != NEXCHAT_CLIENT_ACTIVE)
+    {
+        nexchat_server_release_client(shard, client);
+        return;
+    }
+
+    nexchat_log(NEXCHAT_LOG_INFO, "server: %s disconnected", client->username);
+    char sendbuf[1024];
+    snprintf(sendbuf, sizeof(sendbuf), "%s disconnected", client->username);
+    nexchat_server_broadcast_msg(shard, client->room, client, NULL, sendbuf);
+
+    nexchat_server_release_client(shard, client);
+}
+
+void nexchat_server_kick_client(nexchat_server_shard_t* shard, int32_t sockfd)
+{
+    nexchat_client_state_t* client = nexchat_client_table_find(&shard->clients, sockfd);
+
+    if (client == NULL || !client->connected)
+    {
+        return;
+    }
+
+    nexchat_log(NEXCHAT_LOG_INFO, "server: kicked '%s' from chat", client->username);
+    char sendbuf[1024];
+    snprintf(sendbuf, sizeof(sendbuf), "kicked '%s' from chat", client->username);
+    nexchat_server_broadcast_msg(shard, client->room, client, "server", sendbuf);
+
+    nexchat_server_sendmsg(shard, client, "server: you have been kicked from chat");
+
+    // best effort, the connection is closed right after so there is no waiting for EPOLLOUT
+    if (client->send == NULL)
+    {
+        size_t pending = client->outqueue.bytes;
+        nexchat_outqueue_flush(&client->outqueue, client->sockfd);
+        NEXCHAT_METRIC_ADD(shard, bytes_out, pending - client->outqueue.bytes);
+    }
+
+    nexchat_server_release_client(shard, client);
+}
+
+void nexchat_server_release_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client)
+{
+    nexchat_server_state_t* state = shard->server;
+
+    if (shard->uring)
+    {
+        // requests hold their own reference to the socket, close() alone would leave it open
+        nexchat_server_uring_cancel(shard, NEXCHAT_URING_CLIENT_DATA(URING_OP_RECV, client));
+
+        if (client->send != NULL)
+        {
+            nexchat_server_uring_cancel(shard, NEXCHAT_URING_DATA(URING_OP_SEND, client->send));
+            nexchat_server_uring_cancel(shard, NEXCHAT_URING_DATA(URING_OP_POLLOUT, client->send));
+            client->send = NULL;
+        }
+    }
+    else
+    {
+        epoll_ctl(shard->epollfd, EPOLL_CTL_DEL, client->sockfd, NULL);
+    }
+
+    nexchat_server_leave_room(shard, client);
+    nexchat_timer_cancel(&shard->timers, &client->timer);
+    nexchat_timer_cancel(&shard->timers, &client->vote_timer);
+
+    if (client->phase == NEXCHAT_CLIENT_ACTIVE)
+    {
+        pthread_mutex_lock(&state->roster.writer);
+
+        nexchat_roster_entry_t* entry = nexchat_roster_find(state->roster.current, client->username);
+        bool listed = entry != NULL && entry->client == client && entry->client_id == client->id;
+
+        if (listed && nexchat_roster_update(&state->roster, entry, NULL) == -1)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "server: out of memory unlisting '%s'", client->username);
+        }
+
+        uint64_t version = state->roster.current->version;
+        pthread_mutex_unlock(&state->roster.writer);
+
+        if (listed && state->federating)
+        {
+            nexchat_federation_relay(&state->federation, RELAY_LEAVE, NULL, NULL, client->username, NULL);
+        }
+
+        if (client->subscribed)
+        {
+            nexchat_room_remove(state->presence, shard->index, client);
+        }
+
+        if (listed)
+        {
+            nexchat_server_publish_presence(state, shard, nexchat_server_encode_presence("-%llu %s", (unsigned long long)version, client->username));
+        }
+    }
+
+    client->admin = false;
+    memset(client->username, 0, sizeof(client->username));
+
+    // drop the fd mapping before close() so a reused fd number can't resolve to this slot
+    nexchat_client_table_release(&shard->clients, client);
+    __atomic_sub_fetch(&state->connected_clients, 1, __ATOMIC_RELAXED);
+    NEXCHAT_METRIC_ADD(shard, disconnects, 1);
+
+    if (client->phase == NEXCHAT_CLIENT_ACTIVE)
+    {
+        __atomic_sub_fetch(&state->active_clients, 1, __ATOMIC_RELAXED);
+    }
+
+    client->connected = false;
+    client->phase = NEXCHAT_CLIENT_ACCEPTED;
+    close(client->sockfd);
+    nexchat_frame_decoder_free(&client->decoder);
+    nexchat_outqueue_free(&client->outqueue);
+    nexchat_arena_free(&client->scratch);
+    client->sockfd = 0;
+}
+
+int32_t nexchat_server_claim_username(nexchat_server_state_t* state, nexchat_client_state_t* client, const char* username)
+{
+    char base[sizeof(client->username)];
+    snprintf(base, sizeof(base), "%s", username[0] != '\0' ? username : "guest");
+
+    // first come first served, later arrivals get the first free numbered variant
+    snprintf(client->username, sizeof(client->username), "%s", base);
+
+    for (uint32_t suffix = 2; nexchat_roster_find(state->roster.current, client->username) != NULL; suffix++)
+    {
+        if (suffix > 1000)
+        {
+            client->username[0] = '\0';
+            return -1;
+        }
+
+        // leave room for the suffix by truncating the base if necessary
+        int32_t suffixlen = snprintf(NULL, 0, "_%u", suffix);
+        int32_t baselen = (int32_t)strlen(base);
+        int32_t maxbase = (int32_t)sizeof(client->username) - 1 - suffixlen;
+        snprintf(client->username, sizeof(client->username), "%.*s_%u", baselen < maxbase ? baselen : maxbase, base, suffix);
+    }
+
+    nexchat_roster_entry_t* entry = nexchat_roster_entry_create(client->username, client);
+    if (entry == NULL || nexchat_roster_update(&state->roster, NULL, entry) == -1)
+    {
+        free(entry);
+        client->username[0] = '\0';
+        return -1;
+    }
+
+    return 0;
+}
+
+void nexchat_server_print_usage(const char* program)
+{
+    printf("usage: %s [options]\n", program);
+    printf("  -a, --address <ip>       address to listen on (default %s)\n", IPADDR);
+    printf("  -p, --port <port>        port to listen on (default %s)\n", PORT);
+    printf("  -c, --max-clients <n>    maximum number of connected clients (default %d)\n", MAXCLIENTS);
+    printf("  -r, --max-rooms <n>      maximum number of rooms with members (default %d)\n", MAXROOMS);
+    printf("  -w, --workers <n>        number of reactor threads (default: online cpus)\n");
+    printf("  -H, --handshake-timeout <s> seconds a new connection has to send its username (default %.0f)\n", HANDSHAKE_TIMEOUT);
+    printf("  -T, --heartbeat <s>      ping clients quiet for <s> seconds, drop them %.0f s later if they don't answer, 0 to disable (default %.0f)\n",
+           HEARTBEAT_TIMEOUT, HEARTBEAT_INTERVAL);
+    printf("  -I, --idle-timeout <s>   disconnect clients that send no message for <s> seconds, 0 to disable (default %.0f)\n", IDLE_TIMEOUT);
+    printf("  -V, --vote-window <s>    votes to kick a user lapse <s> seconds after the first one (default %.0f)\n", VOTE_WINDOW);
+    printf("  -t, --admin-token <tok>  enable /admin, which unlocks /stats\n");
+    printf("  -s, --stats-file <path>  periodically write metrics to <path>\n");
+    printf("  -i, --stats-interval <s> seconds between stats dumps (default 10)\n");
+    printf("  -b, --backend <name>     epoll or io_uring, io_uring falls back to epoll when unsupported (default epoll)\n");
+    printf("  -m, --send-mode <mode>   nodelay or cork, see server.h (default %s)\n", NEXCHAT_SEND_MODE_DEFAULT == NEXCHAT_SEND_CORK ? "cork" : "nodelay");
+    printf("  -l, --log-dir <dir>      keep chat history in <dir> and replay it to clients joining a room\n");
+    printf("  -S, --log-segment-size <bytes> size of each log segment, k/m/g suffixes allowed (default 64m)\n");
+    printf("  -K, --log-retention <n>  log segments kept on disk (default %d)\n", MSGLOG_RETENTION);
+    printf("  -n, --log-replay <n>     messages replayed on join, 0 to disable (default %d)\n", MSGLOG_REPLAY);
+    printf("      --log-no-sync        don't msync log batches, faster but a crash can lose them\n");
+    printf("  -o, --outbound-high <bytes> unread output a client may pile up before --slow-policy applies (default 1m)\n");
+    printf("  -O, --outbound-low <bytes>  where a slow client's queue is trimmed to or drains below (default 256k)\n");
+    printf("  -P, --slow-policy <policy>  drop-oldest, drop-new or disconnect, see server.h (default disconnect)\n");
+    printf("  -B, --memory-budget <bytes> pause reading from senders while unread output exceeds this (default 256m)\n");
+    printf("  -F, --federation-port <port> accept links from other servers on <port>\n");
+    printf("  -L, --link <host:port>   link to the server accepting links there, may be repeated (up to %d)\n", FEDERATION_MAX_LINKS);
+    printf("  -v, --verbosity <level>  debug, info, warn or error, what the server reports of itself (default info)\n");
+    printf("  -e, --event-file <path>  append server messages to <path> instead of stdout and stderr\n");
+    printf("  -h, --help               show this message\n");
+    printf("\nsend SIGUSR2 to upgrade in place: the binary is started again with the same options and\n");
+    printf("takes over every connection, clients stay connected\n");
+}
+
+// a byte count with an optional k/m/g suffix, -1 when malformed
+static int32_t nexchat_server_parse_size(const char* arg, unsigned long long* value)
+{
+    char* end = NULL;
+    errno = 0;
+    *value = strtoull(arg, &end, 10);
+    unsigned long long unit = 1;
+
+    // strtoull takes "-1" as ULLONG_MAX, a size is never negative
+    if (errno == ERANGE || end == arg || strchr(arg, '-') != NULL)
+    {
+        return -1;
+    }
+
+    switch (*end)
+    {
+        case 'k': case 'K': unit = 1ull << 10; end++; break;
+        case 'm': case 'M': unit = 1ull << 20; end++; break;
+        case 'g': case 'G': unit = 1ull << 30; end++; break;
+    }
+
+    if (*end != '\0' || *value > ULLONG_MAX / unit)
+    {
+        return -1;
+    }
+
+    *value *= unit;
+
+    return 0;
+}
+
+int32_t nexchat_server_parse_args(nexchat_server_config_t* config, int argc, char** argv)
+{
+    static const struct option options[] =
+    {
+        {"address",     required_argument, NULL, 'a'},
+        {"port",        required_argument, NULL, 'p'},
+        {"max-clients", required_argument, NULL, 'c'},
+        {"max-rooms",   required_argument, NULL, 'r'},
+        {"workers",     required_argument, NULL, 'w'},
+        {"handshake-timeout", required_argument, NULL, 'H'},
+        {"heartbeat",   required_argument, NULL, 'T'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"vote-window", required_argument, NULL, 'V'},
+        {"admin-token", required_argument, NULL, 't'},
+        {"stats-file",  required_argument, NULL, 's'},
+        {"stats-interval", required_argument, NULL, 'i'},
+        {"backend",     required_argument, NULL, 'b'},
+        {"send-mode",   required_argument, NULL, 'm'},
+        {"log-dir",     required_argument, NULL, 'l'},
+        {"log-segment-size", required_argument, NULL, 'S'},
+        {"log-retention", required_argument, NULL, 'K'},
+        {"log-replay",  required_argument, NULL, 'n'},
+        {"log-no-sync", no_argument,       NULL, 'N'},
+        {"outbound-high", required_argument, NULL, 'o'},
+        {"outbound-low", required_argument, NULL, 'O'},
+        {"slow-policy", required_argument, NULL, 'P'},
+        {"memory-budget", required_argument, NULL, 'B'},
+        {"federation-port", required_argument, NULL, 'F'},
+        {"link",        required_argument, NULL, 'L'},
+        {"verbosity",   required_argument, NULL, 'v'},
+        {"event-file",  required_argument, NULL, 'e'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    config->ipaddr = IPADDR;
+    config->port = PORT;
+    config->max_clients = MAXCLIENTS;
+    config->max_rooms = MAXROOMS;
+    config->handshake_timeout = HANDSHAKE_TIMEOUT;
+    config->heartbeat = HEARTBEAT_INTERVAL;
+    config->idle_timeout = IDLE_TIMEOUT;
+    config->vote_window = VOTE_WINDOW;
+    config->admin_token = NULL;
+    config->admin_token_len = 0;
+    config->stats_file = NULL;
+    config->stats_interval = 10.0;
+    config->send_mode = NEXCHAT_SEND_MODE_DEFAULT;
+    config->backend = NEXCHAT_BACKEND_EPOLL;
+    config->log.dir = NULL;
+    config->log.segment_size = MSGLOG_SEGMENT_SIZE;
+    config->log.retention = MSGLOG_RETENTION;
+    config->log.replay = MSGLOG_REPLAY;
+    config->log.sync = true;
+    config->outbound_high = OUTBOUND_HIGH;
+    config->outbound_low = OUTBOUND_LOW;
+    config->slow_policy = NEXCHAT_SLOW_DISCONNECT;
+    config->memory_budget = MEMORY_BUDGET;
+    config->federation.port = NULL;
+    config->federation.link_count = 0;
+    config->output.path = NULL;
+    config->output.level = NEXCHAT_LOG_INFO;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    config->workers = cpus > 0 ? (size_t)cpus : 1;
+
+    int32_t opt = 0;
+    while ((opt = getopt_long(argc, argv, "a:p:c:r:w:H:T:I:V:t:s:i:b:m:l:S:K:n:o:O:P:B:F:L:v:e:h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': config->ipaddr = optarg; break;
+            case 'p': config->port = optarg; break;
+            case 'c':
+            {
+                char* end = NULL;
+                unsigned long long value = strtoull(optarg, &end, 10);
+                if (*end != '\0' || value == 0)
+                {
+                    fprintf(stderr, "server: invalid --max-clients '%s'\n", optarg);
+                    return -1;
+                }
+                config->max_clients = (size_t)value;
+            } break;
+            case 'r':
+            {
+                char* end = NULL;
+                unsigned long long value = strtoull(optarg, &end, 10);
+                if (*end != '\0' || value == 0)
+                {
+                    fprintf(stderr, "server: invalid --max-rooms '%s'\n", optarg);
+                    return -1;
+                }
+                config->max_rooms = (size_t)value;
+            } break;
+            case 'w':
+            {
+                char* end = NULL;
+                unsigned long long value = strtoull(optarg, &end, 10);
+                if (*end != '\0' || value == 0 || value >= (1ull << (64 - CLIENT_ID_SHARD_SHIFT)))
+                {
+                    fprintf(stderr, "server: invalid --workers '%s'\n", optarg);
+                    return -1;
+                }
+                config->workers = (size_t)value;
+            } break;
+            case 'H':
+            {
+                char* end = NULL;
+                double value = strtod(optarg, &end);
+                if (*end != '\0' || value < 0.001)
+                {
+                    fprintf(stderr, "server: invalid --handshake-timeout '%s'\n", optarg);
+                    return -1;
+                }
+                config->handshake_timeout = value;
+            } break;
+            case 'T':
+            case 'I':
+            case 'V':
+            {
+                // pings and idle disconnects can be switched off, the vote window can't
+                const char* name = opt == 'T' ? "heartbeat" : opt == 'I' ? "idle-timeout" : "vote-window";
+                char* end = NULL;
+                double value = strtod(optarg, &end);
+                if (*end != '\0' || value < 0.0 || (value < 0.001 && (value != 0.0 || opt == 'V')))
+                {
+                    fprintf(stderr, "server: invalid --%s '%s'\n", name, optarg);
+                    return -1;
+                }
+
+                double* target = opt == 'T' ? &config->heartbeat : opt == 'I' ? &config->idle_timeout : &config->vote_window;
+                *target = value;
+            } break;
+            case 't': config->admin_token = optarg; config->admin_token_len = strlen(optarg); break;
+            case 's':
+            {
+#if NEXCHAT_METRICS
+                config->stats_file = optarg;
+#else
+                fprintf(stderr, "server: metrics are compiled out of this build, ignoring --stats-file\n");
+#endif
+            } break;
+            case 'i':
+            {
+                char* end = NULL;
+                double value = strtod(optarg, &end);
+                if (*end != '\0' || value < 0.001)
+                {
+                    fprintf(stderr, "server: invalid --stats-interval '%s'\n", optarg);
+                    return -1;
+                }
+                config->stats_interval = value;
+            } break;
+            case 'b':
+            {
+                if (strcmp(optarg, "epoll") == 0)
+                {
+                    config->backend = NEXCHAT_BACKEND_EPOLL;
+                }
+                else if (strcmp(optarg, "io_uring") == 0 || strcmp(optarg, "uring") == 0)
+                {
+                    config->backend = NEXCHAT_BACKEND_URING;
+                }
+                else
+                {
+                    fprintf(stderr, "server: invalid --backend '%s'\n", optarg);
+                    return -1;
+                }
+            } break;
+            case 'm':
+            {
+                if (strcmp(optarg, "nodelay") == 0)
+                {
+                    config->send_mode = NEXCHAT_SEND_NODELAY;
+                }
+                else if (strcmp(optarg, "cork") == 0)
+                {
+                    config->send_mode = NEXCHAT_SEND_CORK;
+                }
+                else
+                {
+                    fprintf(stderr, "server: invalid --send-mode '%s'\n", optarg);
+                    return -1;
+                }
+            } break;
+            case 'l': config->log.dir = optarg; break;
+            case 'S':
+            {
+                // a segment must hold at least one maximum size frame, offsets into it are 32 bit
+                unsigned long long value = 0;
+                if (nexchat_server_parse_size(optarg, &value) == -1 || value < MSGLOG_SEGMENT_MIN || value > UINT32_MAX)
+                {
+                    fprintf(stderr, "server: invalid --log-segment-size '%s'\n", optarg);
+                    return -1;
+                }
+                config->log.segment_size = (size_t)value;
+            } break;
+            case 'K':
+            {
+                char* end = NULL;
+                unsigned long long value = strtoull(optarg, &end, 10);
+                if (*end != '\0' || value == 0)
+                {
+                    fprintf(stderr, "server: invalid --log-retention '%s'\n", optarg);
+                    return -1;
+                }
+                config->log.retention = (size_t)value;
+            } break;
+            case 'n':
+            {
+                char* end = NULL;
+                unsigned long long value = strtoull(optarg, &end, 10);
+                if (*end != '\0' || value > 100000)
+                {
+                    fprintf(stderr, "server: invalid --log-replay '%s'\n", optarg);
+                    return -1;
+                }
+                config->log.replay = (size_t)value;
+            } break;
+            case 'N': config->log.sync = false; break;
+            case 'o':
+            case 'O':
+            case 'B':
+            {
+                const char* name = opt == 'o' ? "outbound-high" : opt == 'O' ? "outbound-low" : "memory-budget";
+                unsigned long long value = 0;
+                if (nexchat_server_parse_size(optarg, &value) == -1 || value == 0 || value > SIZE_MAX)
+                {
+                    fprintf(stderr, "server: invalid --%s '%s'\n", name, optarg);
+                    return -1;
+                }
+
+                size_t* target = opt == 'o' ? &config->outbound_high : opt == 'O' ? &config->outbound_low : &config->memory_budget;
+                *target = (size_t)value;
+            } break;
+            case 'P':
+            {
+                if (strcmp(optarg, "drop-oldest") == 0)
+                {
+                    config->slow_policy = NEXCHAT_SLOW_DROP_OLDEST;
+                }
+                else if (strcmp(optarg, "drop-new") == 0)
+                {
+                    config->slow_policy = NEXCHAT_SLOW_DROP_NEW;
+                }
+                else if (strcmp(optarg, "disconnect") == 0)
+                {
+                    config->slow_policy = NEXCHAT_SLOW_DISCONNECT;
+                }
+                else
+                {
+                    fprintf(stderr, "server: invalid --slow-policy '%s'\n", optarg);
+                    return -1;
+                }
+            } break;
+            case 'F': config->federation.port = optarg; break;
+            case 'L':
+            {
+                if (config->federation.link_count == FEDERATION_MAX_LINKS || strchr(optarg, ':') == NULL)
+                {
+                    fprintf(stderr, "server: invalid --link '%s', expected host:port and at most %d links\n", optarg, FEDERATION_MAX_LINKS);
+                    return -1;
+                }
+                config->federation.links[config->federation.link_count++] = optarg;
+            } break;
+            case 'v':
+            {
+                if (nexchat_log_parse_level(optarg, &config->output.level) == -1)
+                {
+                    fprintf(stderr, "server: invalid --verbosity '%s'\n", optarg);
+                    return -1;
+                }
+            } break;
+            case 'e': config->output.path = optarg; break;
+            case 'h':
+            default:
+                nexchat_server_print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (config->outbound_low >= config->outbound_high)
+    {
+        fprintf(stderr, "server: --outbound-low must be below --outbound-high\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void nexchat_server_raise_fd_limit(size_t max_clients)
+{
+    // every client is an fd, make sure the soft limit doesn't cap us below the configured capacity
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        return;
+    }
+
+    rlim_t wanted = (rlim_t)max_clients + 64;
+    if (limit.rlim_cur >= wanted)
+    {
+        return;
+    }
+
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > wanted ? wanted : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        nexchat_log_errno("setrlimit");
+    }
+
+    if ((rlim_t)max_clients + 64 > limit.rlim_cur)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "server: open file limit %llu is below --max-clients %zu", (unsigned long long)limit.rlim_cur, max_clients);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    // a peer closing mid-send must not take the whole event loop down
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR2 is read from a signalfd by shard 0, every thread inherits the mask
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    nexchat_server_state_t server;
+    memset(&server, 0, sizeof server);
+    if (nexchat_server_parse_args(&server.config, argc, argv) == -1)
+    {
+        return 1;
+    }
+
+    // from here on nothing but the usage text goes through stdio
+    if (nexchat_log_open(&server.config.output) == -1)
+    {
+        return 1;
+    }
+
+    // resolved now, a hot upgrade runs whatever binary is at this path by then
+    static char exe[PATH_MAX];
+    ssize_t exelen = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    exe[exelen > 0 ? exelen : 0] = '\0';
+    server.config.exe = exelen > 0 ? exe : argv[0];
+    server.config.argv = argv;
+
+    nexchat_server_raise_fd_limit(server.config.max_clients);
+
+    // started by a hot upgrade, the connections of the previous process come first
+    nexchat_upgrade_init(&server.upgrade);
+    if (nexchat_upgrade_inherit(&server.upgrade) == -1)
+    {
+        nexchat_upgrade_free(&server.upgrade);
+        nexchat_log_close();
+        return 1;
+    }
+
     nexchat_server_launch(&server);
 
     nexchat_server_shutdown(&server);
+
+    // every thread that logs has been joined
+    nexchat_log_close();
 }
\ No newline at end of file
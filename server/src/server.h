@@ -0,0 +1,301 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "libcommon/libcommon.h"
+
+#include "client_table.h"
+#include "metrics.h"
+#include "commands.h"
+#include "rooms.h"
+#include "msglog.h"
+#include "uring.h"
+#include "roster.h"
+#include "federation.h"
+#include "upgrade.h"
+
+#define IPADDR     "127.0.0.1"
+#define PORT       "3490"
+#define MAXCLIENTS 4096 // default, override with --max-clients
+#define MAXEVENTS  64
+#define HANDSHAKE_TIMEOUT 5.0 // seconds a new connection has to send its username
+#define HEARTBEAT_INTERVAL 30.0 // default --heartbeat, seconds of silence before a client is pinged
+#define HEARTBEAT_TIMEOUT  10.0 // seconds a pinged client has to answer before it is disconnected
+#define IDLE_TIMEOUT       0.0  // default --idle-timeout, seconds without a message before disconnecting, 0 never
+#define VOTE_WINDOW        300.0 // default --vote-window, seconds after the first vote to kick a user that the votes count
+#define MAXROOMS   65536 // default, override with --max-rooms
+#define ADMIN_ATTEMPTS 3    // wrong /admin tokens a connection may send before it is disconnected
+
+// how frames queued during one event loop iteration reach the wire. Either way they leave in one
+// writev per client at the end of the iteration; the modes differ in what the kernel does with them.
+//   nodelay: TCP_NODELAY, segments go out right away, lowest latency
+//   cork:    TCP_CORK is held while the shard is saturated so the kernel only emits full segments,
+//            and pulled once an iteration comes up short of MAXEVENTS. Fewer, fuller packets
+//            under load at the cost of up to 200ms extra latency
+typedef enum nexchat_send_mode_t
+{
+    NEXCHAT_SEND_NODELAY,
+    NEXCHAT_SEND_CORK,
+} nexchat_send_mode_t;
+
+// what drives a shard's sockets, io_uring falls back to epoll when the kernel can't run it
+typedef enum nexchat_server_backend_t
+{
+    NEXCHAT_BACKEND_EPOLL,
+    NEXCHAT_BACKEND_URING,
+} nexchat_server_backend_t;
+
+// what happens to a client whose unwritten output crosses the high watermark
+//   drop-oldest: queued frames are discarded, oldest first, down to the low watermark
+//   drop-new:    new frames are discarded until the queue drains below the low watermark
+//   disconnect:  the queue is discarded and the client is disconnected with a reason
+typedef enum nexchat_slow_policy_t
+{
+    NEXCHAT_SLOW_DROP_OLDEST,
+    NEXCHAT_SLOW_DROP_NEW,
+    NEXCHAT_SLOW_DISCONNECT,
+} nexchat_slow_policy_t;
+
+#define OUTBOUND_HIGH (1024 * 1024) // default per-client watermarks, override with --outbound-high/--outbound-low
+#define OUTBOUND_LOW  (256 * 1024)
+#define MEMORY_BUDGET (256ull * 1024 * 1024) // default --memory-budget, unwritten output across all clients
+#define RESUME_POLL_MS 10 // how often a shard with paused readers checks whether the budget has freed up
+
+#ifndef NEXCHAT_SEND_MODE_DEFAULT
+    #define NEXCHAT_SEND_MODE_DEFAULT NEXCHAT_SEND_NODELAY // override with --send-mode or -DNEXCHAT_SEND_MODE_DEFAULT
+#endif
+
+// client ids carry the index of the owning shard in their top bits
+#define CLIENT_ID_SHARD_SHIFT 48
+
+typedef struct nexchat_server_config_t
+{
+    const char* ipaddr;
+    const char* port;
+    size_t max_clients;
+    size_t max_rooms;
+    size_t workers;
+    double handshake_timeout;
+    double heartbeat;          // seconds, 0 disables pings
+    double idle_timeout;       // seconds, 0 disables idle disconnects
+    double vote_window;        // seconds
+    const char* admin_token;   // /admin unlocks admin-only commands, disabled when NULL
+    size_t admin_token_len;    // measured once, so checking a guess doesn't walk the token to its end
+    const char* stats_file;    // periodic metrics dump, disabled when NULL
+    double stats_interval;     // seconds between dumps
+    nexchat_send_mode_t send_mode;
+    nexchat_server_backend_t backend;
+    nexchat_msglog_config_t log; // chat history on disk, disabled when log.dir is NULL
+    size_t outbound_high;        // per-client unwritten bytes that trigger `slow_policy`
+    size_t outbound_low;
+    nexchat_slow_policy_t slow_policy;
+    size_t memory_budget;        // reads from senders pause while unwritten output across all clients exceeds this
+    nexchat_federation_config_t federation; // links to other servers, disabled without a port or links
+    nexchat_log_config_t output; // where and what the server itself logs
+    const char* exe;             // a hot upgrade runs this binary again with the same arguments
+    char** argv;
+} nexchat_server_config_t;
+
+typedef enum nexchat_shard_msg_type_t
+{
+    SHARD_MSG_BROADCAST,
+    SHARD_MSG_KICK,
+    SHARD_MSG_VOTE, // the first vote to kick one of this shard's clients, start counting down
+} nexchat_shard_msg_type_t;
+
+// io_uring user_data: the operation in the top bits, then either a pointer or, for a client's recv,
+// its fd and the low bits of its id so completions meant for an earlier owner of the fd are recognised
+typedef enum nexchat_uring_op_t
+{
+    URING_OP_ACCEPT = 1,
+    URING_OP_INBOX,
+    URING_OP_TIMER,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_POLLOUT,
+    URING_OP_CANCEL,
+    URING_OP_SIGNAL,
+} nexchat_uring_op_t;
+
+#define URING_OP_SHIFT 60
+#define URING_ID_BITS  28
+#define NEXCHAT_URING_DATA(op, ptr) (((uint64_t)(op) << URING_OP_SHIFT) | (uint64_t)(uintptr_t)(ptr))
+#define NEXCHAT_URING_CLIENT_DATA(op, client) \
+    (((uint64_t)(op) << URING_OP_SHIFT) | ((uint64_t)(uint32_t)(client)->sockfd << URING_ID_BITS) | ((client)->id & ((1ull << URING_ID_BITS) - 1)))
+
+// a sendmsg in flight on the io_uring backend. It holds its own references to the frames it
+// points at, so the kernel never reads freed memory if the client is released before it completes
+typedef struct nexchat_server_send_t
+{
+    nexchat_client_state_t* client;
+    uint64_t client_id;
+    struct msghdr msg;
+    struct iovec iov[NEXCHAT_OUTQUEUE_MAXIOV];
+    nexchat_msgbuf_t* frames[NEXCHAT_OUTQUEUE_MAXIOV];
+    size_t count;
+} nexchat_server_send_t;
+
+// work posted to a shard by another shard, delivered through its inbox
+typedef struct nexchat_shard_msg_t
+{
+    nexchat_mpsc_node_t node;
+    nexchat_shard_msg_type_t type;
+    nexchat_msgbuf_t* msg; // SHARD_MSG_BROADCAST, the message holds a reference
+    nexchat_room_t* room;  // SHARD_MSG_BROADCAST
+    int32_t sockfd;        // SHARD_MSG_KICK, SHARD_MSG_VOTE
+    uint64_t client_id;    // SHARD_MSG_KICK, SHARD_MSG_VOTE, guards against the fd having been reused
+} nexchat_shard_msg_t;
+
+typedef struct nexchat_server_state_t nexchat_server_state_t;
+
+// One reactor thread. Each shard owns a SO_REUSEPORT listening socket, an epoll
+// instance and every client the kernel hands to that socket.
+typedef struct nexchat_server_shard_t
+{
+    nexchat_server_state_t* server;
+    size_t index;
+    pthread_t thread;
+
+    int32_t sockfd;
+    int32_t epollfd;
+    int32_t eventfd; // signalled when the inbox goes from empty to non-empty
+    int32_t timerfd; // stats dump ticks, shard 0 only
+    int32_t signalfd; // SIGUSR2 starts a hot upgrade, shard 0 only
+    nexchat_mpsc_t inbox;
+
+    bool uring; // NEXCHAT_BACKEND_URING, epollfd is unused
+    nexchat_uring_t ring;
+    bool accept_multishot; // cleared when the kernel rejects multishot, requests are rearmed one at a time
+    bool recv_multishot;
+
+    nexchat_client_table_t clients;
+    uint64_t next_client_id;
+
+    nexchat_buffer_t sendbuf;
+    nexchat_client_state_t** flushlist; // clients with frames queued since the last flush
+    size_t flushlist_count;
+    size_t flushlist_capacity;
+    nexchat_client_state_t** corklist; // NEXCHAT_SEND_CORK, clients holding partial segments in the kernel
+    size_t corklist_count;
+    size_t corklist_capacity;
+
+    uint64_t buffered; // atomic, single writer, unwritten output across this shard's clients
+    nexchat_client_state_t** paused; // clients whose input waits for the memory budget to free up
+    size_t paused_count;
+    size_t paused_capacity;
+
+    nexchat_timer_wheel_t timers; // every client's deadlines on this shard
+    uint64_t now;                 // CLOCK_MONOTONIC ns, read once per wakeup
+
+#if NEXCHAT_METRICS
+    nexchat_server_metrics_t metrics;
+#endif
+} nexchat_server_shard_t;
+
+typedef struct nexchat_server_state_t
+{
+    nexchat_server_config_t config;
+
+    nexchat_server_shard_t* shards;
+    size_t shard_count;
+
+    nexchat_roster_t roster;  // every active user, read lock-free from any shard
+
+    pthread_mutex_t rooms_mutex; // guards the room registry
+    nexchat_strmap_t rooms;      // room name -> nexchat_room_t, rooms live until shutdown
+    nexchat_room_t* presence;    // /presence subscribers, outside the registry, broadcasts reach them like a room
+    size_t connected_clients;   // atomic, across all shards, including handshakes in flight
+    size_t active_clients;      // atomic, clients that completed the handshake
+    uint64_t started_ns;
+
+    nexchat_msglog_t log;
+    bool logging;
+
+    nexchat_federation_t federation;
+    bool federating;
+
+    nexchat_upgrade_t upgrade;
+    bool upgrading; // the new process is up, shards stop and hand their connections over
+
+    bool running;
+} nexchat_server_state_t;
+
+int32_t nexchat_server_bind(nexchat_server_shard_t* shard, const nexchat_inet_id_t* id);
+void nexchat_server_launch(nexchat_server_state_t* state);
+void nexchat_server_shutdown(nexchat_server_state_t* state);
+void nexchat_server_stop(nexchat_server_state_t* state);
+void nexchat_server_handle_signal(nexchat_server_shard_t* shard);
+void nexchat_server_hand_off(nexchat_server_state_t* state);
+void nexchat_server_adopt_clients(nexchat_server_state_t* state);
+int32_t nexchat_server_adopt_client(nexchat_server_shard_t* shard, nexchat_upgrade_client_t* adopted);
+int32_t nexchat_server_init_shard(nexchat_server_shard_t* shard);
+int32_t nexchat_server_start_stats_timer(nexchat_server_shard_t* shard);
+void* nexchat_server_run_shard(void* arg);
+int32_t nexchat_server_init_uring(nexchat_server_shard_t* shard);
+void nexchat_server_run_uring(nexchat_server_shard_t* shard);
+void nexchat_server_uring_quiesce(nexchat_server_shard_t* shard);
+void nexchat_server_uring_complete(nexchat_server_shard_t* shard, uint64_t user_data, int32_t res, uint32_t flags);
+void nexchat_server_uring_accept(nexchat_server_shard_t* shard);
+void nexchat_server_uring_poll(nexchat_server_shard_t* shard, int32_t fd, uint32_t events, bool multishot, uint64_t user_data);
+void nexchat_server_uring_recv(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_uring_received(nexchat_server_shard_t* shard, uint64_t user_data, int32_t res, uint32_t flags);
+void nexchat_server_uring_send(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_uring_sendmsg(nexchat_server_shard_t* shard, nexchat_server_send_t* send);
+void nexchat_server_uring_sent(nexchat_server_shard_t* shard, nexchat_server_send_t* send, bool polled, int32_t res);
+void nexchat_server_free_send(nexchat_server_send_t* send);
+void nexchat_server_uring_cancel(nexchat_server_shard_t* shard, uint64_t user_data);
+void nexchat_server_post(nexchat_server_shard_t* shard, nexchat_shard_msg_t* msg);
+void nexchat_server_drain_inbox(nexchat_server_shard_t* shard);
+int32_t nexchat_server_accept_connection(nexchat_server_shard_t* shard);
+void nexchat_server_print_connection(int32_t connfd, const struct sockaddr_storage* conninfo);
+void nexchat_server_accept_pending(nexchat_server_shard_t* shard);
+void nexchat_server_add_client(nexchat_server_shard_t* shard, int32_t connfd);
+void nexchat_server_activate_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* username);
+void nexchat_server_track_handshake(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+int32_t nexchat_server_run_timers(nexchat_server_shard_t* shard);
+void nexchat_server_client_timer(void* ctx, nexchat_timer_t* timer);
+void nexchat_server_check_liveness(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_arm_vote(nexchat_server_shard_t* shard, int32_t sockfd, uint64_t client_id);
+void nexchat_server_expire_votes(void* ctx, nexchat_timer_t* timer);
+void nexchat_server_handle_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+int32_t nexchat_server_dispatch_frames(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_handle_msg(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* recvbuf);
+void nexchat_server_sendmsg(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* msg);
+void nexchat_server_enqueue(nexchat_server_shard_t* shard, nexchat_client_state_t* client, nexchat_msgbuf_t* msg);
+void nexchat_server_flush_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_flush_pending(nexchat_server_shard_t* shard);
+int32_t nexchat_server_schedule_flush(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+bool nexchat_server_apply_slow_policy(nexchat_server_shard_t* shard, nexchat_client_state_t* client, nexchat_msgbuf_t* msg);
+void nexchat_server_evict_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+size_t nexchat_server_buffered_bytes(nexchat_server_state_t* state);
+bool nexchat_server_reads_paused(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_resume_reading(nexchat_server_shard_t* shard);
+void nexchat_server_track_corked(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_push_corked(nexchat_server_shard_t* shard);
+int32_t nexchat_server_recvmsg(int32_t sockfd, char* recvbuf, size_t size);
+void nexchat_server_send_cmdlist_to_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_exec_cmd(nexchat_server_shard_t* shard, nexchat_client_state_t* client, nexchat_client_command_t cmd, size_t argc, const char** argv);
+void nexchat_server_broadcast_msg(nexchat_server_shard_t* shard, nexchat_room_t* room, nexchat_client_state_t* sender, const char* username, const char* msg);
+nexchat_msgbuf_t* nexchat_server_encode_broadcast(nexchat_server_shard_t* shard, const char* username, const char* msg);
+void nexchat_server_broadcast_shared(nexchat_server_shard_t* shard, nexchat_room_t* room, nexchat_client_state_t* sender, nexchat_msgbuf_t* shared);
+void nexchat_server_fanout(nexchat_server_shard_t* shard, nexchat_room_t* room, nexchat_client_state_t* sender, nexchat_msgbuf_t* msg);
+int32_t nexchat_server_join_room(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* name);
+nexchat_room_t* nexchat_server_enter_room(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const char* name);
+void nexchat_server_replay_room(nexchat_server_shard_t* shard, nexchat_client_state_t* client, nexchat_room_t* room);
+void nexchat_server_leave_room(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_room_departed(nexchat_server_state_t* state, nexchat_room_t* room);
+void nexchat_server_send_roomlist_to_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+void nexchat_server_disconnect_client(nexchat_server_shard_t* shard, int32_t sockfd);
+void nexchat_server_kick_client(nexchat_server_shard_t* shard, int32_t sockfd);
+void nexchat_server_release_client(nexchat_server_shard_t* shard, nexchat_client_state_t* client);
+int32_t nexchat_server_claim_username(nexchat_server_state_t* state, nexchat_client_state_t* client, const char* username);
+void nexchat_server_send_listing(nexchat_server_shard_t* shard, nexchat_client_state_t* client, const nexchat_roster_snapshot_t* roster);
+void nexchat_server_subscribe_presence(nexchat_server_shard_t* shard, nexchat_client_state_t* client, bool on);
+nexchat_msgbuf_t* nexchat_server_encode_presence(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void nexchat_server_publish_presence(nexchat_server_state_t* state, nexchat_server_shard_t* shard, nexchat_msgbuf_t* event);
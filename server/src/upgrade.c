@@ -0,0 +1,590 @@
+#include "upgrade.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+extern char** environ;
+
+static void nexchat_upgrade_put_u32(uint8_t* dst, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+    {
+        dst[i] = (uint8_t)(value >> (24 - i * 8));
+    }
+}
+
+static void nexchat_upgrade_put_u64(uint8_t* dst, uint64_t value)
+{
+    for (size_t i = 0; i < 8; i++)
+    {
+        dst[i] = (uint8_t)(value >> (56 - i * 8));
+    }
+}
+
+static uint32_t nexchat_upgrade_get_u32(const uint8_t* src)
+{
+    return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | (uint32_t)src[3];
+}
+
+static uint64_t nexchat_upgrade_get_u64(const uint8_t* src)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < 8; i++)
+    {
+        value = (value << 8) | src[i];
+    }
+
+    return value;
+}
+
+// one record, with `fd` attached unless it is -1
+static int32_t nexchat_upgrade_send(int32_t sockfd, nexchat_upgrade_kind_t kind, const void* payload, size_t size, int32_t fd)
+{
+    uint8_t packet[1 + UPGRADE_RECORD_MAX];
+    packet[0] = (uint8_t)kind;
+    if (size > 0)
+    {
+        memcpy(packet + 1, payload, size);
+    }
+
+    struct iovec iov = {.iov_base = packet, .iov_len = 1 + size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int32_t))];
+    } control;
+
+    if (fd != -1)
+    {
+        memset(&control, 0, sizeof control);
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof control.buf;
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int32_t));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int32_t));
+    }
+
+    while (sendmsg(sockfd, &msg, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            nexchat_log_errno("sendmsg");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// one record into `packet`, its size or -1. `fd` gets the descriptor that came with it, -1 for none
+static ssize_t nexchat_upgrade_recv(int32_t sockfd, uint8_t* packet, size_t size, int32_t* fd)
+{
+    struct iovec iov = {.iov_base = packet, .iov_len = size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int32_t))];
+    } control;
+
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+
+    ssize_t received = 0;
+    while ((received = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+    {
+    }
+
+    *fd = -1;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); received > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int32_t)))
+        {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int32_t));
+        }
+    }
+
+    if (received == -1)
+    {
+        nexchat_log_errno("recvmsg");
+    }
+
+    // a truncated record or descriptor is as good as a lost one
+    if (received > 0 && (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "upgrade: received a truncated record");
+        return -1;
+    }
+
+    return received;
+}
+
+void nexchat_upgrade_init(nexchat_upgrade_t* up)
+{
+    memset(up, 0, sizeof(nexchat_upgrade_t));
+    up->sockfd = -1;
+    up->child = -1;
+}
+
+int32_t nexchat_upgrade_spawn(nexchat_upgrade_t* up, const char* exe, char** argv)
+{
+    int32_t pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1)
+    {
+        nexchat_log_errno("socketpair");
+        return -1;
+    }
+
+    // everything the child needs is built before the fork, only async-signal-safe calls may follow it
+    char variable[64];
+    snprintf(variable, sizeof variable, "%s=%d", UPGRADE_ENV, pair[1]);
+
+    size_t count = 0;
+    while (environ[count] != NULL)
+    {
+        count++;
+    }
+
+    char** envp = (char**)malloc((count + 2) * sizeof(char*));
+    if (envp == NULL)
+    {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    size_t envc = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (strncmp(environ[i], UPGRADE_ENV "=", strlen(UPGRADE_ENV) + 1) != 0)
+        {
+            envp[envc++] = environ[i];
+        }
+    }
+
+    envp[envc++] = variable;
+    envp[envc] = NULL;
+
+    struct rlimit limit;
+    int32_t maxfd = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY ? (int32_t)limit.rlim_cur : 65536;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // none of this process's sockets may live on in the new one, a connection it closes
+        // would otherwise stay open behind its back
+        for (int32_t fd = 3; fd < maxfd; fd++)
+        {
+            if (fd != pair[1])
+            {
+                close(fd);
+            }
+        }
+
+        execve(exe, argv, envp);
+        _exit(127);
+    }
+
+    free(envp);
+    close(pair[1]);
+
+    if (pid == -1)
+    {
+        nexchat_log_errno("fork");
+        close(pair[0]);
+        return -1;
+    }
+
+    up->sockfd = pair[0];
+    up->child = pid;
+
+    // nothing is stopped until the new binary proves it runs and speaks our format
+    struct pollfd pfd = {.fd = pair[0], .events = POLLIN, .revents = 0};
+    int32_t ready = 0;
+    while ((ready = poll(&pfd, 1, UPGRADE_TIMEOUT_MS)) == -1 && errno == EINTR)
+    {
+    }
+
+    uint8_t packet[16];
+    int32_t fd = -1;
+    ssize_t received = ready > 0 ? nexchat_upgrade_recv(pair[0], packet, sizeof packet, &fd) : -1;
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    if (received == 5 && packet[0] == UPGRADE_READY && nexchat_upgrade_get_u32(packet + 1) == UPGRADE_FORMAT)
+    {
+        return 0;
+    }
+
+    if (received == 5 && packet[0] == UPGRADE_READY)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "upgrade: '%s' expects handoff format %u, this server sends %d", exe, nexchat_upgrade_get_u32(packet + 1), UPGRADE_FORMAT);
+    }
+    else if (ready == 0)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "upgrade: '%s' did not start within %d ms", exe, UPGRADE_TIMEOUT_MS);
+    }
+    else
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "upgrade: '%s' exited before taking over", exe);
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(pair[0]);
+    up->sockfd = -1;
+    up->child = -1;
+
+    return -1;
+}
+
+int32_t nexchat_upgrade_send_state(nexchat_upgrade_t* up, uint64_t roster_version, uint64_t node, uint64_t seq)
+{
+    uint8_t payload[4 + 8 + 8 + 8];
+    nexchat_upgrade_put_u32(payload, UPGRADE_FORMAT);
+    nexchat_upgrade_put_u64(payload + 4, roster_version);
+    nexchat_upgrade_put_u64(payload + 12, node);
+    nexchat_upgrade_put_u64(payload + 20, seq);
+
+    return nexchat_upgrade_send(up->sockfd, UPGRADE_STATE, payload, sizeof payload, -1);
+}
+
+int32_t nexchat_upgrade_send_listener(nexchat_upgrade_t* up, int32_t fd)
+{
+    return nexchat_upgrade_send(up->sockfd, UPGRADE_LISTENER, NULL, 0, fd);
+}
+
+int32_t nexchat_upgrade_send_client(nexchat_upgrade_t* up, const nexchat_client_state_t* client, bool subscribed, uint64_t kicks, const char* room)
+{
+    uint8_t payload[3 + 8 + 1 + 64 + 1 + ROOM_NAME_MAX];
+    size_t usernamelen = strnlen(client->username, sizeof(client->username) - 1);
+    size_t roomlen = strnlen(room, ROOM_NAME_MAX - 1);
+    size_t offset = 0;
+
+    payload[offset++] = client->phase == NEXCHAT_CLIENT_ACTIVE ? 2 : 1;
+    payload[offset++] = client->admin ? 1 : 0;
+    payload[offset++] = subscribed ? 1 : 0;
+    nexchat_upgrade_put_u64(payload + offset, kicks);
+    offset += 8;
+    payload[offset++] = (uint8_t)usernamelen;
+    memcpy(payload + offset, client->username, usernamelen);
+    offset += usernamelen;
+    payload[offset++] = (uint8_t)roomlen;
+    memcpy(payload + offset, room, roomlen);
+    offset += roomlen;
+
+    return nexchat_upgrade_send(up->sockfd, UPGRADE_CLIENT, payload, offset, client->sockfd);
+}
+
+int32_t nexchat_upgrade_send_bytes(nexchat_upgrade_t* up, nexchat_upgrade_kind_t kind, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+
+    while (size > 0)
+    {
+        size_t chunk = size < UPGRADE_RECORD_MAX ? size : UPGRADE_RECORD_MAX;
+        if (nexchat_upgrade_send(up->sockfd, kind, bytes, chunk, -1) == -1)
+        {
+            return -1;
+        }
+
+        bytes += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+void nexchat_upgrade_finish(nexchat_upgrade_t* up)
+{
+    if (up->sockfd == -1)
+    {
+        return;
+    }
+
+    // after a failed send the new process sees the socket close instead, and keeps what it got
+    if (!up->failed)
+    {
+        nexchat_upgrade_send(up->sockfd, UPGRADE_END, NULL, 0, -1);
+    }
+
+    close(up->sockfd);
+    up->sockfd = -1;
+}
+
+static int32_t nexchat_upgrade_take_client(nexchat_upgrade_t* up, const uint8_t* payload, size_t size, int32_t fd)
+{
+    if (size < 3 + 8 + 1 || payload[0] < 1 || payload[0] > 2)
+    {
+        return -1;
+    }
+
+    size_t usernamelen = payload[11];
+    if (usernamelen >= 64 || size < 12 + usernamelen + 1)
+    {
+        return -1;
+    }
+
+    size_t roomlen = payload[12 + usernamelen];
+    if (roomlen >= ROOM_NAME_MAX || size != 12 + usernamelen + 1 + roomlen)
+    {
+        return -1;
+    }
+
+    if (up->client_count == up->client_capacity)
+    {
+        size_t capacity = up->client_capacity > 0 ? up->client_capacity * 2 : 64;
+        nexchat_upgrade_client_t* clients = (nexchat_upgrade_client_t*)realloc(up->clients, capacity * sizeof(nexchat_upgrade_client_t));
+        if (clients == NULL)
+        {
+            return -1;
+        }
+
+        up->clients = clients;
+        up->client_capacity = capacity;
+    }
+
+    nexchat_upgrade_client_t* client = &up->clients[up->client_count++];
+    memset(client, 0, sizeof(nexchat_upgrade_client_t));
+    client->sockfd = fd;
+    client->phase = payload[0] == 2 ? NEXCHAT_CLIENT_ACTIVE : NEXCHAT_CLIENT_AWAITING_USERNAME;
+    client->admin = payload[1] != 0;
+    client->subscribed = payload[2] != 0;
+    client->kicks = nexchat_upgrade_get_u64(payload + 3);
+    memcpy(client->username, payload + 12, usernamelen);
+    memcpy(client->room, payload + 12 + usernamelen + 1, roomlen);
+    nexchat_buffer_init(&client->input, 0);
+    nexchat_buffer_init(&client->output, 0);
+
+    return 0;
+}
+
+static int32_t nexchat_upgrade_take_listener(nexchat_upgrade_t* up, int32_t fd)
+{
+    if (up->listener_count == up->listener_capacity)
+    {
+        size_t capacity = up->listener_capacity > 0 ? up->listener_capacity * 2 : 8;
+        int32_t* listeners = (int32_t*)realloc(up->listeners, capacity * sizeof(int32_t));
+        if (listeners == NULL)
+        {
+            return -1;
+        }
+
+        up->listeners = listeners;
+        up->listener_capacity = capacity;
+    }
+
+    up->listeners[up->listener_count++] = fd;
+
+    return 0;
+}
+
+int32_t nexchat_upgrade_inherit(nexchat_upgrade_t* up)
+{
+    const char* variable = getenv(UPGRADE_ENV);
+    if (variable == NULL)
+    {
+        return 0;
+    }
+
+    up->sockfd = atoi(variable);
+    up->inherited = true;
+    unsetenv(UPGRADE_ENV);
+
+    uint8_t ready[4];
+    nexchat_upgrade_put_u32(ready, UPGRADE_FORMAT);
+    if (nexchat_upgrade_send(up->sockfd, UPGRADE_READY, ready, sizeof ready, -1) == -1)
+    {
+        nexchat_log(NEXCHAT_LOG_ERROR, "upgrade: lost the previous process before the handoff");
+        return -1;
+    }
+
+    uint8_t* packet = (uint8_t*)malloc(1 + UPGRADE_RECORD_MAX);
+    if (packet == NULL)
+    {
+        return -1;
+    }
+
+    int32_t status = 0;
+    bool stated = false;
+    bool broken = false;
+
+    while (status == 0)
+    {
+        int32_t fd = -1;
+        ssize_t received = nexchat_upgrade_recv(up->sockfd, packet, 1 + UPGRADE_RECORD_MAX, &fd);
+
+        if (received <= 0)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "upgrade: the previous process went away in the middle of the handoff");
+            broken = true;
+            break;
+        }
+
+        const uint8_t* payload = packet + 1;
+        size_t size = (size_t)received - 1;
+        nexchat_upgrade_client_t* last = up->client_count > 0 ? &up->clients[up->client_count - 1] : NULL;
+        int32_t taken = 0;
+
+        // past a bad record the rest is only drained, nothing after it is kept
+        if (broken)
+        {
+            status = packet[0] == UPGRADE_END ? 1 : 0;
+            if (fd != -1)
+            {
+                close(fd);
+            }
+
+            continue;
+        }
+
+        switch (packet[0])
+        {
+            case UPGRADE_STATE:
+            {
+                if (size != 28 || nexchat_upgrade_get_u32(payload) != UPGRADE_FORMAT)
+                {
+                    taken = -1;
+                    break;
+                }
+
+                up->roster_version = nexchat_upgrade_get_u64(payload + 4);
+                up->node = nexchat_upgrade_get_u64(payload + 12);
+                up->seq = nexchat_upgrade_get_u64(payload + 20);
+                stated = true;
+            } break;
+            case UPGRADE_LISTENER:
+            {
+                taken = stated && fd != -1 ? nexchat_upgrade_take_listener(up, fd) : -1;
+                fd = taken == 0 ? -1 : fd;
+            } break;
+            case UPGRADE_CLIENT:
+            {
+                taken = stated && fd != -1 ? nexchat_upgrade_take_client(up, payload, size, fd) : -1;
+                fd = taken == 0 ? -1 : fd;
+            } break;
+            case UPGRADE_INPUT:
+            case UPGRADE_OUTPUT:
+            {
+                nexchat_buffer_t* buffer = last == NULL ? NULL : packet[0] == UPGRADE_INPUT ? &last->input : &last->output;
+                taken = buffer != NULL ? nexchat_buffer_append(buffer, payload, size) : -1;
+            } break;
+            case UPGRADE_END:
+            {
+                status = 1;
+            } break;
+            default:
+            {
+                taken = -1;
+            } break;
+        }
+
+        // only listeners and clients come with a descriptor
+        if (fd != -1)
+        {
+            close(fd);
+        }
+
+        // the previous process has stopped serving by now, so the handoff is not abandoned
+        // over one bad record: the rest is read to its end, so the message log is only opened
+        // after the previous process closed it, and what was taken before is kept
+        if (taken == -1)
+        {
+            nexchat_log(NEXCHAT_LOG_ERROR, "upgrade: received a malformed record of kind %u", packet[0]);
+            broken = true;
+        }
+    }
+
+    free(packet);
+    close(up->sockfd);
+    up->sockfd = -1;
+
+    if (!broken)
+    {
+        return 1;
+    }
+
+    // the state comes first, without it nothing was handed over and this starts like any server
+    if (!stated)
+    {
+        nexchat_log(NEXCHAT_LOG_WARN, "upgrade: nothing was handed over, starting afresh");
+        nexchat_upgrade_free(up);
+        up->inherited = false;
+        return 0;
+    }
+
+    // the last connection may have been cut short with part of its input or output missing,
+    // it is closed and reconnects rather than being served a broken stream
+    if (up->client_count > 0)
+    {
+        nexchat_upgrade_client_t* client = &up->clients[up->client_count - 1];
+        close(client->sockfd);
+        client->sockfd = -1;
+    }
+
+    nexchat_log(NEXCHAT_LOG_WARN, "upgrade: handoff cut short, taking over the %zu listening socket(s) and %zu connection(s) received",
+        up->listener_count, up->client_count > 0 ? up->client_count - 1 : 0);
+
+    return 1;
+}
+
+void nexchat_upgrade_free(nexchat_upgrade_t* up)
+{
+    // anything still here was not taken over
+    for (size_t i = 0; i < up->listener_count; i++)
+    {
+        if (up->listeners[i] != -1)
+        {
+            close(up->listeners[i]);
+        }
+    }
+
+    for (size_t i = 0; i < up->client_count; i++)
+    {
+        if (up->clients[i].sockfd != -1)
+        {
+            close(up->clients[i].sockfd);
+        }
+
+        nexchat_buffer_free(&up->clients[i].input);
+        nexchat_buffer_free(&up->clients[i].output);
+    }
+
+    free(up->listeners);
+    free(up->clients);
+    up->listeners = NULL;
+    up->listener_count = 0;
+    up->listener_capacity = 0;
+    up->clients = NULL;
+    up->client_count = 0;
+    up->client_capacity = 0;
+
+    if (up->sockfd != -1)
+    {
+        close(up->sockfd);
+        up->sockfd = -1;
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "libcommon/libcommon.h"
+
+#include "rooms.h"
+
+#define UPGRADE_ENV        "NEXCHAT_UPGRADE_FD" // set for the new process, the fd it receives the handoff on
+#define UPGRADE_FORMAT     1                    // bumped whenever a record below changes
+#define UPGRADE_TIMEOUT_MS 5000                 // the new process has this long to start before the upgrade is abandoned
+#define UPGRADE_QUIESCE_MS 1000                 // io_uring shards wait at most this long for writes in flight
+#define UPGRADE_RECORD_MAX (32 * 1024)          // payload bytes per record, longer input and output is split
+
+// Hot upgrade. On SIGUSR2 the server forks and executes its own binary again with the same
+// arguments and a SOCK_SEQPACKET socket in UPGRADE_ENV. Once the new process reports it started,
+// the old one stops its shards and sends over its listening sockets and every connection with
+// SCM_RIGHTS, along with what each client was in the middle of, then exits. The new process
+// picks the connections up where they were: clients see a pause, not a disconnect.
+//
+// Each record is one packet, [u8 kind][payload], integers big-endian.
+typedef enum nexchat_upgrade_kind_t
+{
+    UPGRADE_NONE,
+    UPGRADE_READY,    // new to old, [u32 format], it started and wants the handoff
+    UPGRADE_STATE,    // [u32 format][u64 roster version][u64 federation node][u64 federation seq]
+    UPGRADE_LISTENER, // a listening socket, one per shard
+    UPGRADE_CLIENT,   // a connection, [u8 phase][u8 admin][u8 subscribed][u64 kicks][u8 len][username][u8 len][room]
+    UPGRADE_INPUT,    // bytes the last client sent that don't make a whole frame yet
+    UPGRADE_OUTPUT,   // bytes queued for the last client, in order
+    UPGRADE_END,      // the old process has let go of everything, the new one can start
+    UPGRADE_MAXKINDS,
+} nexchat_upgrade_kind_t;
+
+// one connection as the new process receives it
+typedef struct nexchat_upgrade_client_t
+{
+    int32_t sockfd;
+    nexchat_client_phase_t phase; // NEXCHAT_CLIENT_AWAITING_USERNAME or NEXCHAT_CLIENT_ACTIVE
+    bool admin;
+    bool subscribed;
+    uint64_t kicks;
+    char username[64];
+    char room[ROOM_NAME_MAX];
+    nexchat_buffer_t input;
+    nexchat_buffer_t output;
+} nexchat_upgrade_client_t;
+
+typedef struct nexchat_upgrade_t
+{
+    int32_t sockfd; // -1 unless an upgrade is under way, on either side
+    pid_t child;    // old process, the new one
+    bool failed;    // old process, the handoff stopped partway and ends without UPGRADE_END
+
+    // new process, what was handed over
+    bool inherited;
+    uint64_t roster_version;
+    uint64_t node;
+    uint64_t seq;
+    int32_t* listeners;
+    size_t listener_count;
+    size_t listener_capacity;
+    nexchat_upgrade_client_t* clients;
+    size_t client_count;
+    size_t client_capacity;
+} nexchat_upgrade_t;
+
+void nexchat_upgrade_init(nexchat_upgrade_t* up);
+
+// old process: starts `exe` with `argv` and waits for it to report in. -1 when it didn't, the
+// server carries on as if nothing happened
+int32_t nexchat_upgrade_spawn(nexchat_upgrade_t* up, const char* exe, char** argv);
+
+// old process, in this order once every shard has stopped
+int32_t nexchat_upgrade_send_state(nexchat_upgrade_t* up, uint64_t roster_version, uint64_t node, uint64_t seq);
+int32_t nexchat_upgrade_send_listener(nexchat_upgrade_t* up, int32_t fd);
+int32_t nexchat_upgrade_send_client(nexchat_upgrade_t* up, const nexchat_client_state_t* client, bool subscribed, uint64_t kicks, const char* room);
+int32_t nexchat_upgrade_send_bytes(nexchat_upgrade_t* up, nexchat_upgrade_kind_t kind, const void* data, size_t size);
+void nexchat_upgrade_finish(nexchat_upgrade_t* up);
+
+// new process: 0 when not started by an upgrade or nothing was handed over, 1 once the handoff
+// ended, cut short or not, with whatever was received, -1 when the old process was never reached
+int32_t nexchat_upgrade_inherit(nexchat_upgrade_t* up);
+
+// closes whatever the new process did not take over and frees the rest
+void nexchat_upgrade_free(nexchat_upgrade_t* up);
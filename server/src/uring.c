@@ -0,0 +1,275 @@
+#include "uring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if NEXCHAT_URING
+
+static int32_t nexchat_uring_setup(uint32_t entries, struct io_uring_params* params)
+{
+    return (int32_t)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int32_t nexchat_uring_enter(int32_t fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, void* arg, size_t argsz)
+{
+    return (int32_t)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int32_t nexchat_uring_register(int32_t fd, uint32_t opcode, void* arg, uint32_t count)
+{
+    return (int32_t)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static int32_t nexchat_uring_map(nexchat_uring_t* ring, const struct io_uring_params* params)
+{
+    ring->sq_map_size = params->sq_off.array + params->sq_entries * sizeof(uint32_t);
+    ring->cq_map_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+    bool single = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+    {
+        ring->sq_map_size = ring->sq_map_size > ring->cq_map_size ? ring->sq_map_size : ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        ring->sq_map = NULL;
+        return -1;
+    }
+
+    ring->cq_map = single ? ring->sq_map : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED)
+    {
+        ring->cq_map = NULL;
+        return -1;
+    }
+
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    uint8_t* sq = (uint8_t*)ring->sq_map;
+    ring->sq_head = (uint32_t*)(sq + params->sq_off.head);
+    ring->sq_tail = (uint32_t*)(sq + params->sq_off.tail);
+    ring->sq_mask = *(uint32_t*)(sq + params->sq_off.ring_mask);
+    ring->sq_entries = params->sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    // SQE slots are used in order, so the indirection array is the identity and is filled once
+    uint32_t* array = (uint32_t*)(sq + params->sq_off.array);
+    for (uint32_t i = 0; i < params->sq_entries; i++)
+    {
+        array[i] = i;
+    }
+
+    uint8_t* cq = (uint8_t*)ring->cq_map;
+    ring->cq_head = (uint32_t*)(cq + params->cq_off.head);
+    ring->cq_tail = (uint32_t*)(cq + params->cq_off.tail);
+    ring->cq_mask = *(uint32_t*)(cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+
+    return 0;
+}
+
+static int32_t nexchat_uring_init_buffers(nexchat_uring_t* ring)
+{
+    ring->buffers_size = NEXCHAT_URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buffers = (struct io_uring_buf_ring*)mmap(NULL, ring->buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED)
+    {
+        ring->buffers = NULL;
+        return -1;
+    }
+
+    ring->buffer_data = (uint8_t*)mmap(NULL, (size_t)NEXCHAT_URING_BUFFERS * NEXCHAT_URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffer_data == MAP_FAILED)
+    {
+        ring->buffer_data = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buffers;
+    reg.ring_entries = NEXCHAT_URING_BUFFERS;
+    reg.bgid = NEXCHAT_URING_BUFFER_GROUP;
+
+    if (nexchat_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        return -1;
+    }
+
+    ring->buffer_tail = 0;
+    for (uint16_t bid = 0; bid < NEXCHAT_URING_BUFFERS; bid++)
+    {
+        nexchat_uring_recycle(ring, bid);
+    }
+
+    return 0;
+}
+
+int32_t nexchat_uring_init(nexchat_uring_t* ring, uint32_t entries)
+{
+    memset(ring, 0, sizeof(nexchat_uring_t));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;
+
+    ring->fd = nexchat_uring_setup(entries, &params);
+
+    // cooperative task running is a 5.19 hint, older kernels reject unknown flags
+    if (ring->fd == -1 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof params);
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring->fd = nexchat_uring_setup(entries, &params);
+    }
+
+    if (ring->fd == -1)
+    {
+        return -1;
+    }
+
+    // without NODROP completions can be lost under load, without EXT_ARG there is no wait timeout
+    if ((params.features & IORING_FEAT_NODROP) == 0 || (params.features & IORING_FEAT_EXT_ARG) == 0 ||
+        nexchat_uring_map(ring, &params) == -1 || nexchat_uring_init_buffers(ring) == -1)
+    {
+        int32_t error = errno;
+        nexchat_uring_free(ring);
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+void nexchat_uring_free(nexchat_uring_t* ring)
+{
+    if (ring->buffer_data != NULL) munmap(ring->buffer_data, (size_t)NEXCHAT_URING_BUFFERS * NEXCHAT_URING_BUFFER_SIZE);
+    if (ring->buffers != NULL) munmap(ring->buffers, ring->buffers_size);
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->fd >= 0) close(ring->fd);
+
+    memset(ring, 0, sizeof(nexchat_uring_t));
+    ring->fd = -1;
+}
+
+bool nexchat_uring_supported(void)
+{
+    nexchat_uring_t ring;
+    if (nexchat_uring_init(&ring, 8) == -1)
+    {
+        return false;
+    }
+
+    nexchat_uring_free(&ring);
+    return true;
+}
+
+struct io_uring_sqe* nexchat_uring_get_sqe(nexchat_uring_t* ring)
+{
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+    {
+        // full, hand what's queued to the kernel without waiting on anything
+        __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+        if (nexchat_uring_enter(ring->fd, ring->sq_local_tail - head, 0, 0, NULL, 0) == -1)
+        {
+            return NULL;
+        }
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries)
+        {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_local_tail++;
+
+    return sqe;
+}
+
+int32_t nexchat_uring_submit_and_wait(nexchat_uring_t* ring, int32_t timeout_ms)
+{
+    uint32_t pending = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    arg.sigmask_sz = _NSIG / 8;
+
+    if (timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    // completions already waiting make this return straight away
+    uint32_t min_complete = nexchat_uring_peek(ring) != NULL ? 0 : 1;
+    int32_t status = nexchat_uring_enter(ring->fd, pending, min_complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+
+    if (status == -1 && (errno == ETIME || errno == EINTR || errno == EBUSY))
+    {
+        return 0;
+    }
+
+    return status;
+}
+
+void nexchat_uring_recycle(nexchat_uring_t* ring, uint16_t bid)
+{
+    struct io_uring_buf* buf = &ring->buffers->bufs[ring->buffer_tail & (NEXCHAT_URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)nexchat_uring_buffer(ring, bid);
+    buf->len = NEXCHAT_URING_BUFFER_SIZE;
+    buf->bid = bid;
+
+    ring->buffer_tail++;
+    __atomic_store_n(&ring->buffers->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+#else
+
+int32_t nexchat_uring_init(nexchat_uring_t* ring, uint32_t entries)
+{
+    (void)entries;
+    memset(ring, 0, sizeof(nexchat_uring_t));
+    ring->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+void nexchat_uring_free(nexchat_uring_t* ring)
+{
+    (void)ring;
+}
+
+bool nexchat_uring_supported(void)
+{
+    return false;
+}
+
+#endif
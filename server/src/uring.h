@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#if defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+    #endif
+#endif
+
+// multishot recv is the newest feature used, headers older than that build without the backend
+#if defined(IORING_RECV_MULTISHOT)
+    #define NEXCHAT_URING 1
+#else
+    #define NEXCHAT_URING 0
+#endif
+
+#define NEXCHAT_URING_ENTRIES     1024 // submission queue, the completion queue is 4x
+#define NEXCHAT_URING_BUFFERS     512  // provided recv buffers per ring, power of two
+#define NEXCHAT_URING_BUFFER_SIZE 4096
+#define NEXCHAT_URING_BUFFER_GROUP 0
+
+// Minimal io_uring binding on the raw syscalls, enough for one reactor thread to own a ring.
+// SQEs are queued with nexchat_uring_get_sqe and go to the kernel with the next
+// nexchat_uring_submit_and_wait, so everything a loop iteration produces costs one syscall.
+// Received data lands in a ring of provided buffers that are handed back with nexchat_uring_recycle.
+typedef struct nexchat_uring_t
+{
+    int32_t fd;
+
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sq_local_tail; // SQEs handed out, published to the kernel on submit
+    struct io_uring_sqe* sqes;
+
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring* buffers;
+    size_t buffers_size;
+    uint8_t* buffer_data;
+    uint16_t buffer_tail;
+} nexchat_uring_t;
+
+// sets up a ring and its provided buffer group, returns -1 when the kernel lacks something we need
+int32_t nexchat_uring_init(nexchat_uring_t* ring, uint32_t entries);
+void nexchat_uring_free(nexchat_uring_t* ring);
+
+// true when nexchat_uring_init would succeed here, checked once before choosing a backend
+bool nexchat_uring_supported(void);
+
+#if NEXCHAT_URING
+
+// returns a zeroed SQE, submitting what is queued first when the queue is full
+struct io_uring_sqe* nexchat_uring_get_sqe(nexchat_uring_t* ring);
+
+// submits queued SQEs and waits up to `timeout_ms` (-1 forever) for at least one completion
+int32_t nexchat_uring_submit_and_wait(nexchat_uring_t* ring, int32_t timeout_ms);
+
+static inline struct io_uring_cqe* nexchat_uring_peek(nexchat_uring_t* ring)
+{
+    uint32_t head = *ring->cq_head;
+    uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    return head != tail ? &ring->cqes[head & ring->cq_mask] : NULL;
+}
+
+// marks the CQE returned by the last peek as consumed
+static inline void nexchat_uring_advance(nexchat_uring_t* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint8_t* nexchat_uring_buffer(nexchat_uring_t* ring, uint16_t bid)
+{
+    return ring->buffer_data + (size_t)bid * NEXCHAT_URING_BUFFER_SIZE;
+}
+
+// gives a provided buffer back to the kernel once its contents have been consumed
+void nexchat_uring_recycle(nexchat_uring_t* ring, uint16_t bid);
+
+#endif
@@ -0,0 +1,45 @@
+project "nexchat-test"
+   kind "ConsoleApp"
+   language "C"
+   cdialect "gnu99"
+   targetdir "bin/%{cfg.buildcfg}"
+   staticruntime "off"
+
+   files { "src/**.h", "src/**.c" }
+
+   includedirs
+   {
+      "src",
+
+      -- include libcommon
+      "../libcommon/src",
+   }
+
+   links
+   {
+      "libcommon",
+      "pthread",
+   }
+
+   -- the scenarios run against a real server, make sure the one next to us is current
+   dependson { "server" }
+
+   targetdir ("../bin/" .. OutputDir .. "/%{prj.name}")
+   objdir ("../bin/int/" .. OutputDir .. "/%{prj.name}")
+
+   filter "configurations:Debug"
+       defines { "DEBUG" }
+       runtime "Debug"
+       symbols "On"
+
+   filter "configurations:Release"
+       defines { "RELEASE" }
+       runtime "Release"
+       optimize "On"
+       symbols "On"
+
+   filter "configurations:Dist"
+       defines { "DIST" }
+       runtime "Release"
+       optimize "On"
+       symbols "Off"
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <libgen.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "libcommon/libcommon.h"
+
+// End to end scenarios, each against a server of its own started from the binary built
+// alongside this one (or the path given as the first argument). Exits non-zero when any
+// scenario fails.
+
+#define IPADDR "127.0.0.1"
+#define PORT   "3591"
+
+#define TEST_MAX_ROOMS 3
+#define TEST_TIMEOUT   5 // seconds to wait for a reply before calling it missing
+
+typedef struct nexchat_test_server_t
+{
+    pid_t pid;
+    nexchat_inet_id_t host;
+} nexchat_test_server_t;
+
+typedef int32_t (*nexchat_test_fn_t)(const nexchat_test_server_t* server);
+
+static const char* nexchat_test_binary;
+
+static int32_t nexchat_test_start(nexchat_test_server_t* server, const char* max_rooms)
+{
+    server->host.ipaddr = IPADDR;
+    server->host.service = PORT;
+
+    server->pid = fork();
+    if (server->pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+
+    if (server->pid == 0)
+    {
+        execl(nexchat_test_binary, nexchat_test_binary, "-a", IPADDR, "-p", PORT, "-r", max_rooms, "-w", "2", "-v", "error", (char*)NULL);
+        perror("execl");
+        _exit(127);
+    }
+
+    // poll until it listens, or give up once it has had long enough or exited
+    for (int32_t attempt = 0; attempt < TEST_TIMEOUT * 20; attempt++)
+    {
+        int32_t status = 0;
+        if (waitpid(server->pid, &status, WNOHANG) == server->pid)
+        {
+            fprintf(stderr, "test: server exited during startup\n");
+            server->pid = -1;
+            return -1;
+        }
+
+        // a bare connect, nexchat_session_connect would complain about every refusal
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)atoi(PORT));
+        inet_pton(AF_INET, IPADDR, &addr.sin_addr);
+
+        int32_t probe = socket(AF_INET, SOCK_STREAM, 0);
+        if (probe != -1 && connect(probe, (struct sockaddr*)&addr, sizeof addr) == 0)
+        {
+            close(probe);
+            return 0;
+        }
+
+        if (probe != -1)
+        {
+            close(probe);
+        }
+
+        usleep(50 * 1000);
+    }
+
+    fprintf(stderr, "test: server never started listening\n");
+    return -1;
+}
+
+static int32_t nexchat_test_stop(nexchat_test_server_t* server)
+{
+    if (server->pid <= 0)
+    {
+        return -1;
+    }
+
+    // the server has no graceful stop, anything but our SIGTERM means it died during the scenario
+    kill(server->pid, SIGTERM);
+
+    int32_t status = 0;
+    if (waitpid(server->pid, &status, 0) == -1)
+    {
+        perror("waitpid");
+        return -1;
+    }
+
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGTERM)
+    {
+        fprintf(stderr, "test: server died before it was stopped (status %d)\n", status);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int32_t nexchat_test_connect(nexchat_client_state_t* state, const nexchat_test_server_t* server, const char* username)
+{
+    memset(state, 0, sizeof *state);
+    if (nexchat_session_connect(state, &server->host) == -1)
+    {
+        return -1;
+    }
+
+    struct timeval timeout = { .tv_sec = TEST_TIMEOUT, .tv_usec = 0 };
+    if (setsockopt(state->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) == -1)
+    {
+        perror("setsockopt");
+    }
+
+    state->connected = true;
+    return nexchat_session_handshake(state, username);
+}
+
+static void nexchat_test_disconnect(nexchat_client_state_t* state)
+{
+    if (!state->connected)
+    {
+        return;
+    }
+
+    close(state->sockfd);
+    nexchat_frame_decoder_free(&state->decoder);
+    state->connected = false;
+}
+
+// reads until a text frame containing `want` arrives (0), or one containing `reject`, a timeout or EOF (-1)
+static int32_t nexchat_test_expect(nexchat_client_state_t* state, const char* want, const char* reject)
+{
+    for (;;)
+    {
+        nexchat_frame_t frame;
+        int32_t status = 0;
+
+        while ((status = nexchat_frame_decoder_next(&state->decoder, &frame)) == 1)
+        {
+            if (frame.type != FRAME_TEXT)
+            {
+                continue;
+            }
+
+            if (strstr(frame.payload, want) != NULL)
+            {
+                return 0;
+            }
+
+            if (reject != NULL && strstr(frame.payload, reject) != NULL)
+            {
+                fprintf(stderr, "test: %s: got '%s' waiting for '%s'\n", state->username, frame.payload, want);
+                return -1;
+            }
+        }
+
+        size_t space = 0;
+        uint8_t* recvbuf = status == 0 ? nexchat_frame_decoder_prepare(&state->decoder, &space) : NULL;
+        if (recvbuf == NULL)
+        {
+            fprintf(stderr, "test: %s: malformed stream\n", state->username);
+            return -1;
+        }
+
+        ssize_t bytesread = recv(state->sockfd, recvbuf, space, 0);
+        if (bytesread == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesread <= 0)
+        {
+            fprintf(stderr, "test: %s: %s waiting for '%s'\n", state->username, bytesread == 0 ? "disconnected" : "timed out", want);
+            return -1;
+        }
+
+        nexchat_frame_decoder_commit(&state->decoder, (size_t)bytesread);
+    }
+}
+
+static int32_t nexchat_test_join(nexchat_client_state_t* state, const char* room)
+{
+    char command[128];
+    snprintf(command, sizeof(command), "/join %s", room);
+
+    if (nexchat_session_sendmsg(state->sockfd, command) == -1)
+    {
+        return -1;
+    }
+
+    return nexchat_test_expect(state, "server: you are now in", "server: can't create any more rooms");
+}
+
+// one user creating a new room per connection, many times over the room limit, must never use it
+// up: a room is gone once its last member is, so a fresh user can still make one afterwards
+static int32_t nexchat_test_rooms_after_reconnect(const nexchat_test_server_t* server)
+{
+    nexchat_client_state_t state;
+
+    for (int32_t cycle = 0; cycle < TEST_MAX_ROOMS * 3; cycle++)
+    {
+        if (nexchat_test_connect(&state, server, "alice") == -1)
+        {
+            return -1;
+        }
+
+        char room[32];
+        snprintf(room, sizeof(room), "room%d", cycle);
+
+        int32_t status = nexchat_test_join(&state, room);
+        nexchat_test_disconnect(&state);
+
+        if (status == -1)
+        {
+            fprintf(stderr, "test: alice could not create '%s' on connection %d\n", room, cycle + 1);
+            return -1;
+        }
+    }
+
+    if (nexchat_test_connect(&state, server, "bob") == -1)
+    {
+        return -1;
+    }
+
+    int32_t status = nexchat_test_join(&state, "final");
+    nexchat_test_disconnect(&state);
+
+    return status;
+}
+
+static const struct
+{
+    const char* name;
+    nexchat_test_fn_t run;
+} nexchat_test_scenarios[] =
+{
+    { "rooms are released when their members reconnect", nexchat_test_rooms_after_reconnect },
+};
+
+int main(int argc, char** argv)
+{
+    char binary[PATH_MAX];
+
+    if (argc > 1)
+    {
+        nexchat_test_binary = argv[1];
+    }
+    else
+    {
+        // bin/<platform>/<config>/nexchat-test/nexchat-test -> bin/<platform>/<config>/server/server
+        char self[PATH_MAX];
+        ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if (len == -1)
+        {
+            perror("readlink");
+            return EXIT_FAILURE;
+        }
+
+        self[len] = '\0';
+        snprintf(binary, sizeof(binary), "%s/../server/server", dirname(self));
+        nexchat_test_binary = binary;
+    }
+
+    // a server that drops us mid write must fail the scenario, not kill the runner
+    signal(SIGPIPE, SIG_IGN);
+
+    char max_rooms[16];
+    snprintf(max_rooms, sizeof(max_rooms), "%d", TEST_MAX_ROOMS);
+
+    size_t failed = 0;
+    size_t count = sizeof(nexchat_test_scenarios) / sizeof(nexchat_test_scenarios[0]);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        nexchat_test_server_t server;
+        int32_t status = nexchat_test_start(&server, max_rooms);
+
+        if (status == 0)
+        {
+            status = nexchat_test_scenarios[i].run(&server);
+        }
+
+        if (nexchat_test_stop(&server) == -1)
+        {
+            status = -1;
+        }
+
+        printf("%s: %s\n", status == 0 ? "PASS" : "FAIL", nexchat_test_scenarios[i].name);
+        failed += status == 0 ? 0 : 1;
+    }
+
+    printf("%zu of %zu scenarios passed\n", count - failed, count);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}